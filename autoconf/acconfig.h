@@ -152,6 +152,12 @@
 /* Define if you have zlib */
 #undef HAVE_LIBZ
 
+/* Define if you have zstd */
+#undef HAVE_ZSTD
+
+/* Define if you have the lz4 frame library */
+#undef HAVE_LZ4
+
 /* Define if you have libacl */
 #undef HAVE_ACL
 
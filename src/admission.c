@@ -0,0 +1,381 @@
+#include "burp.h"
+#include "prog.h"
+#include "handy.h"
+#include "asyncio.h"
+#include "admission.h"
+
+// Clients that have never been backed up go to the front of the queue.
+#define NEVER_BACKED_UP		1000000L
+// How long to guess that a backup takes before any have finished.
+#define DEFAULT_BACKUP_SECS	1800
+// Limits on how long a queued client is told to wait before trying again.
+#define MIN_RETRY		30
+#define MAX_RETRY		600
+// A queued client that is due back within this many seconds keeps its place
+// ahead of the clients behind it. One that has not come back this long after
+// it was due is forgotten.
+#define GRACE			120
+// How long a child waits for the parent to answer.
+#define REPLY_TIMEOUT		60
+
+/* Child side. */
+
+// Understands the same intervals as the example timer script, such as '20h'.
+static long interval_to_secs(const char *interval)
+{
+	long i=0;
+	char *cp=NULL;
+	if(!interval) return 0;
+	i=strtol(interval, &cp, 10);
+	if(cp==interval || i<0) return 0;
+	switch(*cp)
+	{
+		case 's': return i;
+		case 'm': return i*60;
+		case 'h': return i*60*60;
+		case 'd': return i*60*60*24;
+		case 'w': return i*60*60*24*7;
+		case 'n': return i*60*60*24*7*30;
+	}
+	return 0;
+}
+
+// How many hours the client is overdue by, going by the time of its last
+// backup and the interval given to the timer script. Also, the size of the
+// manifest of the last backup, which is the cheapest measure of how big the
+// backup was.
+static int get_queue_keys(struct config *cconf, const char *current, long *overdue, unsigned long long *size)
+{
+	int ret=-1;
+	char *timestamp=NULL;
+	char *manifest=NULL;
+	struct stat statp;
+
+	*overdue=NEVER_BACKED_UP;
+	*size=0;
+
+	if(!(timestamp=prepend_s(current, "timestamp", strlen("timestamp")))
+	  || !(manifest=prepend_s(current, "manifest.gz",
+		strlen("manifest.gz"))))
+	{
+		logp("out of memory\n");
+		goto end;
+	}
+	if(!lstat(timestamp, &statp))
+	{
+		long interval=0;
+		if(cconf->tacount)
+			interval=interval_to_secs(cconf->timer_arg[0]->path);
+		*overdue=(time(NULL)-statp.st_mtime-interval)/(60*60);
+	}
+	if(!lstat(manifest, &statp))
+		*size=(unsigned long long)statp.st_size;
+	ret=0;
+end:
+	if(timestamp) free(timestamp);
+	if(manifest) free(manifest);
+	return ret;
+}
+
+// Sequence number of the last request from this process.
+static unsigned long seq=0;
+
+/* Takes the whole lines out of buf. Returns 1, with the answer after the
+   sequence number moved to the start of buf, if one of them is the answer to
+   the current request. Answers to earlier requests, which came in after the
+   child gave up waiting for them, are thrown away. */
+static int take_reply(char *buf, size_t *got)
+{
+	char *cp=NULL;
+	char *nl=NULL;
+	while((nl=strchr(buf, '\n')))
+	{
+		if(strtoul(buf, &cp, 10)==seq && cp!=buf && *cp=='\t')
+		{
+			memmove(buf, cp+1, nl-cp);
+			buf[nl-cp]='\0';
+			return 1;
+		}
+		*got-=nl+1-buf;
+		memmove(buf, nl+1, *got+1);
+	}
+	return 0;
+}
+
+static int read_reply(char *buf, size_t len)
+{
+	size_t got=0;
+	while(1)
+	{
+		ssize_t l=0;
+		int mfd=-1;
+		fd_set fsr;
+		struct timeval tval;
+
+		FD_ZERO(&fsr);
+		tval.tv_sec=REPLY_TIMEOUT;
+		tval.tv_usec=0;
+		add_fd_to_sets(status_rfd, &fsr, NULL, NULL, &mfd);
+
+		if(select(mfd+1, &fsr, NULL, NULL, &tval)<0)
+		{
+			if(errno==EAGAIN || errno==EINTR) continue;
+			logp("select error: %s\n", strerror(errno));
+			return -1;
+		}
+		if(!FD_ISSET(status_rfd, &fsr))
+		{
+			logp("timed out waiting for admission\n");
+			return -1;
+		}
+		if((l=read(status_rfd, buf+got, len-1-got))<0)
+		{
+			if(errno==EAGAIN || errno==EINTR) continue;
+			logp("error reading admission: %s\n", strerror(errno));
+			return -1;
+		}
+		if(!l) return -1;
+		got+=l;
+		buf[got]='\0';
+		if(take_reply(buf, &got)) return 0;
+		if(got>=len-1)
+		{
+			logp("admission answer too long\n");
+			return -1;
+		}
+	}
+}
+
+int admission_request(struct config *cconf, const char *client, const char *current, struct admission *adm)
+{
+	long overdue=0;
+	char buf[256]="";
+	unsigned long long size=0;
+
+	memset(adm, 0, sizeof(struct admission));
+
+	// Not forking, so there is nobody to ask.
+	if(status_wfd<0 || status_rfd<0) return 0;
+
+	if(get_queue_keys(cconf, current, &overdue, &size)) return -1;
+
+	snprintf(buf, sizeof(buf), "%s%lu\t%s\t%ld\t%llu\t%d\n",
+		ADMISSION_PREFIX, ++seq,
+		client, overdue, size, cconf->backup_priority);
+	if(write(status_wfd, buf, strlen(buf))<0)
+	{
+		logp("error writing admission request to server: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if(read_reply(buf, sizeof(buf)))
+	{
+		// Do not hold the backup up if the parent could not give
+		// an answer, for example because it is reloading.
+		logp("no admission answer from server - starting backup\n");
+		return 0;
+	}
+	if(!strncmp(buf, "admit", strlen("admit"))) return 0;
+	if(sscanf(buf, "queued\t%d\t%ld\t%d",
+		&adm->position, &adm->expected, &adm->retry)==3)
+	{
+		if(adm->retry<=0) adm->retry=MIN_RETRY;
+		return 1;
+	}
+	logp("unexpected admission answer from server: %s", buf);
+	return -1;
+}
+
+/* Parent side. */
+
+struct qentry
+{
+	char *client;
+	long overdue;
+	unsigned long long size;
+	int priority;
+	time_t first_seen;
+	time_t retry_at;
+};
+
+static struct qentry *queue=NULL;
+static int qlen=0;
+
+static time_t avg_secs=DEFAULT_BACKUP_SECS;
+static int finished=0;
+
+void admission_finished(time_t secs)
+{
+	if(secs<0) return;
+	if(!finished++) avg_secs=secs;
+	else avg_secs=(avg_secs*7+secs)/8;
+}
+
+// Most overdue first, then biggest last backup, then highest priority, then
+// whoever has been waiting longest.
+static int qentry_cmp(struct qentry *a, struct qentry *b)
+{
+	if(a->overdue!=b->overdue) return a->overdue>b->overdue?-1:1;
+	if(a->size!=b->size) return a->size>b->size?-1:1;
+	if(a->priority!=b->priority) return a->priority>b->priority?-1:1;
+	if(a->first_seen!=b->first_seen)
+		return a->first_seen<b->first_seen?-1:1;
+	return 0;
+}
+
+static void qentry_remove(int q)
+{
+	free(queue[q].client);
+	memmove(queue+q, queue+q+1, sizeof(struct qentry)*(qlen-q-1));
+	qlen--;
+}
+
+static void expire_queue(time_t now)
+{
+	int q=0;
+	while(q<qlen)
+	{
+		if(queue[q].retry_at+GRACE<now) qentry_remove(q);
+		else q++;
+	}
+}
+
+static struct qentry *get_qentry(const char *client, time_t now)
+{
+	int q=0;
+	struct qentry *tmp=NULL;
+	for(q=0; q<qlen; q++)
+		if(!strcmp(queue[q].client, client)) return &(queue[q]);
+	if(!(tmp=(struct qentry *)
+		realloc(queue, sizeof(struct qentry)*(qlen+1))))
+			return NULL;
+	queue=tmp;
+	memset(&(queue[qlen]), 0, sizeof(struct qentry));
+	if(!(queue[qlen].client=strdup(client))) return NULL;
+	queue[qlen].first_seen=now;
+	queue[qlen].retry_at=now;
+	return &(queue[qlen++]);
+}
+
+#ifndef HAVE_WIN32
+// Dirty and Writeback from /proc/meminfo, in megabytes. This is how far
+// behind the storage is with writing out what the backups have given it.
+static long get_writeback_mb(void)
+{
+	FILE *fp=NULL;
+	char buf[128]="";
+	long kb=0;
+	long total=0;
+	if(!(fp=fopen("/proc/meminfo", "r"))) return 0;
+	while(fgets(buf, sizeof(buf), fp))
+	{
+		if(sscanf(buf, "Dirty: %ld", &kb)==1
+		  || sscanf(buf, "Writeback: %ld", &kb)==1)
+			total+=kb;
+	}
+	fclose(fp);
+	return total/1024;
+}
+#endif
+
+int admission_decide(struct config *conf, const char *line, int running, char *reply, size_t rlen)
+{
+	int q=0;
+	int slots=0;
+	int ahead=0;
+	int ahead_due=0;
+	int retry=0;
+	int parallel=0;
+	long expected=0;
+	char *cp=NULL;
+	char *client=NULL;
+	unsigned long rseq=0;
+	struct qentry *me=NULL;
+	time_t now=time(NULL);
+
+	// The child starts the backup anyway if it gets no answer, so an
+	// answer without its sequence number is as good as letting it go.
+	rseq=strtoul(line+strlen(ADMISSION_PREFIX), &cp, 10);
+	snprintf(reply, rlen, "%lu\tadmit\n", rseq);
+	if(*cp!='\t')
+	{
+		logp("bad admission request: %s\n", line);
+		return -1;
+	}
+
+	if(!(client=strdup(cp+1)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	if(!(cp=strchr(client, '\t')))
+	{
+		logp("bad admission request: %s\n", line);
+		free(client);
+		return -1;
+	}
+	*cp++='\0';
+
+	expire_queue(now);
+	if(!(me=get_qentry(client, now)))
+	{
+		logp("out of memory\n");
+		free(client);
+		return -1;
+	}
+	if(sscanf(cp, "%ld\t%llu\t%d",
+		&me->overdue, &me->size, &me->priority)!=3)
+	{
+		logp("bad admission request: %s\n", line);
+		qentry_remove(me-queue);
+		free(client);
+		return -1;
+	}
+
+	slots=conf->max_concurrent_backups?
+		conf->max_concurrent_backups-running:qlen+1;
+#ifndef HAVE_WIN32
+	// Something has to be allowed to run, or the queue would never move.
+	if(conf->max_writeback && running)
+	{
+		long mb=0;
+		if((mb=get_writeback_mb())>conf->max_writeback)
+		{
+			logp("%ld MB waiting to be written out - not admitting %s\n", mb, client);
+			slots=0;
+		}
+	}
+#endif
+
+	// Only those ahead in the queue that are due back soon can hold on
+	// to a free slot.
+	for(q=0; q<qlen; q++)
+	{
+		if(&(queue[q])==me || qentry_cmp(&(queue[q]), me)>=0) continue;
+		ahead++;
+		if(queue[q].retry_at<=now+GRACE) ahead_due++;
+	}
+
+	if(slots>0 && ahead_due<slots)
+	{
+		qentry_remove(me-queue);
+		free(client);
+		return 1;
+	}
+
+	parallel=conf->max_concurrent_backups?conf->max_concurrent_backups:
+		(running>0?running:1);
+	expected=avg_secs*(ahead/parallel+1);
+	retry=expected;
+	if(retry<MIN_RETRY) retry=MIN_RETRY;
+	if(retry>MAX_RETRY) retry=MAX_RETRY;
+	me->retry_at=now+retry;
+
+	logp("queued backup of %s at position %d, expected wait %lds\n",
+		client, ahead+1, expected);
+	snprintf(reply, rlen, "%lu\tqueued\t%d\t%ld\t%d\n",
+		rseq, ahead+1, expected, retry);
+	free(client);
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+// A child asks the parent whether it may start a backup by sending a line
+// starting with this down its status pipe. Client names cannot begin with a
+// tab, so it cannot be confused with a status line. Each request carries a
+// sequence number, which the parent puts at the start of its answer, so that
+// a late answer to an earlier request is never taken for the current one.
+#define ADMISSION_PREFIX	"\tadmit\t"
+
+// What the parent told a child that asked to start a backup.
+struct admission
+{
+	int position; // place in the queue, 0 if admitted
+	long expected; // expected number of seconds until admission
+	int retry; // number of seconds to wait before asking again
+};
+
+// Child side. Returns 0 if the backup may start, 1 if it has been queued,
+// or -1 on error.
+extern int admission_request(struct config *cconf, const char *client, const char *current, struct admission *adm);
+
+// Parent side. Deals with a request line from a child, and writes the answer
+// to send back into reply. Returns 1 if the backup may start, 0 if it has
+// been queued, or -1 on error.
+extern int admission_decide(struct config *conf, const char *line, int running, char *reply, size_t rlen);
+// Tells the parent how long an admitted backup took, to improve the estimates
+// of the waiting time.
+extern void admission_finished(time_t secs);
+
+#endif
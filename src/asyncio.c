@@ -7,6 +7,8 @@
 #include "find.h"
 #include "ssl.h"
 #include "sbuf.h"
+#include "ratelimit.h"
+#include "phase1bin.h"
 
 /* For IPTOS / IPTOS_THROUGHPUT */
 #ifdef HAVE_WIN32
@@ -15,83 +17,523 @@
 #include <netinet/ip.h>
 #endif
 
+#ifndef HAVE_WIN32
+#include <sys/resource.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#endif
+
 static int fd=-1;
 static SSL *ssl=NULL;
-static float ratelimit=0;
+static struct tbucket send_tb;
+static struct tbucket recv_tb;
+static struct tbucket *shared_tb=NULL; // Across all server children.
 static int network_timeout=0;
 static int max_network_timeout=0;
 static int doing_estimate=0;
 
-static char *readbuf=NULL;
-static size_t readbuflen=0;
-static size_t readbufmaxsize=(ASYNC_BUF_LEN*2)+32;
+// Bytes that have been through SSL_read and SSL_write, and the CPU time
+// used up to the start of the connection, to give the cost per gigabyte.
+static unsigned long long net_bytes=0;
+#ifndef HAVE_WIN32
+static struct rusage net_rusage;
+#endif
 
-static char *writebuf=NULL;
-static size_t writebuflen=0;
-static size_t writebufmaxsize=(ASYNC_BUF_LEN*2)+32;
+/* The read and write buffers are rings. Data is consumed by moving the head
+   cursor, so bytes are never shuffled down after a partial write or after
+   a frame has been parsed. */
+struct ringbuf
+{
+	char *buf;
+	size_t size; // capacity
+	size_t head; // offset of the first byte in use
+	size_t len;  // number of bytes in use
+};
+
+static struct ringbuf readbuf={NULL, (ASYNC_BUF_LEN*2)+32, 0, 0};
+static struct ringbuf writebuf={NULL, (ASYNC_BUF_LEN*2)+32, 0, 0};
+
+// Maximum frame payload, and the length of the frame header. Frames bigger
+// than 0xFFFF need eight hex digits for the length instead of four.
+static size_t frame_size=ASYNC_BUF_LEN;
+static size_t frame_hdr_len=5;
+
+/* Once channels are agreed, each frame header carries a channel number in
+   two hex digits after the command. Channel 0 is the ordinary ordered
+   stream. The others carry file data, and each has a window of bytes that
+   the sender may have in flight. The receiver opens the window again with
+   CMD_WINDOW frames as it takes the data. */
+static int channels=0;
+static int write_channel=0;
+static int read_channel=0;
+static long window=0;
+static long credit[MAX_CHANNELS]; // Sender: bytes that may still be sent.
+static long owed[MAX_CHANNELS]; // Receiver: bytes taken but not yet credited.
+
+/* Once compression is agreed, each direction is a single deflate stream
+   between the frames and SSL. What goes out is deflated from the write
+   buffer into zobuf, and what comes in is read into zibuf and inflated into
+   the read buffer. Frames are not flushed through the compressor one at a
+   time. The stream is flushed when we might wait for the peer, and at least
+   every NET_FLUSH_MS otherwise, so nothing sits in it that the other end is
+   waiting for. */
+#define NET_ZBUF_LEN	(64*1024)
+#define NET_FLUSH_MS	100
+static int net_compression=0;
+static z_stream zout;
+static z_stream zin;
+static char *zobuf=NULL; // Compressed, waiting for SSL_write.
+static size_t zohead=0;
+static size_t zolen=0;
+static char *zibuf=NULL; // From SSL_read, waiting to be inflated.
+static size_t zihead=0;
+static size_t zilen=0;
+static int zimore=0; // inflate may have more output for us.
+static int zpending=0; // Deflated since the last flush.
+static int zflushing=0; // A flush that did not fit in zobuf yet.
+static int zflush_now=0;
+static struct timeval zpending_since;
+// Bytes before and after compression on this connection, both ways.
+static unsigned long long zraw=0;
+static unsigned long long zcomp=0;
+
+#if !defined(HAVE_WIN32) && defined(HAVE_SYS_EPOLL_H)
+static int efd=-1; // epoll instance watching fd.
+static uint32_t emask=0; // Events currently registered with efd.
+#endif
 
 int status_wfd=-1; // for the child to send information to the parent.
 int status_rfd=-1; // for the child to read information from the parent.
 
-static void truncate_buf(char **buf, size_t *buflen)
+static void ring_reset(struct ringbuf *r)
+{
+	r->head=0;
+	r->len=0;
+}
+
+static size_t ring_space(struct ringbuf *r)
+{
+	return r->size-r->len;
+}
+
+// The largest contiguous free area, starting at the tail.
+static char *ring_tail(struct ringbuf *r, size_t *avail)
+{
+	size_t tail=(r->head+r->len)%r->size;
+	if(r->len==r->size) *avail=0;
+	else if(tail<r->head) *avail=r->head-tail;
+	else *avail=r->size-tail;
+	return r->buf+tail;
+}
+
+// The largest contiguous area of data, starting at the head.
+static char *ring_data(struct ringbuf *r, size_t *avail)
+{
+	*avail=r->len;
+	if(r->head+r->len>r->size) *avail=r->size-r->head;
+	return r->buf+r->head;
+}
+
+static void ring_produced(struct ringbuf *r, size_t n)
 {
-	(*buf)[0]='\0';
-	*buflen=0;
+	r->len+=n;
+}
+
+static void ring_consume(struct ringbuf *r, size_t n)
+{
+	r->len-=n;
+	// Rewind when empty so that the next data is contiguous.
+	if(!r->len) r->head=0;
+	else r->head=(r->head+n)%r->size;
+}
+
+// Copy in, wrapping at the end. The caller checks there is room.
+static void ring_append(struct ringbuf *r, const char *src, size_t n)
+{
+	size_t avail;
+	char *tail;
+	while(n)
+	{
+		tail=ring_tail(r, &avail);
+		if(avail>n) avail=n;
+		memcpy(tail, src, avail);
+		ring_produced(r, avail);
+		src+=avail;
+		n-=avail;
+	}
+}
+
+// Copy out n bytes starting at offset off from the head, without consuming.
+static void ring_peek(struct ringbuf *r, size_t off, char *dst, size_t n)
+{
+	size_t start=(r->head+off)%r->size;
+	size_t first=r->size-start;
+	if(first>n) first=n;
+	memcpy(dst, r->buf+start, first);
+	if(n>first) memcpy(dst+first, r->buf, n-first);
+}
+
+static void set_frame_hdr_len(void)
+{
+	frame_hdr_len=((frame_size>0xFFFF)?9:5)+(channels?2:0);
+}
+
+static const char *frame_hdr_fmt(void)
+{
+	if(channels) return frame_hdr_len==7?"%c%02X%04X":"%c%02X%08X";
+	return frame_hdr_len==5?"%c%04X":"%c%08X";
+}
+
+static int parse_frame_hdr(const char *hdr, char *cmd, unsigned int *ch, unsigned int *s)
+{
+	*ch=0;
+	if(channels)
+		return sscanf(hdr, frame_hdr_len==7?"%c%2X%4X":"%c%2X%8X",
+			cmd, ch, s)==3?0:-1;
+	return sscanf(hdr, frame_hdr_len==5?"%c%4X":"%c%8X", cmd, s)==2?0:-1;
 }
 
 static int parse_readbuf(char *cmd, char **dest, size_t *rlen)
 {
 	unsigned int s=0;
+	unsigned int ch=0;
 	char cmdtmp='\0';
+	char hdr[16]="";
 
-	if(readbuflen>=5)
+	while(readbuf.len>=frame_hdr_len)
 	{
-		if((sscanf(readbuf, "%c%04X", &cmdtmp, &s))!=2)
+		ring_peek(&readbuf, 0, hdr, frame_hdr_len);
+		hdr[frame_hdr_len]='\0';
+		if(parse_frame_hdr(hdr, &cmdtmp, &ch, &s))
 		{
-			logp("sscanf of '%s' failed in parse_readbuf\n",
-				readbuf);
-			truncate_buf(&readbuf, &readbuflen);
+			logp("sscanf of '%s' failed in parse_readbuf\n", hdr);
+			ring_reset(&readbuf);
 			return -1;
 		}
-	}
-	if(readbuflen>=s+5)
-	{
+		if(channels && ch>=(unsigned int)channels)
+		{
+			logp("frame for unknown channel %u\n", ch);
+			ring_reset(&readbuf);
+			return -1;
+		}
+		if(s+frame_hdr_len>readbuf.size)
+		{
+			logp("frame of %u bytes is too big for the read buffer\n", s);
+			ring_reset(&readbuf);
+			return -1;
+		}
+		if(readbuf.len<s+frame_hdr_len) break;
+
+		if(cmdtmp==CMD_WINDOW && channels)
+		{
+			// The peer has room for more on a channel. These are
+			// dealt with here, and never handed to the caller.
+			char num[32]="";
+			if(s>=sizeof(num))
+			{
+				logp("bad window frame\n");
+				ring_reset(&readbuf);
+				return -1;
+			}
+			ring_peek(&readbuf, frame_hdr_len, num, s);
+			num[s]='\0';
+			credit[ch]+=strtol(num, NULL, 10);
+			ring_consume(&readbuf, s+frame_hdr_len);
+			continue;
+		}
+
 		*cmd=cmdtmp;
 		if(!(*dest=(char *)malloc(s+1)))
 		{
 			logp("out of memory in parse_readbuf\n");
-			truncate_buf(&readbuf, &readbuflen);
+			ring_reset(&readbuf);
 			return -1;
 		}
-		if(!(memcpy(*dest, readbuf+5, s)))
+		ring_peek(&readbuf, frame_hdr_len, *dest, s);
+		(*dest)[s]='\0';
+		ring_consume(&readbuf, s+frame_hdr_len);
+		*rlen=s;
+		read_channel=ch;
+		// Whoever reads a frame deals with it straight away, so
+		// this is as good a time as any to count it as taken.
+		if(ch) owed[ch]+=s;
+		break;
+	}
+	return 0;
+}
+
+static int async_alloc_buf(struct ringbuf *r)
+{
+	if(!r->buf)
+	{
+		if(!(r->buf=(char *)malloc(r->size)))
 		{
-			logp("memcpy failed in parse_readbuf\n");
-			truncate_buf(&readbuf, &readbuflen);
+			logp("out of memory in async_alloc_buf\n");
 			return -1;
 		}
-		(*dest)[s]='\0';
-		if(!(memmove(readbuf, readbuf+s+5, readbuflen-s-5)))
+		ring_reset(r);
+	}
+	return 0;
+}
+
+// Resize a ring, keeping what is in it.
+static int ring_resize(struct ringbuf *r, size_t size)
+{
+	char *buf=NULL;
+	if(r->len>size)
+	{
+		logp("cannot shrink buffer below the %lu bytes it holds\n",
+			(unsigned long)r->len);
+		return -1;
+	}
+	if(!r->buf)
+	{
+		r->size=size;
+		return 0;
+	}
+	if(!(buf=(char *)malloc(size)))
+	{
+		logp("out of memory in ring_resize\n");
+		return -1;
+	}
+	ring_peek(r, 0, buf, r->len);
+	free(r->buf);
+	r->buf=buf;
+	r->size=size;
+	r->head=0;
+	return 0;
+}
+
+size_t async_get_frame_size(void)
+{
+	return frame_size;
+}
+
+int async_set_frame_size(size_t size)
+{
+	// Room for two full frames and a bit, as before. Smaller frames
+	// do not shrink the rings below their default size, because single
+	// messages that are not file data, such as incexc, can be bigger
+	// than a frame.
+	size_t bufsize=((size+11)*2)+32;
+	if(bufsize<(ASYNC_BUF_LEN*2)+32)
+		bufsize=(ASYNC_BUF_LEN*2)+32;
+	if(size<MIN_FRAME_SIZE || size>MAX_FRAME_SIZE)
+	{
+		logp("frame size %lu out of range\n", (unsigned long)size);
+		return -1;
+	}
+	if(ring_resize(&readbuf, bufsize)
+	  || ring_resize(&writebuf, bufsize))
+		return -1;
+	frame_size=size;
+	set_frame_hdr_len();
+	return 0;
+}
+
+int async_set_channels(int n)
+{
+	int c=0;
+	if(n<0 || n>MAX_CHANNELS)
+	{
+		logp("number of channels %d out of range\n", n);
+		return -1;
+	}
+	channels=n;
+	write_channel=0;
+	read_channel=0;
+	// Enough for a few full frames on each channel.
+	window=(long)frame_size*4;
+	for(c=0; c<MAX_CHANNELS; c++)
+	{
+		credit[c]=window;
+		owed[c]=0;
+	}
+	set_frame_hdr_len();
+	// The window frames are small, and the sender stops until they
+	// arrive. Left to Nagle, the last part of each data frame waits for
+	// the peer's delayed ACK, so the window frame does too.
+	if(channels && fd>=0) nodelay(fd);
+	return 0;
+}
+
+int async_get_channels(void)
+{
+	return channels;
+}
+
+void async_set_write_channel(int ch)
+{
+	write_channel=(ch>=0 && ch<channels)?ch:0;
+}
+
+int async_get_read_channel(void)
+{
+	return read_channel;
+}
+
+long async_channel_credit(int ch)
+{
+	if(!channels || ch<=0 || ch>=channels) return window?window:1;
+	return credit[ch];
+}
+
+static void end_compression(void)
+{
+	if(net_compression)
+	{
+		deflateEnd(&zout);
+		inflateEnd(&zin);
+	}
+	if(zobuf) { free(zobuf); zobuf=NULL; }
+	if(zibuf) { free(zibuf); zibuf=NULL; }
+	zohead=zolen=zihead=zilen=0;
+	zimore=zpending=zflushing=zflush_now=0;
+	net_compression=0;
+}
+
+int async_set_compression(int level)
+{
+	size_t w=0;
+	if(level<1 || level>9)
+	{
+		logp("network compression level %d out of range\n", level);
+		return -1;
+	}
+	// Whatever has already been written goes out as it is.
+	while(writebuf.len)
+		if(async_rw(NULL, NULL, NULL, '\0', NULL, &w)) return -1;
+
+	memset(&zout, 0, sizeof(zout));
+	memset(&zin, 0, sizeof(zin));
+	if(!(zobuf=(char *)malloc(NET_ZBUF_LEN))
+	  || !(zibuf=(char *)malloc(NET_ZBUF_LEN)))
+	{
+		logp("out of memory in async_set_compression\n");
+		end_compression();
+		return -1;
+	}
+	if(deflateInit(&zout, level)!=Z_OK)
+	{
+		logp("could not start network compression\n");
+		end_compression();
+		return -1;
+	}
+	if(inflateInit(&zin)!=Z_OK)
+	{
+		logp("could not start network decompression\n");
+		deflateEnd(&zout);
+		end_compression();
+		return -1;
+	}
+	net_compression=level;
+	return 0;
+}
+
+int async_get_compression(unsigned long long *raw, unsigned long long *comp)
+{
+	*raw=zraw;
+	*comp=zcomp;
+	return zraw>0;
+}
+
+static int flush_due(void)
+{
+	struct timeval now;
+	if(zflushing) return 1;
+	if(!zpending && !writebuf.len) return 0;
+	if(zflush_now) return 1;
+	if(!zpending) return 0;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec-zpending_since.tv_sec)*1000
+		+(now.tv_usec-zpending_since.tv_usec)/1000>=NET_FLUSH_MS;
+}
+
+// Everything that has been written but not yet given to SSL. Something in
+// the compressor only counts once it is due to be flushed.
+static size_t write_pending(void)
+{
+	if(!net_compression) return writebuf.len;
+	return writebuf.len+zolen+(flush_due()?1:0);
+}
+
+// Deflates what is in the write buffer into zobuf, which must be empty,
+// flushing the stream as well if it is due.
+static int compress_writes(void)
+{
+	int flush=flush_due();
+	zout.next_out=(Bytef *)zobuf;
+	zout.avail_out=NET_ZBUF_LEN;
+	while(zout.avail_out)
+	{
+		int zr;
+		size_t avail=0;
+		char *data=ring_data(&writebuf, &avail);
+		// Flush with the last of the write buffer.
+		if(!zflushing)
 		{
-			logp("memmove failed in parse_readbuf\n");
-			truncate_buf(&readbuf, &readbuflen);
+			if(flush && avail==writebuf.len) zflushing=1;
+			else if(!avail) break;
+		}
+		zout.next_in=(Bytef *)data;
+		zout.avail_in=avail;
+		zr=deflate(&zout, zflushing?Z_SYNC_FLUSH:Z_NO_FLUSH);
+		if(zr!=Z_OK && zr!=Z_BUF_ERROR)
+		{
+			logp("deflate error on network stream: %d\n", zr);
 			return -1;
 		}
-		readbuflen-=s+5;
-		*rlen=s;
+		if(avail>zout.avail_in)
+		{
+			if(!zpending) gettimeofday(&zpending_since, NULL);
+			zpending=1;
+			zraw+=avail-zout.avail_in;
+			ring_consume(&writebuf, avail-zout.avail_in);
+		}
+		if(zflushing && zout.avail_out)
+		{
+			zflushing=0;
+			zpending=0;
+			if(!writebuf.len) break;
+		}
 	}
+	zohead=0;
+	zolen=NET_ZBUF_LEN-zout.avail_out;
+	zcomp+=zolen;
 	return 0;
 }
 
-static int async_alloc_buf(char **buf, size_t *buflen, size_t bufmaxsize)
+// Inflates what has been read into the read buffer, as far as it has room.
+static int inflate_reads(void)
 {
-	if(!*buf)
+	int zr;
+	size_t avail=0;
+	char *tail=NULL;
+	while(zilen || zimore)
 	{
-		if(!(*buf=(char *)malloc(bufmaxsize)))
+		tail=ring_tail(&readbuf, &avail);
+		if(!avail) break;
+		zin.next_in=(Bytef *)zibuf+zihead;
+		zin.avail_in=zilen;
+		zin.next_out=(Bytef *)tail;
+		zin.avail_out=avail;
+		zr=inflate(&zin, Z_SYNC_FLUSH);
+		if(zr!=Z_OK && zr!=Z_BUF_ERROR)
 		{
-			logp("out of memory in async_alloc_buf\n");
+			logp("inflate error on network stream: %d\n", zr);
 			return -1;
 		}
-		truncate_buf(buf, buflen);
+		zihead+=zilen-zin.avail_in;
+		zilen=zin.avail_in;
+		ring_produced(&readbuf, avail-zin.avail_out);
+		zraw+=avail-zin.avail_out;
+		// If it filled the space, it might be holding more back.
+		zimore=!zin.avail_out;
+		if(zr==Z_BUF_ERROR) break;
 	}
 	return 0;
 }
@@ -99,22 +541,49 @@ static int async_alloc_buf(char **buf, size_t *buflen, size_t bufmaxsize)
 static int do_read(int *read_blocked_on_write)
 {
 	ssize_t r;
+	size_t avail=0;
+	char *tail=NULL;
+
+	if(net_compression)
+	{
+		if(zilen || zimore) return inflate_reads();
+		tail=zibuf;
+		avail=NET_ZBUF_LEN;
+		zihead=0;
+	}
+	else
+	{
+		tail=ring_tail(&readbuf, &avail);
+		if(!avail) return 0;
+	}
+
+	ratelimit_wait(&recv_tb);
+	ratelimit_wait(shared_tb);
 
 	ERR_clear_error();
-	r=SSL_read(ssl, readbuf+readbuflen, readbufmaxsize-readbuflen);
+	r=SSL_read(ssl, tail, avail);
 
 	switch(SSL_get_error(ssl, r))
 	{
 	  case SSL_ERROR_NONE:
 		//logp("read: %d\n", r);
-		readbuflen+=r;
-		readbuf[readbuflen]='\0';
+		net_bytes+=r;
+		ratelimit_take(&recv_tb, r);
+		ratelimit_take(shared_tb, r);
+		if(!net_compression)
+		{
+			ring_produced(&readbuf, r);
+			break;
+		}
+		zilen=r;
+		zcomp+=r;
+		if(inflate_reads()) return -1;
 		break;
 	  case SSL_ERROR_ZERO_RETURN:
 		/* end of data */
 		//logp("zero return!\n");
 		SSL_shutdown(ssl);
-		truncate_buf(&readbuf, &readbuflen);
+		ring_reset(&readbuf);
 		return -1;
 	  case SSL_ERROR_WANT_READ:
 		break;
@@ -129,67 +598,50 @@ static int do_read(int *read_blocked_on_write)
 		// Fall through to read problem
 	  default:
 		logp("SSL read problem\n");
-		truncate_buf(&readbuf, &readbuflen);
+		ring_reset(&readbuf);
 		return -1;
 	}
 	return 0;
 }
 
-// Return 0 for OK to write, non-zero for not OK to write.
-static int check_ratelimit(unsigned long long *bytes)
-{
-	float f;
-	time_t now;
-	time_t diff;
-	static time_t start=time(NULL);
-	static int sleeptime=10000;
-	now=time(NULL);
-	if((diff=now-start)<0)
-	{
-		// It is possible that the clock changed. Reset ourselves.
-		now=start;
-		*bytes=0;
-		logp("Looks like the clock went back in time since starting. Resetting ratelimit\n");
-		return 0;
-	}
-	if(!diff) return 0; // Need to get started somehow.
-	f=(*bytes)/diff; // Bytes per second.
-
-	if(f>=ratelimit)
-	{
-	//	printf("ratelimit: %f %f\n", f, ratelimit);
-#ifdef HAVE_WIN32
-		// Windows Sleep is milliseconds, usleep is microseconds.
-		// Do some conversion.
-		Sleep(sleeptime/1000);
-#else
-		usleep(sleeptime);
-#endif
-		// If sleeping, increase the sleep time.
-		if((sleeptime*=2)>=500000) sleeptime=500000;
-		return 1;
-	}
-	// If not sleeping, decrease the sleep time.
-	if((sleeptime/=2)<=9999) sleeptime=10000;
-	return 0;
-}
-
 static int do_write(int *write_blocked_on_read)
 {
 	ssize_t w;
-	static unsigned long long bytes=0;
+	size_t avail=0;
+	char *data=NULL;
+
+	// Wait until any bandwidth borrowed by the last write is paid back.
+	ratelimit_wait(&send_tb);
+	ratelimit_wait(shared_tb);
 
-	if(ratelimit && check_ratelimit(&bytes)) return 0;
+	// If a previous SSL_write wanted a retry, this gives it the same
+	// buffer again, since the head only moves on success.
+	if(net_compression)
+	{
+		if(!zolen && compress_writes()) return -1;
+		if(!zolen) return 0;
+		data=zobuf+zohead;
+		avail=zolen;
+	}
+	else
+		data=ring_data(&writebuf, &avail);
 	ERR_clear_error();
-	w=SSL_write(ssl, writebuf, writebuflen);
+	w=SSL_write(ssl, data, avail);
 
 	switch(SSL_get_error(ssl, w))
 	{
 	  case SSL_ERROR_NONE:
 		//logp("wrote: %d\n", w);
-		if(ratelimit) bytes+=w;
-		memmove(writebuf, writebuf+w, writebuflen-w);
-		writebuflen-=w;
+		ratelimit_take(&send_tb, w);
+		ratelimit_take(shared_tb, w);
+		if(net_compression)
+		{
+			zohead+=w;
+			zolen-=w;
+		}
+		else
+			ring_consume(&writebuf, w);
+		net_bytes+=w;
 		break;
 	  case SSL_ERROR_WANT_WRITE:
 		break;
@@ -210,27 +662,57 @@ static int do_write(int *write_blocked_on_read)
 	return 0;
 }
 
-static int append_to_write_buffer(const char *buf, size_t len)
+static int append_frame(char wcmd, int ch, const char *wsrc, size_t *wlen)
 {
-	memcpy(writebuf+writebuflen, buf, len);
-	writebuflen+=len;
-	writebuf[writebuflen]='\0';
+	size_t sblen=0;
+	char sbuf[24]="";
+	if(frame_hdr_len+(*wlen)>writebuf.size
+	  || ((frame_hdr_len==5 || frame_hdr_len==7) && *wlen>0xFFFF))
+	{
+		logp("frame of %lu bytes will not fit in the write buffer\n",
+			(unsigned long)*wlen);
+		return -1;
+	}
+	if(ring_space(&writebuf) < frame_hdr_len+(*wlen))
+		return 1;
+
+	if(channels)
+		snprintf(sbuf, sizeof(sbuf), frame_hdr_fmt(),
+			wcmd, ch, (unsigned int)*wlen);
+	else
+		snprintf(sbuf, sizeof(sbuf), frame_hdr_fmt(),
+			wcmd, (unsigned int)*wlen);
+	sblen=strlen(sbuf);
+	ring_append(&writebuf, sbuf, sblen);
+	ring_append(&writebuf, wsrc, *wlen);
+	//logp("appended to wbuf: %c (%d) (%d)\n", wcmd, *wlen+sblen, writebuf.len);
+	if(ch && wcmd!=CMD_WINDOW) credit[ch]-=*wlen;
+	*wlen=0;
 	return 0;
 }
 
 int async_append_all_to_write_buffer(char wcmd, const char *wsrc, size_t *wlen)
 {
-	size_t sblen=0;
-	char sbuf[10]="";
-	if(writebuflen+6+(*wlen) >= writebufmaxsize-1)
-		return 1;
+	return append_frame(wcmd, write_channel, wsrc, wlen);
+}
 
-	snprintf(sbuf, sizeof(sbuf), "%c%04X", wcmd, (unsigned int)*wlen);
-	sblen=strlen(sbuf);
-	append_to_write_buffer(sbuf, sblen);
-	append_to_write_buffer(wsrc, *wlen);
-	//logp("appended to wbuf: %c (%d) (%d)\n", wcmd, *wlen+sblen, writebuflen);
-	*wlen=0;
+// Give the peer back the room on each channel once it has used half of it,
+// so that window frames do not crowd out the data.
+static int send_window_updates(void)
+{
+	int c=0;
+	for(c=1; c<channels; c++)
+	{
+		int ret;
+		size_t len=0;
+		char num[32]="";
+		if(owed[c]<window/2) continue;
+		snprintf(num, sizeof(num), "%ld", owed[c]);
+		len=strlen(num);
+		if((ret=append_frame(CMD_WINDOW, c, num, &len)))
+			return ret<0?-1:0; // Try again next time.
+		owed[c]=0;
+	}
 	return 0;
 }
 
@@ -238,17 +720,43 @@ int async_init(int afd, SSL *assl, struct config *conf, int estimate)
 {
 	fd=afd;
 	ssl=assl;
-	ratelimit=conf->ratelimit;
+	ratelimit_init(&send_tb, conf->ratelimit);
+	ratelimit_init(&recv_tb, conf->ratelimit_receive);
+	shared_tb=ratelimit_shared();
 	max_network_timeout=conf->network_timeout;
 	network_timeout=max_network_timeout;
 	doing_estimate=estimate;
 	if(doing_estimate) return 0;
 
-	if(async_alloc_buf(&readbuf, &readbuflen, readbufmaxsize)
-	  || async_alloc_buf(&writebuf, &writebuflen, writebufmaxsize))
+	if(async_alloc_buf(&readbuf)
+	  || async_alloc_buf(&writebuf))
 		return -1;
-	return 0;
 
+	net_bytes=0;
+	zraw=0;
+	zcomp=0;
+#ifndef HAVE_WIN32
+	getrusage(RUSAGE_SELF, &net_rusage);
+#endif
+
+#if !defined(HAVE_WIN32) && defined(HAVE_SYS_EPOLL_H)
+	if(efd<0 && fd>=0)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.data.fd=fd;
+		emask=0;
+		// If epoll is not usable, wait_for_fd() falls back to poll.
+		if((efd=epoll_create(1))<0)
+			logp("epoll_create failed: %s\n", strerror(errno));
+		else if(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev))
+		{
+			logp("epoll_ctl add failed: %s\n", strerror(errno));
+			close_fd(&efd);
+		}
+	}
+#endif
+	return 0;
 }
 
 int set_bulk_packets(void)
@@ -266,9 +774,37 @@ int set_bulk_packets(void)
 	return 0;
 }
 
+// Only worth saying for connections that moved some data.
+#define TRANSFER_LOG_MIN	(1024*1024*64)
+
+static void log_transfer_cost(void)
+{
+#ifndef HAVE_WIN32
+	double secs=0;
+	struct rusage ru;
+	if(net_bytes<TRANSFER_LOG_MIN || getrusage(RUSAGE_SELF, &ru)) return;
+	secs=(ru.ru_utime.tv_sec-net_rusage.ru_utime.tv_sec)
+		+(ru.ru_stime.tv_sec-net_rusage.ru_stime.tv_sec)
+		+(ru.ru_utime.tv_usec-net_rusage.ru_utime.tv_usec)/1000000.0
+		+(ru.ru_stime.tv_usec-net_rusage.ru_stime.tv_usec)/1000000.0;
+	logp("transferred %llu bytes, %.2f CPU seconds per GB%s\n",
+		net_bytes, secs*1024*1024*1024/net_bytes,
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+		(ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)))?" (kernel TLS)":""
+#else
+		""
+#endif
+		);
+#endif
+	net_bytes=0;
+}
+
+static int drain_writes(int *write_blocked_on_read);
+
 void async_free(void)
 {
 //	printf("in async_free\n");
+	log_transfer_cost();
 	if(ssl && fd>=0)
 	{
 		int r;
@@ -279,6 +815,13 @@ void async_free(void)
 #ifndef HAVE_WIN32
 signal(SIGPIPE, SIG_IGN);
 #endif
+		{
+			// Send whatever is still in the write buffer and the
+			// compressor.
+			int blocked=0;
+			zflush_now=1;
+			drain_writes(&blocked);
+		}
 		if(!(r=SSL_shutdown(ssl)))
 		{
 //printf("calling SSL_shutdown again...\n");
@@ -318,11 +861,28 @@ signal(SIGPIPE, SIG_IGN);
 		SSL_free(ssl);
 		ssl=NULL;
 	}
+#if !defined(HAVE_WIN32) && defined(HAVE_SYS_EPOLL_H)
+	close_fd(&efd);
+	emask=0;
+#endif
 	close_fd(&fd);
-	readbuflen=0;
-	writebuflen=0;
-	if(readbuf) { free(readbuf); readbuf=NULL; }
-	if(writebuf) { free(writebuf); writebuf=NULL; }
+	if(net_compression && zcomp)
+		logp("network compression: %llu bytes as %llu (%.1f:1)\n",
+			zraw, zcomp, (double)zraw/zcomp);
+	end_compression();
+	ring_reset(&readbuf);
+	ring_reset(&writebuf);
+	if(readbuf.buf) { free(readbuf.buf); readbuf.buf=NULL; }
+	if(writebuf.buf) { free(writebuf.buf); writebuf.buf=NULL; }
+	// Back to the defaults for the next connection.
+	frame_size=ASYNC_BUF_LEN;
+	channels=0;
+	write_channel=0;
+	read_channel=0;
+	window=0;
+	set_frame_hdr_len();
+	readbuf.size=(ASYNC_BUF_LEN*2)+32;
+	writebuf.size=(ASYNC_BUF_LEN*2)+32;
 }
 
 /* for debug purposes */
@@ -335,15 +895,175 @@ void settimers(int sec, int usec)
 	setusec=usec;
 }
 
+#if !defined(HAVE_WIN32) && defined(HAVE_SYS_EPOLL_H)
+static int wait_with_epoll(int doread, int dowrite, int timeout,
+	int *canread, int *canwrite)
+{
+	int n;
+	uint32_t want=0;
+	struct epoll_event ev;
+
+	if(doread) want|=EPOLLIN;
+	if(dowrite) want|=EPOLLOUT;
+
+	// Only go to the kernel when the interest set actually changes.
+	if(want!=emask)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events=want;
+		ev.data.fd=fd;
+		if(epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev))
+		{
+			logp("epoll_ctl mod failed: %s\n", strerror(errno));
+			return -1;
+		}
+		emask=want;
+	}
+
+	if((n=epoll_wait(efd, &ev, 1, timeout))<0)
+	{
+		if(errno==EAGAIN || errno==EINTR) return 0;
+		logp("epoll_wait error: %s\n", strerror(errno));
+		return -1;
+	}
+	if(!n) return 0;
+
+	if(ev.events & EPOLLERR)
+	{
+		logp("error on socket\n");
+		return -1;
+	}
+	// A hangup may still have data queued behind it, so read it.
+	if(doread && (ev.events & (EPOLLIN|EPOLLHUP))) *canread=1;
+	if(dowrite && (ev.events & EPOLLOUT)) *canwrite=1;
+	return 0;
+}
+#endif
+
+#if !defined(HAVE_WIN32) && defined(HAVE_POLL_H)
+static int wait_with_poll(int doread, int dowrite, int timeout,
+	int *canread, int *canwrite)
+{
+	int n;
+	struct pollfd pfd;
+
+	pfd.fd=fd;
+	pfd.events=0;
+	pfd.revents=0;
+	if(doread) pfd.events|=POLLIN;
+	if(dowrite) pfd.events|=POLLOUT;
+
+	if((n=poll(&pfd, 1, timeout))<0)
+	{
+		if(errno==EAGAIN || errno==EINTR) return 0;
+		logp("poll error: %s\n", strerror(errno));
+		return -1;
+	}
+	if(!n) return 0;
+
+	if(pfd.revents & (POLLERR|POLLNVAL))
+	{
+		logp("error on socket\n");
+		return -1;
+	}
+	if(doread && (pfd.revents & (POLLIN|POLLHUP))) *canread=1;
+	if(dowrite && (pfd.revents & POLLOUT)) *canwrite=1;
+	return 0;
+}
+#endif
+
+static int wait_with_select(int doread, int dowrite, int *canread, int *canwrite)
+{
+	int mfd=-1;
+	fd_set fsr;
+	fd_set fsw;
+	fd_set fse;
+	struct timeval tval;
+
+	if(doread) FD_ZERO(&fsr);
+	if(dowrite) FD_ZERO(&fsw);
+	FD_ZERO(&fse);
+
+	add_fd_to_sets(fd, doread?&fsr:NULL, dowrite?&fsw:NULL, &fse, &mfd);
+
+	tval.tv_sec=setsec;
+	tval.tv_usec=setusec;
+
+	if(select(mfd+1, doread?&fsr:NULL, dowrite?&fsw:NULL, &fse, &tval)<0)
+	{
+		if(errno!=EAGAIN && errno!=EINTR)
+		{
+			logp("select error: %s\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	if(FD_ISSET(fd, &fse))
+	{
+		logp("error on socket\n");
+		return -1;
+	}
+	if(doread && FD_ISSET(fd, &fsr)) *canread=1;
+	if(dowrite && FD_ISSET(fd, &fsw)) *canwrite=1;
+	return 0;
+}
+
+/* Wait for the socket to become ready in the requested directions, for at
+   most setsec/setusec. Uses epoll where available, then poll, then select.
+   Sets canread/canwrite for whatever is ready. */
+static int wait_for_fd(int doread, int dowrite, int *canread, int *canwrite)
+{
+#ifndef HAVE_WIN32
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_POLL_H)
+	int timeout=(setsec*1000)+((setusec+999)/1000);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	if(efd>=0) return wait_with_epoll(doread, dowrite, timeout,
+		canread, canwrite);
+#endif
+#ifdef HAVE_POLL_H
+	return wait_with_poll(doread, dowrite, timeout, canread, canwrite);
+#endif
+#endif
+	return wait_with_select(doread, dowrite, canread, canwrite);
+}
+
+/* Read until SSL has nothing more for us, or the read buffer is full. */
+static int drain_reads(int *read_blocked_on_write)
+{
+	size_t before;
+	while(ring_space(&readbuf))
+	{
+		before=readbuf.len;
+		if(do_read(read_blocked_on_write)) return -1;
+		if(readbuf.len==before || *read_blocked_on_write) break;
+		// Go back to the socket only for more than what has already
+		// arrived, or the end of the connection could throw away
+		// frames that have not been parsed yet.
+		if(!SSL_pending(ssl) && !zilen && !zimore) break;
+	}
+	return 0;
+}
+
+/* Write until the write buffer is empty or SSL cannot take any more. */
+static int drain_writes(int *write_blocked_on_read)
+{
+	size_t before;
+	while((before=write_pending()))
+	{
+		if(do_write(write_blocked_on_read)) return -1;
+		if(write_pending()==before || *write_blocked_on_read) break;
+	}
+	return 0;
+}
+
 int async_rw(char *rcmd, char **rdst, size_t *rlen, char wcmd, const char *wsrc, size_t *wlen)
 {
-        int mfd=-1;
-        fd_set fsr;
-        fd_set fsw;
-        fd_set fse;
 	int doread=0;
 	int dowrite=0;
-        struct timeval tval;
+	int canread=0;
+	int canwrite=0;
 	static int read_blocked_on_write=0;
 	static int write_blocked_on_read=0;
 
@@ -357,14 +1077,19 @@ int async_rw(char *rcmd, char **rdst, size_t *rlen, char wcmd, const char *wsrc,
 	}
 
 	if(rdst) doread++; // Given a pointer to allocate and read into.
+	// About to wait for the peer, which might be waiting for us.
+	zflush_now=doread;
 
 	if(*wlen)
 	{
 		// More stuff to append to the write buffer.
-		async_append_all_to_write_buffer(wcmd, wsrc, wlen);
+		if(async_append_all_to_write_buffer(wcmd, wsrc, wlen)<0)
+			return -1;
 	}
 
-	if(writebuflen && !write_blocked_on_read)
+	if(channels && send_window_updates()) return -1;
+
+	if(write_pending() && !write_blocked_on_read)
 		dowrite++; // The write buffer is not yet empty.
 
 	if(doread)
@@ -379,77 +1104,57 @@ int async_rw(char *rcmd, char **rdst, size_t *rlen, char wcmd, const char *wsrc,
 		if(read_blocked_on_write) doread=0;
 	}
 
-        if(doread || dowrite)
-        {
-//printf("async_rw loop read %d write %d wbuflen: %d\n", doread, dowrite, writebuflen);
-                mfd=-1;
-
-                if(doread) FD_ZERO(&fsr);
-                if(dowrite) FD_ZERO(&fsw);
-                FD_ZERO(&fse);
-
-                add_fd_to_sets(fd,
-			doread?&fsr:NULL, dowrite?&fsw:NULL, &fse, &mfd);
-
-                tval.tv_sec=setsec;
-                tval.tv_usec=setusec;
+	if(!doread && !dowrite) return 0;
 
-                if(select(mfd+1,
-			doread?&fsr:NULL, dowrite?&fsw:NULL, &fse, &tval)<0)
-                {
-                        if(errno!=EAGAIN && errno!=EINTR)
-                        {
-                                logp("select error: %s\n", strerror(errno));
-                                return -1;
-                        }
-                }
+	if(doread && (SSL_pending(ssl) || zilen || zimore))
+	{
+		// SSL or the decompressor already holds data that the socket
+		// will not tell us about, so do not wait for it.
+		canread=1;
+		canwrite=dowrite;
+	}
+	else if(wait_for_fd(doread, dowrite, &canread, &canwrite))
+		return -1;
 
-		if(!FD_ISSET(fd, &fse)
-		  && (!doread || !FD_ISSET(fd, &fsr))
-		  && (!dowrite || !FD_ISSET(fd, &fsw)))
+	if(!canread && !canwrite)
+	{
+		//logp("WAIT HIT TIMEOUT - doread: %d, dowrite: %d\n",
+		//	doread, dowrite);
+		// Be careful to avoid 'read quick' mode.
+		if((setsec || setusec)
+		  && max_network_timeout>0 && network_timeout--<=0)
 		{
-			//logp("SELECT HIT TIMEOUT - doread: %d, dowrite: %d\n",
-			//	doread, dowrite);
-			// Be careful to avoid 'read quick' mode.
-			if((setsec || setusec)
-			  && max_network_timeout>0 && network_timeout--<=0)
-			{
-				logp("No activity on network for %d seconds.\n",
-					max_network_timeout);
-				return -1;
-			}
-			return 0;
+			logp("No activity on network for %d seconds.\n",
+				max_network_timeout);
+			return -1;
 		}
-		network_timeout=max_network_timeout;
-
-                if(FD_ISSET(fd, &fse))
-                {
-                        logp("error on socket\n");
-                        return -1;
-                }
-
-                if(doread && FD_ISSET(fd, &fsr)) // able to read
-                {
-			int r;
-			read_blocked_on_write=0;
-			if(do_read(&read_blocked_on_write)) return -1;
-			if((r=parse_readbuf(rcmd, rdst, rlen)))
-				logp("error in second parse_readbuf\n");
-			return r;
-                }
-
-                if(dowrite && FD_ISSET(fd, &fsw)) // able to write
-		{
-			int r=0;
-			write_blocked_on_read=0;
+		return 0;
+	}
+	network_timeout=max_network_timeout;
 
-			if((r=do_write(&write_blocked_on_read)))
-				logp("error in do_write\n");
-			return r;
+	// Service both directions in the same wakeup, emptying whatever
+	// the socket will take and reading whatever it has for us.
+	if(canwrite)
+	{
+		write_blocked_on_read=0;
+		if(drain_writes(&write_blocked_on_read))
+		{
+			logp("error in do_write\n");
+			return -1;
 		}
-        }
+	}
+
+	if(canread)
+	{
+		int r;
+		read_blocked_on_write=0;
+		if(drain_reads(&read_blocked_on_write)) return -1;
+		if((r=parse_readbuf(rcmd, rdst, rlen)))
+			logp("error in second parse_readbuf\n");
+		return r;
+	}
 
-        return 0;
+	return 0;
 }
 
 int async_rw_ensure_read(char *rcmd, char **rdst, size_t *rlen, char wcmd, const char *wsrc, size_t wlen)
@@ -648,6 +1353,12 @@ int async_read_stat(FILE *fp, gzFile zp, struct sbuf *sb, struct cntr *cntr)
 
 			return 0;
 		}
+		else if(cmd==CMD_PHASE1_BATCH)
+		{
+			if(d) free(d);
+			if(phase1bin_load(fp, zp, buf, len)) return -1;
+			return PHASE1BIN_LOADED;
+		}
 		else if((cmd==CMD_GEN && !strcmp(buf, "backupend"))
 		  || (cmd==CMD_GEN && !strcmp(buf, "restoreend"))
 		  || (cmd==CMD_GEN && !strcmp(buf, "phase1end"))
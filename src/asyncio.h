@@ -1,9 +1,19 @@
 #ifndef _ASYNCIO_ROUTINES_H
 #define _ASYNCIO_ROUTINES_H
 
+// Default network frame size. Peers that do not negotiate a different size
+// in extra_comms always use this.
 #define ASYNC_BUF_LEN	16000
+// Chunk size for local (de)compression that does not touch the network.
 #define ZCHUNK		ASYNC_BUF_LEN
 
+// Limits for the negotiated frame size (max_frame_size).
+#define MIN_FRAME_SIZE	4096
+#define MAX_FRAME_SIZE	(8*1024*1024)
+
+// Most channels that can be agreed for one connection (max_channels).
+#define MAX_CHANNELS	16
+
 #include <zlib.h>
 #include "cmd.h"
 
@@ -18,6 +28,32 @@ extern int async_get_fd(void);
 
 extern int async_append_all_to_write_buffer(char wcmd, const char *wsrc, size_t *wlen);
 
+// The largest payload that a single frame may carry.
+extern size_t async_get_frame_size(void);
+
+// Switch to a frame size agreed with the peer. Must be called at the same
+// point in the conversation on both sides.
+extern int async_set_frame_size(size_t size);
+
+// Switch to frames that carry a channel number, agreed with the peer in the
+// same way as the frame size. 0 turns channels off.
+extern int async_set_channels(int n);
+extern int async_get_channels(void);
+// Frames written from now on go on this channel.
+extern void async_set_write_channel(int ch);
+// The channel of the last frame that was read.
+extern int async_get_read_channel(void);
+// How many bytes may still be sent on a channel before the peer has to
+// make room. Channel 0 is never limited.
+extern long async_channel_credit(int ch);
+
+// Switch to deflating everything after the frame layer, in both directions,
+// agreed with the peer in the same way as the frame size.
+extern int async_set_compression(int level);
+// Bytes on this connection before and after compression. Returns 0 if it
+// has not been compressed.
+extern int async_get_compression(unsigned long long *raw, unsigned long long *comp);
+
 // This one can return without completing the read or write, so check
 // *rdst and/or wlen.
 extern int async_rw(char *rcmd, char **rdst, size_t *rlen,
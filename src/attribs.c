@@ -13,65 +13,86 @@
 #include "asyncio.h"
 
 /*
- * Encode a stat structure into a base64 character string
- *   All systems must create such a structure.
+ * The values that go into the encoded stat, in order, as numbers. Phase1
+ * can send these without turning them into text.
  */
-void encode_stat(char *buf, struct stat *statp, int64_t winattr, int compression)
+void stat_to_fields(int64_t *f, struct stat *statp, int64_t winattr, int compression)
 {
-   char *p = buf;
-
-   p += to_base64(statp->st_dev, p);
-   *p++ = ' ';                        /* separate fields with a space */
-   p += to_base64(statp->st_ino, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_mode, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_nlink, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_uid, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_gid, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_rdev, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_size, p);
-   *p++ = ' ';
+   f[0] = statp->st_dev;
+   f[1] = statp->st_ino;
+   f[2] = statp->st_mode;
+   f[3] = statp->st_nlink;
+   f[4] = statp->st_uid;
+   f[5] = statp->st_gid;
+   f[6] = statp->st_rdev;
+   f[7] = statp->st_size;
 #ifdef HAVE_WIN32
-   p += to_base64(0, p); /* output place holder */
-   *p++ = ' ';
-   p += to_base64(0, p); /* output place holder */
+   f[8] = 0; /* place holder */
+   f[9] = 0; /* place holder */
 #else
-   p += to_base64(statp->st_blksize, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_blocks, p);
+   f[8] = statp->st_blksize;
+   f[9] = statp->st_blocks;
 #endif
-   *p++ = ' ';
-   p += to_base64(statp->st_atime, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_mtime, p);
-   *p++ = ' ';
-   p += to_base64(statp->st_ctime, p);
-   *p++ = ' ';
-
+   f[10] = statp->st_atime;
+   f[11] = statp->st_mtime;
+   f[12] = statp->st_ctime;
 #ifdef HAVE_CHFLAGS
    /* FreeBSD function */
-   p += to_base64(statp->st_flags, p);  /* output st_flags */
+   f[13] = statp->st_flags;
 #else
-   p += to_base64(0, p);     /* output place holder */
+   f[13] = 0; /* place holder */
 #endif
-   *p++ = ' ';
-
 #ifdef HAVE_WIN32
-   p += to_base64(winattr, p);
+   f[14] = winattr;
 #else
-   p += to_base64(0, p);     /* output place holder */
+   f[14] = 0; /* place holder */
 #endif
-   *p++ = ' ';
+   f[15] = compression;
+}
 
-   p += to_base64(compression, p);
+/* Turn the numbers into base64 characters separated by spaces. */
+void fields_to_text(char *buf, const int64_t *f)
+{
+   int i;
+   char *p = buf;
 
+   for (i=0; i<STAT_FIELDS; i++) {
+      if (i) *p++ = ' ';             /* separate fields with a space */
+      p += to_base64(f[i], p);
+   }
    *p = 0;
-   return;
+}
+
+/*
+ * The other way round. Returns -1 unless there is exactly the full set of
+ * fields, as from an older client that did not send them all.
+ */
+int text_to_fields(int64_t *f, const char *buf)
+{
+   int i;
+   const char *p = buf;
+
+   for (i=0; i<STAT_FIELDS; i++) {
+      if (i) {
+         if (*p != ' ') return -1;
+         p++;
+      }
+      if (!*p || *p == ' ') return -1;
+      p += from_base64(&f[i], p);
+   }
+   return *p ? -1 : 0;
+}
+
+/*
+ * Encode a stat structure into a base64 character string
+ *   All systems must create such a structure.
+ */
+void encode_stat(char *buf, struct stat *statp, int64_t winattr, int compression)
+{
+   int64_t f[STAT_FIELDS];
+
+   stat_to_fields(f, statp, winattr, compression);
+   fields_to_text(buf, f);
 }
 
 
@@ -176,6 +197,31 @@ void decode_stat(const char *buf, struct stat *statp, int64_t *winattr, int *com
    }
 }
 
+/* Like decode_stat(), for the full set of fields as numbers. */
+void fields_to_stat(const int64_t *f, struct stat *statp, int64_t *winattr, int *compression)
+{
+   plug(statp->st_dev, f[0]);
+   plug(statp->st_ino, f[1]);
+   plug(statp->st_mode, f[2]);
+   plug(statp->st_nlink, f[3]);
+   plug(statp->st_uid, f[4]);
+   plug(statp->st_gid, f[5]);
+   plug(statp->st_rdev, f[6]);
+   plug(statp->st_size, f[7]);
+#ifndef HAVE_WIN32
+   plug(statp->st_blksize, f[8]);
+   plug(statp->st_blocks, f[9]);
+#endif
+   plug(statp->st_atime, f[10]);
+   plug(statp->st_mtime, f[11]);
+   plug(statp->st_ctime, f[12]);
+#ifdef HAVE_CHFLAGS
+   plug(statp->st_flags, f[13]);
+#endif
+   *winattr = f[14];
+   *compression = f[15];
+}
+
 static int set_file_times(const char *path, struct utimbuf *ut, struct stat *statp, struct cntr *cntr)
 {
 	int e;
@@ -7,17 +7,34 @@
 #include "asyncio.h"
 #include "counter.h"
 #include "extrameta.h"
+#include "scancache.h"
+#include "phase1bin.h"
 #include "backup_phase1_client.h"
 
 static char filesymbol=CMD_FILE;
 static char metasymbol=CMD_METADATA;
 
-static int maybe_send_extrameta(const char *path, char cmd, const char *attribs, struct cntr *p1cntr)
+// Sends the stat and the path, and the link target for links, packed into a
+// batch if the server can take them that way.
+static int send_entry(char cmd, FF_PKT *ff, const char *link, int compression, struct config *conf)
 {
-	if(has_extrameta(path, cmd))
+	char attribs[MAXSTRING];
+	if(conf->phase1_binary)
+		return phase1bin_send(cmd, ff->fname, link,
+			&ff->statp, ff->winattr, compression);
+	encode_stat(attribs, &ff->statp, ff->winattr, compression);
+	if(async_write_str(CMD_STAT, attribs)
+	  || async_write_str(cmd, ff->fname)
+	  || (link && async_write_str(cmd, link)))
+		return -1;
+	return 0;
+}
+
+static int maybe_send_extrameta(FF_PKT *ff, char cmd, int compression, struct config *conf, struct cntr *p1cntr)
+{
+	if(has_extrameta(ff->fname, cmd))
 	{
-		if(async_write_str(CMD_STAT, attribs)
-		  || async_write_str(metasymbol, path))
+		if(send_entry(metasymbol, ff, NULL, compression, conf))
 			return -1;
 		do_filecounter(p1cntr, metasymbol, 1);
 	}
@@ -27,14 +44,11 @@ static int maybe_send_extrameta(const char *path, char cmd, const char *attribs,
 int send_file(FF_PKT *ff, bool top_level, struct config *conf, struct cntr *p1cntr)
 {
    char msg[128]="";
-   char attribs[MAXSTRING];
-
-   if(!file_is_included(conf->incexcdir, conf->iecount,
-	conf->incext, conf->incount,
-	conf->excext, conf->excount,
-	conf->increg, conf->ircount,
-	conf->excreg, conf->ercount,
-	ff->fname, top_level)) return 0;
+   int compression=conf->compression;
+
+   if(scancache_add(ff)) return -1;
+
+   if(!file_is_included(conf, ff->fname, top_level)) return 0;
 #ifdef HAVE_WIN32
 // Useful Windows attributes debug
 /*
@@ -66,11 +80,9 @@ if(ff->winattr & FILE_ATTRIBUTE_VIRTUAL) printf("virtual\n");
 		  || ff->type==FT_REG
 		  || ff->type==FT_DIRBEGIN)
 		{
-			encode_stat(attribs,
-				&ff->statp, ff->winattr, conf->compression);
-			if(async_write_str(CMD_STAT, attribs)
-			  || async_write_str(CMD_EFS_FILE, ff->fname))
-				return -1;
+			if(send_entry(CMD_EFS_FILE, ff, NULL,
+				compression, conf))
+					return -1;
 			do_filecounter(p1cntr, CMD_EFS_FILE, 1);
 			if(ff->type==FT_REG)
 				do_filecounter_bytes(p1cntr,
@@ -95,41 +107,33 @@ if(ff->winattr & FILE_ATTRIBUTE_VIRTUAL) printf("virtual\n");
    switch (ff->type) {
    case FT_LNKSAVED:
         //printf("Lnka: %s -> %s\n", ff->fname, ff->link);
-   	encode_stat(attribs, &ff->statp, ff->winattr, conf->compression);
-	if(async_write_str(CMD_STAT, attribs)
-	  || async_write_str(CMD_HARD_LINK, ff->fname)
-	  || async_write_str(CMD_HARD_LINK, ff->link))
+	if(send_entry(CMD_HARD_LINK, ff, ff->link, compression, conf))
 		return -1;
 	do_filecounter(p1cntr, CMD_HARD_LINK, 1);
 	// At least FreeBSD 8.2 can have different xattrs on hard links.
-	if(maybe_send_extrameta(ff->fname, CMD_HARD_LINK, attribs, p1cntr))
+	if(maybe_send_extrameta(ff, CMD_HARD_LINK, compression, conf, p1cntr))
 		return -1;
       break;
    case FT_RAW:
    case FT_FIFO:
    case FT_REGE:
    case FT_REG:
-      encode_stat(attribs, &ff->statp, ff->winattr,
-		in_exclude_comp(conf->excom, conf->excmcount,
-			ff->fname, conf->compression));
-      if(async_write_str(CMD_STAT, attribs)
-	|| async_write_str(filesymbol, ff->fname))
+      compression=in_exclude_comp(conf->excom, conf->excmcount,
+		ff->fname, conf->compression);
+      if(send_entry(filesymbol, ff, NULL, compression, conf))
 		return -1;
       do_filecounter(p1cntr, filesymbol, 1);
       if(ff->type==FT_REG)
 	do_filecounter_bytes(p1cntr, (unsigned long long)ff->statp.st_size);
-      if(maybe_send_extrameta(ff->fname, filesymbol, attribs, p1cntr))
+      if(maybe_send_extrameta(ff, filesymbol, compression, conf, p1cntr))
 		return -1;
       break;
    case FT_LNK:
 	//printf("link: %s -> %s\n", ff->fname, ff->link);
-   	encode_stat(attribs, &ff->statp, ff->winattr, conf->compression);
-	if(async_write_str(CMD_STAT, attribs)
-	  || async_write_str(CMD_SOFT_LINK, ff->fname)
-	  || async_write_str(CMD_SOFT_LINK, ff->link))
+	if(send_entry(CMD_SOFT_LINK, ff, ff->link, compression, conf))
 		return -1;
 	do_filecounter(p1cntr, CMD_SOFT_LINK, 1);
-        if(maybe_send_extrameta(ff->fname, CMD_SOFT_LINK, attribs, p1cntr))
+        if(maybe_send_extrameta(ff, CMD_SOFT_LINK, compression, conf, p1cntr))
 		return -1;
       break;
    case FT_DIREND:
@@ -150,28 +154,25 @@ if(ff->winattr & FILE_ATTRIBUTE_VIRTUAL) printf("virtual\n");
 	 }
 	 else
 	 {
-		encode_stat(attribs,
-			&ff->statp, ff->winattr, conf->compression);
-	      	if(async_write_str(CMD_STAT, attribs)) return -1;
 #if defined(WIN32_VSS)
-		if(async_write_str(filesymbol, ff->fname)) return -1;
+		if(send_entry(filesymbol, ff, NULL, compression, conf))
+			return -1;
 		do_filecounter(p1cntr, filesymbol, 1);
 #else
-		if(async_write_str(CMD_DIRECTORY, ff->fname)) return -1;
+		if(send_entry(CMD_DIRECTORY, ff, NULL, compression, conf))
+			return -1;
 		do_filecounter(p1cntr, CMD_DIRECTORY, 1);
-        	if(maybe_send_extrameta(ff->fname, CMD_DIRECTORY,
-			attribs, p1cntr)) return -1;
+        	if(maybe_send_extrameta(ff, CMD_DIRECTORY,
+			compression, conf, p1cntr)) return -1;
 #endif
 	 }
 	}
       break;
    case FT_SPEC: // special file - fifo, socket, device node...
-      encode_stat(attribs, &ff->statp, ff->winattr, conf->compression);
-      if(async_write_str(CMD_STAT, attribs)
-	  || async_write_str(CMD_SPECIAL, ff->fname))
+      if(send_entry(CMD_SPECIAL, ff, NULL, compression, conf))
 		return -1;
       do_filecounter(p1cntr, CMD_SPECIAL, 1);
-      if(maybe_send_extrameta(ff->fname, CMD_SPECIAL, attribs, p1cntr))
+      if(maybe_send_extrameta(ff, CMD_SPECIAL, compression, conf, p1cntr))
 		return -1;
       break;
    case FT_NOACCESS:
@@ -215,6 +216,9 @@ int backup_phase1_client(struct config *conf, int estimate, struct cntr *p1cntr,
 		metasymbol=CMD_ENC_METADATA;
 	}
 
+	// An estimate does not record anything for next time.
+	if(!estimate && scancache_open(conf)) return -1;
+
 	ff=init_find_files();
 	for(; sd < conf->sdcount; sd++)
 	{
@@ -226,6 +230,10 @@ int backup_phase1_client(struct config *conf, int estimate, struct cntr *p1cntr,
 		}
 	}
 	term_find_files(ff);
+	// The server wants the last of the entries before 'backupphase2'.
+	if(!ret && phase1bin_send_flush()) ret=-1;
+	phase1bin_free();
+	if(scancache_close(!ret)) ret=-1;
 
 	print_endcounter(p1cntr);
 	//print_filecounters(p1cntr, cntr, ACTION_BACKUP);
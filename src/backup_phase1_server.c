@@ -5,10 +5,11 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
+#include "phase1bin.h"
 #include "backup_phase1_server.h"
 
 int backup_phase1_server(const char *phase1data, const char *client, struct cntr *p1cntr, struct cntr *cntr, struct config *conf)
@@ -42,13 +43,22 @@ int backup_phase1_server(const char *phase1data, const char *client, struct cntr
 			// Last thing the client sends is 'backupphase2', and
 			// it wants an 'ok' reply.
 			if(async_write_str(CMD_GEN, "ok")
+			  || phase1bin_write_flush(p1zp)
 			  || send_msg_zp(p1zp, CMD_GEN,
 				"phase1end", strlen("phase1end")))
 					ret=-1;
 			break;
 		}
 		write_status(client, STATUS_SCANNING, sb.path, p1cntr, cntr);
-		if(sbuf_to_manifest_phase1(&sb, NULL, p1zp))
+		if(conf->phase1_binary)
+		{
+			if(phase1bin_write(p1zp, &sb))
+			{
+				ret=-1;
+				break;
+			}
+		}
+		else if(sbuf_to_manifest_phase1(&sb, NULL, p1zp))
 		{
 			ret=-1;
 			break;
@@ -224,6 +234,7 @@ int do_resume(gzFile p1zp, FILE *p2fp, FILE *ucfp, struct dpth *dpth, struct con
 	if(read_phase1(p1zp, p1cntr)) goto error;
 
 	gzrewind(p1zp);
+	phase1bin_reset(NULL, p1zp);
 
 	logp("Setting up resume positions...\n");
 	// Go to the end of p2fp.
@@ -5,12 +5,58 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
 #include "berrno.h"
 #include "extrameta.h"
+#include "openpool.h"
+#include "zpool.h"
+#include "compsample.h"
+#include "fileread.h"
+
+/* Files that the server has asked for, in the order that it asked. The
+   signatures for deltas follow straight after the request on the network,
+   so they are loaded as soon as the request arrives. */
+struct request
+{
+	struct sbuf sb;
+	rs_signature_t *sumset;
+	int readahead; // the kernel has been asked to start reading it
+	struct opened *op; // being opened by the readahead pool, or NULL
+	struct request *next;
+};
+
+/* A file being sent. Each one has its own channel when channels have been
+   agreed with the server, and they take turns sending a chunk each. */
+struct stream
+{
+	int ch;
+	int busy;
+	struct sbuf sb;
+	char attribs[MAXSTRING];
+	BFILE bfd;
+	FILE *fp;
+	struct fileread fr;
+	char *extrameta;
+	size_t elen;
+	int compression;
+	unsigned long long bytes;
+	// Sending the whole file.
+	struct filesend fs;
+	int fsinit;
+	// Sending a delta against the signature in sumset. The job and the
+	// file buffers live in sb.
+	rs_signature_t *sumset;
+};
+
+// How many requests to hold before the streams have to make room for more,
+// regardless of what the channel windows say.
+#define MAX_QUEUED_REQUESTS	256
+
+// How many of the waiting requests to read ahead.
+#define READAHEAD_REQUESTS	32
 
 static int load_signature(rs_signature_t **sumset, struct cntr *cntr)
 {
@@ -23,6 +69,7 @@ static int load_signature(rs_signature_t **sumset, struct cntr *cntr)
 		NULL, NULL, NULL, NULL, NULL, async_get_fd(), -1, cntr)))
 	{
 		rs_free_sumset(*sumset);
+		*sumset=NULL;
 		return r;
 	}
 	if((r=rs_build_hash_table(*sumset)))
@@ -35,134 +82,387 @@ static int load_signature(rs_signature_t **sumset, struct cntr *cntr)
 	return r;
 }
 
-static int load_signature_and_send_delta(BFILE *bfd, FILE *in, unsigned long long *bytes, unsigned long long *sentbytes, struct cntr *cntr)
+static void free_request(struct request *req)
 {
-	rs_job_t *job;
-	rs_result r;
-	rs_signature_t *sumset=NULL;
-	unsigned char checksum[MD5_DIGEST_LENGTH+1];
-	rs_filebuf_t *infb=NULL;
-	rs_filebuf_t *outfb=NULL;
-	rs_buffers_t rsbuf;
-	memset(&rsbuf, 0, sizeof(rsbuf));
+	free_sbuf(&req->sb);
+	if(req->sumset) rs_free_sumset(req->sumset);
+	openpool_drop(req->op);
+	free(req);
+}
 
-	if(load_signature(&sumset, cntr)) return -1;
+static void free_stream(struct stream *st)
+{
+	if(st->fsinit) filesend_free(&st->fs);
+	st->fsinit=0;
+#ifdef HAVE_WIN32
+	if(st->bfd.mode!=BF_CLOSED) close_file_for_send(&st->bfd, NULL);
+#else
+	fileread_end(&st->fr);
+	close_fp(&st->fp);
+#endif
+	if(st->extrameta) free(st->extrameta);
+	st->extrameta=NULL;
+	st->elen=0;
+	st->bytes=0;
+	// This has the delta job, which uses the signature.
+	free_sbuf(&st->sb);
+	if(st->sumset) rs_free_sumset(st->sumset);
+	st->sumset=NULL;
+	st->busy=0;
+}
 
-//logp("start delta\n");
+// Ask the kernel to start reading the files that are next in the queue, so
+// that their data is already in memory by the time that a stream gets to
+// them. With the readahead pool, its threads open them too.
+static void readahead_requests(struct request *queue)
+{
+	int n=0;
+	struct request *req=NULL;
+	for(req=queue; req && n<READAHEAD_REQUESTS; req=req->next, n++)
+	{
+		if(req->readahead) continue;
+		req->readahead=1;
+		if(openpool_active())
+		{
+			req->op=openpool_add(req->sb.path);
+			continue;
+		}
+#if !defined(HAVE_WIN32) && defined(POSIX_FADV_WILLNEED)
+		int fd=-1;
+		struct stat statp;
+		struct stat fdstatp;
+		if(req->sb.cmd!=CMD_FILE && req->sb.cmd!=CMD_ENC_FILE)
+			continue;
+		// Fifos and raw devices are sent as files too. Opening a fifo
+		// and closing it again would upset whatever is writing to it,
+		// so only open regular files.
+		if(lstat(req->sb.path, &statp) || !S_ISREG(statp.st_mode))
+			continue;
+		// Do not block if it has turned into a fifo since the lstat.
+		if((fd=fileread_open(req->sb.path, O_RDONLY|O_NONBLOCK))<0)
+			continue;
+		if(!fstat(fd, &fdstatp)
+		  && fdstatp.st_dev==statp.st_dev
+		  && fdstatp.st_ino==statp.st_ino)
+			posix_fadvise(fd, 0, READAHEAD_BYTES,
+				POSIX_FADV_WILLNEED);
+		close(fd);
+#endif
+	}
+}
 
-	if(!(job=rs_delta_begin(sumset)))
+static int forget_file(struct sbuf *sb)
+{
+	// Tell the server to forget about this
+	// file, otherwise it might get stuck
+	// on a select waiting for it to arrive.
+	async_set_write_channel(0);
+	if(async_write_str(CMD_INTERRUPT, sb->path))
+		return -1;
+	return 0;
+}
+
+static int start_delta(struct stream *st, struct cntr *cntr)
+{
+	if(!(st->sb.sigjob=rs_delta_begin(st->sumset)))
 	{
 		logp("could not start delta job.\n");
-		rs_free_sumset(sumset);
-		return RS_IO_ERROR;
+		return -1;
 	}
-
-	if(!(infb=rs_filebuf_new(bfd, in, NULL, -1, ASYNC_BUF_LEN, cntr))
-	  || !(outfb=rs_filebuf_new(NULL, NULL, NULL, async_get_fd(), ASYNC_BUF_LEN, cntr)))
+	if(!(st->sb.infb=rs_filebuf_new(&st->bfd, st->fp, NULL, -1,
+		async_get_frame_size(), cntr))
+	  || !(st->sb.outfb=rs_filebuf_new(NULL, NULL, NULL, async_get_fd(),
+		async_get_frame_size(), cntr)))
 	{
 		logp("could not rs_filebuf_new for delta\n");
-		if(infb) rs_filebuf_free(infb);
 		return -1;
 	}
-//logp("start delta loop\n");
+	if(st->fp) st->sb.infb->fr=&st->fr;
+	return 0;
+}
 
-	while(1)
+/* Returns 0 if the file is now being sent, 1 if it was skipped, or -1 on
+   error. */
+static int start_stream(struct stream *st, struct request *req, struct config *conf, struct cntr *cntr)
+{
+	int forget=0;
+	int opened=0;
+	int64_t winattr=0;
+	struct stat statbuf;
+	char cmd=req->sb.cmd;
+
+	st->sb=req->sb;
+	init_sbuf(&req->sb);
+	st->sumset=req->sumset;
+	req->sumset=NULL;
+	st->compression=conf->compression;
+	st->fp=NULL;
+#ifdef HAVE_WIN32
+	binit(&st->bfd, 0);
+#endif
+
+#ifdef HAVE_WIN32
+	if(win32_lstat(st->sb.path, &statbuf, &winattr))
+#else
+	if(req->op && (opened=openpool_take(req->op)))
+		statbuf=req->op->statp;
+	if(opened?req->op->stat_errno:lstat(st->sb.path, &statbuf))
+#endif
 	{
-		size_t wlen=0;
-		rs_result delresult;
-		delresult=rs_async(job, &rsbuf, infb, outfb);
-		if(delresult==RS_DONE)
+		logw(cntr, "Path has vanished: %s", st->sb.path);
+		forget++;
+	}
+	else if(conf->min_file_size
+	  && statbuf.st_size<(boffset_t)conf->min_file_size)
+	{
+		logw(cntr, "File size decreased below min_file_size after initial scan: %s", st->sb.path);
+		forget++;
+	}
+	else if(conf->max_file_size
+	  && statbuf.st_size>(boffset_t)conf->max_file_size)
+	{
+		logw(cntr, "File size increased above max_file_size after initial scan: %s", st->sb.path);
+		forget++;
+	}
+
+	if(!forget)
+	{
+		st->compression=in_exclude_comp(conf->excom,
+		  conf->excmcount, st->sb.path, conf->compression);
+#ifndef HAVE_WIN32
+		if(opened && req->op->fd>=0
+		  && (st->fp=fdopen(req->op->fd, "rb")))
+			req->op->fd=-1;
+		else
+#endif
+		if(open_file_for_send(
+#ifdef HAVE_WIN32
+			&st->bfd, NULL,
+#else
+			NULL, &st->fp,
+#endif
+			st->sb.path, winattr, cntr))
+				forget++;
+	}
+
+	if(!forget && st->fp && (cmd==CMD_FILE || cmd==CMD_ENC_FILE))
+	{
+		fileread_init(&st->fr, fileno(st->fp), conf->drop_page_cache);
+		// A delta is patched on to the old file by the server, so
+		// has to keep the compression of the old file.
+		if(!st->sumset)
+			st->compression=compsample_compression(st->sb.path,
+				st->fp, &statbuf, st->compression);
+	}
+	if(!forget)
+		encode_stat(st->attribs, &statbuf, winattr, st->compression);
+
+	if(forget)
+	{
+		int ret=forget_file(&st->sb);
+		free_stream(st);
+		return ret?-1:1;
+	}
+
+	if(cmd==CMD_METADATA || cmd==CMD_ENC_METADATA)
+	{
+		if(get_extrameta(st->sb.path, &statbuf,
+			&st->extrameta, &st->elen, cntr))
 		{
-			r=delresult;
-//			logp("delresult done\n");
-			break;
+			logw(cntr, "Meta data error for %s", st->sb.path);
+			forget++;
 		}
-		else if(delresult==RS_BLOCKED || delresult==RS_RUNNING)
+		else if(!st->extrameta)
 		{
-//			logp("delresult running/blocked: %d\n", delresult);
-			// Keep going
+			logw(cntr, "No meta data after all: %s", st->sb.path);
+			forget++;
 		}
-		else
+		if(forget)
 		{
-			logp("error in rs_async for delta: %d\n", delresult);
-			r=delresult;
-			break;
+			// The server is counting on an answer for each
+			// file that it asked for.
+			int ret=forget_file(&st->sb);
+			free_stream(st);
+			return ret?-1:1;
 		}
-		// FIX ME: get it to read stuff (errors, for example) here too.
-		if(async_rw(NULL, NULL, '\0', '\0', NULL, &wlen))
-			return -1;
 	}
 
-	if(r!=RS_DONE)
-		logp("delta loop returned: %d\n", r);
-
-//logp("after delta loop: %d\n", r);
-//logp("\n");
-
-	if(r==RS_DONE)
+	st->busy=1;
+	async_set_write_channel(st->ch);
+	if(st->sumset)
 	{
-		*bytes=infb->bytes;
-		*sentbytes=outfb->bytes;
-		if(!MD5_Final(checksum, &(infb->md5)))
+		// Need to do sig/delta stuff.
+		if(async_write_str(CMD_DATAPTH, st->sb.datapth)
+		  || async_write_str(CMD_STAT, st->attribs)
+		  || async_write_str(CMD_FILE, st->sb.path)
+		  || start_delta(st, cntr))
 		{
-			logp("MD5_Final() failed\n");
-			r=RS_IO_ERROR;
+			logp("error in sig/delta for %s (%s)\n",
+				st->sb.path, st->sb.datapth);
+			return -1;
 		}
+		return 0;
 	}
-	rs_filebuf_free(infb);
-	rs_filebuf_free(outfb);
-	rs_job_free(job);
-	rs_free_sumset(sumset);
 
-	if(r==RS_DONE && write_endfile(*bytes, checksum)) // finish delta file
+	//logp("need to send whole file: %s\n", st->sb.path);
+	if(async_write_str(CMD_STAT, st->attribs)
+	  || async_write_str(cmd, st->sb.path))
+		return -1;
+#ifdef HAVE_WIN32
+	if(cmd==CMD_EFS_FILE && !st->extrameta)
+	{
+		// EFS files can only be read in one go.
+		if(send_whole_file(cmd, st->sb.path, NULL, 0, &st->bytes,
+			cntr, &st->bfd, st->fp, NULL, 0))
+				return -1;
+		do_filecounter(cntr, cmd, 1);
+		do_filecounter_bytes(cntr, st->bytes);
+		do_filecounter_sentbytes(cntr, st->bytes);
+		free_stream(st);
+		return 1;
+	}
+#endif
+	if(filesend_init(&st->fs,
+		(st->compression || conf->encryption_password)
+			&& cmd!=CMD_EFS_FILE,
+		NULL, 0, &st->bytes, conf->encryption_password, cntr,
+		st->compression, &st->bfd, st->fp,
+		st->extrameta, st->elen))
 			return -1;
+	if(st->fp) st->fs.fr=&st->fr;
+	st->fsinit=1;
+	return 0;
+}
 
-	//logp("end of load_sig_send_delta\n");
+static int delta_step(struct stream *st, struct cntr *cntr)
+{
+	rs_result r;
+	unsigned char checksum[MD5_DIGEST_LENGTH+1];
+	struct sbuf *sb=&st->sb;
 
-	return r;
+	r=rs_async(sb->sigjob, &sb->rsbuf, sb->infb, sb->outfb);
+	// Blocked means that the write buffer is full.
+	if(r==RS_BLOCKED) return 2;
+	if(r==RS_RUNNING) return 0;
+	if(r!=RS_DONE)
+	{
+		logp("error in rs_async for delta: %d\n", r);
+		return -1;
+	}
+
+	if(!MD5_Final(checksum, &(sb->infb->md5)))
+	{
+		logp("MD5_Final() failed\n");
+		return -1;
+	}
+	st->bytes=sb->infb->bytes;
+	// finish delta file
+	if(write_endfile(st->bytes, checksum)) return -1;
+
+	do_filecounter(cntr, CMD_FILE_CHANGED, 1);
+	do_filecounter_bytes(cntr, st->bytes);
+	do_filecounter_sentbytes(cntr, sb->outfb->bytes);
+	return 1;
 }
 
-static int send_whole_file_w(char cmd, const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, const char *encpassword, struct cntr *cntr, int compression, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen)
+/* Sends the next chunk of a file. Returns 0 if there is more to send,
+   1 if the file is finished, 2 if nothing could be sent until the network
+   takes some of what is waiting, or -1 on error. */
+static int stream_step(struct stream *st, struct cntr *cntr)
 {
-	if((compression || encpassword) && cmd!=CMD_EFS_FILE)
-		return send_whole_file_gz(fname, datapth, quick_read, bytes, 
-		  encpassword, cntr, compression, bfd, fp, extrameta, elen);
-	else
-		return send_whole_file(cmd, fname, datapth, quick_read, bytes, 
-		  cntr, bfd, fp, extrameta, elen);
+	int ret;
+	char cmd=st->sb.cmd;
+
+	async_set_write_channel(st->ch);
+	if(st->sumset) ret=delta_step(st, cntr);
+	else if((ret=filesend_step(&st->fs))>0)
+	{
+		do_filecounter(cntr, cmd, 1);
+		do_filecounter_bytes(cntr, st->bytes);
+		do_filecounter_sentbytes(cntr, st->bytes);
+	}
+	async_set_write_channel(0);
+	if(ret<0)
+		logp("error sending %s\n", st->sb.path);
+	else if(ret==1)
+		free_stream(st);
+	return ret;
 }
 
-static int forget_file(struct sbuf *sb, char cmd, struct cntr *cntr)
+// Deals with something from the server. Returns 1 when the server has asked
+// for everything that it wants, or -1 on error.
+static int got_from_server(char cmd, char **buf, struct sbuf *sb, struct request ***qtail, int *qlen, struct cntr *cntr)
 {
-	// Tell the server to forget about this
-	// file, otherwise it might get stuck
-	// on a select waiting for it to arrive.
-	if(async_write_str(CMD_INTERRUPT, sb->path))
-		return 0;
-
-	if(cmd==CMD_FILE && sb->datapth)
+	//logp("now: %c:%s\n", cmd, *buf);
+	if(cmd==CMD_DATAPTH)
+	{
+		if(sb->datapth) free(sb->datapth);
+		sb->datapth=*buf;
+		*buf=NULL;
+	}
+	else if(cmd==CMD_STAT)
+	{
+		// Ignore the stat data - we will fill it
+		// in again. Some time may have passed by now,
+		// and it is best to make it as fresh as
+		// possible.
+	}
+	else if(cmd==CMD_FILE
+	  || cmd==CMD_ENC_FILE
+	  || cmd==CMD_METADATA
+	  || cmd==CMD_ENC_METADATA
+	  || cmd==CMD_EFS_FILE)
 	{
-		rs_signature_t *sumset=NULL;
-		// The server will be sending
-		// us a signature. Munch it up
-		// then carry on.
-		if(load_signature(&sumset, cntr))
+		struct request *req=NULL;
+		if(!(req=(struct request *)malloc(sizeof(struct request))))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		memset(req, 0, sizeof(struct request));
+		req->sb=*sb;
+		init_sbuf(sb);
+		req->sb.cmd=cmd;
+		req->sb.path=*buf;
+		*buf=NULL;
+		if(cmd==CMD_FILE && req->sb.datapth
+		  && load_signature(&req->sumset, cntr))
+		{
+			free_request(req);
 			return -1;
-		else rs_free_sumset(sumset);
+		}
+		**qtail=req;
+		*qtail=&req->next;
+		(*qlen)++;
+	}
+	else if(cmd==CMD_WARNING)
+	{
+		do_filecounter(cntr, cmd, 0);
+	}
+	else if(cmd==CMD_GEN && !strcmp(*buf, "backupphase2end"))
+	{
+		return 1;
+	}
+	else
+	{
+		logp("unexpected cmd from server: %c %s\n", cmd, *buf);
+		return -1;
 	}
 	return 0;
 }
 
 static int do_backup_phase2_client(struct config *conf, int resume, struct cntr *p1cntr, struct cntr *cntr)
 {
+	int s=0;
 	int ret=0;
-	int quit=0;
-	char cmd;
-	char *buf=NULL;
-	size_t len=0;
-	char attribs[MAXSTRING];
-
+	int ended=0;
+	int qlen=0;
+	int nstreams=1;
+	int active=0;
 	struct sbuf sb;
+	struct stream *streams=NULL;
+	struct request *queue=NULL;
+	struct request **qtail=&queue;
 
 	init_sbuf(&sb);
 
@@ -181,202 +481,132 @@ static int do_backup_phase2_client(struct config *conf, int resume, struct cntr
 			return -1;	
 	}
 
-	while(!quit)
+	if(openpool_init(conf->readahead_threads)) return -1;
+	if(zpool_init(conf->compression_threads))
+	{
+		openpool_free();
+		return -1;
+	}
+	if(conf->compression_sample && compsample_open(conf))
+	{
+		openpool_free();
+		zpool_free();
+		return -1;
+	}
+
+	// Channel 0 is for everything else, so it does not carry files.
+	if(async_get_channels()>1) nstreams=async_get_channels()-1;
+	if(!(streams=(struct stream *)
+		calloc(nstreams, sizeof(struct stream))))
 	{
-		if(async_read(&cmd, &buf, &len))
+		logp("out of memory\n");
+		openpool_free();
+		zpool_free();
+		compsample_close();
+		return -1;
+	}
+	for(s=0; s<nstreams; s++)
+	{
+		init_sbuf(&streams[s].sb);
+		streams[s].ch=async_get_channels()>1?s+1:0;
+	}
+
+	while(1)
+	{
+		char cmd='\0';
+		char *buf=NULL;
+		size_t len=0;
+		size_t wlen=0;
+		int progress=0;
+
+		// Start the files that have been asked for, in order, as
+		// channels come free.
+		for(s=0; queue && s<nstreams; s++)
 		{
-			ret=-1;
-			quit++;
+			int r;
+			struct request *req=queue;
+			if(streams[s].busy) continue;
+			if(!(queue=req->next)) qtail=&queue;
+			qlen--;
+			r=start_stream(&streams[s], req, conf, cntr);
+			async_set_write_channel(0);
+			free_request(req);
+			if(r<0) goto error;
+			if(r>0) s--; // Skipped, so this stream is still free.
 		}
-		else if(buf)
+		readahead_requests(queue);
+
+		// Each file being sent gets a turn. Once enough requests are
+		// waiting, they go ahead whatever the channel windows say,
+		// because reading more from the server has to wait for them.
+		for(s=0, active=0; s<nstreams; s++)
 		{
-			//logp("now: %c:%s\n", cmd, buf);
-			if(cmd==CMD_DATAPTH)
-			{
-				sb.datapth=buf;
-				buf=NULL;
+			int r;
+			if(!streams[s].busy) continue;
+			active++;
+			if(async_channel_credit(streams[s].ch)<=0
+			  && qlen<MAX_QUEUED_REQUESTS)
 				continue;
-			}
-			else if(cmd==CMD_STAT)
-			{
-				// Ignore the stat data - we will fill it
-				// in again. Some time may have passed by now,
-				// and it is best to make it as fresh as
-				// possible.
-				free(buf);
-				buf=NULL;
-				continue;
-			}
-			else if(cmd==CMD_FILE
-			  || cmd==CMD_ENC_FILE
-			  || cmd==CMD_METADATA
-			  || cmd==CMD_ENC_METADATA
-			  || cmd==CMD_EFS_FILE)
-			{
-				int forget=0;
-				int64_t winattr=0;
-				struct stat statbuf;
-				char *extrameta=NULL;
-				size_t elen=0;
-				unsigned long long bytes=0;
-				BFILE bfd;
-				FILE *fp=NULL;
-				int compression=conf->compression;
-
-				sb.path=buf;
-				buf=NULL;
+			if((r=stream_step(&streams[s], cntr))<0) goto error;
+			if(r!=2) progress++;
+		}
 
-#ifdef HAVE_WIN32
-				if(win32_lstat(sb.path, &statbuf, &winattr))
-#else
-				if(lstat(sb.path, &statbuf))
-#endif
-				{
-					logw(cntr, "Path has vanished: %s", sb.path);
-					if(forget_file(&sb, cmd, cntr))
-					{
-						ret=-1;
-						quit++;
-					}
-					free_sbuf(&sb);
-					continue;
-				}
-
-				if(conf->min_file_size
-				  && statbuf.st_size<(boffset_t)conf->min_file_size)
-				{
-					logw(cntr, "File size decreased below min_file_size after initial scan: %s", sb.path);
-					forget++;
-				}
-				else if(conf->max_file_size
-				  && statbuf.st_size>(boffset_t)conf->max_file_size)
-				{
-					logw(cntr, "File size increased above max_file_size after initial scan: %s", sb.path);
-					forget++;
-				}
-
-				if(!forget)
-				{
-					compression=in_exclude_comp(conf->excom,
-					  conf->excmcount, sb.path,
-					  conf->compression);
-					encode_stat(attribs,
-					  &statbuf, winattr, compression);
-					if(open_file_for_send(
-#ifdef HAVE_WIN32
-						&bfd, NULL,
-#else
-						NULL, &fp,
-#endif
-						sb.path, winattr, cntr))
-							forget++;
-				}
-
-				if(forget)
-				{
-					if(forget_file(&sb, cmd, cntr))
-					{
-						ret=-1;
-						quit++;
-					}
-					free_sbuf(&sb);
-					continue;
-				}
-
-				if(cmd==CMD_METADATA
-				  || cmd==CMD_ENC_METADATA)
-				{
-					if(get_extrameta(sb.path,
-						&statbuf, &extrameta, &elen,
-						cntr))
-					{
-						logw(cntr, "Meta data error for %s", sb.path);
-						free_sbuf(&sb);
-						close_file_for_send(&bfd, &fp);
-						continue;
-					}
-					if(!extrameta)
-					{
-						logw(cntr, "No meta data after all: %s", sb.path);
-						free_sbuf(&sb);
-						close_file_for_send(&bfd, &fp);
-						continue;
-					}
-				}
-
-				if(cmd==CMD_FILE && sb.datapth)
-				{
-					unsigned long long sentbytes=0;
-					// Need to do sig/delta stuff.
-					if(async_write_str(CMD_DATAPTH, sb.datapth)
-					  || async_write_str(CMD_STAT, attribs)
-					  || async_write_str(CMD_FILE, sb.path)
-					  || load_signature_and_send_delta(
-						&bfd, fp,
-						&bytes, &sentbytes, cntr))
-					{
-						logp("error in sig/delta for %s (%s)\n", sb.path, sb.datapth);
-						ret=-1;
-						quit++;
-					}
-					else
-					{
-						do_filecounter(cntr, CMD_FILE_CHANGED, 1);
-						do_filecounter_bytes(cntr, bytes);
-						do_filecounter_sentbytes(cntr, sentbytes);
-					}
-				}
-				else
-				{
-					//logp("need to send whole file: %s\n",
-					//	sb.path);
-					// send the whole file.
-					if(async_write_str(CMD_STAT, attribs)
-					  || async_write_str(cmd, sb.path)
-					  || send_whole_file_w(cmd, sb.path,
-						NULL, 0, &bytes,
-						conf->encryption_password,
-						cntr, compression,
-						&bfd, fp,
-						extrameta, elen))
-					{
-						ret=-1;
-						quit++;
-					}
-					else
-					{
-						do_filecounter(cntr, cmd, 1);
-						do_filecounter_bytes(cntr, bytes);
-						do_filecounter_sentbytes(cntr, bytes);
-					}
-				}
-				close_file_for_send(&bfd, &fp);
-				free_sbuf(&sb);
-				if(extrameta) free(extrameta);
-			}
-			else if(cmd==CMD_WARNING)
-			{
-				do_filecounter(cntr, cmd, 0);
-				free(buf);
-				buf=NULL;
-			}
-			else if(cmd==CMD_GEN && !strcmp(buf, "backupphase2end"))
-			{
-				if(async_write_str(CMD_GEN, "okbackupphase2end"))
-					ret=-1;
-				quit++;
-			}
-			else
-			{
-				logp("unexpected cmd from server: %c %s\n",
-					cmd, buf);
-				ret=-1;
-				quit++;
-				free(buf);
-				buf=NULL;
-			}
+		if(ended && !queue && !active)
+		{
+			if(async_write_str(CMD_GEN, "okbackupphase2end"))
+				goto error;
+			// The server may still be opening the channel windows
+			// again. Closing with those unread would reset the
+			// connection, and lose whatever the server has not read
+			// yet. So wait for it to say that it has finished.
+			if(async_get_channels()
+			  && async_read_expect(CMD_GEN, "okbackupend"))
+				goto error;
+			break;
 		}
+		if(qlen>=MAX_QUEUED_REQUESTS)
+		{
+			// Wait for room to write.
+			if(!progress && async_rw(NULL, NULL, NULL,
+				'\0', NULL, &wlen)) goto error;
+			continue;
+		}
+
+		// Only wait for the server when there is nothing to send.
+		if(progress)
+		{
+			if(async_read_quick(&cmd, &buf, &len)) goto error;
+		}
+		else if(async_rw(&cmd, &buf, &len, '\0', NULL, &wlen))
+			goto error;
+		if(!buf) continue;
+
+		switch(got_from_server(cmd, &buf, &sb, &qtail, &qlen, cntr))
+		{
+			case 0: break;
+			case 1: ended=1; break;
+			default: free(buf); goto error;
+		}
+		if(buf) free(buf);
+	}
+	goto end;
+error:
+	ret=-1;
+end:
+	for(s=0; s<nstreams; s++) free_stream(&streams[s]);
+	free(streams);
+	while(queue)
+	{
+		struct request *req=queue;
+		queue=req->next;
+		free_request(req);
 	}
+	openpool_free();
+	zpool_free();
+	if(compsample_close()) ret=-1;
+	fileread_log();
+	free_sbuf(&sb);
+	async_set_write_channel(0);
 	return ret;
 }
 
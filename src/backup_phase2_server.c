@@ -5,10 +5,11 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
+#include "phase1bin.h"
 #include "backup_phase1_server.h" // for the resume stuff
 #include "backup_phase2_server.h"
 #include "current_backups_server.h"
@@ -85,17 +86,52 @@ static int filedata(char cmd)
 	  || cmd==CMD_EFS_FILE);
 }
 
-static int process_changed_file(struct sbuf *cb, struct sbuf *p1b, const char *currentdata, struct cntr *cntr)
+// Signatures for changed files, and how many of them came from the cache.
+static unsigned long long sigs_sent=0;
+static unsigned long long sigs_cached=0;
+
+static uint32_t get_be32(const unsigned char *buf)
 {
-	size_t blocklen=0;
-	char *curpath=NULL;
-	//logp("need to process changed file: %s (%s)\n", cb->path, cb->datapth);
+	return ((uint32_t)buf[0]<<24)|((uint32_t)buf[1]<<16)
+		|((uint32_t)buf[2]<<8)|(uint32_t)buf[3];
+}
 
-	// Move datapth onto p1b.
+/* Returns the signature that phase4 kept for the last backup of the file,
+   or NULL if there is none that can be used. It has to have been made with
+   the block length that a new one would be made with. */
+static FILE *open_cached_sig(const char *currentsigs, const char *datapth, size_t blocklen)
+{
+	FILE *fp=NULL;
+	char *sigpath=NULL;
+	unsigned char head[12];
 
-	if(p1b->datapth) free(p1b->datapth);
-	p1b->datapth=cb->datapth;
-	cb->datapth=NULL;
+	if(!(sigpath=prepend_s(currentsigs, datapth, strlen(datapth))))
+	{
+		logp("out of memory\n");
+		return NULL;
+	}
+	// Not having one is normal, so do not use open_file(), which logs.
+	fp=fopen(sigpath, "rb");
+	free(sigpath);
+	if(!fp) return NULL;
+	// The header is the magic number, the block length and the strong
+	// sum length, each four bytes in network order.
+	if(fread(head, 1, sizeof(head), fp)!=sizeof(head)
+	  || get_be32(head)!=RS_SIG_MAGIC
+	  || get_be32(head+4)!=blocklen
+	  || get_be32(head+8)!=RS_DEFAULT_STRONG_LEN
+	  || fseek(fp, 0, SEEK_SET))
+	{
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+// Starts making the signature from the old file.
+static int start_sig_job(struct sbuf *cb, struct sbuf *p1b, const char *currentdata, size_t blocklen, struct cntr *cntr)
+{
+	char *curpath=NULL;
 
 	if(!(curpath=prepend_s(currentdata,
 		p1b->datapth, strlen(p1b->datapth))))
@@ -104,7 +140,7 @@ static int process_changed_file(struct sbuf *cb, struct sbuf *p1b, const char *c
 		return -1;
 	}
 	if(dpth_is_compressed(cb->compression, curpath))
-		p1b->sigzp=gzopen_file(curpath, "rb");
+		p1b->sigzp=zfile_open(curpath, "rb", 0);
 	else
 		p1b->sigfp=open_file(curpath, "rb");
 	if(!p1b->sigzp && !p1b->sigfp)
@@ -116,7 +152,6 @@ static int process_changed_file(struct sbuf *cb, struct sbuf *p1b, const char *c
 	}
 	free(curpath);
 
-	blocklen=get_librsync_block_len(cb->endfile);
 	if(!(p1b->sigjob=rs_sig_begin(blocklen, RS_DEFAULT_STRONG_LEN)))
 	{
 		logp("could not start signature job.\n");
@@ -129,8 +164,35 @@ static int process_changed_file(struct sbuf *cb, struct sbuf *p1b, const char *c
 		logp("could not rs_filebuf_new for infb.\n");
 		return -1;
 	}
+	return 0;
+}
+
+static int process_changed_file(struct sbuf *cb, struct sbuf *p1b, const char *currentdata, const char *currentsigs, struct cntr *cntr)
+{
+	size_t blocklen=0;
+	//logp("need to process changed file: %s (%s)\n", cb->path, cb->datapth);
+
+	// Move datapth onto p1b.
+
+	if(p1b->datapth) free(p1b->datapth);
+	p1b->datapth=cb->datapth;
+	cb->datapth=NULL;
+
+	sigs_sent++;
+	blocklen=get_librsync_block_len(cb->endfile);
+	if(currentsigs && (p1b->sigfp=open_cached_sig(currentsigs,
+		p1b->datapth, blocklen)))
+	{
+		// Send the signature as it is, without reading the old
+		// file at all.
+		sigs_cached++;
+		p1b->sigcached++;
+	}
+	else if(start_sig_job(cb, p1b, currentdata, blocklen, cntr))
+		return -1;
+
 	if(!(p1b->outfb=rs_filebuf_new(NULL, NULL, NULL,
-		async_get_fd(), ASYNC_BUF_LEN, cntr)))
+		async_get_fd(), async_get_frame_size(), cntr)))
 	{
 		logp("could not rs_filebuf_new for in_outfb.\n");
 		return -1;
@@ -215,7 +277,7 @@ static int process_new_file(struct sbuf *cb, struct sbuf *p1b, FILE *p2fp, FILE
 }
 
 // return 1 to say that a file was processed
-static int maybe_process_file(struct sbuf *cb, struct sbuf *p1b, FILE *p2fp, FILE *ucfp, const char *currentdata, struct cntr *cntr, struct config *cconf)
+static int maybe_process_file(struct sbuf *cb, struct sbuf *p1b, FILE *p2fp, FILE *ucfp, const char *currentdata, const char *currentsigs, struct cntr *cntr, struct config *cconf)
 {
 	int pcmp;
 //	logp("in maybe_proc %s\n", p1b->path);
@@ -276,17 +338,21 @@ static int maybe_process_file(struct sbuf *cb, struct sbuf *p1b, FILE *p2fp, FIL
 			return process_new_file(cb, p1b, p2fp, ucfp, cntr);
 
 		// Get new files if they have switched between compression on
-		// or off.
+		// or off, or to another compression algorithm.
 		if(cb->datapth && dpth_is_compressed(cb->compression, cb->datapth))
 			oldcompressed=1;
 		if( ( oldcompressed && !cconf->compression)
-		 || (!oldcompressed &&  cconf->compression))
+		 || (!oldcompressed &&  cconf->compression)
+		 || ( oldcompressed && cconf->compression_algorithm
+			!=dpth_compression_algorithm(cb->compression,
+				cb->datapth)))
 			return process_new_file(cb, p1b, p2fp, ucfp, cntr);
 
 		// Otherwise, do the delta stuff (if possible).
 		if(filedata(p1b->cmd))
 		{
-			if(process_changed_file(cb, p1b, currentdata, cntr))
+			if(process_changed_file(cb, p1b, currentdata,
+				currentsigs, cntr))
 				return -1;
 		}
 		else
@@ -317,15 +383,123 @@ static int maybe_process_file(struct sbuf *cb, struct sbuf *p1b, FILE *p2fp, FIL
 	return 0;
 }
 
-// Return 1 if there is still stuff needing to be sent.
-static int do_stuff_to_send(struct sbuf *p1b, char **last_requested)
+/* Files that have been asked for, but whose data has not all arrived yet.
+   The server keeps asking for more while the client is still sending, up to
+   phase2_window files or phase2_window_sigs of signatures, so that the
+   client always has the next files to read. */
+struct requested
+{
+	char cmd;
+	char *path;
+	unsigned long long sigbytes;
+};
+
+struct window
+{
+	struct requested *req;
+	int count;
+	int alloc;
+	unsigned long long sigbytes;
+};
+
+static void free_window(struct window *win)
+{
+	int i=0;
+	for(i=0; i<win->count; i++) free(win->req[i].path);
+	if(win->req) free(win->req);
+	memset(win, 0, sizeof(struct window));
+}
+
+static int window_full(struct window *win, struct config *cconf)
+{
+	return win->count>=cconf->phase2_window
+	  || win->sigbytes>=(unsigned long long)cconf->phase2_window_sigs
+		*1024*1024;
+}
+
+static int window_add(struct window *win, struct sbuf *p1b)
+{
+	if(win->count>=win->alloc)
+	{
+		int alloc=win->alloc?win->alloc*2:64;
+		struct requested *tmp=NULL;
+		if(!(tmp=(struct requested *)realloc(win->req,
+			alloc*sizeof(struct requested))))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		win->req=tmp;
+		win->alloc=alloc;
+	}
+	if(!(win->req[win->count].path=strdup(p1b->path)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	win->req[win->count].cmd=p1b->cmd;
+	win->req[win->count].sigbytes=0;
+	win->count++;
+	return 0;
+}
+
+// The signature for the last file asked for has all been sent.
+static void window_add_sig(struct window *win, unsigned long long bytes)
+{
+	if(!win->count) return;
+	win->req[win->count-1].sigbytes+=bytes;
+	win->sigbytes+=bytes;
+}
+
+static void window_drop(struct window *win, int i, int n)
+{
+	int j=0;
+	for(j=i; j<i+n; j++)
+	{
+		win->sigbytes-=win->req[j].sigbytes;
+		free(win->req[j].path);
+	}
+	win->count-=n;
+	memmove(win->req+i, win->req+i+n,
+		(win->count-i)*sizeof(struct requested));
+}
+
+/* The client has finished with a file, or has told us to forget it. The
+   same path can be asked for twice, as a file and as its meta data. The
+   client deals with them in order, so take the oldest. A cmd of '\0' matches
+   anything.
+   Clients from before the window skip some files without saying anything,
+   such as those whose meta data has gone. Without channels, the client
+   deals with the files strictly in order, so anything asked for before this
+   one has been dealt with, and goes too. Channels are only used by clients
+   that always say when they skip a file. */
+static void window_remove(struct window *win, char cmd, const char *path)
+{
+	int i=0;
+	for(i=0; i<win->count; i++)
+	{
+		if(cmd && win->req[i].cmd!=cmd) continue;
+		if(strcmp(win->req[i].path, path)) continue;
+		if(async_get_channels()) window_drop(win, i, 1);
+		else window_drop(win, 0, i+1);
+		return;
+	}
+}
+
+/* Return 1 if there is still stuff needing to be sent, or 2 if it cannot
+   go until the network or the client have taken some of what has already
+   been sent. */
+static int do_stuff_to_send(struct sbuf *p1b, struct window *win, struct config *cconf)
 {
 	//size_t junk=0;
+	// Do not start asking for another file until there is room for it.
+	if(p1b->sendpath && window_full(win, cconf))
+		return 2;
 	if(p1b->senddatapth)
 	{
 		size_t l=strlen(p1b->datapth);
 		if(async_append_all_to_write_buffer(CMD_DATAPTH, p1b->datapth, &l))
-			return 1;
+			return 2;
 		p1b->senddatapth=0;
 		//if(async_rw(NULL, NULL, NULL, NULL, NULL, &junk)) return -1;
 	}
@@ -333,7 +507,7 @@ static int do_stuff_to_send(struct sbuf *p1b, char **last_requested)
 	{
 		size_t l=p1b->slen;
 		if(async_append_all_to_write_buffer(CMD_STAT, p1b->statbuf, &l))
-			return 1;
+			return 2;
 		p1b->sendstat=0;
 		//if(async_rw(NULL, NULL, NULL, NULL, NULL, &junk)) return -1;
 	}
@@ -341,27 +515,36 @@ static int do_stuff_to_send(struct sbuf *p1b, char **last_requested)
 	{
 		size_t l=p1b->plen;
 		if(async_append_all_to_write_buffer(p1b->cmd,
-			p1b->path, &l)) return 1;
+			p1b->path, &l)) return 2;
 		p1b->sendpath=0;
-		if(*last_requested) free(*last_requested);
-		*last_requested=strdup(p1b->path);
+		if(window_add(win, p1b)) return -1;
 		//if(async_rw(NULL, NULL, NULL, NULL, NULL, &junk)) return -1;
 	}
-	if(p1b->sigjob && !p1b->sendendofsig)
+	if((p1b->sigjob || p1b->sigcached) && !p1b->sendendofsig)
 	{
 		rs_result sigresult;
 
-		sigresult=rs_async(p1b->sigjob,
-			&(p1b->rsbuf), p1b->infb, p1b->outfb);
+		if(p1b->sigcached)
+			sigresult=rs_async_file(p1b->sigfp,
+				&(p1b->rsbuf), p1b->outfb);
+		else
+			sigresult=rs_async(p1b->sigjob,
+				&(p1b->rsbuf), p1b->infb, p1b->outfb);
 //logp("after rs_async: %d\n", sigresult);
 
 		if(sigresult==RS_DONE)
 		{
 			p1b->sendendofsig++;
+			window_add_sig(win, p1b->outfb->bytes);
 			//if(async_rw(NULL, NULL, NULL, NULL, NULL, &junk))
 			//	return -1;
 		}
-		else if(sigresult==RS_BLOCKED || sigresult==RS_RUNNING)
+		else if(sigresult==RS_BLOCKED)
+		{
+			// The write buffer is full.
+			return 2;
+		}
+		else if(sigresult==RS_RUNNING)
 		{
 			// keep going round the loop.
 			//if(async_rw(NULL, NULL, NULL, NULL, NULL, &junk))
@@ -380,7 +563,7 @@ static int do_stuff_to_send(struct sbuf *p1b, char **last_requested)
 		const char *endfile="endfile";
 		l=strlen(endfile);
 		if(async_append_all_to_write_buffer(CMD_END_FILE, endfile, &l))
-			return 1;
+			return 2;
 		//if(async_rw(NULL, NULL, NULL, NULL, NULL, &junk)) return -1;
 		p1b->sendendofsig=0;
 	}
@@ -420,17 +603,162 @@ static int finish_delta(struct sbuf *rb, const char *working, const char *deltmp
 	return ret;
 }
 
-// returns 1 for finished ok.
-static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirtmp, struct dpth *dpth, const char *working, char **last_requested, const char *deltmppath, struct cntr *cntr, struct config *cconf)
+/* Files being received. When channels have been agreed, the client sends
+   several at once, one on each channel. They still have to go into the
+   phase2 file in the order that they were asked for, which is the order that
+   the client starts them in, so the finished ones wait here for the ones
+   before them. */
+struct receiving
+{
+	struct sbuf *chan[MAX_CHANNELS]; // the file on each channel
+	char *deltmppath[MAX_CHANNELS];
+	struct sbuf **order; // started, but not yet in the phase2 file
+	int *done;
+	int olen;
+};
+
+static void free_receiving(struct receiving *rx)
+{
+	int c=0;
+	for(c=0; c<MAX_CHANNELS; c++)
+	{
+		if(rx->deltmppath[c]) free(rx->deltmppath[c]);
+		rx->deltmppath[c]=NULL;
+		// Files that are in order are freed below.
+		if(rx->chan[c] && !rx->chan[c]->path)
+		{
+			free_sbuf(rx->chan[c]);
+			free(rx->chan[c]);
+		}
+		rx->chan[c]=NULL;
+	}
+	for(c=0; c<rx->olen; c++)
+	{
+		free_sbuf(rx->order[c]);
+		free(rx->order[c]);
+	}
+	if(rx->order) free(rx->order);
+	if(rx->done) free(rx->done);
+	rx->order=NULL;
+	rx->done=NULL;
+	rx->olen=0;
+}
+
+// The file that has been waited on the longest, for the status.
+static const char *receiving_path(struct receiving *rx)
+{
+	if(rx->olen) return rx->order[0]->path;
+	return NULL;
+}
+
+static struct sbuf *get_channel_sbuf(struct receiving *rx, int ch)
+{
+	if(rx->chan[ch]) return rx->chan[ch];
+	if(!(rx->chan[ch]=(struct sbuf *)malloc(sizeof(struct sbuf))))
+	{
+		log_and_send("out of memory");
+		return NULL;
+	}
+	init_sbuf(rx->chan[ch]);
+	return rx->chan[ch];
+}
+
+static const char *get_deltmppath(struct receiving *rx, int ch, const char *working)
+{
+	char tmp[32]="";
+	if(rx->deltmppath[ch]) return rx->deltmppath[ch];
+	// Channel 0 keeps the old name.
+	if(ch) snprintf(tmp, sizeof(tmp), "delta.tmp.%d", ch);
+	else snprintf(tmp, sizeof(tmp), "delta.tmp");
+	if(!(rx->deltmppath[ch]=prepend_s(working, tmp, strlen(tmp))))
+		log_and_send("out of memory");
+	return rx->deltmppath[ch];
+}
+
+static int add_to_order(struct receiving *rx, struct sbuf *rb)
+{
+	int *dtmp=NULL;
+	struct sbuf **otmp=NULL;
+	if(!(otmp=(struct sbuf **)realloc(rx->order,
+		(rx->olen+1)*sizeof(struct sbuf *))))
+	{
+		log_and_send("out of memory");
+		return -1;
+	}
+	rx->order=otmp;
+	if(!(dtmp=(int *)realloc(rx->done, (rx->olen+1)*sizeof(int))))
+	{
+		log_and_send("out of memory");
+		return -1;
+	}
+	rx->done=dtmp;
+	rx->order[rx->olen]=rb;
+	rx->done[rx->olen]=0;
+	rx->olen++;
+	return 0;
+}
+
+// Write out the finished files that are no longer waiting for others.
+static int flush_order(struct receiving *rx, FILE *p2fp, struct cntr *cntr)
+{
+	int ret=0;
+	while(rx->olen && rx->done[0])
+	{
+		struct sbuf *rb=rx->order[0];
+		if(!ret)
+		{
+			if(sbuf_to_manifest(rb, p2fp, NULL))
+				ret=-1;
+			else
+			{
+				char cmd=rb->cmd;
+				if(rb->receivedelta)
+					do_filecounter_changed(cntr, cmd);
+				else
+					do_filecounter(cntr, cmd, 0);
+				if(rb->endfile)
+					do_filecounter_bytes(cntr,
+					  strtoull(rb->endfile, NULL, 10));
+			}
+		}
+		free_sbuf(rb);
+		free(rb);
+		rx->olen--;
+		memmove(rx->order, rx->order+1,
+			rx->olen*sizeof(struct sbuf *));
+		memmove(rx->done, rx->done+1, rx->olen*sizeof(int));
+	}
+	return ret;
+}
+
+static void file_finished(struct receiving *rx, struct sbuf *rb)
 {
+	int o=0;
+	for(o=0; o<rx->olen; o++) if(rx->order[o]==rb) rx->done[o]=1;
+}
+
+// returns 1 for finished ok. With quick set, does not wait for the client.
+static int do_stuff_to_receive(struct receiving *rx, FILE *p2fp, const char *datadirtmp, struct dpth *dpth, const char *working, struct window *win, int quick, struct cntr *cntr, struct config *cconf)
+{
+	int ch=0;
 	int ret=0;
 	char rcmd;
 	size_t rlen=0;
 	size_t wlen=0;
 	char *rbuf=NULL;
+	struct sbuf *rb=NULL;
+	const char *deltmppath=NULL;
 
 	// This also attempts to write anything in the write buffer.
-	if(async_rw(&rcmd, &rbuf, &rlen, '\0', NULL, &wlen))
+	if(quick)
+	{
+		if(async_read_quick(&rcmd, &rbuf, &rlen))
+		{
+			logp("error in async_read_quick\n");
+			return -1;
+		}
+	}
+	else if(async_rw(&rcmd, &rbuf, &rlen, '\0', NULL, &wlen))
 	{
 		logp("error in async_rw\n");
 		return -1;
@@ -438,12 +766,14 @@ static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirt
 
 	if(rbuf)
 	{
+		ch=async_get_read_channel();
+		rb=rx->chan[ch];
 		if(rcmd==CMD_WARNING)
 		{
 			logp("WARNING: %s\n", rbuf);
 			do_filecounter(cntr, rcmd, 0);
 		}
-		else if(rb->fp || rb->zp)
+		else if(rb && (rb->fp || rb->zp))
 		{
 			// Currently writing a file (or meta data)
 			if(rcmd==CMD_APPEND)
@@ -464,8 +794,9 @@ static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirt
 			else if(rcmd==CMD_END_FILE)
 			{
 				// Finished the file.
-				// Write it to the phase2 file, and free the
-				// buffers.
+				// Close it, and then it can go into the
+				// phase2 file once the files before it
+				// have.
 
 				if(close_fp(&(rb->fp)))
 				{
@@ -481,43 +812,19 @@ static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirt
 				rb->elen=rlen;
 				rbuf=NULL;
 				if(!ret && rb->receivedelta
-				  && finish_delta(rb, working, deltmppath))
+				  && (!(deltmppath=get_deltmppath(rx, ch,
+					working))
+				    || finish_delta(rb, working, deltmppath)))
 					ret=-1;
 				else if(!ret)
 				{
-					if(sbuf_to_manifest(rb, p2fp, NULL))
-						ret=-1;
-					else
-					{
-					  char cmd=rb->cmd;
-					  if(rb->receivedelta)
-						do_filecounter_changed(cntr,
-							cmd);
-					  else
-						do_filecounter(cntr, cmd, 0);
-					  if(*last_requested
-					  && !strcmp(rb->path, *last_requested))
-					  {
-						free(*last_requested);
-						*last_requested=NULL;
-					  }
-					}
-				}
-
-				if(!ret)
-				{
-					char *cp=NULL;
-					cp=strchr(rb->endfile, ':');
-					if(rb->endfile)
-					 do_filecounter_bytes(cntr,
-					  strtoull(rb->endfile, NULL, 10));
-					if(cp)
-					{
-						// checksum stuff goes here
-					}
+					window_remove(win, rb->cmd, rb->path);
+					// checksum stuff goes here
 				}
-
-				free_sbuf(rb);
+				rx->chan[ch]=NULL;
+				file_finished(rx, rb);
+				if(!ret && flush_order(rx, p2fp, cntr))
+					ret=-1;
 			}
 			else
 			{
@@ -528,40 +835,58 @@ static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirt
 		// Otherwise, expecting to be told of a file to save.
 		else if(rcmd==CMD_DATAPTH)
 		{
-			rb->datapth=rbuf;
-			rbuf=NULL;
+			if(!(rb=get_channel_sbuf(rx, ch))) ret=-1;
+			else
+			{
+				if(rb->datapth) free(rb->datapth);
+				rb->datapth=rbuf;
+				rbuf=NULL;
+			}
 		}
 		else if(rcmd==CMD_STAT)
 		{
-			rb->statbuf=rbuf;
-			rb->slen=rlen;
-			rbuf=NULL;
+			if(!(rb=get_channel_sbuf(rx, ch))) ret=-1;
+			else
+			{
+				if(rb->statbuf) free(rb->statbuf);
+				rb->statbuf=rbuf;
+				rb->slen=rlen;
+				rbuf=NULL;
+			}
 		}
 		else if(filedata(rcmd))
 		{
-			rb->cmd=rcmd;
-			rb->plen=rlen;
-			rb->path=rbuf;
-			rbuf=NULL;
-
-			if(rb->datapth)
+			if(!(rb=get_channel_sbuf(rx, ch))
+			  || add_to_order(rx, rb))
+				ret=-1;
+			else
 			{
-				// Receiving a delta.
-				if(start_to_receive_delta(rb,
-				  working, deltmppath, cconf))
+				rb->cmd=rcmd;
+				rb->plen=rlen;
+				rb->path=rbuf;
+				rbuf=NULL;
+
+				if(rb->datapth)
 				{
-					logp("error in start_to_receive_delta\n");
-					ret=-1;
+					// Receiving a delta.
+					if(!(deltmppath=get_deltmppath(rx, ch,
+						working))
+					  || start_to_receive_delta(rb,
+						working, deltmppath, cconf))
+					{
+						logp("error in start_to_receive_delta\n");
+						ret=-1;
+					}
 				}
-			}
-			else
-			{
-				// Receiving a whole new file.
-				if(start_to_receive_new_file(rb,
-					datadirtmp, dpth, cntr, cconf))
+				else
 				{
-					logp("error in start_to_receive_new_file\n");
-					ret=-1;
+					// Receiving a whole new file.
+					if(start_to_receive_new_file(rb,
+						datadirtmp, dpth, cntr, cconf))
+					{
+						logp("error in start_to_receive_new_file\n");
+						ret=-1;
+					}
 				}
 			}
 		}
@@ -572,15 +897,11 @@ static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirt
 		}
 		else if(rcmd==CMD_INTERRUPT)
 		{
-			// Interrupt - forget about the last requested file
-			// if it matches. Otherwise, we can get stuck on the
-			// select in the async stuff, waiting for something
-			// that will never arrive.
-			if(*last_requested && !strcmp(rbuf, *last_requested))
-			{
-				free(*last_requested);
-				*last_requested=NULL;
-			}
+			// Interrupt - forget about the requested file.
+			// Otherwise, we can get stuck on the select in the
+			// async stuff, waiting for something that will never
+			// arrive.
+			window_remove(win, '\0', rbuf);
 		}
 		else
 		{
@@ -595,13 +916,12 @@ static int do_stuff_to_receive(struct sbuf *rb, FILE *p2fp, const char *datadirt
 	return ret;
 }
 
-int backup_phase2_server(gzFile *cmanfp, const char *phase1data, const char *phase2data, const char *unchangeddata, const char *datadirtmp, struct dpth *dpth, const char *currentdata, const char *working, const char *client, struct cntr *p1cntr, int resume, struct cntr *cntr, struct config *cconf)
+int backup_phase2_server(gzFile *cmanfp, const char *phase1data, const char *phase2data, const char *unchangeddata, const char *datadirtmp, struct dpth *dpth, const char *currentdata, const char *currentsigs, const char *working, const char *client, struct cntr *p1cntr, int resume, struct cntr *cntr, struct config *cconf)
 {
 	int ars=0;
 	int ret=0;
+	int sts=0;
 	gzFile p1zp=NULL;
-	char *deltmppath=NULL;
-	char *last_requested=NULL;
 	// Where to write phase2data.
 	// Data is not getting written to a compressed file.
 	// This is important for recovery if the power goes.
@@ -612,11 +932,15 @@ int backup_phase2_server(gzFile *cmanfp, const char *phase1data, const char *pha
 	struct sbuf cb;		// file list in current manifest
 	struct sbuf p1b;	// file list from client
 
-	struct sbuf rb;		// receiving file from client
+	struct receiving rx;	// receiving files from client
+	struct window win;	// files asked for, but not yet received
 
 	init_sbuf(&cb);
 	init_sbuf(&p1b);
-	init_sbuf(&rb);
+	sigs_sent=0;
+	sigs_cached=0;
+	memset(&rx, 0, sizeof(rx));
+	memset(&win, 0, sizeof(win));
 
 	if(!(p1zp=gzopen_file(phase1data, "rb")))
 		goto error;
@@ -642,27 +966,26 @@ int backup_phase2_server(gzFile *cmanfp, const char *phase1data, const char *pha
 
 	logp("Begin phase2 (receive file data)\n");
 
-	if(!(deltmppath=prepend_s(working, "delta.tmp", strlen("delta.tmp"))))
-		goto error;
-
 	while(1)
 	{
-		int sts=0;
 		//logp("in loop, %s\n", *cmanfp?"got cmanfp":"no cmanfp");
-		if(rb.path) write_status(client, STATUS_BACKUP,
-			rb.path, p1cntr, cntr);
+		if(receiving_path(&rx)) write_status(client, STATUS_BACKUP,
+			receiving_path(&rx), p1cntr, cntr);
 		else write_status(client, STATUS_BACKUP,
 			p1b.path, p1cntr, cntr);
-		if((last_requested || !p1zp)
-		  && (ars=do_stuff_to_receive(&rb, p2fp, datadirtmp, dpth,
-			working, &last_requested, deltmppath, cntr, cconf)))
+		// Only wait for the client when there is nothing else to do.
+		// Otherwise, just take what has already arrived, and get on
+		// with working out what to ask for next.
+		if((win.count || !p1zp || sts==2)
+		  && (ars=do_stuff_to_receive(&rx, p2fp, datadirtmp, dpth,
+			working, &win, p1zp && sts!=2, cntr, cconf)))
 		{
 			if(ars<0) goto error;
 			// 1 means ok.
 			break;
 		}
 
-		if((sts=do_stuff_to_send(&p1b, &last_requested))<0)
+		if((sts=do_stuff_to_send(&p1b, &win, cconf))<0)
 			goto error;
 
 		if(!sts && p1zp)
@@ -696,8 +1019,8 @@ int backup_phase2_server(gzFile *cmanfp, const char *phase1data, const char *pha
 			if(cb.path)
 			{
 				if((ars=maybe_process_file(&cb, &p1b,
-					p2fp, ucfp,
-					currentdata, cntr, cconf)))
+					p2fp, ucfp, currentdata,
+					currentsigs, cntr, cconf)))
 				{
 					if(ars<0) goto error;
 					// Do not free it - need to send stuff.
@@ -721,7 +1044,8 @@ int backup_phase2_server(gzFile *cmanfp, const char *phase1data, const char *pha
 				}
 		//logp("against: %s\n", cb.path);
 				if((ars=maybe_process_file(&cb, &p1b,
-					p2fp, ucfp, currentdata, cntr, cconf)))
+					p2fp, ucfp, currentdata,
+					currentsigs, cntr, cconf)))
 				{
 					if(ars<0) goto error;
 					// Do not free it - need to send stuff.
@@ -749,13 +1073,17 @@ end:
 			unchangeddata);
 		ret=-1;
 	}
-	free(deltmppath);
 	free_sbuf(&cb);
 	free_sbuf(&p1b);
-	free_sbuf(&rb);
+	free_receiving(&rx);
+	free_window(&win);
+	phase1bin_free();
 	gzclose_fp(&p1zp);
 	if(!ret) unlink(phase1data);
 
+	if(currentsigs && sigs_sent)
+		logp("Sent %llu of %llu signatures from the signature cache\n",
+			sigs_cached, sigs_sent);
 	logp("End phase2 (receive file data)\n");
 
 	return ret;
@@ -5,7 +5,7 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
@@ -19,27 +19,27 @@
 static int make_rev_sig(const char *dst, const char *sig, const char *endfile, int compression, struct cntr *cntr)
 {
 	FILE *dstfp=NULL;
-	gzFile dstzp=NULL;
+	struct zfile *dstzp=NULL;
 	FILE *sigp=NULL;
 	rs_result result;
 //logp("make rev sig: %s %s\n", dst, sig);
 
 	if(dpth_is_compressed(compression, dst))
-		dstzp=gzopen_file(dst, "rb");
+		dstzp=zfile_open(dst, "rb", 0);
 	else
 		dstfp=open_file(dst, "rb");
 
 	if((!dstzp && !dstfp)
 	  || !(sigp=open_file(sig, "wb")))
 	{
-		gzclose_fp(&dstzp);
+		zfile_close(&dstzp);
 		close_fp(&dstfp);
 		return -1;
 	}
 	result=rs_sig_gzfile(dstfp, dstzp, sigp,
 		get_librsync_block_len(endfile),
 		RS_DEFAULT_STRONG_LEN, NULL, cntr);
-	gzclose_fp(&dstzp);
+	zfile_close(&dstzp);
 	close_fp(&dstfp);
 	if(close_fp(&sigp))
 	{
@@ -52,7 +52,7 @@ static int make_rev_sig(const char *dst, const char *sig, const char *endfile, i
 
 static int make_rev_delta(const char *src, const char *sig, const char *del, int compression, struct cntr *cntr, struct config *cconf)
 {
-	gzFile srczp=NULL;
+	struct zfile *srczp=NULL;
 	FILE *srcfp=NULL;
 	FILE *sigp=NULL;
 	rs_result result;
@@ -72,7 +72,7 @@ static int make_rev_delta(const char *src, const char *sig, const char *del, int
 //logp("make rev deltb: %s %s %s\n", src, sig, del);
 
 	if(dpth_is_compressed(compression, src))
-		srczp=gzopen_file(src, "rb");
+		srczp=zfile_open(src, "rb", 0);
 	else
 		srcfp=open_file(src, "rb");
 
@@ -84,16 +84,16 @@ static int make_rev_delta(const char *src, const char *sig, const char *del, int
 
 	if(cconf->compression)
 	{
-		gzFile delzp=NULL;
-		if(!(delzp=gzopen_file(del, comp_level(cconf))))
+		struct zfile *delzp=NULL;
+		if(!(delzp=zfile_open(del, "wb", cconf->compression)))
 		{
-			gzclose_fp(&srczp);
+			zfile_close(&srczp);
 			close_fp(&srcfp);
 			rs_free_sumset(sumset);
 			return -1;
 		}
 		result=rs_delta_gzfile(sumset, srcfp, srczp, NULL, delzp, NULL, cntr);
-		if(gzclose_fp(&delzp))
+		if(zfile_close(&delzp))
 		{
 			logp("error closing %s in make_rev_delta\n", del);
 			result=RS_IO_ERROR;
@@ -104,7 +104,7 @@ static int make_rev_delta(const char *src, const char *sig, const char *del, int
 		FILE *delfp=NULL;
 		if(!(delfp=open_file(del, "wb")))
 		{
-			gzclose_fp(&srczp);
+			zfile_close(&srczp);
 			close_fp(&srcfp);
 			rs_free_sumset(sumset);
 			return -1;
@@ -113,7 +113,7 @@ static int make_rev_delta(const char *src, const char *sig, const char *del, int
 		if(close_fp(&delfp))
 		{
 			logp("error closing %s in make_rev_delta\n", del);
-			gzclose_fp(&srczp);
+			zfile_close(&srczp);
 			close_fp(&srcfp);
 			rs_free_sumset(sumset);
 			return -1;
@@ -121,7 +121,7 @@ static int make_rev_delta(const char *src, const char *sig, const char *del, int
 	}
 
 	rs_free_sumset(sumset);
-	gzclose_fp(&srczp);
+	zfile_close(&srczp);
 	close_fp(&srcfp);
 
 	return result;
@@ -161,7 +161,7 @@ static int gen_rev_delta(const char *sigpath, const char *deltadir, const char *
 		logp("could not make delta from: %s\n", oldpath);
 		ret=-1;
 	}
-	else unlink(sigpath);	
+	// The signature is left for the caller, which might keep it.
 	if(delpath) free(delpath);
 	return ret;
 }
@@ -208,8 +208,8 @@ static int inflate_or_link_oldfile(const char *oldpath, const char *infpath, int
 			close_fp(&dest);
 			return -1;
 		}
-		if((ret=zlib_inflate(source, dest))!=Z_OK)
-		logp("zlib_inflate returned: %d\n", ret);
+		if((ret=zcodec_inflate(source, dest)))
+			logp("could not inflate %s\n", oldpath);
 		close_fp(&source);
 		if(close_fp(&dest))
 		{
@@ -228,7 +228,44 @@ static int inflate_or_link_oldfile(const char *oldpath, const char *infpath, int
 	return ret;
 }
 
-static int jiggle(const char *datapth, const char *currentdata, const char *datadirtmp, const char *datadir, const char *deltabdir, const char *deltafdir, const char *sigpath, const char *endfile, const char *deletionsfile, FILE **delfp, struct sbuf *sb, int hardlinked, int compression, struct cntr *cntr, struct config *cconf)
+/* Keeps the signature of a file that has just been put in place, so that
+   the next backup can send it to the client instead of making it from the
+   file again. The signatures are only a cache, so not being able to keep
+   one is not an error. */
+static void keep_sig(const char *sigpath, const char *sigdir, const char *datapth)
+{
+	char *dst=NULL;
+	if(!(dst=prepend_s(sigdir, datapth, strlen(datapth)))
+	  || mkpath(&dst, sigdir)
+	  || do_rename(sigpath, dst))
+	{
+		logp("could not keep signature for %s\n", datapth);
+		unlink(sigpath);
+	}
+	if(dst) free(dst);
+}
+
+// Keeps the signature of an unchanged file, if the last backup had one.
+static void carry_sig(const char *currentsigs, const char *sigdir, const char *datapth, struct config *cconf)
+{
+	struct stat statp;
+	char *src=NULL;
+	char *dst=NULL;
+	if(!(src=prepend_s(currentsigs, datapth, strlen(datapth)))
+	  || !(dst=prepend_s(sigdir, datapth, strlen(datapth))))
+	{
+		logp("out of memory\n");
+	}
+	else if(!lstat(src, &statp) && S_ISREG(statp.st_mode)
+	  && (mkpath(&dst, sigdir) || do_link(src, dst, &statp, cconf)))
+	{
+		logp("could not keep signature for %s\n", datapth);
+	}
+	if(src) free(src);
+	if(dst) free(dst);
+}
+
+static int jiggle(const char *datapth, const char *currentdata, const char *datadirtmp, const char *datadir, const char *deltabdir, const char *deltafdir, const char *sigpath, const char *currentsigs, const char *sigdir, const char *endfile, const char *deletionsfile, FILE **delfp, struct sbuf *sb, int hardlinked, int compression, struct cntr *cntr, struct config *cconf)
 {
 	int ret=0;
 	struct stat statp;
@@ -350,10 +387,18 @@ static int jiggle(const char *datapth, const char *currentdata, const char *data
 				oldpath, newpath, datapth, endfile,
 				compression, cntr, cconf))
 			{
+				unlink(sigpath);
 				ret=-1;
 				goto cleanup;
 			}
 		}
+		else if(sigdir && make_rev_sig(newpath, sigpath,
+			endfile, compression, cntr))
+		{
+			// Only wanted for the cache, so carry on without it.
+			logp("could not make signature from: %s\n", newpath);
+			unlink(sigpath);
+		}
 
 		// Power interruptions should be
 		// recoverable. If it happens before
@@ -365,11 +410,21 @@ static int jiggle(const char *datapth, const char *currentdata, const char *data
 		// Use the fresh new file.
 		if(do_rename(newpath, finpath))
 		{
+			unlink(sigpath);
 			ret=-1;
 			goto cleanup;
 		}
 		else
 		{
+			// The signature of the new file has been made
+			// already. Keep it only now that the file is in
+			// place, so that a kept signature always matches
+			// the file that it is next to.
+			if(sigdir && !lstat(sigpath, &statp))
+				keep_sig(sigpath, sigdir, datapth);
+			else
+				unlink(sigpath);
+
 			// Remove the forward delta, as it is
 			// no longer needed. There is a
 			// reverse diff and the finished
@@ -417,6 +472,9 @@ static int jiggle(const char *datapth, const char *currentdata, const char *data
 		}
 		else
 		{
+			if(sigdir) carry_sig(currentsigs, sigdir,
+				datapth, cconf);
+
 			// If we are not keeping a hardlinked
 			// archive, delete the old link.
 			if(!hardlinked)
@@ -602,6 +660,8 @@ static int atomic_data_jiggle(const char *finishing, const char *working, const
 	char *deltabdir=NULL;
 	char *deltafdir=NULL;
 	char *sigpath=NULL;
+	char *currentsigs=NULL;
+	char *sigdir=NULL;
 	gzFile zp=NULL;
 	struct sbuf sb;
 
@@ -625,7 +685,11 @@ static int atomic_data_jiggle(const char *finishing, const char *working, const
 	  || !(deltafdir=prepend_s(finishing,
 		"deltas.forward", strlen("deltas.forward")))
 	  || !(sigpath=prepend_s(current,
-		"sig.tmp", strlen("sig.tmp"))))
+		"sig.tmp", strlen("sig.tmp")))
+	  || !(currentsigs=prepend_s(current,
+		"signatures", strlen("signatures")))
+	  || !(sigdir=prepend_s(finishing,
+		"signatures", strlen("signatures"))))
 	{
 		logp("out of memory\n");
 		gzclose_fp(&zp);
@@ -643,7 +707,9 @@ static int atomic_data_jiggle(const char *finishing, const char *working, const
 
 			if((ret=jiggle(sb.datapth, currentdata, datadirtmp,
 				datadir, deltabdir, deltafdir,
-				sigpath, sb.endfile, deletionsfile, &delfp,
+				sigpath, currentsigs,
+				cconf->signature_cache?sigdir:NULL,
+				sb.endfile, deletionsfile, &delfp,
 				&sb,
 				hardlinked, sb.compression, cntr, cconf)))
 					break;
@@ -671,7 +737,13 @@ static int atomic_data_jiggle(const char *finishing, const char *working, const
 	sync(); // try to help CIFS
 	recursive_delete(deltafdir, NULL, FALSE /* do not del files */);
 
+	// Only the latest backup needs signatures. Those that are still
+	// wanted have been linked into the new one.
+	if(!ret) recursive_delete(currentsigs, NULL, TRUE /* del files */);
+
 	if(deltabdir) free(deltabdir);
+	if(currentsigs) free(currentsigs);
+	if(sigdir) free(sigdir);
 	if(deltafdir) free(deltafdir);
 	if(sigpath) free(sigpath);
 	if(datapth) free(datapth);
@@ -98,6 +98,9 @@ extern "C" {
 #endif
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#if !defined(HAVE_WIN32)
+#include <netinet/tcp.h>
+#endif
 
 #ifdef HAVE_OPENSSL
 /* fight OpenSSL namespace pollution */
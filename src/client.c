@@ -22,7 +22,11 @@
 
 #include <sys/types.h>
 
-// Return 0 for OK, -1 for error, 1 for timer conditions not met.
+// How long the server asked us to wait when it queued our backup.
+static int queue_retry=0;
+
+// Return 0 for OK, -1 for error, 1 for timer conditions not met, 2 for the
+// backup being queued by the server.
 static int maybe_check_timer(const char *phase1str, struct config *conf, int *resume)
 {
 	char rcmd;
@@ -40,6 +44,19 @@ static int maybe_check_timer(const char *phase1str, struct config *conf, int *re
                 logp("Timer conditions on the server were not met\n");
                 return 1;
         }
+	else if(rcmd==CMD_GEN && !strncmp(rdst, "queued:", strlen("queued:")))
+	{
+		int position=0;
+		long expected=0;
+		queue_retry=0;
+		sscanf(rdst+strlen("queued:"), "%d:%ld:%d",
+			&position, &expected, &queue_retry);
+		free(rdst);
+		logp("Backup queued on the server at position %d\n", position);
+		logp("Expected wait: %ld seconds\n", expected);
+		if(queue_retry<=0) queue_retry=60;
+		return 2;
+	}
         else if(rcmd!=CMD_GEN)
         {
                 logp("unexpected command from server: %c:%s\n", rcmd ,rdst);
@@ -62,8 +79,14 @@ static int maybe_check_timer(const char *phase1str, struct config *conf, int *re
                 return -1;
 	}
         // The server now tells us the compression level in the OK response.
+        // It has the algorithm in it too, if it is not gzip.
         if(strlen(rdst)>3) conf->compression=atoi(rdst+complen);
-        logp("Compression level: %d\n", conf->compression);
+        if(zcodec_alg(conf->compression)!=ZC_GZIP)
+                logp("Compression: %s level %d\n",
+                        zcodec_name(zcodec_alg(conf->compression)),
+                        zcodec_level(conf->compression));
+        else
+                logp("Compression level: %d\n", conf->compression);
 
 	return 0;
 }
@@ -147,6 +170,8 @@ static int s_server_session_id_context=1;
    key/certificate.
    Returns 2 if there were restore/verify warnings.
    Returns 3 if timer conditions were not met.
+   Returns 4 if the server queued the backup, to mean try again after
+   queue_retry seconds.
 */
 static int do_client(struct config *conf, enum action act)
 {
@@ -199,13 +224,16 @@ static int do_client(struct config *conf, enum action act)
 			goto end;
 		}
 		SSL_set_bio(ssl, sbio, sbio);
+		ssl_load_client_session(ssl, conf);
 		if(SSL_connect(ssl)<=0)
 		{
 			ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
 			logp("SSL connect error: %s\n", buf);
+			ssl_forget_client_session(conf);
 			ret=-1;
 			goto end;
 		}
+		ssl_log_ktls(ssl, conf);
 	}
 
 	if((ret=async_init(rfd, ssl, conf, act==ACTION_ESTIMATE)))
@@ -242,6 +270,7 @@ static int do_client(struct config *conf, enum action act)
 				// Certificate signed successfully.
 				// Everything is OK, but we will reconnect now, in
 				// order to use the new keys/certificates.
+				ssl_forget_client_session(conf);
 				ret=1;
 				goto end;
 			}
@@ -252,8 +281,10 @@ static int do_client(struct config *conf, enum action act)
 		if((ret=ssl_check_cert(ssl, conf)))
 		{
 			logp("check cert failed\n");
+			ssl_forget_client_session(conf);
 			goto end;
 		}
+		ssl_save_client_session(ssl, conf);
 
 		if((ret=async_write_str(CMD_GEN, "extra_comms_begin")))
 		{
@@ -364,6 +395,151 @@ static int do_client(struct config *conf, enum action act)
 			conf->send_client_counters=1;
 		}
 
+		// :queue: means that the server might tell us to come
+		// back later, instead of keeping us waiting.
+		if(server_supports(feat, ":queue:"))
+		{
+			if(async_write_str(CMD_GEN, "queueok"))
+				goto end;
+			conf->can_queue=1;
+		}
+
+		// :phase1bin: means that the server can take the phase1
+		// scan packed into batches.
+		if(conf->packed_phase1
+		  && server_supports(feat, ":phase1bin:"))
+		{
+			if(async_write_str(CMD_GEN, "phase1binok"))
+				goto end;
+			conf->phase1_binary=1;
+		}
+
+		// :frame_size: means that the server can agree to use
+		// something other than the default network frame size.
+		if(conf->max_frame_size!=ASYNC_BUF_LEN
+		  && server_supports(feat, ":frame_size:"))
+		{
+			char str[64]="";
+			char *reply=NULL;
+			unsigned long fsize=0;
+			snprintf(str, sizeof(str),
+				"frame_size=%lu", conf->max_frame_size);
+			if((ret=async_write_str(CMD_GEN, str))
+			  || (ret=async_read(&cmd, &reply, &len)))
+			{
+				logp("Problem requesting %s\n", str);
+				goto end;
+			}
+			if(cmd!=CMD_GEN || strncmp(reply,
+				"frame_size=", strlen("frame_size=")))
+			{
+				logp("Unexpected response to %s: %c:%s\n",
+					str, cmd, reply);
+				free(reply);
+				ret=-1;
+				goto end;
+			}
+			fsize=strtoul(reply+strlen("frame_size="), NULL, 10);
+			free(reply);
+			if(fsize>conf->max_frame_size
+			  || (ret=async_set_frame_size(fsize)))
+			{
+				logp("Could not use frame size of %lu bytes\n",
+					fsize);
+				ret=-1;
+				goto end;
+			}
+			logp("Using network frame size of %lu bytes\n", fsize);
+		}
+
+		// :channels: means that the server can receive several
+		// files at once.
+		if(conf->network_channels>1
+		  && server_supports(feat, ":channels:"))
+		{
+			int n=0;
+			char str[64]="";
+			char *reply=NULL;
+			snprintf(str, sizeof(str),
+				"channels=%d", conf->network_channels);
+			if((ret=async_write_str(CMD_GEN, str))
+			  || (ret=async_read(&cmd, &reply, &len)))
+			{
+				logp("Problem requesting %s\n", str);
+				goto end;
+			}
+			if(cmd!=CMD_GEN || strncmp(reply,
+				"channels=", strlen("channels=")))
+			{
+				logp("Unexpected response to %s: %c:%s\n",
+					str, cmd, reply);
+				free(reply);
+				ret=-1;
+				goto end;
+			}
+			n=atoi(reply+strlen("channels="));
+			free(reply);
+			if(n>conf->network_channels
+			  || (ret=async_set_channels(n>1?n+1:0)))
+			{
+				logp("Could not use %d network channels\n", n);
+				ret=-1;
+				goto end;
+			}
+			if(n>1) logp("Using %d network channels\n", n);
+		}
+
+		// :net_compression: means that the server can deflate
+		// everything on the connection.
+		if(conf->network_compression
+		  && server_supports(feat, ":net_compression:"))
+		{
+			int level=0;
+			char str[64]="";
+			char *reply=NULL;
+			snprintf(str, sizeof(str),
+				"net_compression=%d", conf->network_compression);
+			if((ret=async_write_str(CMD_GEN, str))
+			  || (ret=async_read(&cmd, &reply, &len)))
+			{
+				logp("Problem requesting %s\n", str);
+				goto end;
+			}
+			if(cmd!=CMD_GEN || strncmp(reply,
+				"net_compression=", strlen("net_compression=")))
+			{
+				logp("Unexpected response to %s: %c:%s\n",
+					str, cmd, reply);
+				free(reply);
+				ret=-1;
+				goto end;
+			}
+			level=atoi(reply+strlen("net_compression="));
+			free(reply);
+			if(level<0 || level>conf->network_compression
+			  || (level && (ret=async_set_compression(level))))
+			{
+				logp("Could not use network compression level %d\n",
+					level);
+				ret=-1;
+				goto end;
+			}
+			if(level)
+				logp("Using network compression level %d\n",
+					level);
+		}
+
+		// :compressors: means that the server can be told which
+		// compression algorithms we have, for file data.
+		if(server_supports(feat, ":compressors:"))
+		{
+			char str[128]="";
+			snprintf(str, sizeof(str),
+				"compressors=%s", zcodec_supported_list());
+			if((ret=async_write_str(CMD_GEN, str)))
+				goto end;
+		}
+
 		// :incexc: is for the client sending the server the
 		// incexc config so that it better knows what to do on
 		// resume.
@@ -447,6 +623,11 @@ static int do_client(struct config *conf, enum action act)
 
 			if(ret<0)
 				logp("error in backup\n");
+			else if(ret==2)
+			{
+				// Queued by the server.
+				ret=4;
+			}
 			else if(ret>0)
 			{
 				// Timer script said no.
@@ -535,5 +716,11 @@ int client(struct config *conf, enum action act)
 		sleep(5);
 		ret=do_client(conf, act);
 	}
+	while(ret==4)
+	{
+		logp("Trying again in %d seconds\n", queue_retry);
+		sleep(queue_retry);
+		ret=do_client(conf, act);
+	}
 	return ret;
 }
@@ -7,6 +7,7 @@
 // These two come before any file type entries
 #define CMD_DATAPTH	't'	/* Path to data on the server */
 #define CMD_STAT	'r'	/* File stat information */
+#define CMD_PHASE1_BATCH 'B'	/* Many packed phase1 entries */
 
 // File types
 #define CMD_FILE	'f'	/* Plain file */
@@ -28,6 +29,7 @@
 #define CMD_END_FILE	'x'	/* End of file transmission - also appears at
 				   the end of the manifest and contains
 				   size/checksum info. */
+#define CMD_WINDOW	'W'	/* Room to send more data on a channel */
 
 /* CMD_FILE_UNCHANGED only used in counting stats on the client, for humans */
 #define CMD_FILE_CHANGED 'z'
@@ -0,0 +1,369 @@
+#include "burp.h"
+#include "prog.h"
+#include "msg.h"
+#include "handy.h"
+#include "asyncio.h"
+#include "compsample.h"
+
+#include <math.h>
+
+#ifndef HAVE_WIN32
+
+#define COMPSAMPLE_VERSION	"1"
+
+/* The cache file is made of burp messages, the same as the manifests. After
+   the version comes one message for each path, CS_COMPRESS or CS_STORE,
+   holding the number of times the decision has been used, the number of
+   backups since it was last used, and the path. */
+#define CS_VERSION	'V'
+#define CS_COMPRESS	'c'
+#define CS_STORE	's'
+
+// Samples with fewer bits of entropy per byte than this compress, so they
+// do not need a trial.
+#define COMPSAMPLE_ENTROPY	7.5
+
+// The trial has to take off at least this percentage of the sample for the
+// file to be compressed.
+#define COMPSAMPLE_SAVING	3
+
+// Files that change all the time are sampled again after their decision
+// has been used this many times, in case their contents have changed kind.
+#define COMPSAMPLE_RECHECK	10
+
+// Decisions that have not been used for this many backups are dropped, so
+// that the cache does not fill up with files that have gone.
+#define COMPSAMPLE_MAX_IDLE	30
+
+#define FNV_OFFSET	14695981039346656037ULL
+#define FNV_PRIME	1099511628211ULL
+
+struct decision
+{
+	char *path; // NULL for an empty slot
+	unsigned long long hash;
+	int store; // send uncompressed
+	int uses;
+	int idle;
+	int used; // this backup
+};
+
+static struct decision *slots=NULL;
+static size_t nslots=0;
+static size_t count=0;
+
+static char *cachepath=NULL;
+static unsigned char *sample=NULL;
+static unsigned char *trial=NULL;
+static uLongf triallen=0;
+
+static unsigned long long files=0;
+static unsigned long long stored=0;
+static unsigned long long cached=0;
+
+static unsigned long long fnv(const char *str)
+{
+	unsigned long long h=FNV_OFFSET;
+	const unsigned char *cp=(const unsigned char *)str;
+	for(; *cp; cp++) { h^=*cp; h*=FNV_PRIME; }
+	return h;
+}
+
+static struct decision *find_slot(const char *path, unsigned long long hash)
+{
+	size_t i=0;
+	for(i=hash&(nslots-1); slots[i].path; i=(i+1)&(nslots-1))
+		if(slots[i].hash==hash && !strcmp(slots[i].path, path))
+			break;
+	return &(slots[i]);
+}
+
+static int grow(void)
+{
+	size_t i=0;
+	size_t oldslots=nslots;
+	struct decision *old=slots;
+	nslots=nslots?nslots*2:1024;
+	if(!(slots=(struct decision *)calloc(nslots, sizeof(struct decision))))
+	{
+		logp("out of memory\n");
+		slots=old;
+		nslots=oldslots;
+		return -1;
+	}
+	for(i=0; i<oldslots; i++)
+	{
+		if(!old[i].path) continue;
+		*find_slot(old[i].path, old[i].hash)=old[i];
+	}
+	if(old) free(old);
+	return 0;
+}
+
+// Returns the decision for path, adding an empty one if there is none yet.
+static struct decision *get_decision(const char *path)
+{
+	struct decision *d=NULL;
+	unsigned long long hash=fnv(path);
+	if(count*2>=nslots && grow()) return NULL;
+	d=find_slot(path, hash);
+	if(d->path) return d;
+	if(!(d->path=strdup(path)))
+	{
+		logp("out of memory\n");
+		return NULL;
+	}
+	d->hash=hash;
+	count++;
+	return d;
+}
+
+static void free_decisions(void)
+{
+	size_t i=0;
+	for(i=0; i<nslots; i++) if(slots[i].path) free(slots[i].path);
+	if(slots) free(slots);
+	slots=NULL;
+	nslots=0;
+	count=0;
+}
+
+static void load_old(const char *path)
+{
+	FILE *fp=NULL;
+	char cmd='\0';
+	char *buf=NULL;
+	size_t len=0;
+	int r=0;
+
+	if(!(fp=fopen(path, "rb")))
+	{
+		if(errno!=ENOENT)
+			logp("could not open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if(async_read_fp(fp, NULL, &cmd, &buf, &len)
+	  || cmd!=CS_VERSION || strcmp(buf, COMPSAMPLE_VERSION))
+		goto bad;
+	while(1)
+	{
+		int uses=0;
+		int idle=0;
+		char *cp=NULL;
+		struct decision *d=NULL;
+		free(buf);
+		buf=NULL;
+		if((r=async_read_fp(fp, NULL, &cmd, &buf, &len))>0) break;
+		if(r<0
+		  || (cmd!=CS_COMPRESS && cmd!=CS_STORE)
+		  || sscanf(buf, "%d %d", &uses, &idle)!=2
+		  || !(cp=strchr(buf, ' '))
+		  || !(cp=strchr(cp+1, ' ')))
+			goto bad;
+		if(!(d=get_decision(cp+1))) break;
+		d->store=(cmd==CS_STORE);
+		d->uses=uses;
+		d->idle=idle;
+	}
+	goto end;
+bad:
+	logp("%s is not a usable compression sample cache - sampling everything\n", path);
+	free_decisions();
+end:
+	if(buf) free(buf);
+	fclose(fp);
+}
+
+int compsample_open(struct config *conf)
+{
+	files=0;
+	stored=0;
+	cached=0;
+	triallen=compressBound(COMPSAMPLE_BYTES);
+	if(!(sample=(unsigned char *)malloc(COMPSAMPLE_BYTES))
+	  || !(trial=(unsigned char *)malloc(triallen)))
+	{
+		logp("out of memory\n");
+		compsample_close();
+		return -1;
+	}
+	if(!conf->compression_sample_cache) return 0;
+	if(!(cachepath=strdup(conf->compression_sample_cache)))
+	{
+		logp("out of memory\n");
+		compsample_close();
+		return -1;
+	}
+	load_old(cachepath);
+	return 0;
+}
+
+static int write_cache(void)
+{
+	size_t i=0;
+	FILE *fp=NULL;
+	char *tmppath=NULL;
+	char *buf=NULL;
+	size_t alloc=0;
+
+	if(!(tmppath=get_tmp_filename(cachepath)))
+		return -1;
+	if(!(fp=fopen(tmppath, "wb")))
+	{
+		logp("could not open %s: %s\n", tmppath, strerror(errno));
+		free(tmppath);
+		return -1;
+	}
+	if(send_msg_fp(fp, CS_VERSION, COMPSAMPLE_VERSION,
+		strlen(COMPSAMPLE_VERSION))) goto error;
+	for(i=0; i<nslots; i++)
+	{
+		size_t len=0;
+		struct decision *d=&(slots[i]);
+		if(!d->path) continue;
+		if(!d->used && ++(d->idle)>COMPSAMPLE_MAX_IDLE) continue;
+		len=strlen(d->path)+32;
+		if(len>alloc)
+		{
+			char *tmp=NULL;
+			if(!(tmp=(char *)realloc(buf, len)))
+			{
+				logp("out of memory\n");
+				goto error;
+			}
+			buf=tmp;
+			alloc=len;
+		}
+		snprintf(buf, alloc, "%d %d %s", d->uses, d->idle, d->path);
+		if(send_msg_fp(fp, d->store?CS_STORE:CS_COMPRESS,
+			buf, strlen(buf))) goto error;
+	}
+	if(fclose(fp))
+	{
+		fp=NULL;
+		logp("could not close %s: %s\n", tmppath, strerror(errno));
+		goto error;
+	}
+	fp=NULL;
+	if(do_rename(tmppath, cachepath)) goto error;
+	if(buf) free(buf);
+	free(tmppath);
+	return 0;
+error:
+	if(fp) fclose(fp);
+	unlink(tmppath);
+	if(buf) free(buf);
+	free(tmppath);
+	return -1;
+}
+
+int compsample_close(void)
+{
+	int ret=0;
+	if(cachepath && write_cache()) ret=-1;
+	if(files) logp("Compression sampling: %llu of %llu files sent uncompressed, %llu decided by the cache\n", stored, files, cached);
+	free_decisions();
+	if(cachepath) { free(cachepath); cachepath=NULL; }
+	if(sample) { free(sample); sample=NULL; }
+	if(trial) { free(trial); trial=NULL; }
+	return ret;
+}
+
+static double entropy(const unsigned char *buf, size_t len)
+{
+	size_t i=0;
+	double e=0;
+	size_t freq[256];
+	memset(freq, 0, sizeof(freq));
+	for(i=0; i<len; i++) freq[buf[i]]++;
+	for(i=0; i<256; i++)
+	{
+		double p;
+		if(!freq[i]) continue;
+		p=(double)freq[i]/len;
+		e-=p*log(p);
+	}
+	return e/log(2.0);
+}
+
+// Returns 1 if the start of the file will not compress, 0 if it will, or -1
+// if it could not be read.
+static int incompressible(FILE *fp, struct stat *statp)
+{
+	size_t want=COMPSAMPLE_BYTES;
+	size_t got=0;
+	uLongf outlen=triallen;
+
+	if(statp->st_size<(boffset_t)want) want=(size_t)statp->st_size;
+	// pread leaves the file where it is, for sending it from the start.
+	while(got<want)
+	{
+		ssize_t r=pread(fileno(fp), sample+got, want-got, (off_t)got);
+		if(r<0 && errno==EINTR) continue;
+		if(r<=0) break;
+		got+=r;
+	}
+	// Changed since the scan, so just compress it.
+	if(got<want) return -1;
+
+	if(entropy(sample, got)<COMPSAMPLE_ENTROPY) return 0;
+	if(compress2(trial, &outlen, sample, got, 1)!=Z_OK) return -1;
+	return outlen*100>=got*(100-COMPSAMPLE_SAVING);
+}
+
+int compsample_compression(const char *path, FILE *fp, struct stat *statp, int compression)
+{
+	int r=0;
+	struct decision *d=NULL;
+
+	if(!compression || !sample
+	  || statp->st_size<(boffset_t)COMPSAMPLE_MIN_FILE)
+		return compression;
+	files++;
+	if(cachepath)
+	{
+		if(!(d=get_decision(path))) return compression;
+		if(d->used || (d->uses && d->uses<COMPSAMPLE_RECHECK))
+		{
+			cached++;
+			if(!d->used) d->uses++;
+			d->used=1;
+			d->idle=0;
+			if(!d->store) return compression;
+			stored++;
+			return 0;
+		}
+	}
+	if((r=incompressible(fp, statp))<0) return compression;
+	if(d)
+	{
+		d->store=r;
+		d->uses=1;
+		d->used=1;
+		d->idle=0;
+	}
+	if(!r) return compression;
+	stored++;
+	return 0;
+}
+
+#else
+
+int compsample_open(struct config *conf)
+{
+	if(conf->compression_sample)
+		logp("compression_sample is not supported on Windows\n");
+	return 0;
+}
+
+int compsample_close(void)
+{
+	return 0;
+}
+
+int compsample_compression(const char *path, FILE *fp, struct stat *statp, int compression)
+{
+	return compression;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _COMPSAMPLE_H
+#define _COMPSAMPLE_H
+
+/* Finding files that will not compress, such as media, encrypted containers
+   and compressed logs with extensions that exclude_comp does not know about.
+   The start of a file is sampled before it is sent. If its bytes look close
+   to random, a quick trial deflate of them decides, and a file that would
+   hardly shrink is sent uncompressed, just as if exclude_comp had matched
+   it. The decisions can be kept in a file, so that the next backups of the
+   same path do not sample it again. */
+
+// Files smaller than this are compressed without looking at them first.
+#define COMPSAMPLE_MIN_FILE	(64*1024)
+
+// How much of the start of the file is sampled.
+#define COMPSAMPLE_BYTES	(64*1024)
+
+// Loads the decisions from the last backup, if conf->compression_sample_cache
+// is set. Returns 0 on success, or -1 on error.
+extern int compsample_open(struct config *conf);
+// Writes the decisions for the next backup. Returns 0 on success, or -1 on
+// error.
+extern int compsample_close(void);
+// Returns the compression to send the file open on fp with, which is either
+// compression or 0.
+extern int compsample_compression(const char *path, FILE *fp, struct stat *statp, int compression);
+
+#endif
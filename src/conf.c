@@ -7,6 +7,12 @@
 #include "strlist.h"
 #include "prepend.h"
 #include "regexp.h"
+#include "incexc_match.h"
+#include "asyncio.h"
+#include "findpool.h"
+#include "openpool.h"
+#include "zpool.h"
+#include "zcodec.h"
 
 /* Init only stuff related to includes/excludes.
    This is so that the server can override them all on the client. */
@@ -22,6 +28,7 @@ static void init_incexcs(struct config *conf)
 	conf->excreg=NULL; conf->ercount=0; // include (regular expression)
 	conf->excfs=NULL; conf->exfscount=0; // exclude filesystems
 	conf->excom=NULL; conf->excmcount=0; // exclude from compression
+	conf->incexc_match=NULL;
 	conf->fifos=NULL; conf->ffcount=0;
 	conf->blockdevs=NULL; conf->bdcount=0;
 	/* stuff to do with restore */
@@ -46,6 +53,7 @@ static void free_incexcs(struct config *conf)
 	strlists_free(conf->excreg, conf->ercount); // exclude (regular expression)
 	strlists_free(conf->excfs, conf->exfscount); // exclude filesystems
 	strlists_free(conf->excom, conf->excmcount); // exclude from compression
+	incexc_match_free(&(conf->incexc_match));
 	strlists_free(conf->fifos, conf->ffcount);
 	strlists_free(conf->blockdevs, conf->bdcount);
 	if(conf->backup) free(conf->backup);
@@ -83,11 +91,26 @@ void init_config(struct config *conf)
 	conf->passwd=NULL;
 	conf->server=NULL;
 	conf->ratelimit=0;
+	conf->ratelimit_receive=0;
+	conf->ratelimit_total=0;
 	conf->network_timeout=60*60*2; // two hours
+	conf->max_frame_size=ASYNC_BUF_LEN;
+	conf->network_channels=4;
+	conf->network_compression=0;
+	conf->packed_phase1=1;
 	conf->cross_all_filesystems=0;
 	conf->read_all_fifos=0;
 	conf->read_all_blockdevs=0;
 	conf->min_file_size=0;
+	conf->find_threads=0;
+	conf->readahead_threads=0;
+	conf->compression_threads=0;
+	conf->compression_sample=0;
+	conf->compression_sample_cache=NULL;
+	conf->drop_page_cache=0;
+	conf->scan_cache=NULL;
+	conf->verify_cache_every_n_backups=10;
+	conf->change_journal=NULL;
 	conf->max_file_size=0;
 	conf->autoupgrade_dir=NULL;
 	conf->autoupgrade_os=NULL;
@@ -97,13 +120,28 @@ void init_config(struct config *conf)
         conf->ssl_key_password=NULL;
 	conf->ssl_dhfile=NULL;
 	conf->ssl_peer_cn=NULL;
+	conf->ssl_session_cache=NULL;
+	conf->ssl_session_timeout=7200;
+	conf->ssl_ktls=1;
 	conf->encryption_password=NULL;
 	conf->max_children=0;
 	conf->max_status_children=0;
+	conf->prefork_children=0;
+	conf->prefork_max_sessions=100;
+	conf->max_concurrent_backups=0;
+	conf->max_writeback=0;
+	conf->phase2_window=256;
+	conf->phase2_window_sigs=64;
+	conf->backup_priority=0;
+	conf->can_queue=0;
+	conf->phase1_binary=0;
+	conf->compressors=0;
 	// ext3 maximum number of subdirs is 32000, so leave a little room.
 	conf->max_storage_subdirs=30000;
 	conf->librsync=1;
+	conf->signature_cache=0;
 	conf->compression=9;
+	conf->compression_algorithm=ZC_GZIP;
 	conf->version_warn=1;
 	conf->client_lockdir=NULL;
 	conf->umask=0022;
@@ -212,10 +250,15 @@ void free_config(struct config *conf)
         if(conf->ssl_key_password) free(conf->ssl_key_password);
         if(conf->ssl_dhfile) free(conf->ssl_dhfile);
         if(conf->ssl_peer_cn) free(conf->ssl_peer_cn);
+	if(conf->ssl_session_cache) free(conf->ssl_session_cache);
         if(conf->user) free(conf->user);
         if(conf->group) free(conf->group);
         if(conf->encryption_password) free(conf->encryption_password);
 	if(conf->client_lockdir) free(conf->client_lockdir);
+	if(conf->scan_cache) free(conf->scan_cache);
+	if(conf->compression_sample_cache)
+		free(conf->compression_sample_cache);
+	if(conf->change_journal) free(conf->change_journal);
 	if(conf->autoupgrade_dir) free(conf->autoupgrade_dir);
 	if(conf->autoupgrade_os) free(conf->autoupgrade_os);
 
@@ -458,6 +501,22 @@ static int get_file_size(const char *value, unsigned long *dest, const char *con
 	return 0;
 }
 
+static int get_ratelimit(const char *field, const char *value, float *dest)
+{
+	float f=0;
+	f=atof(value);
+	// User is specifying Mega bits per second.
+	// Need to convert to bytes per second.
+	f=(f*1024*1024)/8;
+	if(!f)
+	{
+		logp("%s should be greater than zero\n", field);
+		return -1;
+	}
+	*dest=f;
+	return 0;
+}
+
 static int pre_post_override(char **override, char **pre, char **post)
 {
 	if(!override || !*override) return 0;
@@ -636,12 +695,26 @@ static int load_config_ints(struct config *conf, const char *field, const char *
 		&(conf->max_hardlinks));
 	get_conf_val_int(field, value, "librsync",
 		&(conf->librsync));
+	get_conf_val_int(field, value, "signature_cache",
+		&(conf->signature_cache));
 	get_conf_val_int(field, value, "version_warn",
 		&(conf->version_warn));
 	get_conf_val_int(field, value, "cross_all_filesystems",
 		&(conf->cross_all_filesystems));
 	get_conf_val_int(field, value, "read_all_fifos",
 		&(conf->read_all_fifos));
+	get_conf_val_int(field, value, "find_threads",
+		&(conf->find_threads));
+	get_conf_val_int(field, value, "readahead_threads",
+		&(conf->readahead_threads));
+	get_conf_val_int(field, value, "compression_threads",
+		&(conf->compression_threads));
+	get_conf_val_int(field, value, "compression_sample",
+		&(conf->compression_sample));
+	get_conf_val_int(field, value, "drop_page_cache",
+		&(conf->drop_page_cache));
+	get_conf_val_int(field, value, "verify_cache_every_n_backups",
+		&(conf->verify_cache_every_n_backups));
 	get_conf_val_int(field, value, "read_all_blockdevs",
 		&(conf->read_all_blockdevs));
 	get_conf_val_int(field, value, "backup_script_post_run_on_fail",
@@ -658,6 +731,29 @@ static int load_config_ints(struct config *conf, const char *field, const char *
 		&(conf->max_children));
 	get_conf_val_int(field, value, "max_status_children",
 		&(conf->max_status_children));
+	get_conf_val_int(field, value, "prefork_children",
+		&(conf->prefork_children));
+	get_conf_val_int(field, value, "prefork_max_sessions",
+		&(conf->prefork_max_sessions));
+	get_conf_val_int(field, value, "ssl_session_timeout",
+		&(conf->ssl_session_timeout));
+	get_conf_val_int(field, value, "ssl_ktls", &(conf->ssl_ktls));
+	get_conf_val_int(field, value, "network_channels",
+		&(conf->network_channels));
+	get_conf_val_int(field, value, "network_compression",
+		&(conf->network_compression));
+	get_conf_val_int(field, value, "packed_phase1",
+		&(conf->packed_phase1));
+	get_conf_val_int(field, value, "max_concurrent_backups",
+		&(conf->max_concurrent_backups));
+	get_conf_val_int(field, value, "max_writeback",
+		&(conf->max_writeback));
+	get_conf_val_int(field, value, "phase2_window",
+		&(conf->phase2_window));
+	get_conf_val_int(field, value, "phase2_window_sigs",
+		&(conf->phase2_window_sigs));
+	get_conf_val_int(field, value, "backup_priority",
+		&(conf->backup_priority));
 	get_conf_val_int(field, value, "max_storage_subdirs",
 		&(conf->max_storage_subdirs));
 	get_conf_val_int(field, value, "overwrite",
@@ -707,6 +803,8 @@ static int load_config_strings(struct config *conf, const char *field, const cha
 		return -1;
 	if(get_conf_val(field, value, "ssl_peer_cn", &(conf->ssl_peer_cn)))
 		return -1;
+	if(get_conf_val(field, value, "ssl_session_cache",
+		&(conf->ssl_session_cache))) return -1;
 	if(get_conf_val(field, value, "clientconfdir", &(conf->clientconfdir)))
 		return -1;
 	if(get_conf_val(field, value, "cname", &(conf->cname)))
@@ -753,6 +851,12 @@ static int load_config_strings(struct config *conf, const char *field, const cha
 	if(get_conf_val(field, value, "group", &(conf->group))) return -1;
 	if(get_conf_val(field, value, "client_lockdir",
 		&(conf->client_lockdir))) return -1;
+	if(get_conf_val(field, value, "scan_cache",
+		&(conf->scan_cache))) return -1;
+	if(get_conf_val(field, value, "compression_sample_cache",
+		&(conf->compression_sample_cache))) return -1;
+	if(get_conf_val(field, value, "change_journal",
+		&(conf->change_journal))) return -1;
 	if(get_conf_val(field, value, "encryption_password",
 		&(conf->encryption_password))) return -1;
 	if(get_conf_val_args(field, value, "keep", &(conf->keep),
@@ -881,28 +985,54 @@ static int load_config_field_and_value(struct config *conf, const char *field, c
 		cp=value;
 		if(!strncmp(value, "gzip", strlen("gzip")))
 			cp=value+strlen("gzip");
-		if(strlen(cp)!=1 || !isdigit(*cp))
+		// Two digits for the zstd levels.
+		if(!isdigit(*cp) || (cp[1] && (!isdigit(cp[1]) || cp[2])))
 			return -1;
 
 		conf->compression=atoi(cp);
 	}
+	else if(!strcmp(field, "compression_algorithm"))
+	{
+		if(!strcmp(value, "gzip"))
+			conf->compression_algorithm=ZC_GZIP;
+		else if(!strcmp(value, "zstd"))
+			conf->compression_algorithm=ZC_ZSTD;
+		else if(!strcmp(value, "zstd-long"))
+			conf->compression_algorithm=ZC_ZSTD_LONG;
+		else if(!strcmp(value, "lz4"))
+			conf->compression_algorithm=ZC_LZ4;
+		else return -1;
+	}
 	else if(!strcmp(field, "umask"))
 	{
 		conf->umask=strtol(value, NULL, 8);
 	}
 	else if(!strcmp(field, "ratelimit"))
 	{
-		float f=0;
-		f=atof(value);
-		// User is specifying Mega bits per second.
-		// Need to convert to bytes per second.
-		f=(f*1024*1024)/8;
-		if(!f)
-		{
-			logp("ratelimit should be greater than zero\n");
+		if(get_ratelimit(field, value, &(conf->ratelimit)))
+			return -1;
+	}
+	else if(!strcmp(field, "ratelimit_receive"))
+	{
+		if(get_ratelimit(field, value, &(conf->ratelimit_receive)))
+			return -1;
+	}
+	else if(!strcmp(field, "ratelimit_total"))
+	{
+		if(get_ratelimit(field, value, &(conf->ratelimit_total)))
 			return -1;
+	}
+	else if(!strcmp(field, "max_frame_size"))
+	{
+		if(get_file_size(value, &(conf->max_frame_size),
+			config_path, line)) return -1;
+		if(conf->max_frame_size<MIN_FRAME_SIZE
+		  || conf->max_frame_size>MAX_FRAME_SIZE)
+		{
+			logp("max_frame_size should be between %d and %d bytes\n",
+				MIN_FRAME_SIZE, MAX_FRAME_SIZE);
+			return conf_error(config_path, line);
 		}
-		conf->ratelimit=f;
 	}
 	else if(!strcmp(field, "min_file_size"))
 	{
@@ -1016,6 +1146,9 @@ static int server_conf_checks(struct config *conf, const char *path, int *r)
 		conf_problem(path, "timestamp_format unset", r);
 	if(!conf->clientconfdir)
 		conf_problem(path, "clientconfdir unset", r);
+	if(conf->compression>ZC_MAX_LEVEL(conf->compression_algorithm))
+		conf_problem(path,
+			"compression level too high for compression_algorithm", r);
 	if(!conf->working_dir_recovery_method
 	  || (strcmp(conf->working_dir_recovery_method, "delete")
 	   && strcmp(conf->working_dir_recovery_method, "resume")
@@ -1050,6 +1183,29 @@ static int server_conf_checks(struct config *conf, const char *path, int *r)
 		conf_problem(path, "max_children too low", r);
 	if(conf->max_status_children<=0)
 		conf_problem(path, "max_status_children too low", r);
+	if(conf->network_channels<0
+	  || conf->network_channels>=MAX_CHANNELS)
+		conf_problem(path, "network_channels out of range", r);
+	if(conf->prefork_children<0)
+		conf_problem(path, "prefork_children too low", r);
+	if(conf->prefork_max_sessions<0)
+		conf_problem(path, "prefork_max_sessions too low", r);
+	if(conf->ssl_session_timeout<=0)
+		conf_problem(path, "ssl_session_timeout too low", r);
+	if(conf->max_concurrent_backups<0)
+		conf_problem(path, "max_concurrent_backups too low", r);
+	if(conf->max_writeback<0)
+		conf_problem(path, "max_writeback too low", r);
+	if(conf->phase2_window<1)
+		conf_problem(path, "phase2_window too low", r);
+	if(conf->phase2_window_sigs<1)
+		conf_problem(path, "phase2_window_sigs too low", r);
+	if(conf->prefork_children>conf->max_children)
+	{
+		logp("%s: prefork_children is more than max_children - using %d\n",
+			path, conf->max_children);
+		conf->prefork_children=conf->max_children;
+	}
 	if(conf->max_storage_subdirs<=1000)
 		conf_problem(path, "max_storage_subdirs too low", r);
 	if(conf->ca_conf)
@@ -1123,6 +1279,21 @@ static int client_conf_checks(struct config *conf, const char *path, int *r)
 	}
 	if(!conf->lockfile)
 		conf_problem(path, "lockfile unset", r);
+	if(conf->network_channels<0
+	  || conf->network_channels>=MAX_CHANNELS)
+		conf_problem(path, "network_channels out of range", r);
+	if(conf->network_compression<0 || conf->network_compression>9)
+		conf_problem(path, "network_compression out of range", r);
+	if(conf->find_threads<0 || conf->find_threads>MAX_FIND_THREADS)
+		conf_problem(path, "find_threads out of range", r);
+	if(conf->readahead_threads<0
+	  || conf->readahead_threads>MAX_READAHEAD_THREADS)
+		conf_problem(path, "readahead_threads out of range", r);
+	if(conf->compression_threads<0
+	  || conf->compression_threads>MAX_COMPRESSION_THREADS)
+		conf_problem(path, "compression_threads out of range", r);
+	if(conf->verify_cache_every_n_backups<0)
+		conf_problem(path, "verify_cache_every_n_backups too low", r);
 	if(conf->autoupgrade_os
 	  && strstr(conf->autoupgrade_os, ".."))
 		conf_problem(path,
@@ -1253,6 +1424,13 @@ static int finalise_config(const char *config_path, struct config *conf, struct
 	}
 	conf->startdir=sdlist;
 
+	if(incexc_match_compile(&(conf->incexc_match),
+		conf->incexcdir, conf->iecount,
+		conf->incext, conf->incount,
+		conf->excext, conf->excount,
+		conf->excreg, conf->ercount))
+			return -1;
+
 	if(!l->got_kp_args)
 	{
 		unsigned long long mult=1;
@@ -1517,12 +1695,15 @@ int set_client_global_config(struct config *conf, struct config *cconf, const ch
 	cconf->client_can_verify=conf->client_can_verify;
 	cconf->hardlinked_archive=conf->hardlinked_archive;
 	cconf->librsync=conf->librsync;
+	cconf->signature_cache=conf->signature_cache;
 	cconf->compression=conf->compression;
+	cconf->compression_algorithm=conf->compression_algorithm;
 	cconf->version_warn=conf->version_warn;
 	cconf->notify_success_warnings_only=conf->notify_success_warnings_only;
 	cconf->notify_success_changes_only=conf->notify_success_changes_only;
 	cconf->server_script_post_run_on_fail=conf->server_script_post_run_on_fail;
 	cconf->directory_tree=conf->directory_tree;
+	cconf->backup_priority=conf->backup_priority;
 	if(set_global_str(&(cconf->directory), conf->directory))
 		return -1;
 	if(set_global_str(&(cconf->timestamp_format), conf->timestamp_format))
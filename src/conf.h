@@ -25,10 +25,18 @@ struct config
 	char *ssl_key;
 	char *ssl_key_password;
 	char *ssl_peer_cn;
+	char *ssl_session_cache; // a directory on the server, a file on the client
+	int ssl_session_timeout;
+	int ssl_ktls;
 	char *user;
 	char *group;
 	float ratelimit;
+	float ratelimit_receive;
 	int network_timeout;
+	unsigned long max_frame_size;
+	int network_channels; // files that can be sent at once
+	int network_compression; // deflate level for the connection, or 0
+	int packed_phase1; // pack the phase1 scan, if the server can take it
 
 // server options
 	char *directory;
@@ -37,6 +45,13 @@ struct config
 	char *ssl_dhfile;
 	int max_children;
 	int max_status_children;
+	int prefork_children;
+	int prefork_max_sessions;
+	int max_concurrent_backups;
+	int max_writeback;
+	int phase2_window; // files asked for ahead of their data
+	int phase2_window_sigs; // Mb of signatures sent ahead
+	float ratelimit_total;
 	char *client_lockdir;
 	mode_t umask;
 	int max_hardlinks;
@@ -71,6 +86,8 @@ struct config
 	int ercount; struct strlist **excreg; // exclude (regular expression)
 	int exfscount; struct strlist **excfs; // exclude filesystems
 	int excmcount; struct strlist **excom; // exclude from compression
+	// The directory, extension and regex lists above, compiled for the scan.
+	struct incexc_match *incexc_match;
 	int cross_all_filesystems;
 	int read_all_fifos;
 	struct strlist **fifos;
@@ -80,6 +97,15 @@ struct config
 	int bdcount;
 	unsigned long min_file_size;
 	unsigned long max_file_size;
+	int find_threads; // directory reading threads for the scan
+	int readahead_threads; // file opening threads for phase2
+	int compression_threads; // deflate threads for big files in phase2
+	int compression_sample; // send incompressible files uncompressed
+	char *compression_sample_cache; // decisions from last time, or NULL
+	int drop_page_cache; // drop the pages of files once they are sent
+	char *scan_cache; // what the scan found last time, or NULL
+	int verify_cache_every_n_backups;
+	char *change_journal; // written by the watcher, or NULL
   // These are to do with restore.
 	int overwrite;
 	int strip;
@@ -135,7 +161,9 @@ struct config
 
 	char *working_dir_recovery_method;
 	int librsync;
+	int signature_cache; // keep signatures for the next backup's deltas
 	int compression;
+	int compression_algorithm; // ZC_GZIP etc - see zcodec.h
 	int version_warn;
 
 	char *timer_script;
@@ -165,10 +193,24 @@ struct config
 
 	int server_can_restore;
 
+	int backup_priority;
+
 // Set to 1 on both client and server when the server is able to send counters
 // on resume/verify/restore.
 	int send_client_counters;
 
+// Set to 1 on both client and server when the server is able to tell the
+// client to go away and come back later, because backups are queued.
+	int can_queue;
+
+// Set to 1 on both client and server when phase1 entries are sent packed
+// into batches - see phase1bin.h.
+	int phase1_binary;
+
+// Set on the server to the compression algorithms that the client has, one
+// bit for each. Without them, the client is sent gzip.
+	int compressors;
+
 // Set on the server to the restore client name (the one that you connected
 // with) when the client has switched to a different set of client backups.
 	char *restore_client;
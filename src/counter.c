@@ -304,6 +304,20 @@ static void quint_print(const char *msg, unsigned long long a, unsigned long lon
 	}
 }
 
+// Only for connections that were compressed.
+static void bottom_network(void)
+{
+	unsigned long long raw=0;
+	unsigned long long comp=0;
+	if(!async_get_compression(&raw, &comp) || !comp) return;
+	logc("\n");
+	logc("  Network uncompressed:  % 11llu", raw);
+	logc("%s\n", bytes_to_human(raw));
+	logc("    Network compressed:  % 11llu", comp);
+	logc("%s\n", bytes_to_human(comp));
+	logc("     Compression ratio:  % 11.2f\n", (double)raw/comp);
+}
+
 static void bottom_part(struct cntr *a, struct cntr *b, enum action act)
 {
 	logc("\n");
@@ -345,6 +359,7 @@ static void bottom_part(struct cntr *a, struct cntr *b, enum action act)
 		logc("           Bytes sent:   % 11llu", b->sentbyte);
 		logc("%s\n", bytes_to_human(b->sentbyte));
 	}
+	bottom_network();
 }
 
 void print_filecounters(struct cntr *p1c, struct cntr *c, enum action act)
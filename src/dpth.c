@@ -7,6 +7,7 @@
 #include "counter.h"
 #include "dpth.h"
 #include "find.h"
+#include "zcodec.h"
 
 void mk_dpth(struct dpth *dpth, struct config *cconf, char cmd)
 {
@@ -14,7 +15,8 @@ void mk_dpth(struct dpth *dpth, struct config *cconf, char cmd)
 	snprintf(dpth->path, sizeof(dpth->path), "%04X/%04X/%04X%s",
 	  dpth->prim, dpth->seco, dpth->tert,
 	  /* Because of the way EFS works, it cannot be compressed. */
-	  (cconf->compression && cmd!=CMD_EFS_FILE)?".gz":"");
+	  (cconf->compression && cmd!=CMD_EFS_FILE)?
+		zcodec_suffix(cconf->compression_algorithm):"");
 }
 
 static void mk_dpth_prim(struct dpth *dpth)
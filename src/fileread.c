@@ -0,0 +1,130 @@
+#include "burp.h"
+#include "prog.h"
+#include "fileread.h"
+
+#ifndef HAVE_WIN32
+#include <sys/mman.h>
+#endif
+
+static unsigned long long bytes_read=0;
+static unsigned long long bytes_dropped=0;
+
+int fileread_open(const char *path, int flags)
+{
+	int fd=-1;
+	// Only the owner of a file, or root, may read it without changing
+	// its access time.
+	if((fd=open(path, flags|O_NOATIME))<0 && O_NOATIME && errno==EPERM)
+		fd=open(path, flags);
+	return fd;
+}
+
+#if !defined(HAVE_WIN32) && defined(HAVE_POSIX_FADVISE) \
+  && defined(POSIX_FADV_DONTNEED)
+
+// Returns 1 if most of the first window of the file is in the page cache.
+static int in_cache(int fd, off_t size)
+{
+#ifdef HAVE_LINUX_OS
+	int ret=0;
+	void *map=NULL;
+	unsigned char *vec=NULL;
+	size_t i=0;
+	size_t pages=0;
+	size_t resident=0;
+	size_t len=FILEREAD_WINDOW;
+	long pagesize=sysconf(_SC_PAGESIZE);
+
+	if(size<(off_t)len) len=(size_t)size;
+	if(!len || pagesize<=0) return 0;
+	pages=(len+pagesize-1)/pagesize;
+	if(!(vec=(unsigned char *)malloc(pages))) return 0;
+	if((map=mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0))!=MAP_FAILED)
+	{
+		if(!mincore(map, len, vec))
+		{
+			for(i=0; i<pages; i++) if(vec[i]&1) resident++;
+			ret=resident*2>pages;
+		}
+		munmap(map, len);
+	}
+	free(vec);
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+void fileread_init(struct fileread *fr, int fd, int drop)
+{
+	struct stat statp;
+	memset(fr, 0, sizeof(struct fileread));
+	fr->fd=fd;
+	if(fstat(fd, &statp) || !S_ISREG(statp.st_mode)) return;
+	fr->drop=drop && !in_cache(fd, statp.st_size);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd, 0, FILEREAD_WINDOW, POSIX_FADV_WILLNEED);
+	fr->ahead=FILEREAD_WINDOW;
+}
+
+void fileread_done(struct fileread *fr, size_t len)
+{
+	off_t upto=0;
+	fr->pos+=len;
+	bytes_read+=len;
+	if(!fr->ahead) return; // not a regular file
+	if(fr->pos+FILEREAD_WINDOW>fr->ahead)
+	{
+		posix_fadvise(fr->fd, fr->ahead, FILEREAD_WINDOW,
+			POSIX_FADV_WILLNEED);
+		fr->ahead+=FILEREAD_WINDOW;
+	}
+	// A window at a time, so as not to go to the kernel on every read.
+	upto=fr->pos-fr->pos%FILEREAD_WINDOW;
+	if(!fr->drop || upto<=fr->dropped) return;
+	posix_fadvise(fr->fd, fr->dropped, upto-fr->dropped,
+		POSIX_FADV_DONTNEED);
+	bytes_dropped+=upto-fr->dropped;
+	fr->dropped=upto;
+}
+
+void fileread_end(struct fileread *fr)
+{
+	if(fr->drop && fr->pos>fr->dropped)
+	{
+		// To the end of the file, in case it has grown past where
+		// the reading stopped.
+		posix_fadvise(fr->fd, fr->dropped, 0, POSIX_FADV_DONTNEED);
+		bytes_dropped+=fr->pos-fr->dropped;
+	}
+	memset(fr, 0, sizeof(struct fileread));
+}
+
+#else
+
+void fileread_init(struct fileread *fr, int fd, int drop)
+{
+	memset(fr, 0, sizeof(struct fileread));
+	fr->fd=fd;
+}
+
+void fileread_done(struct fileread *fr, size_t len)
+{
+	fr->pos+=len;
+	bytes_read+=len;
+}
+
+void fileread_end(struct fileread *fr)
+{
+	memset(fr, 0, sizeof(struct fileread));
+}
+
+#endif
+
+void fileread_log(void)
+{
+	if(bytes_read)
+		logp("Read %llu bytes of files, and dropped %llu bytes of them from the page cache\n", bytes_read, bytes_dropped);
+	bytes_read=0;
+	bytes_dropped=0;
+}
@@ -0,0 +1,39 @@
+#ifndef _FILEREAD_H
+#define _FILEREAD_H
+
+/* Hints to the kernel about the files that the client sends. They are read
+   from start to end, so the kernel is told so, and is asked to start on each
+   window of the file a window ahead of the reading. With drop_page_cache,
+   the pages that have been read are dropped from the page cache, so that a
+   backup does not push out what the rest of the machine is using - unless
+   the start of the file was in the cache already, which means that
+   something else is reading it too. */
+
+// How far ahead of the reading the kernel is asked to read.
+#define FILEREAD_WINDOW		(2*1024*1024)
+
+struct fileread
+{
+	int fd;
+	int drop; // drop the pages that have been read
+	off_t pos; // how much has been read
+	off_t ahead; // the kernel has been asked to read up to here
+	off_t dropped; // the pages before here have been dropped
+};
+
+// Opens path with flags, plus O_NOATIME where the file system allows it,
+// so that reading the file does not change it. Returns the fd, or -1 with
+// errno set.
+extern int fileread_open(const char *path, int flags);
+// Starts the hints for reading the file open on fd from the start.
+extern void fileread_init(struct fileread *fr, int fd, int drop);
+// To be called after each read, with the number of bytes read.
+extern void fileread_done(struct fileread *fr, size_t len);
+// Drops the rest of the pages, if that is being done, before the file is
+// closed. Does nothing to a struct fileread that is all zeros.
+extern void fileread_end(struct fileread *fr);
+// Logs how much has been read and dropped since the last time, and starts
+// counting again.
+extern void fileread_log(void);
+
+#endif
@@ -1,10 +1,13 @@
 #include "burp.h"
 #include "prog.h"
 #include "find.h"
+#include "findpool.h"
+#include "scancache.h"
 #include "log.h"
 #include "asyncio.h"
 #include "handy.h"
 #include "regexp.h"
+#include "incexc_match.h"
 #include "backup_phase1_client.h"
 #ifdef HAVE_DARWIN_OS
 #include <sys/param.h>
@@ -57,57 +60,146 @@ FF_PKT *init_find_files()
  *   entry so we can link it.
  */
 struct f_link {
-    struct f_link *next;
     dev_t dev;                        /* device */
     ino_t ino;                        /* inode with device is unique */
     uint32_t FileIndex;               /* FileIndex of this file */
     char name[1];                     /* The name */
 };
 
-typedef struct f_link link_t;
-#define LINK_HASHTABLE_BITS 16
-#define LINK_HASHTABLE_SIZE (1<<LINK_HASHTABLE_BITS)
-#define LINK_HASHTABLE_MASK (LINK_HASHTABLE_SIZE-1)
+/*
+ * The entries live in an arena, which is freed all at once at the end of
+ *   the scan, so that they never move and ff_pkt->linked stays good. The
+ *   table itself is open addressing on (dev, ino), and doubles in size when
+ *   it gets too full.
+ */
+#define LINK_ARENA_CHUNK	(1024*1024)
+#define LINK_TABLE_MIN		1024
+
+struct link_chunk {
+	struct link_chunk *next;
+	size_t used;
+	size_t size;
+	char data[1];
+};
+
+struct link_table {
+	struct f_link **slots;
+	size_t size;                      /* a power of two */
+	size_t count;
+	struct link_chunk *chunks;
+	/* For the statistics at the end. */
+	unsigned long long lookups;
+	unsigned long long probes;
+	unsigned long long maxprobe;
+	unsigned long long resizes;
+};
+
+static size_t link_hash(dev_t dev, ino_t ino)
+{
+	unsigned long long h=(unsigned long long)ino;
+	h^=(unsigned long long)dev*0x9E3779B97F4A7C15ULL;
+	h^=h>>33;
+	h*=0xFF51AFD7ED558CCDULL;
+	h^=h>>33;
+	h*=0xC4CEB9FE1A85EC53ULL;
+	h^=h>>33;
+	return (size_t)h;
+}
+
+static struct f_link *link_alloc(struct link_table *lt, const char *name)
+{
+	struct f_link *lp;
+	struct link_chunk *c=lt->chunks;
+	size_t len=strlen(name);
+	// Keep the entries aligned for dev and ino.
+	size_t need=(sizeof(struct f_link)+len+7)&~(size_t)7;
+
+	if(!c || c->size-c->used<need)
+	{
+		size_t size=LINK_ARENA_CHUNK;
+		if(need>size) size=need;
+		if(!(c=(struct link_chunk *)
+			malloc(sizeof(struct link_chunk)+size)))
+				return NULL;
+		c->next=lt->chunks;
+		c->used=0;
+		c->size=size;
+		lt->chunks=c;
+	}
+	lp=(struct f_link *)(c->data+c->used);
+	c->used+=need;
+	memcpy(lp->name, name, len+1);
+	return lp;
+}
+
+static int link_grow(struct link_table *lt)
+{
+	size_t i;
+	size_t size=lt->size?lt->size*2:LINK_TABLE_MIN;
+	struct f_link **slots;
+
+	if(!(slots=(struct f_link **)calloc(size, sizeof(struct f_link *))))
+		return -1;
+	for(i=0; i<lt->size; i++)
+	{
+		size_t j;
+		struct f_link *lp=lt->slots[i];
+		if(!lp) continue;
+		for(j=link_hash(lp->dev, lp->ino)&(size-1); slots[j];
+			j=(j+1)&(size-1)) { }
+		slots[j]=lp;
+	}
+	if(lt->slots) free(lt->slots);
+	lt->slots=slots;
+	if(lt->size) lt->resizes++;
+	lt->size=size;
+	return 0;
+}
 
-static inline int LINKHASH(const struct stat &info)
+/*
+ * Finds the entry for an inode. If there is none, returns NULL with *slot
+ *   set to where it would go.
+ */
+static struct f_link *link_find(struct link_table *lt, dev_t dev, ino_t ino, size_t *slot)
 {
-    int hash = info.st_dev;
-    unsigned long long i = info.st_ino;
-    hash ^= i;
-    i >>= 16;
-    hash ^= i;
-    i >>= 16;
-    hash ^= i;
-    i >>= 16;
-    hash ^= i;
-    return hash & LINK_HASHTABLE_MASK;
+	size_t i;
+	unsigned long long probe=1;
+	struct f_link *lp;
+
+	lt->lookups++;
+	for(i=link_hash(dev, ino)&(lt->size-1); (lp=lt->slots[i]);
+		i=(i+1)&(lt->size-1), probe++)
+	{
+		if(lp->ino==ino && lp->dev==dev) break;
+	}
+	lt->probes+=probe;
+	if(probe>lt->maxprobe) lt->maxprobe=probe;
+	*slot=i;
+	return lp;
 }
 
 static int term_find_one(FF_PKT *ff)
 {
-   struct f_link *lp, *lc;
-   int count = 0;
-   int i;
-
-   
-   if (ff->linkhash == NULL) return 0;
-
-   for (i =0 ; i < LINK_HASHTABLE_SIZE; i ++) {
-   /* Free up list of hard linked files */
-       lp = ff->linkhash[i];
-       while (lp) {
-      lc = lp;
-      lp = lp->next;
-      if (lc) {
-         free(lc);
-         count++;
-      }
-   }
-       ff->linkhash[i] = NULL;
-   }
-   free(ff->linkhash);
-   ff->linkhash = NULL;
-   return count;
+	int count;
+	struct link_table *lt=ff->linkhash;
+
+	if(!lt) return 0;
+	count=(int)lt->count;
+	if(lt->lookups)
+		logp("Hard link table: %lu inodes, %llu lookups, %.2f average probes, %llu longest, %llu resizes\n",
+			(unsigned long)lt->count, lt->lookups,
+			(double)lt->probes/lt->lookups,
+			lt->maxprobe, lt->resizes);
+	while(lt->chunks)
+	{
+		struct link_chunk *c=lt->chunks;
+		lt->chunks=c->next;
+		free(c);
+	}
+	if(lt->slots) free(lt->slots);
+	free(lt);
+	ff->linkhash=NULL;
+	return count;
 }
 
 /*
@@ -119,6 +211,7 @@ term_find_files(FF_PKT *ff)
 {
    int hard_links;
 
+   findpool_free();
    hard_links = term_find_one(ff);
    free(ff);
    return hard_links;
@@ -176,54 +269,6 @@ static int myalphasort (const struct dirent **a, const struct dirent **b)
 	return pathcmp ((*a)->d_name, (*b)->d_name);
 }
 
-/* Return 1 to include the file, 0 to exclude it. */
-static int in_include_ext(struct strlist **incext, int incount, const char *fname)
-{
-	int i=0;
-	const char *cp=NULL;
-	// If not doing include_ext, let the file get backed up. 
-	if(!incount) return 1;
-
-	// The flag of the first item contains the maximum number of characters
-	// that need to be checked.
-	for(cp=fname+strlen(fname)-1; i<incext[0]->flag && cp>=fname; cp--, i++)
-	{
-		if(*cp=='.')
-		{
-			for(i=0; i<incount; i++)
-				if(!strcasecmp(incext[i]->path, cp+1))
-					return 1;
-			// If file has no extension, it cannot be included.
-			return 0;
-		}
-	}
-	return 0;
-}
-
-static int in_exclude_ext(struct strlist **excext, int excount, const char *fname)
-{
-	int i=0;
-	const char *cp=NULL;
-	// If not doing exclude_ext, let the file get backed up.
-	if(!excount) return 0;
-
-	// The flag of the first item contains the maximum number of characters
-	// that need to be checked.
-	for(cp=fname+strlen(fname)-1; i<excext[0]->flag && cp>=fname; cp--, i++)
-	{
-		if(*cp=='.')
-		{
-			for(i=0; i<excount; i++)
-				if(!strcasecmp(excext[i]->path, cp+1))
-					return 1;
-			// If file has no extension, it is included.
-			return 0;
-		}
-	}
-
-	return 0;
-}
-
 // Returns the level of compression.
 int in_exclude_comp(struct strlist **excom, int excmcount, const char *fname, int compression)
 {
@@ -277,43 +322,12 @@ int in_exclude_regex(struct strlist **excreg, int ercount, const char *fname)
 }
 
 // When recursing into directories, do not want to check the include_ext list.
-static int file_is_included_no_incext(struct strlist **ielist, int iecount, struct strlist **excext, int excount, struct strlist **excreg, int ercount, const char *fname)
+int file_is_included_no_incext(struct config *conf, const char *fname)
 {
-	int i=0;
-	int ret=0;
-	int longest=0;
-	int matching=0;
-	int best=-1;
-
-	if(in_exclude_ext(excext, excount, fname)
-	  || in_exclude_regex(excreg, ercount, fname))
-		return 0;
-
-	// Check include/exclude directories.
-	for(i=0; i<iecount; i++)
-	{
-		//logp("try: %d %s\n", i, ielist[i]->path);
-		matching=is_subdir(ielist[i]->path, fname);
-		if(matching>longest)
-		{
-			longest=matching;
-			best=i;
-		}
-	}
-	//logp("best: %d\n", best);
-	if(best<0) ret=0;
-	else ret=ielist[best]->flag;
-
-	//logp("return: %d\n", ret);
-	return ret;
+	return incexc_match_no_incext(conf->incexc_match, fname);
 }
 
-int file_is_included(struct strlist **ielist, int iecount,
-	struct strlist **incexc, int incount,
-	struct strlist **excext, int excount,
-	struct strlist **increg, int ircount,
-	struct strlist **excreg, int ercount,
-	const char *fname, bool top_level)
+int file_is_included(struct config *conf, const char *fname, bool top_level)
 {
 	// Always save the top level directory.
 	// This will help in the simulation of browsing backups because it
@@ -324,10 +338,9 @@ int file_is_included(struct strlist **ielist, int iecount,
 	// in this example) as the stats of the parent directories (/home,
 	// for example). Trust me on this.
 	if(!top_level
-	  && !in_include_ext(incexc, incount, fname)) return 0;
+	  && !incexc_match_incext(conf->incexc_match, fname)) return 0;
 
-	return file_is_included_no_incext(ielist, iecount,
-		excext, excount, excreg, ercount, fname);
+	return file_is_included_no_incext(conf, fname);
 }
 
 static int fs_change_is_allowed(struct config *conf, const char *fname)
@@ -557,22 +570,27 @@ static int get_files_in_directory(DIR *directory, struct dirent ***nl, int *coun
  */
 static int
 find_files(FF_PKT *ff_pkt, struct config *conf, struct cntr *cntr,
-  char *fname, dev_t parent_device, bool top_level);
+  char *fname, dev_t parent_device, bool top_level,
+  struct dirlist *parent, struct dentry *de);
 
-static int process_files_in_directory(struct dirent **nl, int count, int *rtn_stat, char **link, size_t len, size_t *link_len, struct config *conf, struct cntr *cntr, FF_PKT *ff_pkt, dev_t our_device)
+/* The entries come either from get_files_in_directory() in nl, on Windows,
+   or from findpool_get() in dl. */
+static int process_files_in_directory(struct dirent **nl, struct dirlist *dl, int count, int *rtn_stat, char **link, size_t len, size_t *link_len, struct config *conf, struct cntr *cntr, FF_PKT *ff_pkt, dev_t our_device)
 {
 	int m=0;
 	for(m=0; m<count; m++)
 	{
 		size_t i;
+		size_t plen;
 		char *p=NULL;
 		char *q=NULL;
 
-		p=nl[m]->d_name;
+		p=nl?nl[m]->d_name:dl->entries[m].name;
+		plen=strlen(p);
 
-		if(strlen(p)+len>=*link_len)
+		if(plen+len>=*link_len)
 		{
-			*link_len=len+strlen(p)+1;
+			*link_len=len+plen+1;
 			if(!(*link=(char *)realloc(*link, (*link_len)+1)))
 			{
 				logp("out of memory\n");
@@ -580,67 +598,108 @@ static int process_files_in_directory(struct dirent **nl, int count, int *rtn_st
 			}
 		}
 		q=(*link)+len;
-		for(i=0; i<strlen(nl[m]->d_name); i++) *q++=*p++;
+		for(i=0; i<plen; i++) *q++=*p++;
 		*q=0;
 
-		if(file_is_included_no_incext(conf->incexcdir, conf->iecount,
-			conf->excext, conf->excount,
-			conf->excreg, conf->ercount,
-			*link))
+		if(file_is_included_no_incext(conf, *link))
 		{
-			*rtn_stat=find_files(ff_pkt,
-				conf, cntr, *link, our_device, false);
+			*rtn_stat=find_files(ff_pkt, conf, cntr, *link,
+				our_device, false, dl, dl?&(dl->entries[m]):NULL);
 			if(ff_pkt->linked)
 				ff_pkt->linked->FileIndex = ff_pkt->FileIndex;
 		}
 		else
 		{ 
 			// Excluded, but there might be a subdirectory that is
-			// included.
+			// included. If there is not, nothing under it gets
+			// read at all.
 			int ex=0;
-			for(ex=0; ex<conf->iecount; ex++)
+			int ey=0;
+			int nbelow=0;
+			struct strlist **below=NULL;
+			nbelow=incexc_match_includes_below(conf->incexc_match,
+				*link, &below);
+			for(ex=0; ex<nbelow; ex=ey)
 			{
-				if(conf->incexcdir[ex]->flag
-				  && is_subdir(*link, conf->incexcdir[ex]->path))
-				{
-					int ey;
-					if((*rtn_stat=find_files(ff_pkt, conf,
-						cntr, conf->incexcdir[ex]->path,
-						 our_device, false)))
-							break;
-					// Now need to skip subdirectories of
-					// the thing that we just stuck in
-					// find_one_file(), or we might get
-					// some things backed up twice.
-					for(ey=ex+1; ey<conf->iecount; ey++)
-					  if(is_subdir(
-						conf->incexcdir[ex]->path,
-						conf->incexcdir[ey]->path))
-							ex++;
-				}
+				if((*rtn_stat=find_files(ff_pkt, conf,
+					cntr, below[ex]->path,
+					 our_device, false, NULL, NULL)))
+						break;
+				// Now need to skip subdirectories of
+				// the thing that we just stuck in
+				// find_one_file(), or we might get
+				// some things backed up twice. They
+				// all come straight after it.
+				for(ey=ex+1; ey<nbelow
+				  && is_subdir(below[ex]->path,
+					below[ey]->path); ey++) { }
 			}
 		}
-		free(nl[m]);
+		if(nl) free(nl[m]);
 		if(*rtn_stat) break;
 	}
 	return 0;
 }
 
+/*
+ * Send what the scan cache found in a directory last time, going into the
+ * subdirectories to check them for changes.
+ */
+static int replay_directory(FF_PKT *ff_pkt, struct config *conf,
+	struct cntr *cntr, dev_t our_device)
+{
+	int ret=0;
+	struct scanitem *item=NULL;
+	while((ret=scancache_next(&item))>0)
+	{
+		if(item->descend)
+		{
+			struct dentry de;
+			struct dentry *dep=NULL;
+			if(item->trusted)
+			{
+				// The change journal says that it is as it
+				// was, so there is no need for lstat.
+				const char *cp=strrchr(item->path, '/');
+				de.name=(char *)(cp?cp+1:item->path);
+				de.statted=1;
+				de.statp=item->statp;
+				de.stat_errno=0;
+				dep=&de;
+			}
+			if((ret=find_files(ff_pkt, conf, cntr, item->path,
+				our_device, false, NULL, dep)))
+					return ret;
+			continue;
+		}
+		ff_pkt->fname=item->path;
+		ff_pkt->link=item->link?item->link:item->path;
+		ff_pkt->statp=item->statp;
+		ff_pkt->winattr=item->winattr;
+		ff_pkt->type=item->type;
+		ff_pkt->linked=NULL;
+		if((ret=send_file(ff_pkt, false, conf, cntr))) return ret;
+	}
+	return ret;
+}
+
 static int found_directory(FF_PKT *ff_pkt, struct config *conf,
 	struct cntr *cntr, char *fname, dev_t parent_device, bool top_level,
-	struct utimbuf *restore_times)
+	struct utimbuf *restore_times, struct dirlist *parent, const char *name)
 {
 	int rtn_stat;
-	DIR *directory;
+	DIR *directory=NULL;
 	char *link=NULL;
 	size_t link_len;
 	size_t len;
 	int nbret=0;
 	int count=0;
+	int cached=0;
 	bool recurse;
 	dev_t our_device;
 	bool volhas_attrlist;
 	struct dirent **nl=NULL;
+	struct dirlist *dl=NULL;
 
 	recurse=true;
 	our_device=ff_pkt->statp.st_dev;
@@ -743,12 +802,42 @@ static int found_directory(FF_PKT *ff_pkt, struct config *conf,
 	/* reset "link" */
 	ff_pkt->link=ff_pkt->fname;
 
+	/*
+	* If the scan cache says that nothing has been added, removed or
+	*   renamed in the directory since last time, send what was found
+	*   in it then, rather than reading it again.
+	*/
+	if((cached=scancache_begin(link, &ff_pkt->statp))<0)
+	{
+		free(link);
+		free_dir_ff_pkt(dir_ff_pkt);
+		return -1;
+	}
+	if(cached)
+	{
+		rtn_stat=replay_directory(ff_pkt, conf, cntr, our_device);
+		free(link);
+		goto entries_done;
+	}
+
 	/*
 	* Descend into or "recurse" into the directory to read
 	*   all the files in it.
 	*/
 	errno = 0;
-	if(!(directory=opendir(fname)))
+#ifdef HAVE_WIN32
+	directory=opendir(fname);
+#else
+	// Opened relative to its parent, if it has one. The read ahead pool
+	// may already have read it.
+	if(!(dl=findpool_get(fname, our_device, parent, name)))
+	{
+		free(link);
+		return -1;
+	}
+	errno=dl->open_errno;
+#endif
+	if(dl?dl->open_errno:!directory)
 	{
 		ff_pkt->type=FT_NOOPEN;
 		ff_pkt->ff_errno=errno;
@@ -757,6 +846,8 @@ static int found_directory(FF_PKT *ff_pkt, struct config *conf,
 			ff_pkt->linked->FileIndex=ff_pkt->FileIndex;
 		free(link);
 		free_dir_ff_pkt(dir_ff_pkt);
+		findpool_free_dirlist(dl);
+		if(scancache_end()) return -1;
 		return rtn_stat;
 	}
 
@@ -765,28 +856,36 @@ static int found_directory(FF_PKT *ff_pkt, struct config *conf,
 	*    This would possibly run faster if we chdir to the directory
 	*    before traversing it.
 	*/
-	if(get_files_in_directory(directory, &nl, &count))
+	if(directory)
 	{
+		if(get_files_in_directory(directory, &nl, &count))
+		{
+			closedir(directory);
+			free(link);
+			return -1;
+		}
 		closedir(directory);
-		free(link);
-		return -1;
 	}
-	closedir(directory);
 
 	rtn_stat=0;
-	if(nl)
+	if(nl || dl)
 	{
-		if(process_files_in_directory(nl, count,
+		if(process_files_in_directory(nl, dl, dl?dl->count:count,
 			&rtn_stat, &link, len, &link_len, conf, cntr,
 			ff_pkt, our_device))
 		{
 			free(link);
 			if(nl) free(nl);
+			findpool_free_dirlist(dl);
 			return -1;
 		}
 	}
 	free(link);
 	if(nl) free(nl);
+	findpool_free_dirlist(dl);
+
+entries_done:
+	if(scancache_end()) rtn_stat=-1;
 
 	/*
 	* Now that we have recursed through all the files in the
@@ -844,6 +943,22 @@ static int found_other(FF_PKT *ff_pkt, struct config *conf,
 	return rtn_stat;
 }
 
+/*
+ * Stat a file. Entries of a directory are done relative to the directory,
+ * unless the read ahead pool has already done them.
+ */
+static int find_lstat(FF_PKT *ff_pkt, const char *fname, struct dirlist *parent, struct dentry *de)
+{
+#ifdef HAVE_WIN32
+	return win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr);
+#else
+	if(!de) return lstat(fname, &ff_pkt->statp);
+	if(findpool_stat(parent, de)) return -1;
+	ff_pkt->statp=de->statp;
+	return 0;
+#endif
+}
+
 /*
  * Find a single file.
  * p is the filename
@@ -853,19 +968,15 @@ static int found_other(FF_PKT *ff_pkt, struct config *conf,
  */
 static int
 find_files(FF_PKT *ff_pkt, struct config *conf, struct cntr *cntr,
-  char *fname, dev_t parent_device, bool top_level)
+  char *fname, dev_t parent_device, bool top_level,
+  struct dirlist *parent, struct dentry *de)
 {
-	int len;
 	int rtn_stat;
 	struct utimbuf restore_times;
 
 	ff_pkt->fname=ff_pkt->link=fname;
 
-#ifdef HAVE_WIN32
-	if(win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr))
-#else
-	if(lstat(fname, &ff_pkt->statp))
-#endif
+	if(find_lstat(ff_pkt, fname, parent, de))
 	{
 		ff_pkt->type=FT_NOSTAT;
 		ff_pkt->ff_errno=errno;
@@ -918,26 +1029,26 @@ find_files(FF_PKT *ff_pkt, struct config *conf, struct cntr *cntr,
 		|| S_ISSOCK(ff_pkt->statp.st_mode)))
 	{
 
+		size_t slot;
 		struct f_link *lp;
-		if(!(ff_pkt->linkhash))
+		struct link_table *lt=ff_pkt->linkhash;
+		if(!lt)
 		{
-			if(!(ff_pkt->linkhash=(link_t **)malloc(
-				LINK_HASHTABLE_SIZE*sizeof(link_t *))))
+			if(!(lt=(struct link_table *)
+				calloc(1, sizeof(struct link_table)))
+			  || link_grow(lt))
 			{
 				logp("out of memory doing link hash\n");
+				if(lt) free(lt);
 				return -1;
 			}
-			memset(ff_pkt->linkhash, 0,
-				LINK_HASHTABLE_SIZE*sizeof(link_t *));
+			ff_pkt->linkhash=lt;
 		}
-		const int linkhash=LINKHASH(ff_pkt->statp);
 
-		/* Search link list of hard linked files */
-		for(lp=ff_pkt->linkhash[linkhash]; lp; lp=lp->next)
+		/* Search for the inode in the table of hard linked files */
+		if((lp=link_find(lt, (dev_t)ff_pkt->statp.st_dev,
+			(ino_t)ff_pkt->statp.st_ino, &slot)))
 		{
-		  if(lp->ino==(ino_t)ff_pkt->statp.st_ino
-			&& lp->dev==(dev_t)ff_pkt->statp.st_dev)
-		  {
 			/* If we have already backed up the hard linked file
 				don't do it again */
 			if(!strcmp(lp->name, fname)) return 0;
@@ -948,12 +1059,10 @@ find_files(FF_PKT *ff_pkt, struct config *conf, struct cntr *cntr,
 			ff_pkt->linked=0;
 			rtn_stat=send_file(ff_pkt, top_level, conf, cntr);
 			return rtn_stat;
-		  }
 		}
 
-		/* File not previously dumped. Chain it into our list. */
-		len=strlen(fname)+1;
-		if(!(lp=(struct f_link *)malloc(sizeof(struct f_link)+len)))
+		/* File not previously dumped. Add it to the table. */
+		if(!(lp=link_alloc(lt, fname)))
 		{
 			logp("out of memory\n");
 			return -1;
@@ -962,9 +1071,13 @@ find_files(FF_PKT *ff_pkt, struct config *conf, struct cntr *cntr,
 		lp->dev=ff_pkt->statp.st_dev;
 		/* set later */
 		lp->FileIndex=0;
-		snprintf(lp->name, len, "%s", fname);
-		lp->next=ff_pkt->linkhash[linkhash];
-		ff_pkt->linkhash[linkhash]=lp;
+		lt->slots[slot]=lp;
+		/* Keep it no more than half full, for short probes. */
+		if(++lt->count*2>lt->size && link_grow(lt))
+		{
+			logp("out of memory doing link hash\n");
+			return -1;
+		}
 		/* mark saved link */
 		ff_pkt->linked=lp;
 	}
@@ -981,13 +1094,28 @@ find_files(FF_PKT *ff_pkt, struct config *conf, struct cntr *cntr,
 		return found_soft_link(ff_pkt, conf, cntr, fname, top_level);
 	else if(S_ISDIR(ff_pkt->statp.st_mode))
 		return found_directory(ff_pkt, conf, cntr, fname,
-			parent_device, top_level, &restore_times);
+			parent_device, top_level, &restore_times,
+			parent, de?de->name:NULL);
 	else
 		return found_other(ff_pkt, conf, cntr, fname, top_level);
 }
 
+// Whether the scan will go into a directory. Runs in the read ahead pool.
+static int findpool_want(const char *path, void *arg)
+{
+	struct config *conf=(struct config *)arg;
+	return file_is_included_no_incext(conf, path)
+	  && !nobackup_directory(conf, path);
+}
+
 int find_files_begin(FF_PKT *ff_pkt, struct config *conf, char *fname, struct cntr *cntr)
 {
+	if(conf->find_threads && !findpool_active() && !ff_pkt->pool_tried)
+	{
+		ff_pkt->pool_tried=true;
+		if(findpool_init(conf->find_threads, findpool_want, conf))
+			return -1;
+	}
 	return find_files(ff_pkt, conf, cntr, fname, (dev_t)-1,
-		1 /* top_level */);
+		1 /* top_level */, NULL, NULL);
 }
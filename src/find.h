@@ -101,7 +101,9 @@ struct FF_PKT {
    int strip_path;                    /* strip path count */
 
    /* List of all hard linked files found */
-   struct f_link **linkhash;          /* hard linked files */
+   struct link_table *linkhash;       /* hard linked files */
+
+   bool pool_tried;                   /* read ahead pool has been started */
 
    /* Darwin specific things.
     * To avoid clutter, we always include rsrc_bfd and volhas_attrlist */
@@ -115,18 +117,20 @@ FF_PKT *init_find_files();
 int term_find_files(FF_PKT *ff);
 int find_files_begin(FF_PKT *ff_pkt, struct config *conf, char *fname, struct cntr *cntr);
 int pathcmp(const char *a, const char *b);
-int file_is_included(struct strlist **ielist, int iecount,
-	struct strlist **incext, int incount,
-	struct strlist **excext, int excount,
-	struct strlist **increg, int ircount,
-	struct strlist **excreg, int ercount,
-	const char *fname, bool top_level);
+int file_is_included(struct config *conf, const char *fname, bool top_level);
+int file_is_included_no_incext(struct config *conf, const char *fname);
 int in_include_regex(struct strlist **incre, int incount, const char *fname);
 int in_exclude_regex(struct strlist **excre, int excount, const char *fname);
 // Returns the level of compression.
 int in_exclude_comp(struct strlist **excom, int excmcount, const char *fname, int compression);
 
 /* from attribs.c */
+// How many numbers there are in an encoded stat.
+#define STAT_FIELDS	16
+void stat_to_fields(int64_t *f, struct stat *statp, int64_t winattr, int compression);
+void fields_to_text(char *buf, const int64_t *f);
+int text_to_fields(int64_t *f, const char *buf);
+void fields_to_stat(const int64_t *f, struct stat *statp, int64_t *winattr, int *compression);
 void encode_stat(char *buf, struct stat *statp, int64_t winattr, int compression);
 void decode_stat(const char *buf, struct stat *statp, int64_t *winattr, int *compression);
 bool set_attributes(const char *path, char cmd, struct stat *statp, int64_t winattr, struct cntr *cntr);
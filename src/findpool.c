@@ -0,0 +1,589 @@
+#include "burp.h"
+#include "prog.h"
+#include "find.h"
+#include "findpool.h"
+#ifdef HAVE_LINUX_OS
+#include <sys/syscall.h>
+#endif
+
+// Directories that the scan is holding open, one for each level that it
+// has gone down.
+static int held_fds=0;
+
+void findpool_free_dirlist(struct dirlist *dl)
+{
+	int i=0;
+	if(!dl) return;
+#ifndef HAVE_WIN32
+	if(dl->fd>=0)
+	{
+		close(dl->fd);
+		held_fds--;
+	}
+#endif
+	for(i=0; i<dl->count; i++) free(dl->entries[i].name);
+	if(dl->entries) free(dl->entries);
+	if(dl->path) free(dl->path);
+	free(dl);
+}
+
+#ifndef HAVE_WIN32
+
+// Open directories and stat their entries relative to the directory, so
+// that the kernel does not have to look up the whole path every time.
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+#define USE_DIRFD
+#endif
+// And on Linux, read the entries in bulk.
+#if defined(USE_DIRFD) && defined(HAVE_LINUX_OS) && defined(SYS_getdents64)
+#define USE_GETDENTS
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+// Size of the buffer that directory entries are read into.
+#define DENTS_BUF_LEN	(32*1024)
+// Deeper than this, the scan stops holding directories open, so as not to
+// run out of file descriptors.
+#define MAX_HELD_FDS	256
+
+#ifdef USE_GETDENTS
+// What getdents64 fills the buffer with.
+struct dent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
+// No logging from here down to findpool_get(), because these run in the
+// pool threads.
+
+static char *join_path(const char *dir, const char *name)
+{
+	char *path=NULL;
+	size_t dlen=strlen(dir);
+	size_t nlen=strlen(name);
+	while(dlen && dir[dlen-1]=='/') dlen--;
+	if(!(path=(char *)malloc(dlen+nlen+2))) return NULL;
+	memcpy(path, dir, dlen);
+	path[dlen]='/';
+	memcpy(path+dlen+1, name, nlen+1);
+	return path;
+}
+
+// Takes the path.
+static struct dirlist *new_dirlist(char *path, dev_t dev)
+{
+	struct dirlist *dl=NULL;
+	if(!(dl=(struct dirlist *)calloc(1, sizeof(struct dirlist))))
+		return NULL;
+	dl->path=path;
+	dl->dev=dev;
+	dl->fd=-1;
+	return dl;
+}
+
+static int dentry_cmp(const void *a, const void *b)
+{
+	return pathcmp(((struct dentry *)a)->name, ((struct dentry *)b)->name);
+}
+
+static void clear_entries(struct dirlist *dl)
+{
+	int i=0;
+	for(i=0; i<dl->count; i++) free(dl->entries[i].name);
+	if(dl->entries) free(dl->entries);
+	dl->entries=NULL;
+	dl->count=0;
+	dl->open_errno=0;
+	if(dl->fd>=0) close(dl->fd);
+	dl->fd=-1;
+}
+
+static int add_entry(struct dirlist *dl, const char *name, int *allocated)
+{
+	struct dentry *de=NULL;
+	if(!strcmp(name, ".") || !strcmp(name, "..")) return 0;
+	if(dl->count==*allocated)
+	{
+		struct dentry *tmp=NULL;
+		*allocated=*allocated?*allocated*2:16;
+		if(!(tmp=(struct dentry *)realloc(dl->entries,
+			(*allocated)*sizeof(struct dentry))))
+				return -1;
+		dl->entries=tmp;
+	}
+	de=&(dl->entries[dl->count]);
+	memset(de, 0, sizeof(struct dentry));
+	if(!(de->name=strdup(name))) return -1;
+	dl->count++;
+	return 0;
+}
+
+int findpool_stat(struct dirlist *dl, struct dentry *de)
+{
+	if(!de->statted)
+	{
+		int r=0;
+#ifdef USE_DIRFD
+		if(dl->fd>=0)
+			r=fstatat(dl->fd, de->name, &(de->statp),
+				AT_SYMLINK_NOFOLLOW);
+		else
+#endif
+		{
+			char *path=NULL;
+			if(!(path=join_path(dl->path, de->name)))
+			{
+				errno=ENOMEM;
+				return -1;
+			}
+			r=lstat(path, &(de->statp));
+			free(path);
+		}
+		de->stat_errno=r?errno:0;
+		de->statted=1;
+	}
+	if(de->stat_errno)
+	{
+		errno=de->stat_errno;
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef USE_GETDENTS
+static int read_entries(struct dirlist *dl, char *buf)
+{
+	int allocated=0;
+	while(1)
+	{
+		long n=0;
+		long off=0;
+		if((n=syscall(SYS_getdents64, dl->fd, buf, DENTS_BUF_LEN))<0)
+			return -1;
+		if(!n) break;
+		while(off<n)
+		{
+			struct dent64 *d=(struct dent64 *)(buf+off);
+			if(add_entry(dl, d->d_name, &allocated)) return -1;
+			off+=d->d_reclen;
+		}
+	}
+	return 0;
+}
+#else
+static int read_entries(struct dirlist *dl, char *buf)
+{
+	int fd=-1;
+	int allocated=0;
+	DIR *directory=NULL;
+	struct dirent *d=NULL;
+#ifdef USE_DIRFD
+	// Reading through a DIR closes the descriptor given to it, and the
+	// original is still needed for the stats.
+	if((fd=dup(dl->fd))<0) return -1;
+	if(!(directory=fdopendir(fd)))
+	{
+		close(fd);
+		return -1;
+	}
+#else
+	if(!(directory=opendir(dl->path))) return -1;
+#endif
+	while((d=readdir(directory)))
+	{
+		if(add_entry(dl, d->d_name, &allocated))
+		{
+			closedir(directory);
+			return -1;
+		}
+	}
+	closedir(directory);
+	return 0;
+}
+#endif
+
+/* Reads and sorts the entries of a directory. If parent is still open, the
+   directory is opened relative to it, by name. With stat_all, the entries
+   are all done straight away, and the directory is closed. Otherwise, it is
+   kept open so that findpool_stat() can do them relative to it. */
+static int read_dir(struct dirlist *dl, struct dirlist *parent, const char *name, int stat_all, char *buf)
+{
+	int i=0;
+#ifdef USE_DIRFD
+	if(parent && parent->fd>=0 && name)
+		dl->fd=openat(parent->fd, name, O_RDONLY|O_DIRECTORY);
+	else
+		dl->fd=open(dl->path, O_RDONLY|O_DIRECTORY);
+	if(dl->fd<0)
+	{
+		dl->open_errno=errno;
+		return 0;
+	}
+#else
+	DIR *directory=NULL;
+	// Only to find out whether it can be opened.
+	if(!(directory=opendir(dl->path)))
+	{
+		dl->open_errno=errno;
+		return 0;
+	}
+	closedir(directory);
+#endif
+	if(read_entries(dl, buf)) goto error;
+
+	if(dl->count) qsort(dl->entries, dl->count,
+		sizeof(struct dentry), dentry_cmp);
+
+	if(stat_all || held_fds>=MAX_HELD_FDS)
+	{
+		for(i=0; i<dl->count; i++)
+			findpool_stat(dl, &(dl->entries[i]));
+		if(dl->fd>=0) close(dl->fd);
+		dl->fd=-1;
+	}
+	else if(dl->fd>=0)
+		held_fds++;
+	return 0;
+error:
+	clear_entries(dl);
+	return -1;
+}
+
+#ifdef HAVE_PTHREAD
+
+// How far the pool may get ahead of the scan.
+#define MAX_AHEAD_DIRS		1024
+#define MAX_AHEAD_ENTRIES	262144
+
+// Directories waiting for a thread to read them. Threads take from the
+// front, and the subdirectories of a directory go on in reverse order, so
+// that they come off in the same order that the scan goes through them.
+static struct workq *q=NULL;
+static findpool_want_t *want_fn=NULL;
+static void *want_arg=NULL;
+
+// Every directory that the pool has queued or read, that the scan has not
+// yet taken, sorted with pathcmp. This is also the order of the scan.
+static struct dirlist **ahead=NULL;
+static int alen=0;
+static long entries=0;
+
+// The subdirectories that the scan will go into, in order. It does not
+// cross file systems without asking first, so neither does the pool.
+static char **wanted_subdirs(struct dirlist *dl, int *n)
+{
+	int i=0;
+	char **subdirs=NULL;
+	*n=0;
+	for(i=0; i<dl->count; i++)
+	{
+		char *path=NULL;
+		struct dentry *de=&(dl->entries[i]);
+		if(de->stat_errno
+		  || !S_ISDIR(de->statp.st_mode)
+		  || de->statp.st_dev!=dl->dev)
+			continue;
+		if(!subdirs && !(subdirs=(char **)
+			malloc(dl->count*sizeof(char *))))
+				return NULL;
+		if(!(path=join_path(dl->path, de->name))) break;
+		if(!want_fn(path, want_arg))
+		{
+			free(path);
+			continue;
+		}
+		subdirs[(*n)++]=path;
+	}
+	return subdirs;
+}
+
+// Returns 1 and the position if path is known, otherwise 0 and where it
+// would go.
+static int find_ahead(const char *path, int *pos)
+{
+	int lo=0;
+	int hi=alen;
+	while(lo<hi)
+	{
+		int c;
+		int mid=(lo+hi)/2;
+		if(!(c=pathcmp(ahead[mid]->path, path)))
+		{
+			*pos=mid;
+			return 1;
+		}
+		if(c<0) lo=mid+1;
+		else hi=mid;
+	}
+	*pos=lo;
+	return 0;
+}
+
+static void remove_ahead(int pos)
+{
+	alen--;
+	memmove(ahead+pos, ahead+pos+1, (alen-pos)*sizeof(struct dirlist *));
+}
+
+// Call with the lock held. Takes the paths, as many as there is room for.
+static void queue_subdirs(char **subdirs, int n, dev_t dev)
+{
+	int i=0;
+	int room=MAX_AHEAD_DIRS-alen;
+	if(entries>=MAX_AHEAD_ENTRIES) room=0;
+	if(n>room)
+	{
+		for(i=room; i<n; i++) free(subdirs[i]);
+		n=room;
+	}
+	for(i=n-1; i>=0; i--)
+	{
+		int pos=0;
+		struct dirlist *dl=NULL;
+		if(find_ahead(subdirs[i], &pos)
+		  || !(dl=new_dirlist(subdirs[i], dev)))
+		{
+			free(subdirs[i]);
+			continue;
+		}
+		memmove(ahead+pos+1, ahead+pos,
+			(alen-pos)*sizeof(struct dirlist *));
+		ahead[pos]=dl;
+		alen++;
+		workq_push_locked(q, &dl->wi);
+	}
+}
+
+static void free_subdirs(struct dirlist *dl)
+{
+	int i=0;
+	for(i=0; i<dl->nsubdirs; i++) free(dl->subdirs[i]);
+	if(dl->subdirs) free(dl->subdirs);
+	dl->subdirs=NULL;
+	dl->nsubdirs=0;
+}
+
+static void free_item(struct workitem *wi)
+{
+	struct dirlist *dl=(struct dirlist *)wi;
+	free_subdirs(dl);
+	findpool_free_dirlist(dl);
+}
+
+// Call with the lock held. Anything before path will not be asked for again.
+static void forget_before(const char *path)
+{
+	while(alen && pathcmp(ahead[0]->path, path)<0)
+	{
+		struct dirlist *dl=ahead[0];
+		remove_ahead(0);
+		// If it is being read, the thread that is reading it frees it.
+		if(!workq_drop_locked(q, &dl->wi)) continue;
+		if(dl->wi.state==WQ_DONE && !dl->read_error)
+			entries-=dl->count;
+		free_item(&dl->wi);
+	}
+}
+
+// A thread that cannot get a buffer leaves the work to the others, and to
+// the scan.
+static void *thread_start(void)
+{
+	return malloc(DENTS_BUF_LEN);
+}
+
+static void thread_end(void *buf)
+{
+	free(buf);
+}
+
+static void read_item(struct workitem *wi, void *buf)
+{
+	struct dirlist *dl=(struct dirlist *)wi;
+	if((dl->read_error=read_dir(dl, NULL, NULL, 1, (char *)buf)))
+		return;
+	dl->subdirs=wanted_subdirs(dl, &dl->nsubdirs);
+}
+
+static void read_done(struct workitem *wi)
+{
+	struct dirlist *dl=(struct dirlist *)wi;
+	// If it could not be read, leave it for the scan, which can log the
+	// problem.
+	if(dl->read_error) return;
+	entries+=dl->count;
+	queue_subdirs(dl->subdirs, dl->nsubdirs, dl->dev);
+	if(dl->subdirs) free(dl->subdirs);
+	dl->subdirs=NULL;
+	dl->nsubdirs=0;
+}
+
+/* Returns what the pool has for path. If *ready is set, it has been read,
+   otherwise the caller has to read it. */
+static struct dirlist *take_from_pool(const char *path, int *ready)
+{
+	int pos=0;
+	struct dirlist *dl=NULL;
+
+	*ready=0;
+	workq_lock(q);
+	forget_before(path);
+	if(find_ahead(path, &pos))
+	{
+		int read=0;
+		dl=ahead[pos];
+		read=workq_take_locked(q, &dl->wi);
+		// Others may have been added while waiting.
+		if(find_ahead(path, &pos)) remove_ahead(pos);
+		if(read && !dl->read_error)
+		{
+			entries-=dl->count;
+			*ready=1;
+		}
+		else
+			clear_entries(dl);
+	}
+	workq_unlock(q);
+	return dl;
+}
+
+static void queue_wanted(struct dirlist *dl)
+{
+	int n=0;
+	char **subdirs=NULL;
+	if(!(subdirs=wanted_subdirs(dl, &n))) return;
+	workq_lock(q);
+	queue_subdirs(subdirs, n, dl->dev);
+	workq_unlock(q);
+	free(subdirs);
+}
+
+#endif /* HAVE_PTHREAD */
+
+static int nthreads=0;
+
+struct dirlist *findpool_get(const char *path, dev_t dev, struct dirlist *parent, const char *name)
+{
+	char *copy=NULL;
+	struct dirlist *dl=NULL;
+	static char *buf=NULL;
+
+#ifdef HAVE_PTHREAD
+	if(nthreads)
+	{
+		int ready=0;
+		if((dl=take_from_pool(path, &ready)) && ready)
+			return dl;
+	}
+#endif
+	if(!buf && !(buf=(char *)malloc(DENTS_BUF_LEN)))
+	{
+		logp("out of memory\n");
+		findpool_free_dirlist(dl);
+		return NULL;
+	}
+	if(!dl && (!(copy=strdup(path)) || !(dl=new_dirlist(copy, dev))))
+	{
+		logp("out of memory\n");
+		if(copy) free(copy);
+		return NULL;
+	}
+	// With the pool, the entries are needed to find the subdirectories
+	// to give to it.
+	if(read_dir(dl, parent, name, nthreads>0, buf))
+	{
+		logp("could not read directory %s\n", path);
+		findpool_free_dirlist(dl);
+		return NULL;
+	}
+#ifdef HAVE_PTHREAD
+	if(nthreads) queue_wanted(dl);
+#endif
+	return dl;
+}
+
+int findpool_init(int count, findpool_want_t *want, void *arg)
+{
+#ifdef HAVE_PTHREAD
+	if(count<=0) return 0;
+	want_fn=want;
+	want_arg=arg;
+	if(!(ahead=(struct dirlist **)
+		malloc(MAX_AHEAD_DIRS*sizeof(struct dirlist *))))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	if(!(q=workq_new(count, "directory reading", read_item, read_done,
+		free_item, thread_start, thread_end)))
+	{
+		findpool_free();
+		return -1;
+	}
+	nthreads=count;
+#else
+	if(count>0)
+		logp("find_threads is not supported here - scanning on one thread\n");
+#endif
+	return 0;
+}
+
+int findpool_active(void)
+{
+	return nthreads>0;
+}
+
+void findpool_free(void)
+{
+#ifdef HAVE_PTHREAD
+	int i=0;
+	workq_free(&q);
+	// Nothing is being read any more.
+	for(i=0; i<alen; i++) free_item(&(ahead[i]->wi));
+	if(ahead) free(ahead);
+	ahead=NULL;
+	alen=0;
+	entries=0;
+#endif
+	nthreads=0;
+}
+
+#else
+
+// Windows has its own way of going through directories, in find.c.
+
+int findpool_init(int count, findpool_want_t *want, void *arg)
+{
+	if(count>0)
+		logp("find_threads is not supported here - scanning on one thread\n");
+	return 0;
+}
+
+int findpool_active(void)
+{
+	return 0;
+}
+
+struct dirlist *findpool_get(const char *path, dev_t dev, struct dirlist *parent, const char *name)
+{
+	return NULL;
+}
+
+int findpool_stat(struct dirlist *dl, struct dentry *de)
+{
+	return -1;
+}
+
+void findpool_free(void)
+{
+}
+
+#endif
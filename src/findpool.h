@@ -0,0 +1,67 @@
+#ifndef _FINDPOOL_H
+#define _FINDPOOL_H
+
+#include "workq.h"
+
+/* Reading directories for the file system scan, on systems other than
+   Windows. Directories are opened relative to their parent, and their
+   entries are stat'ed relative to the directory, so that the kernel does not
+   have to look up every component of the path for each file.
+
+   Optionally, a pool of threads reads directories ahead of the scan. The
+   scan itself stays on one thread, so that it still finds everything in the
+   order that the server expects. When it gets to a directory that the pool
+   has already read, it takes the sorted entries and their lstat results
+   instead of doing the system calls itself. */
+
+// Most threads that find_threads may ask for.
+#define MAX_FIND_THREADS	64
+
+// One entry of a directory, with the result of lstat on it.
+struct dentry
+{
+	char *name;
+	int statted; // statp and stat_errno have been filled in
+	struct stat statp;
+	int stat_errno; // 0 if statp is good
+};
+
+struct dirlist
+{
+	struct workitem wi; // used by the pool
+	char *path;
+	dev_t dev; // device of the directory itself
+	int fd; // kept open while its entries still need stat'ing, or -1
+	int open_errno; // 0 if the directory could be opened
+	struct dentry *entries; // sorted with pathcmp
+	int count;
+
+	// Used by the pool.
+	int read_error; // left for the scan to read again, and log
+	char **subdirs; // to be read ahead once the scan wants this one
+	int nsubdirs;
+};
+
+// Decides whether a subdirectory will be gone into by the scan, and so is
+// worth reading ahead. Called from the pool threads, so it must not touch
+// anything that the scan changes.
+typedef int findpool_want_t(const char *path, void *arg);
+
+// Starts count threads. Returns 0 if the pool has started, or if count is 0,
+// so that there is no pool. Returns -1 on error.
+extern int findpool_init(int count, findpool_want_t *want, void *arg);
+extern int findpool_active(void);
+// Gets the entries of a directory, reading it now if the pool has not
+// already. If parent is given, the directory is opened relative to it, by
+// name. Directories before this one, in the order of the scan, are
+// forgotten, because the scan will not come back for them. Returns NULL on
+// error. A directory that could not be opened is not an error - open_errno
+// is set instead.
+extern struct dirlist *findpool_get(const char *path, dev_t dev, struct dirlist *parent, const char *name);
+// Does lstat on an entry, unless that has already been done. Returns 0, or
+// -1 with errno set.
+extern int findpool_stat(struct dirlist *dl, struct dentry *de);
+extern void findpool_free_dirlist(struct dirlist *dl);
+extern void findpool_free(void);
+
+#endif
@@ -7,6 +7,7 @@
 #include "find.h"
 #include "berrno.h"
 #include "forkchild.h"
+#include "zpool.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -242,12 +243,16 @@ int write_endfile(unsigned long long bytes, unsigned char *checksum)
 
 static int do_encryption(EVP_CIPHER_CTX *ctx, unsigned char *inbuf, size_t inlen, unsigned char *outbuf, size_t *outlen, MD5_CTX *md5)
 {
+	// OpenSSL gives the length as an int, which only fills half of a
+	// size_t.
+	int len=0;
 	if(!inlen) return 0;
-	if(!EVP_CipherUpdate(ctx, outbuf, (int *)outlen, inbuf, (int)inlen))
+	if(!EVP_CipherUpdate(ctx, outbuf, &len, inbuf, (int)inlen))
 	{
 		logp("Encryption failure.\n");
 		return -1;
 	}
+	*outlen=len;
 	if(*outlen>0)
 	{
 		int ret;
@@ -301,10 +306,13 @@ int open_file_for_send(BFILE *bfd, FILE **fp, const char *fname, int64_t winattr
 {
 	if(fp)
 	{
-		if(!(*fp=fopen(fname, "rb")))
+		int fd=-1;
+		if((fd=fileread_open(fname, O_RDONLY))<0
+		  || !(*fp=fdopen(fd, "rb")))
 		{
 			logw(cntr,
 				"Could not open %s: %s\n", fname, strerror(errno));
+			if(fd>=0) close(fd);
 			return -1;
 		}
 	}
@@ -334,219 +342,449 @@ int close_file_for_send(BFILE *bfd, FILE **fp)
 	return -1;
 }
 
-/* OK, this function is getting a bit out of control.
+/* The sending of a file is split into steps, each of which reads one chunk
+   and writes what it makes of it, so that the sends of several files can
+   take turns on the network.
+
    One problem is that, if you give deflateInit2 compression=0, it still
    writes gzip headers and footers, so I had to add extra
    if(compression) and if(!compression) bits all over the place that would
    skip the actual compression.
    This is needed for the case where encryption is on and compression is off.
-   Encryption off and compression off uses send_whole_file().
-   Perhaps a separate function is needed for encryption on compression off.
+   Encryption off and compression off does not use zlib at all (gz=0).
 */
-int send_whole_file_gz(const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, const char *encpassword, struct cntr *cntr, int compression, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen)
+int filesend_init(struct filesend *fs, int gz, const char *datapth, int quick_read, unsigned long long *bytes, const char *encpassword, struct cntr *cntr, int compression, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen)
 {
-	int ret=0;
-	int zret=0;
-	MD5_CTX md5;
-	size_t metalen=0;
-	const char *metadata=NULL;
-
-	unsigned have;
-	z_stream strm;
-	int flush=Z_NO_FLUSH;
-	unsigned char in[ZCHUNK];
-	unsigned char out[ZCHUNK];
-
-	size_t eoutlen;
-	unsigned char eoutbuf[ZCHUNK+EVP_MAX_BLOCK_LENGTH];
-
-	EVP_CIPHER_CTX *enc_ctx=NULL;
-
-	if(encpassword && !(enc_ctx=enc_setup(1, encpassword)))
-		return -1;
-
-	if(!MD5_Init(&md5))
+	memset(fs, 0, sizeof(struct filesend));
+	fs->gz=gz;
+	fs->datapth=datapth;
+	fs->quick_read=quick_read;
+	fs->bytes=bytes;
+	fs->cntr=cntr;
+	fs->compression=compression;
+	fs->bfd=bfd;
+	fs->fp=fp;
+	fs->metadata=extrameta;
+	fs->metalen=elen;
+
+	if(!MD5_Init(&(fs->md5)))
 	{
 		logp("MD5_Init() failed\n");
 		return -1;
 	}
 
-//logp("send_whole_file_gz: %s%s\n", fname, extrameta?" (meta)":"");
-
-	if((metadata=extrameta))
+	if(!gz)
 	{
-		metalen=elen;
+		fs->zchunk=async_get_frame_size();
+		if(!(fs->in=(unsigned char *)malloc(fs->zchunk)))
+		{
+			logp("out of memory in filesend_init\n");
+			return -1;
+		}
+		return 0;
 	}
 
-	/* allocate deflate state */
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	if((zret=deflateInit2(&strm, compression, Z_DEFLATED, (15+16),
-		8, Z_DEFAULT_STRATEGY))!=Z_OK)
-
+	/* Compressed chunks, once encrypted, must still fit in one network
+	   frame. */
+	fs->zchunk=async_get_frame_size()-EVP_MAX_BLOCK_LENGTH;
+	if(!(fs->in=(unsigned char *)malloc(fs->zchunk))
+	  || !(fs->out=(unsigned char *)malloc(fs->zchunk))
+	  || !(fs->eoutbuf=(unsigned char *)
+		malloc(fs->zchunk+EVP_MAX_BLOCK_LENGTH)))
 	{
+		logp("out of memory in filesend_init\n");
 		return -1;
 	}
 
-	do
-	{
-		if(metadata)
-		{
-			if(metalen>ZCHUNK)
-				strm.avail_in=ZCHUNK;
-			else
-				strm.avail_in=metalen;
-			memcpy(in, metadata, strm.avail_in);
-			metadata+=strm.avail_in;
-			metalen-=strm.avail_in;
-		}
-		else
-		{
-			if(fp) strm.avail_in=fread(in, 1, ZCHUNK, fp);
-#ifdef HAVE_WIN32
-			else strm.avail_in=(uint32_t)bread(bfd, in, ZCHUNK);
-#endif
-		}
-		if(!compression && !strm.avail_in) break;
-		if(strm.avail_in<0)
-		{
-			logp("Error in read: %d\n", strm.avail_in);
-			ret=-1;
-			break;
-		}
-		*bytes+=strm.avail_in;
+	if(encpassword && !(fs->enc_ctx=enc_setup(1, encpassword)))
+		return -1;
 
-		// The checksum needs to be later if encryption is being used.
-		if(!enc_ctx)
+	if(compression && zcodec_alg(compression)==ZC_GZIP
+	  && fp && !extrameta && zpool_threads())
+	{
+		struct stat statp;
+		if(!fstat(fileno(fp), &statp) && statp.st_size>=ZPOOL_MIN_FILE)
 		{
-			if(!MD5_Update(&md5, in, strm.avail_in))
+			if(!(fs->zdict=(unsigned char *)malloc(ZPOOL_DICT)))
 			{
-				logp("MD5_Update() failed\n");
-				ret=-1;
-				break;
+				logp("out of memory in filesend_init\n");
+				return -1;
 			}
+			fs->pipelined=1;
+			fs->zcrc=crc32(0L, Z_NULL, 0);
+			return 0;
 		}
+	}
 
-		if(strm.avail_in) flush=Z_NO_FLUSH;
-		else flush=Z_FINISH;
-
-		strm.next_in=in;
-
-		/* run deflate() on input until output buffer not full, finish
-			compression if all of source has been read in */
-		do
-		{
-			if(compression)
-			{
-				strm.avail_out = ZCHUNK;
-				strm.next_out = out;
-				zret = deflate(&strm, flush); /* no bad return value */
-				if(zret==Z_STREAM_ERROR) /* state not clobbered */
-				{
-					logp("z_stream_error\n");
-					ret=-1;
-					break;
-				}
-				have = ZCHUNK-strm.avail_out;
-			}
-			else
-			{
-				have=strm.avail_in;
-				memcpy(out, in, have);
-			}
+	if(!compression) return 0;
+	if(zstrm_init_compress(&(fs->strm), compression))
+	{
+		zstrm_end(&(fs->strm));
+		return -1;
+	}
+	fs->zinit=1;
+	return 0;
+}
 
-			if(enc_ctx)
-			{
-				if(do_encryption(enc_ctx, out, have, eoutbuf, &eoutlen, &md5))
-				{
-					ret=-1;
-					break;
-				}
-			}
-			else if(async_write(CMD_APPEND, (const char *)out, have))
-			{
-				ret=-1;
-				break;
-			}
-			if(quick_read && datapth)
-			{
-				int qr;
-				if((qr=do_quick_read(datapth, cntr))<0)
-				{
-					ret=-1;
-					break;
-				}
-				if(qr) // client wants to interrupt
-				{
-					goto cleanup;
-				}
-			}
-			if(!compression) break;
-		} while (!strm.avail_out);
+void filesend_free(struct filesend *fs)
+{
+	if(fs->zinit) zstrm_end(&(fs->strm));
+	fs->zinit=0;
+	if(fs->enc_ctx)
+	{
+		EVP_CIPHER_CTX_cleanup(fs->enc_ctx);
+		free(fs->enc_ctx);
+		fs->enc_ctx=NULL;
+	}
+	if(fs->in) { free(fs->in); fs->in=NULL; }
+	if(fs->out) { free(fs->out); fs->out=NULL; }
+	if(fs->eoutbuf) { free(fs->eoutbuf); fs->eoutbuf=NULL; }
+	while(fs->zhead)
+	{
+		struct zblock *zb=fs->zhead;
+		fs->zhead=zb->fnext;
+		zpool_drop(zb);
+	}
+	fs->ztail=NULL;
+	fs->zqueued=0;
+	if(fs->zdict) { free(fs->zdict); fs->zdict=NULL; }
+}
 
-		if(ret) break;
+// Returns 1 if the client wants to interrupt.
+static int filesend_quick_read(struct filesend *fs)
+{
+	if(!fs->quick_read || !fs->datapth) return 0;
+	return do_quick_read(fs->datapth, fs->cntr);
+}
 
-		if(!compression) continue;
+// Fills fs->in from the meta data or the file, returning the length.
+static size_t filesend_read(struct filesend *fs)
+{
+	size_t s=0;
+	if(fs->metadata)
+	{
+		s=fs->metalen>fs->zchunk?fs->zchunk:fs->metalen;
+		memcpy(fs->in, fs->metadata, s);
+		fs->metadata+=s;
+		fs->metalen-=s;
+		return s;
+	}
+	if(fs->fp)
+	{
+		s=fread(fs->in, 1, fs->zchunk, fs->fp);
+		if(fs->fr) fileread_done(fs->fr, s);
+		return s;
+	}
+#ifdef HAVE_WIN32
+	s=(uint32_t)bread(fs->bfd, fs->in, fs->zchunk);
+#endif
+	return s;
+}
 
-		if(strm.avail_in) /* all input will be used */
-		{
-			ret=-1;
-			logp("strm.avail_in=%d\n", strm.avail_in);
-			break;
-		}
-	} while(flush!=Z_FINISH);
+static int filesend_finish(struct filesend *fs, int interrupted)
+{
+	unsigned char checksum[MD5_DIGEST_LENGTH+1];
 
-	if(!ret)
+	if(fs->gz && !interrupted)
 	{
-		if(compression && zret!=Z_STREAM_END)
+		if(fs->compression && fs->zret!=ZS_END)
 		{
-			logp("ret OK, but zstream not finished: %d\n", zret);
-			ret=-1;
+			logp("ret OK, but zstream not finished: %d\n",
+				fs->zret);
+			return -1;
 		}
-		else if(enc_ctx)
+		else if(fs->enc_ctx)
 		{
-			if(!EVP_CipherFinal_ex(enc_ctx,
-				eoutbuf, (int *)&eoutlen))
+			size_t eoutlen=0;
+			if(!EVP_CipherFinal_ex(fs->enc_ctx,
+				fs->eoutbuf, (int *)&eoutlen))
 			{
 				logp("Encryption failure at the end\n");
-				ret=-1;
+				return -1;
 			}
 			else if(eoutlen>0)
 			{
-			  if(async_write(CMD_APPEND, (const char *)eoutbuf, eoutlen))
-				ret=-1;
-			  else if(!MD5_Update(&md5, eoutbuf, eoutlen))
+			  if(async_write(CMD_APPEND,
+				(const char *)fs->eoutbuf, eoutlen))
+					return -1;
+			  else if(!MD5_Update(&(fs->md5), fs->eoutbuf, eoutlen))
 			  {
 				logp("MD5_Update() failed\n");
-				ret=-1;
+				return -1;
 			  }
 			}
 		}
 	}
 
-cleanup:
-	deflateEnd(&strm);
+	if(!MD5_Final(checksum, &(fs->md5)))
+	{
+		logp("MD5_Final() failed\n");
+		return -1;
+	}
+	if(write_endfile(*(fs->bytes), checksum)) return -1;
+	return 1;
+}
 
-	if(enc_ctx)
+static int filesend_step_plain(struct filesend *fs)
+{
+	int qr;
+	size_t s=0;
+
+	if(!(s=filesend_read(fs))) return filesend_finish(fs, 0);
+
+	*(fs->bytes)+=s;
+	if(!MD5_Update(&(fs->md5), fs->in, s))
 	{
-		EVP_CIPHER_CTX_cleanup(enc_ctx);
-		free(enc_ctx);
+		logp("MD5_Update() failed\n");
+		return -1;
 	}
+	if(async_write(CMD_APPEND, (const char *)fs->in, s))
+		return -1;
+	if((qr=filesend_quick_read(fs))<0) return -1;
+	if(qr) return filesend_finish(fs, 0); // client wants to interrupt
+	return 0;
+}
 
-	if(!ret)
+static int filesend_step_gz(struct filesend *fs)
+{
+	int qr;
+	size_t have;
+	size_t eoutlen=0;
+	struct zstrm *strm=&(fs->strm);
+	int finish=0;
+
+	strm->avail_in=filesend_read(fs);
+	if(!fs->compression && !strm->avail_in)
+		return filesend_finish(fs, 0);
+	*(fs->bytes)+=strm->avail_in;
+
+	// The checksum needs to be later if encryption is being used.
+	if(!fs->enc_ctx)
 	{
-		unsigned char checksum[MD5_DIGEST_LENGTH+1];
-		if(!MD5_Final(checksum, &md5))
+		if(!MD5_Update(&(fs->md5), fs->in, strm->avail_in))
 		{
-			logp("MD5_Final() failed\n");
+			logp("MD5_Update() failed\n");
 			return -1;
 		}
+	}
+
+	finish=!strm->avail_in;
+
+	strm->next_in=fs->in;
+
+	/* run the compressor on input until output buffer not full, finish
+		compression if all of source has been read in */
+	do
+	{
+		if(fs->compression)
+		{
+			strm->avail_out = fs->zchunk;
+			strm->next_out = fs->out;
+			if((fs->zret=zstrm_run(strm, finish))==ZS_ERROR)
+				return -1;
+			have = fs->zchunk-strm->avail_out;
+		}
+		else
+		{
+			have=strm->avail_in;
+			memcpy(fs->out, fs->in, have);
+		}
+
+		if(fs->enc_ctx)
+		{
+			if(do_encryption(fs->enc_ctx, fs->out, have,
+				fs->eoutbuf, &eoutlen, &(fs->md5)))
+					return -1;
+		}
+		else if(async_write(CMD_APPEND, (const char *)fs->out, have))
+			return -1;
+		if((qr=filesend_quick_read(fs))<0) return -1;
+		// client wants to interrupt
+		if(qr) return filesend_finish(fs, 1);
+		if(!fs->compression) break;
+	} while (!strm->avail_out);
+
+	if(!fs->compression) return 0;
 
-		return write_endfile(*bytes, checksum);
+	if(strm->avail_in) /* all input will be used */
+	{
+		logp("strm.avail_in=%lu\n", (unsigned long)strm->avail_in);
+		return -1;
 	}
-//logp("end of send\n");
-	return ret;
+	if(finish) return filesend_finish(fs, 0);
+	return 0;
+}
+
+// Sends what is in out, encrypting it first if need be.
+static int filesend_flush_out(struct filesend *fs)
+{
+	size_t eoutlen=0;
+	if(!fs->outlen) return 0;
+	if(fs->enc_ctx)
+	{
+		if(do_encryption(fs->enc_ctx, fs->out, fs->outlen,
+			fs->eoutbuf, &eoutlen, &(fs->md5)))
+				return -1;
+	}
+	else if(async_write(CMD_APPEND, (const char *)fs->out, fs->outlen))
+		return -1;
+	fs->outlen=0;
+	return 0;
+}
+
+// Queues up compressed data to be sent in whole frames. Returns 1 if the
+// client wants to interrupt.
+static int filesend_out(struct filesend *fs, const unsigned char *buf, size_t len)
+{
+	int qr;
+	size_t s=0;
+	while(len)
+	{
+		s=fs->zchunk-fs->outlen;
+		if(s>len) s=len;
+		memcpy(fs->out+fs->outlen, buf, s);
+		fs->outlen+=s;
+		buf+=s;
+		len-=s;
+		if(fs->outlen<fs->zchunk) break;
+		if(filesend_flush_out(fs)) return -1;
+		if((qr=filesend_quick_read(fs))) return qr;
+	}
+	return 0;
+}
+
+static void put_le32(unsigned char *p, unsigned long v)
+{
+	p[0]=v&0xFF;
+	p[1]=(v>>8)&0xFF;
+	p[2]=(v>>16)&0xFF;
+	p[3]=(v>>24)&0xFF;
+}
+
+// Reads the next block of the file and gives it to the compression pool.
+static int filesend_queue_block(struct filesend *fs)
+{
+	struct zblock *zb=NULL;
+	if(!(zb=(struct zblock *)calloc(1, sizeof(struct zblock)))
+	  || !(zb->in=(unsigned char *)malloc(ZPOOL_BLOCK)))
+	{
+		logp("out of memory in filesend_queue_block\n");
+		if(zb) free(zb);
+		return -1;
+	}
+	// The whole block, so that the blocks do not get small when the
+	// file is slow to read.
+	while(zb->inlen<ZPOOL_BLOCK)
+	{
+		size_t s=fread(zb->in+zb->inlen, 1,
+			ZPOOL_BLOCK-zb->inlen, fs->fp);
+		if(!s) break;
+		if(fs->fr) fileread_done(fs->fr, s);
+		zb->inlen+=s;
+	}
+	if(!zb->inlen) fs->zeof=zb->last=1;
+	zb->level=fs->compression;
+	memcpy(zb->dict, fs->zdict, fs->zdictlen);
+	zb->dictlen=fs->zdictlen;
+
+	*(fs->bytes)+=zb->inlen;
+	// The checksum needs to be later if encryption is being used.
+	if(!fs->enc_ctx && !MD5_Update(&(fs->md5), zb->in, zb->inlen))
+	{
+		logp("MD5_Update() failed\n");
+		zpool_drop(zb);
+		return -1;
+	}
+	if(zb->inlen>=ZPOOL_DICT)
+	{
+		memcpy(fs->zdict, zb->in+zb->inlen-ZPOOL_DICT, ZPOOL_DICT);
+		fs->zdictlen=ZPOOL_DICT;
+	}
+	else if(zb->inlen)
+	{
+		// Keep the end of what there was before, too.
+		size_t keep=fs->zdictlen+zb->inlen>ZPOOL_DICT?
+			ZPOOL_DICT-zb->inlen:fs->zdictlen;
+		memmove(fs->zdict, fs->zdict+fs->zdictlen-keep, keep);
+		memcpy(fs->zdict+keep, zb->in, zb->inlen);
+		fs->zdictlen=keep+zb->inlen;
+	}
+
+	if(fs->ztail) fs->ztail->fnext=zb;
+	else fs->zhead=zb;
+	fs->ztail=zb;
+	fs->zqueued++;
+	zpool_add(zb);
+	return 0;
+}
+
+static int filesend_step_pipelined(struct filesend *fs)
+{
+	int qr=0;
+	struct zblock *zb=NULL;
+	unsigned char trailer[8];
+	// Like what deflate writes, but without the compression level.
+	static const unsigned char header[10]=
+		{ 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03 };
+
+	// Keep every thread busy, with one block more for each to go on to.
+	while(!fs->zeof && fs->zqueued<zpool_threads()*2)
+		if(filesend_queue_block(fs)) return -1;
+
+	zb=fs->zhead;
+	if(zpool_take(zb)) return -1;
+	if(!fs->zsent++ && (qr=filesend_out(fs, header, sizeof(header))))
+		goto end;
+	if((qr=filesend_out(fs, zb->out, zb->outlen))) goto end;
+	fs->zcrc=crc32_combine(fs->zcrc, zb->crc, zb->inlen);
+	fs->zisize+=zb->inlen;
+	if(zb->last)
+	{
+		put_le32(trailer, fs->zcrc);
+		put_le32(trailer+4, fs->zisize);
+		if((qr=filesend_out(fs, trailer, sizeof(trailer)))
+		  || (qr=filesend_flush_out(fs)))
+			goto end;
+		fs->zret=ZS_END;
+	}
+end:
+	fs->zhead=zb->fnext;
+	if(!fs->zhead) fs->ztail=NULL;
+	fs->zqueued--;
+	zpool_drop(zb);
+	if(qr<0) return -1;
+	// client wants to interrupt
+	if(qr) return filesend_finish(fs, 1);
+	if(fs->zret==ZS_END) return filesend_finish(fs, 0);
+	return 0;
+}
+
+int filesend_step(struct filesend *fs)
+{
+	if(fs->pipelined) return filesend_step_pipelined(fs);
+	if(fs->gz) return filesend_step_gz(fs);
+	return filesend_step_plain(fs);
+}
+
+static int filesend_all(struct filesend *fs)
+{
+	int ret=0;
+	while(!(ret=filesend_step(fs))) { }
+	filesend_free(fs);
+	return ret<0?-1:0;
+}
+
+int send_whole_file_gz(const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, const char *encpassword, struct cntr *cntr, int compression, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen)
+{
+	struct filesend fs;
+//logp("send_whole_file_gz: %s%s\n", fname, extrameta?" (meta)":"");
+	if(filesend_init(&fs, 1, datapth, quick_read, bytes, encpassword,
+		cntr, compression, bfd, fp, extrameta, elen))
+	{
+		filesend_free(&fs);
+		return -1;
+	}
+	return filesend_all(&fs);
 }
 
 #ifdef HAVE_WIN32
@@ -582,150 +820,58 @@ static DWORD WINAPI write_efs(PBYTE pbData, PVOID pvCallbackContext, ULONG ulLen
 	}
 	return ERROR_SUCCESS;
 }
-#endif
 
-int send_whole_file(char cmd, const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, struct cntr *cntr, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen)
+static int send_efs_file(const char *datapth, int quick_read, unsigned long long *bytes, struct cntr *cntr, BFILE *bfd)
 {
-	int ret=0;
-	size_t s=0;
 	MD5_CTX md5;
-	char buf[4096]="";
+	struct winbuf mybuf;
+	unsigned char checksum[MD5_DIGEST_LENGTH+1];
 
 	if(!MD5_Init(&md5))
 	{
 		logp("MD5_Init() failed\n");
 		return -1;
 	}
-
-	if(extrameta)
+	mybuf.md5=&md5;
+	mybuf.quick_read=quick_read;
+	mybuf.datapth=datapth;
+	mybuf.cntr=cntr;
+	mybuf.bytes=bytes;
+	// The EFS read function, ReadEncryptedFileRaw(),
+	// works in an annoying way. You have to give it a
+	// function that it calls repeatedly every time the
+	// read buffer is called.
+	// So ReadEncryptedFileRaw() will not return until
+	// it has read the whole file. I have no idea why
+	// they do not have a plain 'read()' function for it.
+
+	ReadEncryptedFileRaw((PFE_EXPORT_FUNC)write_efs,
+		&mybuf, bfd->pvContext);
+
+	if(!MD5_Final(checksum, &md5))
 	{
-		size_t metalen=0;
-		const char *metadata=NULL;
-
-		metadata=extrameta;
-		metalen=elen;
-
-		// Send metadata in chunks, rather than all at once.
-		while(metalen>0)
-		{
-			if(metalen>ZCHUNK) s=ZCHUNK;
-			else s=metalen;
-
-			if(!MD5_Update(&md5, metadata, s))
-			{
-				logp("MD5_Update() failed\n");
-				ret=-1;
-			}
-			if(async_write(CMD_APPEND, metadata, s))
-			{
-				ret=-1;
-			}
-
-			metadata+=s;
-			metalen-=s;
-
-			*bytes+=s;
-		}
+		logp("MD5_Final() failed\n");
+		return -1;
 	}
-	else
-	{
-#ifdef HAVE_WIN32
-		if(!ret && cmd==CMD_EFS_FILE)
-		{
-			struct winbuf mybuf;
-			mybuf.md5=&md5;
-			mybuf.quick_read=quick_read;
-			mybuf.datapth=datapth;
-			mybuf.cntr=cntr;
-			mybuf.bytes=bytes;
-			// The EFS read function, ReadEncryptedFileRaw(),
-			// works in an annoying way. You have to give it a
-			// function that it calls repeatedly every time the
-			// read buffer is called.
-			// So ReadEncryptedFileRaw() will not return until
-			// it has read the whole file. I have no idea why
-			// they do not have a plain 'read()' function for it.
-
-			ReadEncryptedFileRaw((PFE_EXPORT_FUNC)write_efs,
-				&mybuf, bfd->pvContext);
-		}
+	return write_endfile(*bytes, checksum);
+}
+#endif
 
-		if(!ret && cmd!=CMD_EFS_FILE)
-		{
-		  while((s=(uint32_t)bread(bfd, buf, 4096))>0)
-		  {
-			*bytes+=s;
-			if(!MD5_Update(&md5, buf, s))
-			{
-				logp("MD5_Update() failed\n");
-				ret=-1;
-				break;
-			}
-			if(async_write(CMD_APPEND, buf, s))
-			{
-				ret=-1;
-				break;
-			}
-			if(quick_read)
-			{
-				int qr;
-				if((qr=do_quick_read(datapth, cntr))<0)
-				{
-					ret=-1;
-					break;
-				}
-				if(qr)
-				{
-					// client wants to interrupt
-					break;
-				}
-			}
-		  }
-		}
-#else
-	//printf("send_whole_file: %s\n", fname);
-		if(!ret) while((s=fread(buf, 1, 4096, fp))>0)
-		{
-			*bytes+=s;
-			if(!MD5_Update(&md5, buf, s))
-			{
-				logp("MD5_Update() failed\n");
-				ret=-1;
-				break;
-			}
-			if(async_write(CMD_APPEND, buf, s))
-			{
-				ret=-1;
-				break;
-			}
-			if(quick_read)
-			{
-				int qr;
-				if((qr=do_quick_read(datapth, cntr))<0)
-				{
-					ret=-1;
-					break;
-				}
-				if(qr)
-				{
-					// client wants to interrupt
-					break;
-				}
-			}
-		}
+int send_whole_file(char cmd, const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, struct cntr *cntr, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen)
+{
+	struct filesend fs;
+#ifdef HAVE_WIN32
+	if(!extrameta && cmd==CMD_EFS_FILE)
+		return send_efs_file(datapth, quick_read, bytes, cntr, bfd);
 #endif
-	}
-	if(!ret)
+	//printf("send_whole_file: %s\n", fname);
+	if(filesend_init(&fs, 0, datapth, quick_read, bytes, NULL,
+		cntr, 0, bfd, fp, extrameta, elen))
 	{
-		unsigned char checksum[MD5_DIGEST_LENGTH+1];
-		if(!MD5_Final(checksum, &md5))
-		{
-			logp("MD5_Final() failed\n");
-			return -1;
-		}
-		return write_endfile(*bytes, checksum);
+		filesend_free(&fs);
+		return -1;
 	}
-	return ret;
+	return filesend_all(&fs);
 }
 
 int set_non_blocking(int fd)
@@ -822,6 +968,15 @@ void reuseaddr(int fd)
 				strerror(errno));
 }
 
+void nodelay(int fd)
+{
+	int on=1;
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+		(sockopt_val_t)&on, sizeof(on))<0)
+			logp("Error: setsockopt TCP_NODELAY: %s\n",
+				strerror(errno));
+}
+
 #ifndef HAVE_WIN32
 
 void write_status(const char *client, char phase, const char *path, struct cntr *p1cntr, struct cntr *cntr)
@@ -903,6 +1058,53 @@ void setup_signal(int sig, void handler(int sig))
 	sigaction(sig, &sa, NULL);
 }
 
+int daemonise(void)
+{
+	/* process ID */
+	pid_t pid;
+
+	/* session ID */
+	pid_t sid;
+
+	/* fork new child and end parent */
+	pid=fork();
+
+	/* did we fork? */
+	if(pid<0)
+	{
+		logp("error forking\n");
+		return -1;
+	}
+
+	/* parent? */
+	if(pid>0)
+		exit(EXIT_SUCCESS);
+
+	/* now we are in the child process */
+
+	/* create a session and set the process group ID */
+	sid=setsid();
+	if(sid<0)
+	{
+		logp("error setting sid\n");
+		return -1;
+	}
+
+	/* leave and unblock current working dir */
+	if(chdir("/")<0)
+	{
+		logp("error changing working dir\n");
+		return -1;
+	}
+
+	/* close std* */
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+
+	return 0;
+}
+
 static int run_script_select(FILE **sout, FILE **serr, struct cntr *cntr, int logfunc)
 {
 	int mfd=-1;
@@ -1036,7 +1238,10 @@ int run_script(const char *script, struct strlist **userargs, int userargc, cons
 char *comp_level(struct config *conf)
 {
 	static char comp[8]="";
-	snprintf(comp, sizeof(comp), "wb%d", conf->compression);
+	// Levels above the gzip ones are for the other algorithms.
+	snprintf(comp, sizeof(comp), "wb%d",
+		conf->compression>ZC_GZIP_MAX_LEVEL?
+			ZC_GZIP_MAX_LEVEL:conf->compression);
 	return comp;
 }
 
@@ -1175,10 +1380,27 @@ int dpth_is_compressed(int compressed, const char *datapath)
 
 	/* Legacy - if the compressed value is -1 - that is, it is not set in
 	   the manifest, deduce the value from the datapath. */
-	if((dp=strrchr(datapath, '.')) && !strcmp(dp, ".gz")) return 1;
+	if((dp=strrchr(datapath, '.'))
+	  && (!strcmp(dp, ".gz") || !strcmp(dp, ".zst") || !strcmp(dp, ".lz4")))
+		return 1;
 	return 0;
 }
 
+int dpth_compression_algorithm(int compressed, const char *datapath)
+{
+	const char *dp=NULL;
+
+	if(compressed>0) return zcodec_alg(compressed);
+
+	// As above, for when it is not set in the manifest.
+	if((dp=strrchr(datapath, '.')))
+	{
+		if(!strcmp(dp, ".zst")) return ZC_ZSTD;
+		if(!strcmp(dp, ".lz4")) return ZC_LZ4;
+	}
+	return ZC_GZIP;
+}
+
 void cmd_to_text(char cmd, char *buf, size_t len)
 {
 	switch(cmd)
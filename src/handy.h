@@ -7,6 +7,8 @@
 #include <zlib.h>
 
 #include "bfile.h"
+#include "zcodec.h"
+#include "fileread.h"
 
 extern void close_fd(int *fd);
 extern int close_fp(FILE **fp);
@@ -17,6 +19,48 @@ extern int build_path(const char *datadir, const char *fname, size_t flen, char
 
 extern int open_file_for_send(BFILE *bfd, FILE **fp, const char *fname, int64_t winattr, struct cntr *cntr);
 extern int close_file_for_send(BFILE *bfd, FILE **fp);
+// The state of sending the data of one file, a chunk at a time.
+struct filesend
+{
+	int gz; // compressing and/or encrypting
+	const char *datapth;
+	int quick_read;
+	unsigned long long *bytes;
+	struct cntr *cntr;
+	int compression;
+	BFILE *bfd;
+	FILE *fp;
+	struct fileread *fr; // hints for reading fp, or NULL
+	const char *metadata;
+	size_t metalen;
+	EVP_CIPHER_CTX *enc_ctx;
+	struct zstrm strm;
+	int zinit;
+	int zret;
+	MD5_CTX md5;
+	unsigned char *in;
+	unsigned char *out;
+	unsigned char *eoutbuf;
+	size_t zchunk;
+	// Big files are deflated a block at a time on the compression pool.
+	int pipelined;
+	struct zblock *zhead; // the oldest block that has not been sent yet
+	struct zblock *ztail;
+	int zqueued;
+	int zeof;
+	int zsent; // blocks sent
+	unsigned long zcrc;
+	unsigned long zisize;
+	unsigned char *zdict; // the end of the last block read
+	size_t zdictlen;
+	size_t outlen; // what is waiting in out to be sent
+};
+
+extern int filesend_init(struct filesend *fs, int gz, const char *datapth, int quick_read, unsigned long long *bytes, const char *encpassword, struct cntr *cntr, int compression, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen);
+// Sends the next chunk. Returns 0 if there is more to send, 1 once the end
+// of the file has been sent, or -1 on error.
+extern int filesend_step(struct filesend *fs);
+extern void filesend_free(struct filesend *fs);
 extern int send_whole_file_gz(const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, const char *encpassword, struct cntr *cntr, int compression, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen);
 extern int send_whole_file(char cmd, const char *fname, const char *datapth, int quick_read, unsigned long long *bytes, struct cntr *cntr, BFILE *bfd, FILE *fp, const char *extrameta, size_t elen);
 extern int set_non_blocking(int fd);
@@ -29,6 +73,7 @@ extern EVP_CIPHER_CTX *enc_setup(int encrypt, const char *encryption_password);
 extern void add_fd_to_sets(int fd, fd_set *read_set, fd_set *write_set, fd_set *err_set, int *max_fd);
 extern int init_client_socket(const char *host, const char *port);
 extern void reuseaddr(int fd);
+extern void nodelay(int fd);
 extern void write_status(const char *client, char phase, const char *path, struct cntr *p1cntr, struct cntr *cntr);
 extern int run_script(const char *script, struct strlist **userargs, int userargc, const char *arg1, const char *arg2, const char *arg3, const char *arg4, const char *arg5, const char *arg6, const char *arg7, const char *arg8, const char *arg9, const char *arg10, struct cntr *cntr, int do_wait, int logfunc);
 extern char *comp_level(struct config *conf);
@@ -36,8 +81,10 @@ extern int chuser_and_or_chgrp(const char *user, const char *group);
 extern const char *getdatestr(time_t t);
 extern const char *time_taken(time_t d);
 extern int dpth_is_compressed(int compressed, const char *datapath);
+extern int dpth_compression_algorithm(int compressed, const char *datapath);
 #ifndef HAVE_WIN32
 extern void setup_signal(int sig, void handler(int sig));
+extern int daemonise(void);
 #endif
 extern void cmd_to_text(char cmd, char *buf, size_t len);
 extern void print_all_cmds(void);
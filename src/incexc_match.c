@@ -0,0 +1,441 @@
+#include "burp.h"
+#include "log.h"
+#include "conf.h"
+#include "strlist.h"
+#include "regexp.h"
+#include "incexc_match.h"
+
+#include <ctype.h>
+
+// With fewer rules than this, going through the list is quicker than looking
+// up every directory in the path.
+#define MIN_DIR_TABLE	16
+
+// Joining fewer patterns than this is slower than running them one by one.
+#define MIN_REGEX_JOIN	3
+
+struct dirrule
+{
+	const char *path; // in the list, or NULL for an empty slot
+	size_t len;
+	int index; // position in the list, which decides between equal matches
+	int depth; // 1 plus the number of slashes in path
+	int flag;
+};
+
+struct extset
+{
+	char **slots; // lower case, NULL for an empty slot
+	size_t mask;
+	int count;
+	int window; // how far back from the end of a path to look for a '.'
+};
+
+struct incexc_match
+{
+	struct strlist **ielist; // if there are too few rules for the table
+	int iecount;
+	struct dirrule *rules;
+	size_t rmask;
+	struct strlist **includes; // the include directories, sorted
+	int incount;
+	size_t rmaxlen;
+	struct extset incext;
+	struct extset excext;
+	regex_t *excreg; // all the patterns that could be joined together
+	struct strlist **excreg_rest; // ones that could not
+	int ercount_rest;
+	int excreg_all; // an empty pattern, which matches everything
+};
+
+#define FNV_OFFSET	14695981039346656037ULL
+#define FNV_PRIME	1099511628211ULL
+
+static uint64_t hash_byte(uint64_t h, unsigned char c)
+{
+	return (h^c)*FNV_PRIME;
+}
+
+static uint64_t hash_lower(const char *s, size_t len)
+{
+	size_t i=0;
+	uint64_t h=FNV_OFFSET;
+	for(i=0; i<len; i++) h=hash_byte(h, tolower((unsigned char)s[i]));
+	return h;
+}
+
+// A power of two with room for count items at no more than half full.
+static size_t table_size(int count)
+{
+	size_t size=16;
+	while(size<(size_t)count*2) size<<=1;
+	return size;
+}
+
+static void add_rule(struct incexc_match *m, const char *path, int index, int flag)
+{
+	const char *cp=NULL;
+	size_t len=strlen(path);
+	uint64_t h=FNV_OFFSET;
+	struct dirrule *r=NULL;
+
+	for(cp=path; *cp; cp++) h=hash_byte(h, (unsigned char)*cp);
+	for(r=&(m->rules[h&m->rmask]); r->path;
+		r=&(m->rules[(r-m->rules+1)&m->rmask]))
+	{
+		// The same path again, so the first one wins, like it does when
+		// the list is checked in order.
+		if(r->len==len && !memcmp(r->path, path, len)) return;
+	}
+	r->path=path;
+	r->len=len;
+	r->index=index;
+	r->flag=flag;
+	r->depth=1;
+	for(cp=path; *cp; cp++) if(*cp=='/') r->depth++;
+	if(len>m->rmaxlen) m->rmaxlen=len;
+}
+
+static struct dirrule *find_rule(struct incexc_match *m, uint64_t h, const char *path, size_t len)
+{
+	struct dirrule *r=NULL;
+	for(r=&(m->rules[h&m->rmask]); r->path;
+		r=&(m->rules[(r-m->rules+1)&m->rmask]))
+	{
+		if(r->len==len && !memcmp(r->path, path, len)) return r;
+	}
+	return NULL;
+}
+
+static int extset_build(struct extset *e, struct strlist **list, int count)
+{
+	int i=0;
+	size_t j=0;
+	e->count=count;
+	if(!count) return 0;
+	e->mask=table_size(count)-1;
+	if(!(e->slots=(char **)calloc(e->mask+1, sizeof(char *))))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	for(i=0; i<count; i++)
+	{
+		char *ext=NULL;
+		size_t len=strlen(list[i]->path);
+		if((int)len+1>e->window) e->window=len+1;
+		if(!(ext=strdup(list[i]->path)))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		for(j=0; j<len; j++) ext[j]=tolower((unsigned char)ext[j]);
+		for(j=hash_lower(ext, len)&e->mask; e->slots[j];
+			j=(j+1)&e->mask)
+				if(!strcmp(e->slots[j], ext)) break;
+		if(e->slots[j]) free(ext);
+		else e->slots[j]=ext;
+	}
+	return 0;
+}
+
+static int extset_has(struct extset *e, const char *ext, size_t len)
+{
+	size_t j=0;
+	for(j=hash_lower(ext, len)&e->mask; e->slots[j]; j=(j+1)&e->mask)
+	{
+		if(strlen(e->slots[j])==len
+		  && !strncasecmp(e->slots[j], ext, len))
+			return 1;
+	}
+	return 0;
+}
+
+static void extset_free(struct extset *e)
+{
+	size_t j=0;
+	if(!e->slots) return;
+	for(j=0; j<=e->mask; j++) if(e->slots[j]) free(e->slots[j]);
+	free(e->slots);
+	e->slots=NULL;
+}
+
+// The extension of fname, if there is a '.' near enough to the end.
+static const char *find_ext(const char *fname, size_t flen, int window)
+{
+	int i=0;
+	const char *cp=NULL;
+	for(cp=fname+flen-1; i<window && cp>=fname; cp--, i++)
+		if(*cp=='.') return cp+1;
+	return NULL;
+}
+
+// Whether a pattern can go inside brackets in an alternation without
+// changing what it means. The groups have to balance, and back references
+// would be numbered differently.
+static int can_join(const char *re)
+{
+	int depth=0;
+	const char *p=NULL;
+	for(p=re; *p; p++)
+	{
+		if(*p=='\\')
+		{
+			if(!p[1] || isdigit((unsigned char)p[1])) return 0;
+			p++;
+		}
+		else if(*p=='[')
+		{
+			p++;
+			if(*p=='^') p++;
+			if(*p==']') p++;
+			while(*p && *p!=']')
+			{
+				if(*p=='[' && (p[1]==':' || p[1]=='.' || p[1]=='='))
+				{
+					char c=p[1];
+					for(p+=2; *p && !(*p==c && p[1]==']'); p++) { }
+					if(!*p) return 0;
+					p++;
+				}
+				p++;
+			}
+			if(!*p) return 0;
+		}
+		else if(*p=='(') depth++;
+		else if(*p==')' && --depth<0) return 0;
+	}
+	return !depth;
+}
+
+static int join_regex(struct incexc_match *m, struct strlist **excreg, int ercount)
+{
+	int i=0;
+	int joined=0;
+	size_t len=0;
+	char *str=NULL;
+
+	for(i=0; i<ercount; i++)
+	{
+		if(!excreg[i]->re)
+		{
+			m->excreg_all=1;
+			return 0;
+		}
+		if(can_join(excreg[i]->path)) len+=strlen(excreg[i]->path)+3;
+	}
+	if(!len) len=1;
+	if(!(str=(char *)malloc(len))
+	  || !(m->excreg_rest=(struct strlist **)
+		malloc(ercount*sizeof(struct strlist *))))
+	{
+		logp("out of memory\n");
+		if(str) free(str);
+		return -1;
+	}
+	*str='\0';
+	for(i=0; i<ercount; i++)
+	{
+		if(!can_join(excreg[i]->path))
+		{
+			m->excreg_rest[m->ercount_rest++]=excreg[i];
+			continue;
+		}
+		if(joined++) strcat(str, "|");
+		strcat(str, "(");
+		strcat(str, excreg[i]->path);
+		strcat(str, ")");
+	}
+	if(joined>=MIN_REGEX_JOIN && compile_regex(&(m->excreg), str))
+	{
+		if(m->excreg) free(m->excreg);
+		m->excreg=NULL;
+	}
+	if(!m->excreg)
+	{
+		m->ercount_rest=0;
+		for(i=0; i<ercount; i++)
+			m->excreg_rest[m->ercount_rest++]=excreg[i];
+	}
+	free(str);
+	return 0;
+}
+
+int incexc_match_compile(struct incexc_match **m,
+	struct strlist **ielist, int iecount,
+	struct strlist **incext, int incount,
+	struct strlist **excext, int excount,
+	struct strlist **excreg, int ercount)
+{
+	int i=0;
+	incexc_match_free(m);
+	if(!(*m=(struct incexc_match *)calloc(1, sizeof(struct incexc_match))))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	if(iecount<MIN_DIR_TABLE)
+	{
+		(*m)->ielist=ielist;
+		(*m)->iecount=iecount;
+	}
+	else
+	{
+		if(!((*m)->rules=(struct dirrule *)
+			calloc(table_size(iecount), sizeof(struct dirrule))))
+		{
+			logp("out of memory\n");
+			goto error;
+		}
+		(*m)->rmask=table_size(iecount)-1;
+		for(i=0; i<iecount; i++)
+			add_rule(*m, ielist[i]->path, i, ielist[i]->flag);
+	}
+	if(iecount && !((*m)->includes=(struct strlist **)
+		malloc(iecount*sizeof(struct strlist *))))
+	{
+		logp("out of memory\n");
+		goto error;
+	}
+	for(i=0; i<iecount; i++)
+		if(ielist[i]->flag)
+			(*m)->includes[(*m)->incount++]=ielist[i];
+	if((*m)->incount) qsort((*m)->includes, (*m)->incount,
+		sizeof(struct strlist *),
+		(int (*)(const void *, const void *))strlist_sort);
+	if(extset_build(&((*m)->incext), incext, incount)
+	  || extset_build(&((*m)->excext), excext, excount)
+	  || join_regex(*m, excreg, ercount))
+		goto error;
+	return 0;
+error:
+	incexc_match_free(m);
+	return -1;
+}
+
+int incexc_match_incext(struct incexc_match *m, const char *fname)
+{
+	const char *ext=NULL;
+	size_t flen=0;
+	// If not doing include_ext, let the file get backed up.
+	if(!m->incext.count) return 1;
+	flen=strlen(fname);
+	// If file has no extension, it cannot be included.
+	if(!(ext=find_ext(fname, flen, m->incext.window))) return 0;
+	return extset_has(&(m->incext), ext, fname+flen-ext);
+}
+
+static int excluded(struct incexc_match *m, const char *fname, size_t flen)
+{
+	int i=0;
+	const char *ext=NULL;
+	if(m->excext.count
+	  && (ext=find_ext(fname, flen, m->excext.window))
+	  && extset_has(&(m->excext), ext, fname+flen-ext))
+		return 1;
+	if(m->excreg_all) return 1;
+	if(m->excreg && check_regex(m->excreg, fname)) return 1;
+	for(i=0; i<m->ercount_rest; i++)
+		if(check_regex(m->excreg_rest[i]->re, fname)) return 1;
+	return 0;
+}
+
+// Keeps the rule that is_subdir() would have said was the deepest match,
+// and the earliest of those.
+static void better(struct dirrule **best, int *bestdepth, struct dirrule *r, int extra)
+{
+	int depth=0;
+	if(!r) return;
+	depth=r->depth+extra;
+	if(depth<*bestdepth) return;
+	if(depth==*bestdepth && (*best)->index<r->index) return;
+	*best=r;
+	*bestdepth=depth;
+}
+
+static int dir_flag_from_list(struct incexc_match *m, const char *fname)
+{
+	int i=0;
+	int longest=0;
+	int matching=0;
+	int best=-1;
+	for(i=0; i<m->iecount; i++)
+	{
+		matching=is_subdir(m->ielist[i]->path, fname);
+		if(matching>longest)
+		{
+			longest=matching;
+			best=i;
+		}
+	}
+	if(best<0) return 0;
+	return m->ielist[best]->flag;
+}
+
+static int dir_flag_from_table(struct incexc_match *m, const char *fname, size_t flen)
+{
+	size_t i=0;
+	int bestdepth=0;
+	uint64_t h=FNV_OFFSET;
+	struct dirrule *best=NULL;
+
+	// A rule matches the whole of fname, or the part before a slash. If
+	// the rule itself ends with a slash, it also matches up to and
+	// including a slash that has more of the path after it, but without
+	// counting the extra level, which is how is_subdir() sees it.
+	for(i=0; i<=flen && i<=m->rmaxlen; i++)
+	{
+		if(i==flen || fname[i]=='/')
+			better(&best, &bestdepth,
+				find_rule(m, h, fname, i), 1);
+		if(i==flen) break;
+		h=hash_byte(h, (unsigned char)fname[i]);
+		if(fname[i]=='/' && fname[i+1] && fname[i+1]!='/')
+			better(&best, &bestdepth,
+				find_rule(m, h, fname, i+1), 0);
+	}
+	return best?best->flag:0;
+}
+
+int incexc_match_no_incext(struct incexc_match *m, const char *fname)
+{
+	size_t flen=strlen(fname);
+	if(excluded(m, fname, flen)) return 0;
+	if(m->rules) return dir_flag_from_table(m, fname, flen);
+	return dir_flag_from_list(m, fname);
+}
+
+int incexc_match_includes_below(struct incexc_match *m, const char *path, struct strlist ***list)
+{
+	int n=0;
+	int lo=0;
+	int hi=m->incount;
+	// Sorted with pathcmp, the path comes before everything under it, and
+	// those all come before anything else that starts the same way.
+	while(lo<hi)
+	{
+		int mid=lo+(hi-lo)/2;
+		if(pathcmp(m->includes[mid]->path, path)<0) lo=mid+1;
+		else hi=mid;
+	}
+	while(lo+n<m->incount && is_subdir(path, m->includes[lo+n]->path)) n++;
+	*list=m->includes+lo;
+	return n;
+}
+
+void incexc_match_free(struct incexc_match **m)
+{
+	if(!m || !*m) return;
+	if((*m)->rules) free((*m)->rules);
+	if((*m)->includes) free((*m)->includes);
+	extset_free(&((*m)->incext));
+	extset_free(&((*m)->excext));
+	if((*m)->excreg)
+	{
+		regfree((*m)->excreg);
+		free((*m)->excreg);
+	}
+	if((*m)->excreg_rest) free((*m)->excreg_rest);
+	free(*m);
+	*m=NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef _INCEXC_MATCH_H
+#define _INCEXC_MATCH_H
+
+/* The include/exclude rules that the scan checks every path against,
+   compiled once when the config is loaded. Long lists of directories go in
+   a hash table, so that a path is checked by looking up each of its leading
+   directories, rather than by comparing it with every rule. The extensions
+   go in hash sets, and the exclude_regex patterns are joined into one
+   alternation, so that each path only goes through the regex engine once.
+   The answers are the same as checking the lists one item at a time. */
+
+struct incexc_match;
+
+extern int incexc_match_compile(struct incexc_match **m,
+	struct strlist **ielist, int iecount,
+	struct strlist **incext, int incount,
+	struct strlist **excext, int excount,
+	struct strlist **excreg, int ercount);
+// Return 1 to include the file, 0 to exclude it.
+extern int incexc_match_incext(struct incexc_match *m, const char *fname);
+// The flag of the include/exclude directory that fname is deepest inside,
+// or 0 if it is excluded by extension or regex, or not inside any of them.
+extern int incexc_match_no_incext(struct incexc_match *m, const char *fname);
+// For a path that is excluded, whether anything under it is included after
+// all. Sets list to the include directories that are path or under it, in
+// pathcmp order, and returns how many there are. With none, the scan does
+// not need to go anywhere near path.
+extern int incexc_match_includes_below(struct incexc_match *m, const char *path, struct strlist ***list);
+extern void incexc_match_free(struct incexc_match **m);
+
+#endif
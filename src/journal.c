@@ -0,0 +1,574 @@
+#include "burp.h"
+#include "prog.h"
+#include "msg.h"
+#include "handy.h"
+#include "lock.h"
+#include "asyncio.h"
+#include "journal.h"
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+/* The journal is made of burp messages. It starts with its id, followed by
+   the paths of directories that have changed, each ending with a slash. If
+   the watcher has to start again, it adds JOURNAL_RESTART first, so that
+   backups that read the journal before it gets truncated do not trust it. */
+#define JOURNAL_ID	'J'
+#define JOURNAL_DIR	'D'
+#define JOURNAL_RESTART	'O'
+
+static char *get_lockpath(const char *path)
+{
+	return prepend(path, ".lock", strlen(".lock"), NULL);
+}
+
+/* Reading side, for the scan cache. */
+
+static char **changed=NULL;
+static int ccount=0;
+static int calloced=0;
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static int add_changed(char *path)
+{
+	if(ccount>=calloced)
+	{
+		char **tmp=NULL;
+		int a=calloced?calloced*2:256;
+		if(!(tmp=(char **)realloc(changed, a*sizeof(char *))))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		changed=tmp;
+		calloced=a;
+	}
+	changed[ccount++]=path;
+	return 0;
+}
+
+void journal_free(void)
+{
+	int i=0;
+	for(i=0; i<ccount; i++) free(changed[i]);
+	if(changed) free(changed);
+	changed=NULL;
+	ccount=0;
+	calloced=0;
+}
+
+int journal_read(const char *path, const char *lastid, unsigned long long lastoff, char **id, unsigned long long *endoff)
+{
+	int usable=0;
+	char cmd='\0';
+	FILE *fp=NULL;
+	char *buf=NULL;
+	size_t len=0;
+	char *lockpath=NULL;
+	unsigned long long pos=0;
+
+	*id=NULL;
+	*endoff=0;
+	journal_free();
+
+	if(!(fp=fopen(path, "rb")))
+	{
+		logp("could not open change journal %s: %s\n",
+			path, strerror(errno));
+		return 1;
+	}
+	// The watcher may be starting it again.
+	if(async_read_fp(fp, NULL, &cmd, &buf, &len) || cmd!=JOURNAL_ID)
+	{
+		logp("change journal %s is not ready\n", path);
+		goto end;
+	}
+	*id=buf;
+	buf=NULL;
+	pos=5+len+1;
+	*endoff=pos;
+
+	// If the watcher has gone away, changes since then are missing.
+	if(!(lockpath=get_lockpath(path))) goto end;
+	if(!test_lock(lockpath))
+		logp("Nothing is watching for changes to go in %s\n", path);
+	else if(lastid && !strcmp(lastid, *id) && lastoff>=pos)
+		usable=1;
+
+	// The last message may still be being written, so stop at the last
+	// complete one.
+	while(!async_read_fp(fp, NULL, &cmd, &buf, &len))
+	{
+		if(usable && pos>=lastoff)
+		{
+			if(cmd!=JOURNAL_DIR || add_changed(buf)) usable=0;
+			else buf=NULL;
+		}
+		pos+=5+len+1;
+		*endoff=pos;
+		if(buf) { free(buf); buf=NULL; }
+	}
+	if(lastoff>*endoff) usable=0;
+	if(usable && changed)
+		qsort(changed, ccount, sizeof(char *), cmp_path);
+end:
+	if(buf) free(buf);
+	if(lockpath) free(lockpath);
+	fclose(fp);
+	if(!usable) journal_free();
+	return usable?0:1;
+}
+
+int journal_changed(const char *path)
+{
+	if(!changed) return 0;
+	return bsearch(&path, changed, ccount, sizeof(char *), cmp_path)!=NULL;
+}
+
+/* The watcher. */
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define WATCH_MASK	(IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE \
+			|IN_DELETE_SELF|IN_MODIFY|IN_MOVE_SELF|IN_MOVED_FROM \
+			|IN_MOVED_TO|IN_DONT_FOLLOW|IN_ONLYDIR)
+
+// Changes are collected for this long before being written out, so that a
+// file that is being written to all the time does not fill the journal.
+#define FLUSH_SECS		1
+// How often to look for include paths that do not exist yet.
+#define MISSING_SECS		10
+// The journal is started again when it gets this big.
+#define MAX_JOURNAL_SIZE	(64*1024*1024)
+#define EVENT_BUF_LEN		(64*1024)
+
+static int ifd=-1;
+static FILE *jfp=NULL;
+static int generation=0;
+static int watches=0;
+
+// The directory of each watch, ending with a slash.
+static char **wdpaths=NULL;
+static int wdalloc=0;
+
+// Directories that have changed since the last write to the journal.
+static char **pending=NULL;
+static int pcount=0;
+static int palloc=0;
+static time_t pending_since=0;
+
+// Changes to these are ours, and would otherwise keep their directory in
+// the journal for ever.
+static const char *own_files[4];
+
+static char *child_path(const char *dir, const char *name)
+{
+	if(dir[strlen(dir)-1]=='/')
+		return prepend(dir, name, strlen(name), NULL);
+	return prepend_s(dir, name, strlen(name));
+}
+
+static int is_own_file(const char *path)
+{
+	int i=0;
+	for(i=0; i<(int)(sizeof(own_files)/sizeof(*own_files)); i++)
+		if(own_files[i] && !strcmp(own_files[i], path)) return 1;
+	return 0;
+}
+
+static int mark_changed(const char *dpath)
+{
+	if(pcount>=palloc)
+	{
+		char **tmp=NULL;
+		int a=palloc?palloc*2:64;
+		if(!(tmp=(char **)realloc(pending, a*sizeof(char *))))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		pending=tmp;
+		palloc=a;
+	}
+	if(!(pending[pcount]=strdup(dpath)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	if(!pcount++) pending_since=time(NULL);
+	return 0;
+}
+
+static int flush_pending(void)
+{
+	int i=0;
+	int ret=0;
+	qsort(pending, pcount, sizeof(char *), cmp_path);
+	for(i=0; i<pcount; i++)
+	{
+		if(!ret && (!i || strcmp(pending[i], pending[i-1])))
+			ret=send_msg_fp(jfp, JOURNAL_DIR,
+				pending[i], strlen(pending[i]));
+	}
+	for(i=0; i<pcount; i++) free(pending[i]);
+	pcount=0;
+	if(!ret && fflush(jfp))
+	{
+		logp("could not write change journal: %s\n", strerror(errno));
+		ret=-1;
+	}
+	return ret;
+}
+
+static int set_wdpath(int wd, char *dpath)
+{
+	if(wd>=wdalloc)
+	{
+		char **tmp=NULL;
+		int a=wdalloc?wdalloc:1024;
+		while(a<=wd) a*=2;
+		if(!(tmp=(char **)realloc(wdpaths, a*sizeof(char *))))
+		{
+			logp("out of memory\n");
+			free(dpath);
+			return -1;
+		}
+		memset(tmp+wdalloc, 0, (a-wdalloc)*sizeof(char *));
+		wdpaths=tmp;
+		wdalloc=a;
+	}
+	// The same directory may be watched twice, through a bind mount.
+	if(wdpaths[wd]) free(wdpaths[wd]);
+	else watches++;
+	wdpaths[wd]=dpath;
+	return 0;
+}
+
+// Watches a directory and everything under it that the scan would go into.
+// If mark is set, they all go into the journal too, because they are new.
+static int add_watches(struct config *conf, const char *path, dev_t dev, int mark)
+{
+	int wd=-1;
+	int ret=0;
+	DIR *dir=NULL;
+	char *dpath=NULL;
+	struct dirent *d=NULL;
+	struct stat statp;
+
+	if(lstat(path, &statp) || !S_ISDIR(statp.st_mode)) return 0;
+	if(dev!=(dev_t)-1 && statp.st_dev!=dev
+	  && !conf->cross_all_filesystems && !conf->fscount)
+		return 0;
+	if(!file_is_included_no_incext(conf, path))
+			return 0;
+
+	if(path[strlen(path)-1]=='/') dpath=strdup(path);
+	else dpath=prepend(path, "/", 1, NULL);
+	if(!dpath)
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	if((wd=inotify_add_watch(ifd, path, WATCH_MASK))<0)
+	{
+		free(dpath);
+		// Gone already, or unreadable, in which case the scan will
+		// not be able to read it either.
+		if(errno==ENOENT || errno==EACCES) return 0;
+		if(errno==ENOSPC)
+			logp("Out of inotify watches at %s - raise fs.inotify.max_user_watches\n", path);
+		else
+			logp("could not watch %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(mark && mark_changed(dpath))
+	{
+		free(dpath);
+		return -1;
+	}
+	if(set_wdpath(wd, dpath)) return -1;
+
+	if(!(dir=opendir(path))) return 0;
+	while((d=readdir(dir)))
+	{
+		char *sub=NULL;
+		if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if(d->d_type!=DT_DIR && d->d_type!=DT_UNKNOWN) continue;
+		if(!(sub=child_path(path, d->d_name)))
+		{
+			ret=-1;
+			break;
+		}
+		ret=add_watches(conf, sub, statp.st_dev, mark);
+		free(sub);
+		if(ret) break;
+	}
+	closedir(dir);
+	return ret;
+}
+
+// Returns 0 to carry on, 1 if the watches have to be set up again, or -1 on
+// error.
+static int handle_event(struct config *conf, struct inotify_event *ev)
+{
+	int ret=0;
+	char *path=NULL;
+	const char *dir=NULL;
+
+	if(ev->mask & IN_Q_OVERFLOW)
+	{
+		logp("Too many changes at once for inotify\n");
+		return 1;
+	}
+	if(ev->wd<0 || ev->wd>=wdalloc || !(dir=wdpaths[ev->wd])) return 0;
+	if(ev->mask & IN_IGNORED)
+	{
+		free(wdpaths[ev->wd]);
+		wdpaths[ev->wd]=NULL;
+		watches--;
+		return 0;
+	}
+	// A directory that has been renamed takes its watches with it, and
+	// the paths that they are for are now wrong.
+	if((ev->mask & IN_MOVE_SELF)
+	  || ((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM)))
+	{
+		logp("%s has been moved\n", dir);
+		return 1;
+	}
+	if(ev->len)
+	{
+		if(!(path=prepend(dir, ev->name, strlen(ev->name), NULL)))
+			return -1;
+		if(is_own_file(path))
+		{
+			free(path);
+			return 0;
+		}
+		if((ev->mask & IN_ISDIR)
+		  && (ev->mask & (IN_CREATE|IN_MOVED_TO)))
+			ret=add_watches(conf, path, (dev_t)-1, 1);
+		free(path);
+		if(ret) return ret;
+	}
+	return mark_changed(dir);
+}
+
+static int read_events(struct config *conf, char *buf)
+{
+	ssize_t l=0;
+	char *cp=NULL;
+	if((l=read(ifd, buf, EVENT_BUF_LEN))<0)
+	{
+		if(errno==EAGAIN || errno==EINTR) return 0;
+		logp("could not read inotify events: %s\n", strerror(errno));
+		return -1;
+	}
+	for(cp=buf; cp<buf+l; )
+	{
+		int r=0;
+		struct inotify_event *ev=(struct inotify_event *)cp;
+		if((r=handle_event(conf, ev))) return r;
+		cp+=sizeof(struct inotify_event)+ev->len;
+	}
+	return 0;
+}
+
+// Whether any include path that did not exist when the watches were set up
+// has turned up since.
+static int missing_appeared(struct config *conf)
+{
+	int i=0;
+	struct stat statp;
+	for(i=0; i<conf->iecount; i++)
+		if(conf->incexcdir[i]->flag
+		  && !lstat(conf->incexcdir[i]->path, &statp))
+			return 1;
+	return 0;
+}
+
+static void free_watches(void)
+{
+	int i=0;
+	if(ifd>=0) { close(ifd); ifd=-1; }
+	for(i=0; i<wdalloc; i++) if(wdpaths[i]) free(wdpaths[i]);
+	if(wdpaths) free(wdpaths);
+	wdpaths=NULL;
+	wdalloc=0;
+	watches=0;
+	for(i=0; i<pcount; i++) free(pending[i]);
+	if(pending) free(pending);
+	pending=NULL;
+	pcount=0;
+	palloc=0;
+}
+
+// Returns 0 if the watches have to be set up again, or -1 on error.
+static int watch(struct config *conf)
+{
+	int i=0;
+	int ret=-1;
+	int mfd=-1;
+	int missing=0;
+	char id[64]="";
+	char *buf=NULL;
+	time_t last_missing=time(NULL);
+
+	if((ifd=inotify_init())<0)
+	{
+		logp("could not start inotify: %s\n", strerror(errno));
+		goto end;
+	}
+	fcntl(ifd, F_SETFD, FD_CLOEXEC);
+	for(i=0; i<conf->iecount; i++)
+	{
+		struct stat statp;
+		if(!conf->incexcdir[i]->flag) continue;
+		if(lstat(conf->incexcdir[i]->path, &statp))
+		{
+			missing++;
+			continue;
+		}
+		if(add_watches(conf, conf->incexcdir[i]->path, (dev_t)-1, 0))
+			goto end;
+	}
+
+	// Started after the watches, so that there is no gap between them.
+	snprintf(id, sizeof(id), "%d.%ld.%d",
+		(int)getpid(), (long)time(NULL), generation++);
+	if(!(jfp=fopen(conf->change_journal, "wb")))
+	{
+		logp("could not open %s: %s\n",
+			conf->change_journal, strerror(errno));
+		goto end;
+	}
+	if(send_msg_fp(jfp, JOURNAL_ID, id, strlen(id)) || fflush(jfp))
+		goto end;
+	logp("Watching %d directories for changes\n", watches);
+
+	// Mounts that come and go underneath the include paths do not show
+	// up in inotify.
+	mfd=open("/proc/self/mounts", O_RDONLY);
+
+	if(!(buf=(char *)malloc(EVENT_BUF_LEN)))
+	{
+		logp("out of memory\n");
+		goto end;
+	}
+	while(1)
+	{
+		int r=0;
+		int timeout=-1;
+		struct pollfd pfd[2];
+
+		if(missing) timeout=MISSING_SECS*1000;
+		if(pcount) timeout=FLUSH_SECS*1000;
+		pfd[0].fd=ifd;
+		pfd[0].events=POLLIN;
+		pfd[0].revents=0;
+		pfd[1].fd=mfd;
+		pfd[1].events=POLLPRI;
+		pfd[1].revents=0;
+		if(poll(pfd, 2, timeout)<0)
+		{
+			if(errno==EINTR) continue;
+			logp("poll error: %s\n", strerror(errno));
+			goto end;
+		}
+		if(pfd[1].revents & (POLLPRI|POLLERR))
+		{
+			logp("Mounts have changed\n");
+			ret=0;
+			goto end;
+		}
+		if((pfd[0].revents & POLLIN) && (r=read_events(conf, buf)))
+		{
+			if(r>0) ret=0;
+			goto end;
+		}
+		if(pcount && time(NULL)-pending_since>=FLUSH_SECS
+		  && flush_pending())
+			goto end;
+		if(missing && time(NULL)-last_missing>=MISSING_SECS)
+		{
+			if(missing_appeared(conf))
+			{
+				logp("An include path has turned up\n");
+				ret=0;
+				goto end;
+			}
+			last_missing=time(NULL);
+		}
+		if(ftello(jfp)>MAX_JOURNAL_SIZE)
+		{
+			ret=0;
+			goto end;
+		}
+	}
+end:
+	if(jfp)
+	{
+		// The changes collected so far are good, but nothing after
+		// them can be trusted.
+		if(pcount) flush_pending();
+		send_msg_fp(jfp, JOURNAL_RESTART, "", 0);
+		fclose(jfp);
+		jfp=NULL;
+	}
+	if(mfd>=0) close(mfd);
+	if(buf) free(buf);
+	free_watches();
+	return ret;
+}
+
+int journal_watch(struct config *conf)
+{
+	int ret=1;
+	char *lockpath=NULL;
+	char *cachetmp=NULL;
+
+	if(!conf->change_journal)
+	{
+		logp("change_journal is not set\n");
+		return 1;
+	}
+	if(!(lockpath=get_lockpath(conf->change_journal))
+	  || (conf->scan_cache
+		&& !(cachetmp=get_tmp_filename(conf->scan_cache))))
+			goto end;
+	own_files[0]=conf->change_journal;
+	own_files[1]=lockpath;
+	own_files[2]=conf->scan_cache;
+	own_files[3]=cachetmp;
+
+	if(conf->daemon && daemonise()) goto end;
+	if(get_lock(lockpath))
+	{
+		logp("Could not get lockfile %s.\n", lockpath);
+		logp("Another watcher is probably running.\n");
+		goto end;
+	}
+	while(!watch(conf))
+		logp("Starting the change journal again\n");
+	unlink(lockpath);
+end:
+	if(lockpath) free(lockpath);
+	if(cachetmp) free(cachetmp);
+	return ret;
+}
+
+#else
+
+int journal_watch(struct config *conf)
+{
+	logp("Watching for changes is not supported on this platform\n");
+	return 1;
+}
+
+#endif
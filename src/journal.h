@@ -0,0 +1,28 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+/* A change journal, for clients that are always up. 'burp -a w' watches
+   everything that gets backed up with inotify, and appends to the journal
+   each directory in which something changes. Each time that it starts, it
+   begins the journal with a new id, so a backup can tell whether it has
+   been watching continuously since the last one.
+
+   With the scan cache, a backup then only reads the directories in the
+   journal. Everything else is sent from the cache without even doing lstat
+   on it. */
+
+// Runs the watcher. Only returns on error.
+extern int journal_watch(struct config *conf);
+
+// Reads the directories that have changed since offset lastoff in the
+// journal with id lastid. Returns 0 if they can be used, or 1 if the
+// journal does not cover the whole time since then. Either way, id and
+// endoff are set to where the journal is now, for next time, with id set
+// to NULL if there is no journal.
+extern int journal_read(const char *path, const char *lastid, unsigned long long lastoff, char **id, unsigned long long *endoff);
+// Whether a directory, with its path ending in a slash, is in what
+// journal_read() found.
+extern int journal_changed(const char *path);
+extern void journal_free(void);
+
+#endif
@@ -5,7 +5,7 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
@@ -70,10 +70,9 @@ static int do_write(BFILE *bfd, FILE *fp, unsigned char *out, size_t outlen, cha
 	return 0;
 }
 
-static int do_inflate(z_stream *zstrm, BFILE *bfd, FILE *fp, unsigned char *out, unsigned char *buftouse, size_t lentouse, char **metadata, const char *encpassword, int enccompressed, unsigned long long *sent)
+static int do_inflate(struct zstrm *zstrm, BFILE *bfd, FILE *fp, unsigned char *out, unsigned char *buftouse, size_t lentouse, char **metadata, const char *encpassword, int enccompressed, unsigned long long *sent)
 {
-	int zret=Z_OK;
-	unsigned have=0;
+	size_t have=0;
 
 	// Do not want to inflate encrypted data that was not compressed.
 	// Just write it straight out.
@@ -87,17 +86,7 @@ static int do_inflate(z_stream *zstrm, BFILE *bfd, FILE *fp, unsigned char *out,
 	{
 		zstrm->avail_out=ZCHUNK;
 		zstrm->next_out=out;
-		zret=inflate(zstrm, Z_NO_FLUSH);
-		switch(zret)
-		{
-			case Z_NEED_DICT:
-			  zret=Z_DATA_ERROR;
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-			  logp("zstrm inflate error: %d\n", zret);
-			  return -1;
-			  break;
-		}
+		if(zstrm_run(zstrm, 0)==ZS_ERROR) return -1;
 		have=ZCHUNK-zstrm->avail_out;
 		if(!have) continue;
 
@@ -189,10 +178,12 @@ int transfer_gzfile_in(struct sbuf *sb, const char *path, BFILE *bfd, FILE *fp,
 	int ret=-1;
 	unsigned char out[ZCHUNK];
 	size_t doutlen=0;
-	//unsigned char doutbuf[1000+EVP_MAX_BLOCK_LENGTH];
-	unsigned char doutbuf[ZCHUNK-EVP_MAX_BLOCK_LENGTH];
+	// Sized to the negotiated frame size, so kept between calls.
+	static unsigned char *doutbuf=NULL;
+	static size_t doutbuflen=0;
 
-	z_stream zstrm;
+	// The server says nothing of the algorithm - the data does.
+	struct zstrm zstrm;
 
 	EVP_CIPHER_CTX *enc_ctx=NULL;
 
@@ -213,22 +204,26 @@ int transfer_gzfile_in(struct sbuf *sb, const char *path, BFILE *bfd, FILE *fp,
 	//	return -1;
 	//}
 
-	zstrm.zalloc=Z_NULL;
-	zstrm.zfree=Z_NULL;
-	zstrm.opaque=Z_NULL;
-	zstrm.avail_in=0;
-	zstrm.next_in=Z_NULL;
+	zstrm_init_decompress(&zstrm);
 
-	if(inflateInit2(&zstrm, (15+16)))
-	{
-		logp("unable to init inflate\n");
+	if(encpassword && !(enc_ctx=enc_setup(0, encpassword)))
 		return -1;
-	}
 
-	if(encpassword && !(enc_ctx=enc_setup(0, encpassword)))
+	if(enc_ctx
+	  && doutbuflen<async_get_frame_size()+EVP_MAX_BLOCK_LENGTH)
 	{
-		inflateEnd(&zstrm);
-		return -1;
+		unsigned char *tmp=NULL;
+		size_t newlen=async_get_frame_size()+EVP_MAX_BLOCK_LENGTH;
+		if(!(tmp=(unsigned char *)realloc(doutbuf, newlen)))
+		{
+			logp("out of memory in transfer_gzfile_in\n");
+			EVP_CIPHER_CTX_cleanup(enc_ctx);
+			free(enc_ctx);
+			zstrm_end(&zstrm);
+			return -1;
+		}
+		doutbuf=tmp;
+		doutbuflen=newlen;
 	}
 
 	while(!quit)
@@ -240,7 +235,7 @@ int transfer_gzfile_in(struct sbuf *sb, const char *path, BFILE *bfd, FILE *fp,
 				EVP_CIPHER_CTX_cleanup(enc_ctx);
 				free(enc_ctx);
 			}
-			inflateEnd(&zstrm);
+			zstrm_end(&zstrm);
 			return -1;
 		}
 		(*rcvd)+=len;
@@ -282,6 +277,13 @@ int transfer_gzfile_in(struct sbuf *sb, const char *path, BFILE *bfd, FILE *fp,
 					  }
 					  else 
 */
+					  if(len+EVP_MAX_BLOCK_LENGTH>doutbuflen)
+					  {
+						logp("Encrypted frame too big: %d\n",
+							len);
+						quit++; ret=-1;
+						break;
+					  }
 					  if(!EVP_CipherUpdate(enc_ctx,
 						doutbuf, (int *)&doutlen,
 						(unsigned char *)buf,
@@ -368,7 +370,7 @@ int transfer_gzfile_in(struct sbuf *sb, const char *path, BFILE *bfd, FILE *fp,
 		if(buf) free(buf);
 		buf=NULL;
 	}
-	inflateEnd(&zstrm);
+	zstrm_end(&zstrm);
 	if(enc_ctx)
 	{
 		EVP_CIPHER_CTX_cleanup(enc_ctx);
@@ -0,0 +1,132 @@
+#include "burp.h"
+#include "prog.h"
+#include "openpool.h"
+#include "fileread.h"
+
+#if !defined(HAVE_WIN32) && defined(HAVE_PTHREAD)
+
+// Files waiting for a thread, in the order that they were given.
+static struct workq *q=NULL;
+
+static void free_opened(struct workitem *wi)
+{
+	struct opened *op=(struct opened *)wi;
+	if(op->fd>=0) close(op->fd);
+	if(op->path) free(op->path);
+	free(op);
+}
+
+// No logging in here, because it runs in the pool threads. Anything that
+// goes wrong is left for the stream to find again and log.
+static void open_file(struct workitem *wi, void *tdata)
+{
+	int fd=-1;
+	int flags=0;
+	struct stat statp;
+	struct opened *op=(struct opened *)wi;
+
+	if(lstat(op->path, &op->statp))
+	{
+		op->stat_errno=errno;
+		return;
+	}
+	if(!S_ISREG(op->statp.st_mode)) return;
+	// Do not block if it has turned into a fifo since the lstat.
+	if((fd=fileread_open(op->path, O_RDONLY|O_NONBLOCK))<0) return;
+	if(fstat(fd, &statp)
+	  || statp.st_dev!=op->statp.st_dev
+	  || statp.st_ino!=op->statp.st_ino
+	  || (flags=fcntl(fd, F_GETFL))<0
+	  || fcntl(fd, F_SETFL, flags&~O_NONBLOCK)<0)
+	{
+		close(fd);
+		return;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+#endif
+	op->fd=fd;
+}
+
+int openpool_init(int count)
+{
+	if(count<=0) return 0;
+	if(!(q=workq_new(count, "readahead", open_file, NULL, free_opened,
+		NULL, NULL))) return -1;
+	return 0;
+}
+
+int openpool_active(void)
+{
+	return q!=NULL;
+}
+
+struct opened *openpool_add(const char *path)
+{
+	struct opened *op=NULL;
+	if(!q) return NULL;
+	if(!(op=(struct opened *)calloc(1, sizeof(struct opened)))
+	  || !(op->path=strdup(path)))
+	{
+		logp("out of memory\n");
+		if(op) free(op);
+		return NULL;
+	}
+	op->fd=-1;
+	workq_add(q, &op->wi);
+	return op;
+}
+
+int openpool_take(struct opened *op)
+{
+	// The pool has stopped, and not got to it.
+	if(!q) return 0;
+	return workq_take(q, &op->wi);
+}
+
+void openpool_drop(struct opened *op)
+{
+	if(!op) return;
+	if(q) workq_drop(q, &op->wi);
+	else free_opened(&op->wi);
+}
+
+void openpool_free(void)
+{
+	// Whoever gave files to the pool still has them, and drops them.
+	workq_free(&q);
+}
+
+#else
+
+int openpool_init(int count)
+{
+	if(count>0)
+		logp("readahead_threads is not supported here - opening files on one thread\n");
+	return 0;
+}
+
+int openpool_active(void)
+{
+	return 0;
+}
+
+struct opened *openpool_add(const char *path)
+{
+	return NULL;
+}
+
+int openpool_take(struct opened *op)
+{
+	return 0;
+}
+
+void openpool_drop(struct opened *op)
+{
+}
+
+void openpool_free(void)
+{
+}
+
+#endif
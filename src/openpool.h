@@ -0,0 +1,44 @@
+#ifndef _OPENPOOL_H
+#define _OPENPOOL_H
+
+#include "workq.h"
+
+/* Opening the files that the server has asked for in phase2, ahead of the
+   streams that send them. Where every lstat and open has to wait on the
+   network, a pool of threads keeps several of them going at once, and asks
+   the kernel to start reading each file as soon as it is open. The streams
+   then pick up the results in the order that the server asked. */
+
+// Most threads that readahead_threads may ask for.
+#define MAX_READAHEAD_THREADS	64
+
+// How much of each file to ask the kernel to start reading.
+#define READAHEAD_BYTES		(1024*1024)
+
+// A file that has been given to the pool.
+struct opened
+{
+	struct workitem wi;
+	char *path;
+	struct stat statp; // from lstat
+	int stat_errno; // 0 if statp is good
+	int fd; // open for reading if it is a regular file, or -1
+};
+
+// Starts count threads. Returns 0 if the pool has started, or if count is 0,
+// so that there is no pool. Returns -1 on error.
+extern int openpool_init(int count);
+extern int openpool_active(void);
+// Gives a file to the pool. Returns NULL if there is no pool, or on error,
+// in which case the caller opens the file itself later.
+extern struct opened *openpool_add(const char *path);
+// Waits for a thread to finish with the file, if one has started on it.
+// Returns 1 if statp, stat_errno and fd have been filled in, or 0 if the
+// caller has to do it all itself. Either way, openpool_drop() must be called
+// afterwards. The caller may take the fd, setting it to -1.
+extern int openpool_take(struct opened *op);
+// Forgets about a file, closing it if it is still open.
+extern void openpool_drop(struct opened *op);
+extern void openpool_free(void);
+
+#endif
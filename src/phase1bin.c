@@ -0,0 +1,358 @@
+#include "burp.h"
+#include "prog.h"
+#include "msg.h"
+#include "handy.h"
+#include "asyncio.h"
+#include "find.h"
+#include "sbuf.h"
+#include "phase1bin.h"
+
+// The most that a batch holds. File messages cannot be any bigger.
+#define MAX_BATCH	0xFFFF
+
+// Enough for the cmd, the stat fields and the path lengths of an entry.
+#define MAX_ENTRY_HDR	(1+(STAT_FIELDS+3)*10)
+
+// Enough for the text form of the stat fields.
+#define STAT_TEXT_LEN	(STAT_FIELDS*13)
+
+struct p1enc
+{
+	char *buf;
+	size_t len;
+	int64_t prev[STAT_FIELDS];
+	char *path; // the path before
+	size_t plen;
+	size_t palloc;
+};
+
+struct p1dec
+{
+	// Where the batch came from. Both NULL for the network.
+	FILE *fp;
+	gzFile zp;
+	char *buf;
+	size_t len;
+	size_t pos;
+	int64_t prev[STAT_FIELDS];
+	char *path;
+	size_t plen;
+	size_t palloc;
+};
+
+static struct p1enc netenc;
+static struct p1enc fileenc;
+static struct p1dec netdec;
+static struct p1dec filedec;
+
+static size_t put_varint(char *p, uint64_t v)
+{
+	size_t n=0;
+	while(v>=0x80)
+	{
+		p[n++]=(char)(v|0x80);
+		v>>=7;
+	}
+	p[n++]=(char)v;
+	return n;
+}
+
+static int get_varint(struct p1dec *d, uint64_t *v)
+{
+	int shift=0;
+	*v=0;
+	while(d->pos<d->len && shift<64)
+	{
+		unsigned char c=(unsigned char)d->buf[d->pos++];
+		*v|=(uint64_t)(c&0x7F)<<shift;
+		if(!(c&0x80)) return 0;
+		shift+=7;
+	}
+	return -1;
+}
+
+// Small differences either way become small numbers.
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v<<1)^(uint64_t)(v>>63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v>>1)^-(int64_t)(v&1);
+}
+
+static int keep_path(char **path, size_t *palloc, size_t len)
+{
+	char *tmp=NULL;
+	if(len<*palloc) return 0;
+	if(!(tmp=(char *)realloc(*path, len+256)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	*path=tmp;
+	*palloc=len+256;
+	return 0;
+}
+
+static void enc_reset(struct p1enc *e)
+{
+	memset(e->prev, 0, sizeof(e->prev));
+	e->plen=0;
+	e->len=0;
+}
+
+// Returns 0 if the entry was added, 1 if it does not fit in what is left of
+// the batch, or -1 on error.
+static int enc_add(struct p1enc *e, size_t limit, char cmd, const int64_t *f, const char *path, size_t plen, const char *linkto, size_t llen)
+{
+	int i=0;
+	size_t h=0;
+	size_t shared=0;
+	char hdr[MAX_ENTRY_HDR];
+
+	if(!e->buf && !(e->buf=(char *)malloc(MAX_BATCH)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+
+	hdr[h++]=cmd;
+	for(i=0; i<STAT_FIELDS; i++)
+		h+=put_varint(hdr+h,
+			zigzag((int64_t)((uint64_t)f[i]-(uint64_t)e->prev[i])));
+	while(shared<plen && shared<e->plen && path[shared]==e->path[shared])
+		shared++;
+	h+=put_varint(hdr+h, shared);
+	h+=put_varint(hdr+h, plen-shared);
+	if(cmd_is_link(cmd)) h+=put_varint(hdr+h, llen);
+	else llen=0;
+
+	if(e->len+h+(plen-shared)+llen>limit) return 1;
+
+	memcpy(e->buf+e->len, hdr, h);
+	e->len+=h;
+	memcpy(e->buf+e->len, path+shared, plen-shared);
+	e->len+=plen-shared;
+	if(llen)
+	{
+		memcpy(e->buf+e->len, linkto, llen);
+		e->len+=llen;
+	}
+
+	if(keep_path(&e->path, &e->palloc, plen)) return -1;
+	memcpy(e->path+shared, path+shared, plen-shared);
+	e->plen=plen;
+	memcpy(e->prev, f, sizeof(e->prev));
+	return 0;
+}
+
+static void enc_free(struct p1enc *e)
+{
+	if(e->buf) free(e->buf);
+	if(e->path) free(e->path);
+	memset(e, 0, sizeof(struct p1enc));
+}
+
+static size_t net_limit(void)
+{
+	size_t limit=async_get_frame_size();
+	if(limit>MAX_BATCH) limit=MAX_BATCH;
+	return limit;
+}
+
+int phase1bin_send_flush(void)
+{
+	int ret=0;
+	if(!netenc.len) return 0;
+	ret=async_write(CMD_PHASE1_BATCH, netenc.buf, netenc.len);
+	enc_reset(&netenc);
+	return ret;
+}
+
+int phase1bin_send(char cmd, const char *path, const char *linkto, struct stat *statp, int64_t winattr, int compression)
+{
+	int r=0;
+	size_t plen=strlen(path);
+	size_t llen=linkto?strlen(linkto):0;
+	int64_t f[STAT_FIELDS];
+	char attribs[STAT_TEXT_LEN];
+
+	stat_to_fields(f, statp, winattr, compression);
+	if((r=enc_add(&netenc, net_limit(),
+		cmd, f, path, plen, linkto, llen))<=0) return r;
+	if(netenc.len)
+	{
+		if(phase1bin_send_flush()) return -1;
+		if((r=enc_add(&netenc, net_limit(),
+			cmd, f, path, plen, linkto, llen))<=0) return r;
+	}
+
+	// Too big for a batch of its own.
+	fields_to_text(attribs, f);
+	if(async_write_str(CMD_STAT, attribs)
+	  || async_write(cmd, path, plen)
+	  || (cmd_is_link(cmd) && async_write(cmd, linkto, llen)))
+		return -1;
+	return 0;
+}
+
+int phase1bin_write_flush(gzFile zp)
+{
+	int ret=0;
+	if(!fileenc.len) return 0;
+	ret=send_msg_zp(zp, CMD_PHASE1_BATCH, fileenc.buf, fileenc.len);
+	enc_reset(&fileenc);
+	return ret;
+}
+
+int phase1bin_write(gzFile zp, struct sbuf *sb)
+{
+	int r=0;
+	int64_t f[STAT_FIELDS];
+
+	// A text entry with fewer fields stays as it is.
+	if(!text_to_fields(f, sb->statbuf))
+	{
+		if((r=enc_add(&fileenc, MAX_BATCH, sb->cmd, f,
+			sb->path, sb->plen, sb->linkto, sb->llen))<=0)
+				return r;
+		if(fileenc.len)
+		{
+			if(phase1bin_write_flush(zp)) return -1;
+			if((r=enc_add(&fileenc, MAX_BATCH, sb->cmd, f,
+				sb->path, sb->plen, sb->linkto, sb->llen))<=0)
+					return r;
+		}
+	}
+	if(phase1bin_write_flush(zp)) return -1;
+	return sbuf_to_manifest_phase1(sb, NULL, zp);
+}
+
+static struct p1dec *get_dec(FILE *fp, gzFile zp)
+{
+	if(!fp && !zp) return &netdec;
+	return &filedec;
+}
+
+static void dec_reset(struct p1dec *d)
+{
+	if(d->buf) free(d->buf);
+	d->buf=NULL;
+	d->len=0;
+	d->pos=0;
+	d->plen=0;
+	memset(d->prev, 0, sizeof(d->prev));
+}
+
+int phase1bin_load(FILE *fp, gzFile zp, char *buf, size_t len)
+{
+	struct p1dec *d=get_dec(fp, zp);
+	dec_reset(d);
+	d->fp=fp;
+	d->zp=zp;
+	d->buf=buf;
+	d->len=len;
+	return 0;
+}
+
+static int corrupt(struct p1dec *d)
+{
+	logp("corrupt phase1 batch at byte %lu of %lu\n",
+		(unsigned long)d->pos, (unsigned long)d->len);
+	dec_reset(d);
+	return -1;
+}
+
+int phase1bin_next(FILE *fp, gzFile zp, struct sbuf *sb)
+{
+	int i=0;
+	char cmd;
+	uint64_t v=0;
+	uint64_t shared=0;
+	uint64_t rest=0;
+	uint64_t llen=0;
+	int64_t f[STAT_FIELDS];
+	struct p1dec *d=get_dec(fp, zp);
+
+	// The old manifest is read in between the phase1 file, and never
+	// has batches in it.
+	if(d->fp!=fp || d->zp!=zp || !d->buf) return 1;
+	if(d->pos>=d->len)
+	{
+		dec_reset(d);
+		return 1;
+	}
+
+	cmd=d->buf[d->pos++];
+	for(i=0; i<STAT_FIELDS; i++)
+	{
+		if(get_varint(d, &v)) return corrupt(d);
+		f[i]=(int64_t)((uint64_t)d->prev[i]+(uint64_t)unzigzag(v));
+	}
+	if(get_varint(d, &shared)
+	  || get_varint(d, &rest)
+	  || (cmd_is_link(cmd) && get_varint(d, &llen))
+	  || shared>d->plen
+	  || rest>d->len-d->pos
+	  || llen>d->len-d->pos-rest)
+		return corrupt(d);
+	if(keep_path(&d->path, &d->palloc, shared+rest)) return -1;
+	memcpy(d->path+shared, d->buf+d->pos, rest);
+	d->pos+=rest;
+	d->plen=shared+rest;
+	memcpy(d->prev, f, sizeof(d->prev));
+
+	if(!(sb->path=(char *)malloc(d->plen+1))
+	  || !(sb->statbuf=(char *)malloc(STAT_TEXT_LEN)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	memcpy(sb->path, d->path, d->plen);
+	sb->path[d->plen]='\0';
+	sb->plen=d->plen;
+	sb->cmd=cmd;
+
+	if(cmd_is_link(cmd))
+	{
+		if(!(sb->linkto=(char *)malloc(llen+1)))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		memcpy(sb->linkto, d->buf+d->pos, llen);
+		sb->linkto[llen]='\0';
+		sb->llen=llen;
+		d->pos+=llen;
+	}
+
+	// The text is what the client would have sent without the batches,
+	// and it is what goes into the manifest.
+	fields_to_text(sb->statbuf, f);
+	sb->slen=strlen(sb->statbuf);
+	fields_to_stat(f, &sb->statp, &sb->winattr, &sb->compression);
+	return 0;
+}
+
+void phase1bin_reset(FILE *fp, gzFile zp)
+{
+	struct p1dec *d=get_dec(fp, zp);
+	if(d->fp==fp && d->zp==zp) dec_reset(d);
+}
+
+static void dec_free(struct p1dec *d)
+{
+	dec_reset(d);
+	if(d->path) free(d->path);
+	memset(d, 0, sizeof(struct p1dec));
+}
+
+void phase1bin_free(void)
+{
+	enc_free(&netenc);
+	enc_free(&fileenc);
+	dec_free(&netdec);
+	dec_free(&filedec);
+}
@@ -0,0 +1,37 @@
+#ifndef _PHASE1BIN_H
+#define _PHASE1BIN_H
+
+/* A packed form of the phase1 scan, used on the network and in the phase1
+   file on the server, when both ends know about it. Instead of a text stat
+   frame and a path frame for each entry, one CMD_PHASE1_BATCH frame holds as
+   many entries as fit. In each entry, every stat field is a varint of its
+   difference from the same field in the entry before, and the path is the
+   length that it shares with the path before, followed by the rest of it.
+   Each batch starts afresh, so it can be read without the ones before it.
+
+   An entry that will not fit in a batch on its own goes in the old text form
+   instead, and readers take either. */
+
+// What async_read_stat() returns when it has handed a batch over.
+#define PHASE1BIN_LOADED	2
+
+// Client: adds an entry to the batch for the server, sending the batch first
+// if the entry does not fit.
+extern int phase1bin_send(char cmd, const char *path, const char *linkto, struct stat *statp, int64_t winattr, int compression);
+extern int phase1bin_send_flush(void);
+
+// Server: adds an entry to the batch for the phase1 file.
+extern int phase1bin_write(gzFile zp, struct sbuf *sb);
+extern int phase1bin_write_flush(gzFile zp);
+
+// Readers. A batch read from fp or zp, or from the network if both are NULL,
+// is handed over with phase1bin_load(), which takes buf. After that,
+// phase1bin_next() fills in sb from it. It returns 0 if it did, 1 if there
+// is nothing more in the batch, or -1 on error.
+extern int phase1bin_load(FILE *fp, gzFile zp, char *buf, size_t len);
+extern int phase1bin_next(FILE *fp, gzFile zp, struct sbuf *sb);
+// Forgets the rest of a batch, for when zp has been rewound.
+extern void phase1bin_reset(FILE *fp, gzFile zp);
+extern void phase1bin_free(void);
+
+#endif
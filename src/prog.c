@@ -4,6 +4,7 @@
 #include "lock.h"
 #include "handy.h"
 #include "status_client.h"
+#include "journal.h"
 
 static char *get_config_path(void)
 {
@@ -69,6 +70,7 @@ static void usage_client(void)
 	printf("                  r: restore\n");
 	printf("                  t: timed backup\n");
 	printf("                  v: verify\n");
+	printf("                  w: watch for changes, for the change journal\n");
 	printf("  -b <number>    Backup number (default: the most recent backup)\n");
 	printf("  -c <path>      Path to config file (default: %s).\n", get_config_path());
 	printf("  -d <directory> Directory to restore to, or directory to list\n");
@@ -191,6 +193,8 @@ int main (int argc, char *argv[])
 					act=ACTION_STATUS_SNAPSHOT;
 				else if(!strncmp(optarg, "estimate", 1))
 					act=ACTION_ESTIMATE;
+				else if(!strncmp(optarg, "watch", 1))
+					act=ACTION_WATCH;
 				else
 				{
 					usage();
@@ -287,6 +291,11 @@ int main (int argc, char *argv[])
 	{
 		// Server status mode needs to run without getting the lock.
 	}
+	else if(act==ACTION_WATCH)
+	{
+		// The watcher has a lock of its own, so that it can run
+		// alongside backups.
+	}
 	else
 	{
 		if(get_lock(conf.lockfile))
@@ -326,6 +335,8 @@ int main (int argc, char *argv[])
 				generate_ca_only);
 #endif
 	}
+	else if(act==ACTION_WATCH)
+		ret=journal_watch(&conf);
 	else
 	{
 		logp("before client\n");
@@ -0,0 +1,143 @@
+#include "burp.h"
+#include "prog.h"
+#include "ratelimit.h"
+
+#ifndef HAVE_WIN32
+#include <sys/mman.h>
+#endif
+
+// Let a quarter of a second of unused bandwidth be saved up.
+#define BURST_SECONDS	0.25
+// Never sleep longer than this in one go, so that the caller gets to notice
+// a change in circumstances.
+#define MAX_SLEEP	1.0
+
+static struct tbucket *shared_tb=NULL;
+
+static double now_seconds(void)
+{
+#ifdef HAVE_WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart/(double)freq.QuadPart;
+#else
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	if(!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec+(ts.tv_nsec/1000000000.0);
+#endif
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+(tv.tv_usec/1000000.0);
+#endif
+}
+
+static void sleep_seconds(double secs)
+{
+#ifdef HAVE_WIN32
+	Sleep((DWORD)(secs*1000));
+#else
+	usleep((useconds_t)(secs*1000000));
+#endif
+}
+
+static void tb_lock(struct tbucket *tb)
+{
+	if(!tb->shared) return;
+	while(__sync_lock_test_and_set(&tb->lock, 1))
+		sleep_seconds(0.0001);
+}
+
+static void tb_unlock(struct tbucket *tb)
+{
+	if(!tb->shared) return;
+	__sync_lock_release(&tb->lock);
+}
+
+static void refill(struct tbucket *tb, double now)
+{
+	double elapsed=now-tb->last;
+	// A monotonic clock should never go backwards, but the fallback
+	// clock can.
+	if(elapsed>0)
+	{
+		tb->tokens+=elapsed*tb->rate;
+		if(tb->tokens>tb->burst) tb->tokens=tb->burst;
+	}
+	tb->last=now;
+}
+
+void ratelimit_init(struct tbucket *tb, double rate)
+{
+	tb->rate=rate;
+	tb->burst=rate*BURST_SECONDS;
+	tb->tokens=tb->burst;
+	tb->last=now_seconds();
+	tb->shared=0;
+	tb->lock=0;
+}
+
+void ratelimit_take(struct tbucket *tb, size_t bytes)
+{
+	if(!tb || tb->rate<=0) return;
+	tb_lock(tb);
+	refill(tb, now_seconds());
+	tb->tokens-=bytes;
+	tb_unlock(tb);
+}
+
+void ratelimit_wait(struct tbucket *tb)
+{
+	double wait=0;
+	if(!tb || tb->rate<=0) return;
+	while(1)
+	{
+		tb_lock(tb);
+		refill(tb, now_seconds());
+		wait=(tb->tokens<0)?(-tb->tokens/tb->rate):0;
+		tb_unlock(tb);
+		if(wait<=0) return;
+		sleep_seconds(wait>MAX_SLEEP?MAX_SLEEP:wait);
+	}
+}
+
+int ratelimit_shared_init(double rate)
+{
+#ifdef HAVE_WIN32
+	logp("ratelimit_total is not supported on Windows\n");
+	return -1;
+#else
+	if(!shared_tb)
+	{
+		void *p;
+		if(rate<=0) return 0;
+		if((p=mmap(NULL, sizeof(struct tbucket), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANON, -1, 0))==MAP_FAILED)
+		{
+			logp("could not mmap shared ratelimit: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		shared_tb=(struct tbucket *)p;
+		ratelimit_init(shared_tb, rate);
+		shared_tb->shared=1;
+		return 0;
+	}
+	// Reloading the config. Children may be using it, so lock.
+	tb_lock(shared_tb);
+	shared_tb->rate=rate;
+	shared_tb->burst=rate*BURST_SECONDS;
+	if(shared_tb->tokens>shared_tb->burst)
+		shared_tb->tokens=shared_tb->burst;
+	tb_unlock(shared_tb);
+	return 0;
+#endif
+}
+
+struct tbucket *ratelimit_shared(void)
+{
+	if(shared_tb && shared_tb->rate>0) return shared_tb;
+	return NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+/* A token bucket. Tokens are bytes, topped up continuously from a monotonic
+   clock. Transfers may overdraw the bucket, after which the next transfer
+   waits for exactly as long as it takes to pay the debt back. */
+struct tbucket
+{
+	double rate;   // bytes per second, zero for no limit
+	double burst;  // most bytes that can be saved up while idle
+	double tokens; // bytes available now, negative when in debt
+	double last;   // when the tokens were last topped up
+	int shared;    // set if the bucket lives in memory shared by processes
+	int lock;      // for shared buckets
+};
+
+extern void ratelimit_init(struct tbucket *tb, double rate);
+extern void ratelimit_take(struct tbucket *tb, size_t bytes);
+extern void ratelimit_wait(struct tbucket *tb);
+
+// The server sets this up before forking, so that all of its children draw
+// from the same bucket.
+extern int ratelimit_shared_init(double rate);
+extern struct tbucket *ratelimit_shared(void);
+
+#endif
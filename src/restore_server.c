@@ -5,7 +5,7 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
@@ -20,8 +20,8 @@ int do_patch(const char *dst, const char *del, const char *upd, bool gzupd, int
 {
 	FILE *dstp=NULL;
 	FILE *delfp=NULL;
-	gzFile delzp=NULL;
-	gzFile updp=NULL;
+	struct zfile *delzp=NULL;
+	struct zfile *updp=NULL;
 	FILE *updfp=NULL;
 	rs_result result;
 
@@ -34,7 +34,7 @@ int do_patch(const char *dst, const char *del, const char *upd, bool gzupd, int
 	}
 
 	if(dpth_is_compressed(compression, del))
-		delzp=gzopen(del, "rb");
+		delzp=zfile_open(del, "rb", 0);
 	else
 		delfp=fopen(del, "rb");
 
@@ -45,8 +45,11 @@ int do_patch(const char *dst, const char *del, const char *upd, bool gzupd, int
 		return -1;
 	}
 
+	// The result is compressed in the same way as the file it replaces.
 	if(gzupd)
-		updp=gzopen(upd, comp_level(cconf));
+		updp=zfile_open(upd, "wb", zcodec_tag(
+			dpth_compression_algorithm(compression, upd),
+			cconf->compression));
 	else
 		updfp=fopen(upd, "wb");
 
@@ -54,7 +57,7 @@ int do_patch(const char *dst, const char *del, const char *upd, bool gzupd, int
 	{
 		logp("could not open %s for writing\n", upd);
 		close_fp(&dstp);
-		gzclose_fp(&delzp);
+		zfile_close(&delzp);
 		close_fp(&delfp);
 		return -1;
 	}
@@ -62,14 +65,14 @@ int do_patch(const char *dst, const char *del, const char *upd, bool gzupd, int
 	result=rs_patch_gzfile(dstp, delfp, delzp, updfp, updp, NULL, cntr);
 
 	fclose(dstp);
-	gzclose_fp(&delzp);
+	zfile_close(&delzp);
 	close_fp(&delfp);
 	if(close_fp(&updfp))
 	{
 		logp("error closing %s after rs_patch_gzfile\n", upd);
 		result=RS_IO_ERROR;
 	}
-	if(gzclose_fp(&updp))
+	if(zfile_close(&updp))
 	{
 		logp("error gzclosing %s after rs_patch_gzfile\n", upd);
 		result=RS_IO_ERROR;
@@ -118,8 +121,8 @@ static int inflate_or_link_oldfile(const char *oldpath, const char *infpath, int
 			return -1;
 		}
 
-		if((ret=zlib_inflate(source, dest))!=Z_OK)
-			logp("zlib_inflate returned: %d\n", ret);
+		if((ret=zcodec_inflate(source, dest)))
+			logp("could not inflate %s\n", oldpath);
 
 		close_fp(&source);
 		if(close_fp(&dest))
@@ -142,10 +145,24 @@ static int inflate_or_link_oldfile(const char *oldpath, const char *infpath, int
 	return ret;
 }
 
+// Clients only say which algorithms they have if they have more than gzip.
+static int can_decompress(struct config *cconf, int alg)
+{
+	return alg==ZC_GZIP || (cconf->compressors & (1<<alg));
+}
+
 static int send_file(const char *fname, int patches, const char *best, const char *datapth, unsigned long long *bytes, char cmd, int64_t winattr, int compression, struct cntr *cntr, struct config *cconf)
 {
 	int ret=0;
 	FILE *fp=NULL;
+	int alg=dpth_compression_algorithm(compression, datapth);
+	if(!patches && dpth_is_compressed(compression, datapth)
+	  && !can_decompress(cconf, alg))
+	{
+		logw(cntr, "%s was compressed with %s, which the client does not have\n",
+			fname, zcodec_name(alg));
+		return 0;
+	}
 	if(open_file_for_send(NULL, &fp, best, winattr, cntr))
 		return -1;
 	//logp("sending: %s\n", best);
@@ -181,7 +198,8 @@ static int send_file(const char *fname, int patches, const char *best, const cha
 		else
 		{
 			// If we did not do some patches, the resulting
-			// file might already be gzipped. Send it as it is.
+			// file might already be compressed. Send it as it
+			// is. The client can tell which algorithm it is.
 			ret=send_whole_file(cmd, best, datapth, 1, bytes,
 				cntr, NULL, fp, NULL, 0);
 		}
@@ -242,29 +260,30 @@ static int verify_file(const char *fname, int patches, const char *best, const c
 	}
 	else
 	{
-		gzFile zp=NULL;
-		if(!(zp=gzopen_file(best, "rb")))
+		int r=0;
+		struct zfile *zp=NULL;
+		if(!(zp=zfile_open(best, "rb", 0)))
 		{
 			logw(cntr, "could not gzopen %s\n", best);
 			return 0;
 		}
-		while((b=gzread(zp, in, ZCHUNK))>0)
+		while((r=zfile_read(zp, in, ZCHUNK))>0)
 		{
-			cbytes+=b;
-			if(!MD5_Update(&md5, in, b))
+			cbytes+=r;
+			if(!MD5_Update(&md5, in, r))
 			{
 				logp("MD5_Update() failed\n");
-				gzclose_fp(&zp);
+				zfile_close(&zp);
 				return -1;
 			}
 		}
-		if(!gzeof(zp))
+		if(r<0 || !zfile_eof(zp))
 		{
 			logw(cntr, "error while gzreading %s\n", best);
-			gzclose_fp(&zp);
+			zfile_close(&zp);
 			return 0;
 		}
-		gzclose_fp(&zp);
+		zfile_close(&zp);
 	}
 	if(!MD5_Final(checksum, &md5))
 	{
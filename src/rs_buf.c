@@ -45,7 +45,7 @@
 #include "counter.h"
 #include "asyncio.h"
 #include "rs_buf.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include <assert.h>
 
 /* use fseeko instead of fseek for long file support if we have it */
@@ -83,7 +83,7 @@ rs_alloc(size_t size, char const *name)
     return p;
 }
 
-rs_filebuf_t *rs_filebuf_new(BFILE *bfd, FILE *fp, gzFile zp, int fd,
+rs_filebuf_t *rs_filebuf_new(BFILE *bfd, FILE *fp, struct zfile *zp, int fd,
 	size_t buf_len, struct cntr *cntr)
 {
     rs_filebuf_t *pf=NULL;
@@ -96,6 +96,7 @@ rs_filebuf_t *rs_filebuf_new(BFILE *bfd, FILE *fp, gzFile zp, int fd,
     }
     pf->buf_len=buf_len;
     pf->fp=fp;
+    pf->fr=NULL;
     pf->zp=zp;
     pf->fd=fd;
     pf->bfd=bfd;
@@ -128,7 +129,7 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 {
     int                     len=0;
     rs_filebuf_t            *fb = (rs_filebuf_t *) opaque;
-    gzFile                  zp = fb->zp;
+    struct zfile            *zp = fb->zp;
     FILE                    *fp = fb->fp;
     struct cntr *cntr;
     int fd=fb->fd;
@@ -167,6 +168,13 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 	if(rcmd==CMD_APPEND)
 	{
 		//logp("got '%c' in fd infilebuf: %d\n", CMD_APPEND, rlen);
+		if(rlen>fb->buf_len)
+		{
+			logp("frame of %d bytes too big for infilebuf of %d\n",
+				rlen, fb->buf_len);
+			free(rbuf);
+			return RS_IO_ERROR;
+		}
 		memcpy(fb->buf, rbuf, rlen);
 		len=rlen;
 		free(rbuf);
@@ -231,6 +239,7 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 		    return RS_IO_ERROR;
 		}
 	    }
+	    if(fb->fr) fileread_done(fb->fr, len);
 	    fb->bytes+=len;
 	    if(!MD5_Update(&(fb->md5), fb->buf, len))
 	    {
@@ -240,12 +249,12 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
     }
     else if(zp)
     {
-	    len = gzread(zp, fb->buf, fb->buf_len);
-//logp("gzread: %d\n", len);
+	    len = zfile_read(zp, fb->buf, fb->buf_len);
+//logp("zfile_read: %d\n", len);
 	    if (len <= 0) {
 		/* This will happen if file size is a multiple of input block len
 		 */
-		if (gzeof(zp)) {
+		if (zfile_eof(zp)) {
 		    buf->eof_in=1;
 		    return RS_DONE;
 		} else {
@@ -283,7 +292,7 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 {
     rs_filebuf_t *fb = (rs_filebuf_t *) opaque;
     FILE *fp = fb->fp;
-    gzFile zp = fb->zp;
+    struct zfile *zp = fb->zp;
     int fd = fb->fd;
     size_t wlen;
 
@@ -308,9 +317,12 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 	//logp("wlen: %d\n", wlen);
 	if(fd>0)
 	{
+		int ar;
 		size_t w=wlen;
-		if(async_append_all_to_write_buffer(CMD_APPEND, fb->buf, &wlen))
+		if((ar=async_append_all_to_write_buffer(CMD_APPEND,
+			fb->buf, &wlen)))
 		{
+			if(ar<0) return RS_IO_ERROR;
 			// stop the rsync stuff from reading more.
 	//		buf->next_out = fb->buf;
 	//		buf->avail_out = 0;
@@ -323,7 +335,7 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 	{
 		size_t result=0;
 		if(fp) result=fwrite(fb->buf, 1, wlen, fp);
-		else if(zp) result=gzwrite(zp, fb->buf, wlen);
+		else if(zp) result=zfile_write(zp, fb->buf, wlen);
 		if(wlen!=result)
 		{
 		    logp("error draining buf to file: %s",
@@ -341,7 +353,7 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 
 rs_result do_rs_run(rs_job_t *job, BFILE *bfd,
 	FILE *in_file, FILE *out_file,
-	gzFile in_zfile, gzFile out_zfile, int infd, int outfd, struct cntr *cntr)
+	struct zfile *in_zfile, struct zfile *out_zfile, int infd, int outfd, struct cntr *cntr)
 {
 	rs_buffers_t buf;
 	rs_result result;
@@ -359,11 +371,14 @@ rs_result do_rs_run(rs_job_t *job, BFILE *bfd,
 		return RS_IO_ERROR;
 	}
 
+	// Buffers that talk to the network need to match the frame size.
 	if((bfd || in_file || in_zfile || infd>=0)
-	 && !(in_fb=rs_filebuf_new(bfd, in_file, in_zfile, infd, ASYNC_BUF_LEN, cntr)))
+	 && !(in_fb=rs_filebuf_new(bfd, in_file, in_zfile, infd,
+		infd>=0?async_get_frame_size():ASYNC_BUF_LEN, cntr)))
 		return RS_MEM_ERROR;
 	if((out_file || out_zfile || outfd>=0)
-	 && !(out_fb=rs_filebuf_new(NULL, out_file, out_zfile, outfd, ASYNC_BUF_LEN, cntr)))
+	 && !(out_fb=rs_filebuf_new(NULL, out_file, out_zfile, outfd,
+		outfd>=0?async_get_frame_size():ASYNC_BUF_LEN, cntr)))
 	{
 		if(in_fb) rs_filebuf_free(in_fb);
 		return RS_MEM_ERROR;
@@ -420,9 +435,34 @@ rs_result rs_async(rs_job_t *job, rs_buffers_t *rsbuf, rs_filebuf_t *infb, rs_fi
 		outfb ? rs_outfilebuf_drain : NULL, outfb);
 }
 
+/* Like rs_async(), but for sending a file that is already in the form that
+   the other end wants, such as a signature from the cache. */
+rs_result rs_async_file(FILE *fp, rs_buffers_t *rsbuf, rs_filebuf_t *outfb)
+{
+	size_t len=0;
+	rs_result result;
+
+	// Only read more once what was read last time has all gone.
+	if(!rsbuf->next_out || rsbuf->next_out==outfb->buf)
+	{
+		if(!(len=fread(outfb->buf, 1, outfb->buf_len, fp)))
+		{
+			if(!ferror(fp)) return RS_DONE;
+			logp("error reading file to send: %s\n",
+				strerror(errno));
+			return RS_IO_ERROR;
+		}
+		rsbuf->next_out=outfb->buf+len;
+		rsbuf->avail_out=outfb->buf_len-len;
+	}
+	if((result=rs_outfilebuf_drain(NULL, rsbuf, outfb))!=RS_DONE)
+		return result;
+	return RS_RUNNING;
+}
+
 
 static rs_result
-rs_whole_gzrun(rs_job_t *job, FILE *in_file, gzFile in_zfile, FILE *out_file, gzFile out_zfile, struct cntr *cntr)
+rs_whole_gzrun(rs_job_t *job, FILE *in_file, struct zfile *in_zfile, FILE *out_file, struct zfile *out_zfile, struct cntr *cntr)
 {
     rs_buffers_t    buf;
     rs_result       result;
@@ -448,7 +488,7 @@ rs_whole_gzrun(rs_job_t *job, FILE *in_file, gzFile in_zfile, FILE *out_file, gz
     return result;
 }
 
-rs_result rs_patch_gzfile(FILE *basis_file, FILE *delta_file, gzFile delta_zfile, FILE *new_file, gzFile new_zfile, rs_stats_t *stats, struct cntr *cntr)
+rs_result rs_patch_gzfile(FILE *basis_file, FILE *delta_file, struct zfile *delta_zfile, FILE *new_file, struct zfile *new_zfile, rs_stats_t *stats, struct cntr *cntr)
 {
 	rs_job_t            *job;
 	rs_result           r;
@@ -466,7 +506,7 @@ rs_result rs_patch_gzfile(FILE *basis_file, FILE *delta_file, gzFile delta_zfile
 	return r;
 }
 
-rs_result rs_sig_gzfile(FILE *old_file, gzFile old_zfile, FILE *sig_file, size_t new_block_len, size_t strong_len, rs_stats_t *stats, struct cntr *cntr)
+rs_result rs_sig_gzfile(FILE *old_file, struct zfile *old_zfile, FILE *sig_file, size_t new_block_len, size_t strong_len, rs_stats_t *stats, struct cntr *cntr)
 {
     rs_job_t        *job;
     rs_result       r;
@@ -482,7 +522,7 @@ rs_result rs_sig_gzfile(FILE *old_file, gzFile old_zfile, FILE *sig_file, size_t
     return r;
 }
 
-rs_result rs_delta_gzfile(rs_signature_t *sig, FILE *new_file, gzFile new_zfile, FILE *delta_file, gzFile delta_zfile, rs_stats_t *stats, struct cntr *cntr)
+rs_result rs_delta_gzfile(rs_signature_t *sig, FILE *new_file, struct zfile *new_zfile, FILE *delta_file, struct zfile *delta_zfile, rs_stats_t *stats, struct cntr *cntr)
 {
     rs_job_t            *job;
     rs_result           r;
@@ -24,7 +24,8 @@
 #ifndef RS_BUF_H
 #define RS_BUF_H
 
-#include "zlibio.h"
+#include "zcodec.h"
+#include "fileread.h"
 
 #include <librsync.h>
 #include <openssl/md5.h>
@@ -37,7 +38,8 @@ struct rs_filebuf
 {
         BFILE *bfd;
 	FILE *fp;
-        gzFile zp;
+	struct fileread *fr; // hints for reading fp, or NULL
+        struct zfile *zp;
 	int fd;
 	char *buf;
         size_t buf_len;
@@ -46,20 +48,21 @@ struct rs_filebuf
 	MD5_CTX md5;
 };
 
-rs_filebuf_t *rs_filebuf_new(BFILE *bfd, FILE *fp, gzFile zp, int fd, size_t buf_len, struct cntr *cntr);
+rs_filebuf_t *rs_filebuf_new(BFILE *bfd, FILE *fp, struct zfile *zp, int fd, size_t buf_len, struct cntr *cntr);
 void rs_filebuf_free(rs_filebuf_t *fb);
 rs_result rs_infilebuf_fill(rs_job_t *, rs_buffers_t *buf, void *fb);
 rs_result rs_outfilebuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
-rs_result do_rs_run(rs_job_t *job, BFILE *bfd, FILE *in_file, FILE *out_file, gzFile in_zfile, gzFile out_zfile, int infd, int outfd, struct cntr *cntr);
+rs_result do_rs_run(rs_job_t *job, BFILE *bfd, FILE *in_file, FILE *out_file, struct zfile *in_zfile, struct zfile *out_zfile, int infd, int outfd, struct cntr *cntr);
 
 rs_result rs_async(rs_job_t *job,
 	rs_buffers_t *rsbuf, rs_filebuf_t *infb, rs_filebuf_t *outfb);
+rs_result rs_async_file(FILE *fp, rs_buffers_t *rsbuf, rs_filebuf_t *outfb);
 
 
 
-rs_result rs_patch_gzfile(FILE *basis_file, FILE *delta_file, gzFile delta_zfile, FILE *new_file, gzFile new_zfile, rs_stats_t *stats, struct cntr *cntr);
-rs_result rs_sig_gzfile(FILE *old_file, gzFile old_zfile, FILE *sig_file, size_t new_block_len, size_t strong_len, rs_stats_t *stats, struct cntr *cntr);
-rs_result rs_delta_gzfile(rs_signature_t *sig, FILE *new_file, gzFile new_zfile, FILE *delta_file, gzFile delta_zfile, rs_stats_t *stats, struct cntr *cntr);
+rs_result rs_patch_gzfile(FILE *basis_file, FILE *delta_file, struct zfile *delta_zfile, FILE *new_file, struct zfile *new_zfile, rs_stats_t *stats, struct cntr *cntr);
+rs_result rs_sig_gzfile(FILE *old_file, struct zfile *old_zfile, FILE *sig_file, size_t new_block_len, size_t strong_len, rs_stats_t *stats, struct cntr *cntr);
+rs_result rs_delta_gzfile(rs_signature_t *sig, FILE *new_file, struct zfile *new_zfile, FILE *delta_file, struct zfile *delta_zfile, rs_stats_t *stats, struct cntr *cntr);
 
 
 #endif
@@ -5,10 +5,11 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
+#include "phase1bin.h"
 
 void init_sbuf(struct sbuf *sb)
 {
@@ -33,6 +34,7 @@ void init_sbuf(struct sbuf *sb)
 	sb->outfb=NULL;
 	sb->sigfp=NULL;
 	sb->sigzp=NULL;
+	sb->sigcached=0;
 	sb->sendendofsig=0;
 
 	sb->receivedelta=0;
@@ -55,7 +57,7 @@ void free_sbuf(struct sbuf *sb)
 	if(sb->outfb) rs_filebuf_free(sb->outfb);
 	if(sb->endfile) free(sb->endfile);
 	close_fp(&sb->sigfp);
-	gzclose_fp(&sb->sigzp);
+	zfile_close(&sb->sigzp);
 	close_fp(&sb->fp);
 	gzclose_fp(&sb->zp);
 	init_sbuf(sb);
@@ -77,10 +79,29 @@ int sbuf_is_endfile(struct sbuf *sb)
 	return sb->cmd==CMD_END_FILE;
 }
 
+// Reads the stat of the next entry. If the rest of the entry came packed
+// with it, got_entry is set.
+static int read_stat(FILE *fp, gzFile zp, struct sbuf *sb, int *got_entry, struct cntr *cntr)
+{
+	int ars;
+	while(1)
+	{
+		if((ars=phase1bin_next(fp, zp, sb))<=0)
+		{
+			*got_entry=!ars;
+			return ars;
+		}
+		if((ars=async_read_stat(fp, zp, sb, cntr))!=PHASE1BIN_LOADED)
+			return ars;
+	}
+}
+
 static int do_sbuf_fill_from_net(struct sbuf *sb, struct cntr *cntr)
 {
 	int ars;
-	if((ars=async_read_stat(NULL, NULL, sb, cntr))) return ars;
+	int got_entry=0;
+	if((ars=read_stat(NULL, NULL, sb, &got_entry, cntr)) || got_entry)
+		return ars;
 	if((ars=async_read(&(sb->cmd), &(sb->path), &(sb->plen)))) return ars;
 	if(sbuf_is_link(sb))
 	{
@@ -100,8 +121,10 @@ static int do_sbuf_fill_from_net(struct sbuf *sb, struct cntr *cntr)
 static int do_sbuf_fill_from_file(FILE *fp, gzFile zp, struct sbuf *sb, int phase1, struct cntr *cntr)
 {
 	int ars;
+	int got_entry=0;
 	//free_sbuf(sb);
-	if((ars=async_read_stat(fp, zp, sb, cntr))) return ars;
+	if((ars=read_stat(fp, zp, sb, &got_entry, cntr)) || got_entry)
+		return ars;
 	if((ars=async_read_fp(fp, zp, &(sb->cmd), &(sb->path), &(sb->plen))))
 		return ars;
 	//sb->path[sb->plen]='\0'; sb->plen--; // avoid new line
@@ -30,7 +30,8 @@ struct sbuf
 	rs_filebuf_t *infb;
 	rs_filebuf_t *outfb;
 	FILE *sigfp;
-	gzFile sigzp;
+	struct zfile *sigzp;
+	int sigcached; // sigfp is a signature from the cache, to send as it is
 	int sendendofsig;
 
 	int receivedelta;
@@ -0,0 +1,779 @@
+#include "burp.h"
+#include "prog.h"
+#include "msg.h"
+#include "handy.h"
+#include "asyncio.h"
+#include "find.h"
+#include "scancache.h"
+#include "journal.h"
+
+#ifndef HAVE_WIN32
+
+#define SCANCACHE_VERSION	"2"
+
+/* The cache file is made of burp messages, the same as the manifests. After
+   the header comes a block for each directory, written when the scan has
+   finished with it. Each entry in a block is CMD_STAT followed by either
+   SC_SUBDIR, or SC_FILE and, for soft links, SC_LINK. An index of the blocks
+   comes last, and the file ends with the offset of the index. */
+#define SC_VERSION	'V'
+#define SC_FINGERPRINT	'F'
+#define SC_BACKUPS	'N' // number of backups since the last full scan
+#define SC_JOURNAL	'J' // change journal id and offset, or empty
+#define SC_DIR		'D'
+#define SC_SUBDIR	'd'
+#define SC_FILE		'f'
+#define SC_LINK		'l'
+#define SC_DIR_END	'E'
+#define SC_INDEX	'I'
+#define SC_INDEX_ENTRY	'i'
+
+// The offset of the index, in hex, and a newline.
+#define TRAILER_LEN	17
+
+// The longest message that fits in the four digits of the length.
+#define MAX_MSG_LEN	0xFFFF
+
+#define FNV_OFFSET	14695981039346656037ULL
+#define FNV_PRIME	1099511628211ULL
+
+struct dirkey
+{
+	unsigned long long hash; // of the path, 0 for an empty slot
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long mtime;
+	unsigned long long ctime;
+	unsigned long long off; // of the SC_DIR message
+};
+
+// A directory that the scan is in.
+struct frame
+{
+	char *path;
+	size_t plen;
+	struct dirkey key;
+	int nocache; // something in it cannot be cached
+	// Messages for the new cache.
+	char *buf;
+	size_t len;
+	size_t alloc;
+	// Entries from the old cache.
+	struct scanitem *items;
+	int icount;
+	int inext;
+};
+
+static FILE *oldfp=NULL;
+static struct dirkey *oldkeys=NULL;
+static size_t oldslots=0;
+
+static char *newpath=NULL;
+static char *tmppath=NULL;
+static FILE *newfp=NULL;
+static unsigned long long newoff=0;
+static struct dirkey *newkeys=NULL;
+static size_t newcount=0;
+static size_t newalloc=0;
+
+static struct frame *stack=NULL;
+static int depth=0;
+static int salloc=0;
+
+static time_t started=0;
+static int compression=0;
+static unsigned long long dirs=0;
+static unsigned long long hits=0;
+
+// Set if the change journal has everything that changed since the old cache.
+static int journal_ok=0;
+// Set if there is a change journal, whether or not it can be used this time.
+static int journalled=0;
+
+static unsigned long long fnv(unsigned long long h, const char *str)
+{
+	const unsigned char *cp=(const unsigned char *)str;
+	// Include the terminating zero, so that lists of strings that join up
+	// to the same thing are different.
+	do { h^=*cp; h*=FNV_PRIME; } while(*cp++);
+	return h;
+}
+
+static unsigned long long fnv_strlist(unsigned long long h, int count, struct strlist **list)
+{
+	int i=0;
+	for(i=0; i<count; i++)
+	{
+		h=fnv(h, list[i]->flag?"+":"-");
+		h=fnv(h, list[i]->path);
+	}
+	return fnv(h, "");
+}
+
+static unsigned long long fnv_long(unsigned long long h, long l)
+{
+	char tmp[32]="";
+	snprintf(tmp, sizeof(tmp), "%ld", l);
+	return fnv(h, tmp);
+}
+
+// Covers everything in the configuration that changes what the scan finds.
+// If any of it changes, the old cache cannot be used.
+static unsigned long long fingerprint(struct config *conf)
+{
+	unsigned long long h=FNV_OFFSET;
+	h=fnv_strlist(h, conf->iecount, conf->incexcdir);
+	h=fnv_strlist(h, conf->fscount, conf->fschgdir);
+	h=fnv_strlist(h, conf->nbcount, conf->nobackup);
+	h=fnv_strlist(h, conf->incount, conf->incext);
+	h=fnv_strlist(h, conf->excount, conf->excext);
+	h=fnv_strlist(h, conf->ircount, conf->increg);
+	h=fnv_strlist(h, conf->ercount, conf->excreg);
+	h=fnv_strlist(h, conf->exfscount, conf->excfs);
+	h=fnv_strlist(h, conf->ffcount, conf->fifos);
+	h=fnv_strlist(h, conf->bdcount, conf->blockdevs);
+	h=fnv_long(h, conf->cross_all_filesystems);
+	h=fnv_long(h, conf->read_all_fifos);
+	h=fnv_long(h, conf->read_all_blockdevs);
+	h=fnv_long(h, (long)conf->min_file_size);
+	h=fnv_long(h, (long)conf->max_file_size);
+	return h;
+}
+
+static void set_key(struct dirkey *key, const char *path, struct stat *statp)
+{
+	key->hash=fnv(FNV_OFFSET, path);
+	if(!key->hash) key->hash=1;
+	key->dev=(unsigned long long)statp->st_dev;
+	key->ino=(unsigned long long)statp->st_ino;
+	key->mtime=(unsigned long long)statp->st_mtime;
+	key->ctime=(unsigned long long)statp->st_ctime;
+	key->off=0;
+}
+
+static int same_key(struct dirkey *a, struct dirkey *b)
+{
+	return a->hash==b->hash
+	  && a->dev==b->dev
+	  && a->ino==b->ino
+	  && a->mtime==b->mtime
+	  && a->ctime==b->ctime;
+}
+
+static struct dirkey *find_key(unsigned long long hash)
+{
+	size_t i=0;
+	if(!oldkeys) return NULL;
+	for(i=hash&(oldslots-1); oldkeys[i].hash; i=(i+1)&(oldslots-1))
+		if(oldkeys[i].hash==hash) return &(oldkeys[i]);
+	return NULL;
+}
+
+static void insert_key(struct dirkey *key)
+{
+	size_t i=0;
+	// If two paths have the same hash, the first one wins, and the other
+	// is always scanned.
+	if(find_key(key->hash)) return;
+	for(i=key->hash&(oldslots-1); oldkeys[i].hash; i=(i+1)&(oldslots-1))
+		{ }
+	oldkeys[i]=*key;
+}
+
+static void free_items(struct frame *f)
+{
+	int i=0;
+	for(i=0; i<f->icount; i++)
+	{
+		if(f->items[i].path) free(f->items[i].path);
+		if(f->items[i].link) free(f->items[i].link);
+	}
+	if(f->items) free(f->items);
+	f->items=NULL;
+	f->icount=0;
+	f->inext=0;
+}
+
+static void free_frame(struct frame *f)
+{
+	free_items(f);
+	if(f->path) free(f->path);
+	if(f->buf) free(f->buf);
+	memset(f, 0, sizeof(struct frame));
+}
+
+static void free_old(void)
+{
+	if(oldfp) { fclose(oldfp); oldfp=NULL; }
+	if(oldkeys) { free(oldkeys); oldkeys=NULL; }
+	oldslots=0;
+}
+
+// Reads a message of the given type, replacing whatever was in buf.
+static int read_msg(char want, char **buf, size_t *len)
+{
+	char cmd='\0';
+	if(*buf) { free(*buf); *buf=NULL; }
+	if(async_read_fp(oldfp, NULL, &cmd, buf, len)) return -1;
+	return cmd==want?0:-1;
+}
+
+// Returns 0 if the old cache has been loaded, 1 if there is no old cache
+// that can be used, or -1 on error.
+static int load_old(const char *path, const char *fpstr, int verify, int *backups, char **jid, unsigned long long *joff)
+{
+	int ret=1;
+	char *buf=NULL;
+	size_t len=0;
+	char trailer[TRAILER_LEN+1]="";
+	unsigned long long ioff=0;
+	unsigned long long count=0;
+	unsigned long long i=0;
+
+	if(!(oldfp=fopen(path, "rb")))
+	{
+		if(errno!=ENOENT)
+			logp("could not open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if(read_msg(SC_VERSION, &buf, &len)
+	  || strcmp(buf, SCANCACHE_VERSION)
+	  || read_msg(SC_FINGERPRINT, &buf, &len))
+		goto bad;
+	if(strcmp(buf, fpstr))
+	{
+		logp("Configuration has changed since the last scan cache\n");
+		goto end;
+	}
+	if(read_msg(SC_BACKUPS, &buf, &len)) goto bad;
+	*backups=atoi(buf);
+	if(read_msg(SC_JOURNAL, &buf, &len)) goto bad;
+	if(len)
+	{
+		char *cp=NULL;
+		if(!(cp=strrchr(buf, ' '))) goto bad;
+		*cp++='\0';
+		*joff=strtoull(cp, NULL, 16);
+		if(!(*jid=strdup(buf)))
+		{
+			logp("out of memory\n");
+			ret=-1;
+			goto end;
+		}
+	}
+	if(verify && *backups+1>=verify)
+	{
+		logp("Scan cache used for %d backups - scanning everything\n",
+			*backups);
+		goto end;
+	}
+
+	if(fseeko(oldfp, -TRAILER_LEN, SEEK_END)
+	  || fread(trailer, 1, TRAILER_LEN, oldfp)!=TRAILER_LEN
+	  || sscanf(trailer, "%llx", &ioff)!=1
+	  || fseeko(oldfp, (off_t)ioff, SEEK_SET)
+	  || read_msg(SC_INDEX, &buf, &len))
+		goto bad;
+	count=strtoull(buf, NULL, 10);
+	for(oldslots=16; oldslots<count*2; oldslots*=2) { }
+	if(!(oldkeys=(struct dirkey *)
+		calloc(oldslots, sizeof(struct dirkey))))
+	{
+		logp("out of memory\n");
+		ret=-1;
+		goto end;
+	}
+	for(i=0; i<count; i++)
+	{
+		struct dirkey key;
+		if(read_msg(SC_INDEX_ENTRY, &buf, &len)
+		  || sscanf(buf, "%llx %llx %llx %llx %llx %llx",
+			&key.hash, &key.dev, &key.ino,
+			&key.mtime, &key.ctime, &key.off)!=6
+		  || !key.hash)
+			goto bad;
+		insert_key(&key);
+	}
+	ret=0;
+	goto end;
+bad:
+	logp("%s is not a usable scan cache - scanning everything\n", path);
+end:
+	if(buf) free(buf);
+	if(ret)
+	{
+		free_old();
+		if(*jid) { free(*jid); *jid=NULL; }
+	}
+	return ret;
+}
+
+static struct scanitem *new_item(struct frame *f, int *alloc)
+{
+	struct scanitem *item=NULL;
+	if(f->icount>=*alloc)
+	{
+		struct scanitem *tmp=NULL;
+		int a=*alloc?(*alloc)*2:32;
+		if(!(tmp=(struct scanitem *)
+			realloc(f->items, a*sizeof(struct scanitem))))
+		{
+			logp("out of memory\n");
+			return NULL;
+		}
+		f->items=tmp;
+		*alloc=a;
+	}
+	item=&(f->items[f->icount++]);
+	memset(item, 0, sizeof(struct scanitem));
+	return item;
+}
+
+// Returns 0 if the entries of the directory have been loaded from the old
+// cache, 1 if they could not be, or -1 on error.
+static int load_items(struct frame *f, unsigned long long off)
+{
+	int ret=-1;
+	int alloc=0;
+	int comp=0;
+	char cmd='\0';
+	char *cp=NULL;
+	char *buf=NULL;
+	size_t len=0;
+	struct scanitem *item=NULL;
+
+	if(fseeko(oldfp, (off_t)off, SEEK_SET)
+	  || read_msg(SC_DIR, &buf, &len)
+	  || strcmp(buf, f->path))
+		goto bad;
+	while(1)
+	{
+		if(buf) { free(buf); buf=NULL; }
+		if(async_read_fp(oldfp, NULL, &cmd, &buf, &len)) goto bad;
+		if(cmd==SC_DIR_END) break;
+		if(cmd==SC_LINK)
+		{
+			if(!item || item->descend || item->link) goto bad;
+			item->link=buf;
+			buf=NULL;
+			continue;
+		}
+		if(cmd!=CMD_STAT) goto bad;
+		if(!(item=new_item(f, &alloc))) goto end;
+		decode_stat(buf, &item->statp, &item->winattr, &comp);
+		free(buf);
+		buf=NULL;
+		if(async_read_fp(oldfp, NULL, &cmd, &buf, &len)) goto bad;
+		if(cmd==SC_SUBDIR)
+		{
+			item->descend=1;
+			cp=buf;
+		}
+		else if(cmd==SC_FILE)
+		{
+			item->type=(int)strtol(buf, &cp, 10);
+			if(*cp++!=' ') goto bad;
+		}
+		else
+			goto bad;
+		// The directory path already ends with a slash.
+		if(!(item->path=prepend(f->path, cp, strlen(cp), NULL)))
+			goto end;
+		if(item->descend && journal_ok)
+		{
+			// Its stat from last time is still right, unless
+			// something has changed in it.
+			char *dpath=NULL;
+			if(!(dpath=prepend(item->path, "/", 1, NULL)))
+				goto end;
+			item->trusted=!journal_changed(dpath);
+			free(dpath);
+		}
+	}
+	ret=0;
+	goto end;
+bad:
+	logp("scan cache entry for %s is damaged\n", f->path);
+	ret=1;
+end:
+	if(buf) free(buf);
+	if(ret) free_items(f);
+	return ret;
+}
+
+static int put_msg(char cmd, const char *data, size_t len)
+{
+	if(send_msg_fp(newfp, cmd, data, len)) return -1;
+	newoff+=5+len+1;
+	return 0;
+}
+
+// Adds a message to what will be written for the directory.
+static int frame_add(struct frame *f, char cmd, const char *data, size_t len)
+{
+	if(len>MAX_MSG_LEN)
+	{
+		f->nocache=1;
+		return 0;
+	}
+	if(f->len+len+7>f->alloc)
+	{
+		char *tmp=NULL;
+		size_t a=f->alloc?f->alloc:4096;
+		while(f->len+len+7>a) a*=2;
+		if(!(tmp=(char *)realloc(f->buf, a)))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		f->buf=tmp;
+		f->alloc=a;
+	}
+	snprintf(f->buf+f->len, 6, "%c%04X", cmd, (unsigned int)len);
+	f->len+=5;
+	memcpy(f->buf+f->len, data, len);
+	f->len+=len;
+	f->buf[f->len++]='\n';
+	return 0;
+}
+
+static int write_frame(struct frame *f)
+{
+	if(newcount>=newalloc)
+	{
+		struct dirkey *tmp=NULL;
+		size_t a=newalloc?newalloc*2:1024;
+		if(!(tmp=(struct dirkey *)
+			realloc(newkeys, a*sizeof(struct dirkey))))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		newkeys=tmp;
+		newalloc=a;
+	}
+	f->key.off=newoff;
+	newkeys[newcount++]=f->key;
+	if(put_msg(SC_DIR, f->path, f->plen)) return -1;
+	if(f->len && fwrite(f->buf, 1, f->len, newfp)!=f->len)
+	{
+		logp("could not write to %s: %s\n", tmppath, strerror(errno));
+		return -1;
+	}
+	newoff+=f->len;
+	return put_msg(SC_DIR_END, "", 0);
+}
+
+static int write_index(void)
+{
+	size_t i=0;
+	char buf[256]="";
+	unsigned long long ioff=newoff;
+
+	snprintf(buf, sizeof(buf), "%lu", (unsigned long)newcount);
+	if(put_msg(SC_INDEX, buf, strlen(buf))) return -1;
+	for(i=0; i<newcount; i++)
+	{
+		struct dirkey *k=&(newkeys[i]);
+		snprintf(buf, sizeof(buf), "%llx %llx %llx %llx %llx %llx",
+			k->hash, k->dev, k->ino, k->mtime, k->ctime, k->off);
+		if(put_msg(SC_INDEX_ENTRY, buf, strlen(buf))) return -1;
+	}
+	if(fprintf(newfp, "%016llx\n", ioff)!=TRAILER_LEN)
+	{
+		logp("could not write to %s: %s\n", tmppath, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int scancache_open(struct config *conf)
+{
+	int loaded=0;
+	int backups=0;
+	char fpstr[32]="";
+	char tmp[32]="";
+	char *jid=NULL;
+	char *newjid=NULL;
+	unsigned long long joff=0;
+	unsigned long long newjoff=0;
+	char *jbuf=NULL;
+
+	if(!conf->scan_cache) return 0;
+
+	started=time(NULL);
+	compression=conf->compression;
+	dirs=0;
+	hits=0;
+	journal_ok=0;
+	journalled=0;
+	snprintf(fpstr, sizeof(fpstr), "%016llx", fingerprint(conf));
+	switch(load_old(conf->scan_cache, fpstr,
+		conf->verify_cache_every_n_backups, &backups, &jid, &joff))
+	{
+		case -1: return -1;
+		case 0: loaded=1; break;
+		case 1: backups=-1; break;
+	}
+
+	if(conf->change_journal)
+	{
+		// Read even without an old cache, to know where the next
+		// backup should start from.
+		journalled=1;
+		journal_ok=!journal_read(conf->change_journal, jid, joff,
+			&newjid, &newjoff);
+		if(loaded && !journal_ok)
+		{
+			logp("Change journal does not cover the time since the last backup - scanning everything\n");
+			free_old();
+			backups=-1;
+		}
+		if(!loaded) journal_ok=0;
+	}
+	if(jid) free(jid);
+
+	if(!(newpath=strdup(conf->scan_cache))
+	  || !(tmppath=get_tmp_filename(conf->scan_cache)))
+	{
+		logp("out of memory\n");
+		goto error;
+	}
+	if(!(newfp=fopen(tmppath, "wb")))
+	{
+		logp("could not open %s: %s\n", tmppath, strerror(errno));
+		goto error;
+	}
+	newoff=0;
+	snprintf(tmp, sizeof(tmp), "%d", backups+1);
+	if(newjid)
+	{
+		if(!(jbuf=(char *)malloc(strlen(newjid)+32)))
+		{
+			logp("out of memory\n");
+			goto error;
+		}
+		sprintf(jbuf, "%s %llx", newjid, newjoff);
+	}
+	if(put_msg(SC_VERSION, SCANCACHE_VERSION, strlen(SCANCACHE_VERSION))
+	  || put_msg(SC_FINGERPRINT, fpstr, strlen(fpstr))
+	  || put_msg(SC_BACKUPS, tmp, strlen(tmp))
+	  || put_msg(SC_JOURNAL, jbuf?jbuf:"", jbuf?strlen(jbuf):0))
+		goto error;
+	if(newjid) free(newjid);
+	if(jbuf) free(jbuf);
+	return 0;
+error:
+	if(newjid) free(newjid);
+	if(jbuf) free(jbuf);
+	scancache_close(0);
+	return -1;
+}
+
+int scancache_close(int ok)
+{
+	int ret=0;
+
+	// Anything still here is from a scan that stopped part way through.
+	while(depth>0) free_frame(&(stack[--depth]));
+
+	if(newfp)
+	{
+		if(ok && write_index()) ret=-1;
+		if(fclose(newfp) && ok && !ret)
+		{
+			logp("could not close %s: %s\n",
+				tmppath, strerror(errno));
+			ret=-1;
+		}
+		newfp=NULL;
+		if(ok && !ret)
+		{
+			if(do_rename(tmppath, newpath)) ret=-1;
+			else logp("Scan cache: %llu of %llu directories unchanged\n",
+				hits, dirs);
+		}
+		if(!ok || ret) unlink(tmppath);
+	}
+
+	free_old();
+	journal_free();
+	journal_ok=0;
+	if(stack) { free(stack); stack=NULL; }
+	salloc=0;
+	if(newkeys) { free(newkeys); newkeys=NULL; }
+	newcount=0;
+	newalloc=0;
+	if(newpath) { free(newpath); newpath=NULL; }
+	if(tmppath) { free(tmppath); tmppath=NULL; }
+	return ret;
+}
+
+int scancache_begin(const char *path, struct stat *statp)
+{
+	struct frame *f=NULL;
+	struct dirkey *old=NULL;
+
+	if(!newfp) return 0;
+
+	if(depth>=salloc)
+	{
+		struct frame *tmp=NULL;
+		int a=salloc?salloc*2:32;
+		if(!(tmp=(struct frame *)realloc(stack, a*sizeof(struct frame))))
+		{
+			logp("out of memory\n");
+			return -1;
+		}
+		stack=tmp;
+		salloc=a;
+	}
+	f=&(stack[depth++]);
+	memset(f, 0, sizeof(struct frame));
+	if(!(f->path=strdup(path)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	f->plen=strlen(path);
+	set_key(&f->key, path, statp);
+	dirs++;
+
+	// A change within the same second as the scan would not show up in
+	// the mtime, so do not trust it next time.
+	if(statp->st_mtime>=started-1 || statp->st_ctime>=started-1
+	  || f->plen>MAX_MSG_LEN)
+		f->nocache=1;
+
+	if(journal_ok && journal_changed(path)) return 0;
+	if(!(old=find_key(f->key.hash)) || !same_key(old, &f->key))
+		return 0;
+	switch(load_items(f, old->off))
+	{
+		case -1: return -1;
+		case 1: return 0;
+	}
+	hits++;
+	return 1;
+}
+
+int scancache_next(struct scanitem **item)
+{
+	// The stack may have moved since last time.
+	struct frame *f=NULL;
+	if(!depth) return 0;
+	f=&(stack[depth-1]);
+	if(f->inext>=f->icount) return 0;
+	*item=&(f->items[f->inext++]);
+	return 1;
+}
+
+int scancache_end(void)
+{
+	int ret=0;
+	struct frame *f=NULL;
+	if(!newfp || !depth) return 0;
+	f=&(stack[depth-1]);
+	if(!f->nocache) ret=write_frame(f);
+	free_frame(f);
+	depth--;
+	return ret;
+}
+
+int scancache_add(FF_PKT *ff)
+{
+	int ret=0;
+	char *tmp=NULL;
+	const char *name=NULL;
+	struct frame *f=NULL;
+	char attribs[MAXSTRING]="";
+
+	if(!newfp || !depth) return 0;
+	f=&(stack[depth-1]);
+	if(f->nocache || ff->type==FT_DIREND) return 0;
+
+	// Only things directly in the directory can be cached with it.
+	if(strncmp(ff->fname, f->path, f->plen)
+	  || !*(name=ff->fname+f->plen)
+	  || strchr(name, '/'))
+	{
+		f->nocache=1;
+		return 0;
+	}
+
+	switch(ff->type)
+	{
+		case FT_DIRBEGIN:
+			break;
+		case FT_REG:
+		case FT_REGE:
+		case FT_LNK:
+		case FT_SPEC:
+		case FT_FIFO:
+		case FT_RAW:
+			// Hard links depend on what else the scan has found.
+			if(ff->linked) f->nocache=1;
+			// A change through another of its links would not
+			// show up in the change journal for this directory.
+			if(journalled && ff->statp.st_nlink>1) f->nocache=1;
+			break;
+		default:
+			f->nocache=1;
+			break;
+	}
+	if(f->nocache) return 0;
+
+	if(!(tmp=(char *)malloc(strlen(name)+32)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	sprintf(tmp, "%d %s", ff->type, name);
+	encode_stat(attribs, &ff->statp, ff->winattr, compression);
+	if(frame_add(f, CMD_STAT, attribs, strlen(attribs))
+	  || (ff->type==FT_DIRBEGIN
+		&& frame_add(f, SC_SUBDIR, name, strlen(name)))
+	  || (ff->type!=FT_DIRBEGIN
+		&& frame_add(f, SC_FILE, tmp, strlen(tmp)))
+	  || (ff->type==FT_LNK
+		&& frame_add(f, SC_LINK, ff->link, strlen(ff->link))))
+			ret=-1;
+	free(tmp);
+	return ret;
+}
+
+#else
+
+int scancache_open(struct config *conf)
+{
+	if(conf->scan_cache)
+		logp("scan_cache is not supported on Windows\n");
+	return 0;
+}
+
+int scancache_close(int ok)
+{
+	return 0;
+}
+
+int scancache_begin(const char *path, struct stat *statp)
+{
+	return 0;
+}
+
+int scancache_next(struct scanitem **item)
+{
+	return 0;
+}
+
+int scancache_end(void)
+{
+	return 0;
+}
+
+int scancache_add(FF_PKT *ff)
+{
+	return 0;
+}
+
+#endif
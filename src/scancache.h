@@ -0,0 +1,45 @@
+#ifndef _SCANCACHE_H
+#define _SCANCACHE_H
+
+/* A record, kept by the client, of what the file system scan found in each
+   directory. If a directory has the same device, inode, mtime and ctime as
+   last time, nothing has been added to it, removed from it or renamed in it,
+   so what was sent for its entries last time is sent again without looking
+   at them. Its subdirectories are still checked in the same way.
+
+   A file that is changed in place does not change its directory, so the
+   cache misses it until the next full scan. verify_cache_every_n_backups
+   says how often that happens, unless there is a change journal - see
+   journal.h. */
+
+// One entry of a directory, as it was found last time.
+struct scanitem
+{
+	char *path;
+	char *link; // target of a soft link, or NULL
+	int type; // FT_ type, for send_file()
+	struct stat statp;
+	int64_t winattr;
+	int descend; // a subdirectory, to be scanned again
+	int trusted; // statp of the subdirectory can be used without lstat
+};
+
+// Loads the cache from the last backup, if conf->scan_cache is set, and
+// starts a new one. Returns 0 on success, or -1 on error.
+extern int scancache_open(struct config *conf);
+// Replaces the old cache with the new one if ok is set, or throws the new
+// one away.
+extern int scancache_close(int ok);
+// Called when the scan goes into a directory, with its path ending in a
+// slash. Returns 1 if its entries can be taken from scancache_next()
+// instead of reading it, 0 if it has to be read, or -1 on error. Either way,
+// scancache_end() must be called when the scan has finished with it.
+extern int scancache_begin(const char *path, struct stat *statp);
+// Gets the next cached entry of the directory. Returns 1 with item set, 0
+// at the end, or -1 on error.
+extern int scancache_next(struct scanitem **item);
+extern int scancache_end(void);
+// Records something that the scan is sending to the server.
+extern int scancache_add(FF_PKT *ff);
+
+#endif
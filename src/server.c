@@ -5,7 +5,7 @@
 #include "rs_buf.h"
 #include "handy.h"
 #include "asyncio.h"
-#include "zlibio.h"
+#include "zcodec.h"
 #include "counter.h"
 #include "dpth.h"
 #include "sbuf.h"
@@ -25,8 +25,11 @@
 #include "incexc_recv.h"
 #include "incexc_send.h"
 #include "ca_server.h"
+#include "ratelimit.h"
+#include "admission.h"
 
 #include <netdb.h>
+#include <sys/resource.h>
 #include <librsync.h>
 
 static int sfd=-1; // status fd for the main server
@@ -164,6 +167,10 @@ struct chldstat
 	char *data; // last message sent from the child
 	char *name; // client name
 	int status_server; // set to 1 if this is a status server child.
+	int worker; // set to 1 if this is a pre-forked worker.
+	char *wdata; // last statistics line sent from a worker
+	int admitted; // set to 1 while the child is allowed to run a backup
+	time_t admitted_at;
 };
 
 // Want sigchld_handler to be able to access this, but you cannot pass any
@@ -183,10 +190,100 @@ static void chldstat_free(struct chldstat *chld)
 		free(chld->name);
 		chld->name=NULL;
 	}
+	if(chld->wdata)
+	{
+		free(chld->wdata);
+		chld->wdata=NULL;
+	}
+	chld->worker=0;
+	if(chld->admitted)
+	{
+		admission_finished(time(NULL)-chld->admitted_at);
+		chld->admitted=0;
+	}
 	close_fd(&(chld->rfd));
 	close_fd(&(chld->wfd));
 }
 
+static int count_admitted(void)
+{
+	int q=0;
+	int running=0;
+	for(q=0; chlds && chlds[q].pid!=-2; q++)
+		if(chlds[q].pid>=0 && chlds[q].admitted) running++;
+	return running;
+}
+
+static void chldstat_admission(struct chldstat *chld, const char *line, struct config *conf)
+{
+	char reply[64]="";
+	// On error, let the backup go ahead rather than leave it stuck.
+	if(admission_decide(conf, line, count_admitted(),
+		reply, sizeof(reply)))
+	{
+		chld->admitted=1;
+		chld->admitted_at=time(NULL);
+	}
+	if(chld->wfd>=0 && write(chld->wfd, reply, strlen(reply))<0)
+		logp("could not send admission to child %d: %s\n",
+			chld->pid, strerror(errno));
+}
+
+// Take any control lines, which start with a tab, out of buf. These are
+// statistics from a pre-forked worker, of which the latest is kept, and
+// requests to start a backup. Whatever is left is the status of the client
+// being served.
+static void chldstat_control_data(struct chldstat *chld, char *buf, struct config *conf)
+{
+	char *cp=NULL;
+	char *st=NULL;
+	char *line=NULL;
+	char *from=buf;
+	size_t plen=strlen(WORKER_STATUS_PREFIX);
+
+	while((line=strchr(from, '\t')))
+	{
+		if(!(cp=strchr(line, '\n'))) break;
+		*cp++='\0';
+		// Only whole lines count.
+		if(line!=buf && *(line-1)!='\n')
+		{
+			*(cp-1)='\n';
+			from=cp;
+			continue;
+		}
+		if(!strncmp(line, ADMISSION_PREFIX, strlen(ADMISSION_PREFIX)))
+		{
+			chldstat_admission(chld, line, conf);
+		}
+		else if(!strncmp(line, WORKER_STATUS_PREFIX, plen))
+		{
+			if(chld->wdata) free(chld->wdata);
+			if((chld->wdata=(char *)malloc(cp-line+1)))
+				snprintf(chld->wdata, cp-line+1, "%s\n", line);
+			// A worker that has gone idle has finished with its
+			// client.
+			if((st=strchr(line+plen, '\t'))
+			  && !strncmp(st, "\tidle\t", 6))
+			{
+				if(chld->name)
+				{
+					free(chld->name);
+					chld->name=NULL;
+				}
+				if(chld->admitted)
+				{
+					admission_finished(
+					  time(NULL)-chld->admitted_at);
+					chld->admitted=0;
+				}
+			}
+		}
+		memmove(line, cp, strlen(cp)+1);
+		from=line;
+	}
+}
+
 // Remove any exiting child pids from our list.
 static void check_for_exiting_children(void)
 {
@@ -239,6 +336,9 @@ int setup_signals(int oldmax_children, int max_children, int oldmax_status_child
 		chlds[p].data=NULL;
 		chlds[p].name=NULL;
 		chlds[p].status_server=0;
+		chlds[p].worker=0;
+		chlds[p].wdata=NULL;
+		chlds[p].admitted=0;
 	}
 	// There is one extra entry in the list, as an 
 	// end marker so that sigchld_handler does not fall
@@ -323,6 +423,8 @@ static int do_backup_server(const char *basedir, const char *current, const char
 	char *realworking=NULL;
 	char tstmp[64]="";
 	char *datadirtmp=NULL;
+	// Signatures of the last backup's files, kept by phase4
+	char *currentsigs=NULL;
 
 	struct dpth dpth;
 
@@ -334,7 +436,8 @@ static int do_backup_server(const char *basedir, const char *current, const char
 	if(!(timestamp=prepend_s(working, "timestamp", strlen("timestamp")))
 	  || !(newpath=prepend_s(working, "patched.tmp", strlen("patched.tmp")))
 	  || !(cmanifest=prepend_s(current, "manifest.gz", strlen("manifest.gz")))
-	  || !(datadirtmp=prepend_s(working, "data.tmp", strlen("data.tmp"))))
+	  || !(datadirtmp=prepend_s(working, "data.tmp", strlen("data.tmp")))
+	  || !(currentsigs=prepend_s(current, "signatures", strlen("signatures"))))
 	{
 		log_and_send("out of memory");
 		goto error;
@@ -439,7 +542,8 @@ static int do_backup_server(const char *basedir, const char *current, const char
 	//if(cmanfp) logp("Current manifest: %s\n", cmanifest);
 
 	if(backup_phase2_server(&cmanfp, phase1data, phase2data, unchangeddata,
-		datadirtmp, &dpth, currentdata, working, client,
+		datadirtmp, &dpth, currentdata,
+		cconf->signature_cache?currentsigs:NULL, working, client,
 		p1cntr, resume, cntr, cconf))
 	{
 		logp("error in backup phase 2\n");
@@ -497,6 +601,7 @@ end:
 	if(newpath) free(newpath);
 	if(cmanifest) free(cmanifest);
 	if(datadirtmp) free(datadirtmp);
+	if(currentsigs) free(currentsigs);
 	set_logfp(NULL, cconf); // does an fclose on logfp.
 	return ret;
 }
@@ -842,6 +947,27 @@ static void maybe_do_notification(int status, const char *client, const char *ba
 	}
 }
 
+// Works out what the client is to compress file data with, falling back to
+// gzip when either side does not have the algorithm that is configured.
+static void set_compression(struct config *cconf)
+{
+	int alg=cconf->compression_algorithm;
+	if(alg!=ZC_GZIP
+	  && (!zcodec_supported(alg) || !(cconf->compressors & (1<<alg))))
+	{
+		logp("%s compression is not possible with this client - using gzip\n",
+			zcodec_name(alg));
+		alg=cconf->compression_algorithm=ZC_GZIP;
+	}
+	if(cconf->compression>ZC_MAX_LEVEL(alg))
+	{
+		logp("compression level %d is too high for %s - using %d\n",
+			cconf->compression, zcodec_name(alg),
+			ZC_MAX_LEVEL(alg));
+		cconf->compression=ZC_MAX_LEVEL(alg);
+	}
+}
+
 static int child(struct config *conf, struct config *cconf, const char *client, const char *cversion, const char *incexc, int srestore, char cmd, char *buf, char **gotlock, int *timer_ret, struct cntr *p1cntr, struct cntr *cntr)
 {
 	int ret=0;
@@ -952,10 +1078,44 @@ static int child(struct config *conf, struct config *cconf, const char *client,
 				}
 			}
 
+			if(conf->max_concurrent_backups || conf->max_writeback)
+			{
+				int a=0;
+				struct admission adm;
+				while((a=admission_request(cconf,
+					client, current, &adm))>0)
+				{
+					char qstr[64]="";
+					if(!cconf->can_queue)
+					{
+						// Older clients do not know
+						// about the queue, so keep
+						// them waiting here.
+						sleep(adm.retry);
+						continue;
+					}
+					logp("Backup of %s is queued\n", client);
+					snprintf(qstr, sizeof(qstr),
+						"queued:%d:%ld:%d", adm.position,
+						adm.expected, adm.retry);
+					async_write_str(CMD_GEN, qstr);
+					goto end;
+				}
+				if(a<0)
+				{
+					log_and_send("problem with backup admission");
+					ret=-1;
+					goto end;
+				}
+			}
+
 			buf=NULL;
 
+			set_compression(cconf);
 			snprintf(okstr, sizeof(okstr), "%s:%d",
-				resume?"resume":"ok", cconf->compression);
+				resume?"resume":"ok",
+				zcodec_tag(cconf->compression_algorithm,
+					cconf->compression));
 			async_write_str(CMD_GEN, okstr);
 			ret=do_backup_server(basedir, current, working,
 			  currentdata, finishing, cconf,
@@ -1227,6 +1387,34 @@ static int extra_comms(char **client, const char *cversion, char **incexc, int *
 		if(append_to_feat(&feat, "counters:"))
 			return -1;
 
+		/* Clients can send the phase1 scan packed into batches. */
+		if(append_to_feat(&feat, "phase1bin:"))
+			return -1;
+
+		/* Clients can agree a bigger network frame size. */
+		if(append_to_feat(&feat, "frame_size:"))
+			return -1;
+
+		/* Clients can have the connection deflated. */
+		if(append_to_feat(&feat, "net_compression:"))
+			return -1;
+
+		/* Clients can say which compression algorithms they have. */
+		if(append_to_feat(&feat, "compressors:"))
+			return -1;
+
+		/* Clients can send several files at once, on separate
+		   channels. */
+		if(conf->network_channels>1
+		  && append_to_feat(&feat, "channels:"))
+			return -1;
+
+		/* Clients can be told to come back later if their backup
+		   is queued. */
+		if((conf->max_concurrent_backups || conf->max_writeback)
+		  && append_to_feat(&feat, "queue:"))
+			return -1;
+
 		//printf("feat: %s\n", feat);
 
 		if(async_write_str(CMD_GEN, feat))
@@ -1328,6 +1516,101 @@ static int extra_comms(char **client, const char *cversion, char **incexc, int *
 				logp("Client supports being sent counters.\n");
 				cconf->send_client_counters=1;
 			}
+			else if(!strcmp(buf, "queueok"))
+			{
+				// Client can go away and come back later
+				// if its backup is queued.
+				logp("Client supports being queued.\n");
+				cconf->can_queue=1;
+			}
+			else if(!strcmp(buf, "phase1binok"))
+			{
+				// Client will send the phase1 scan packed
+				// into batches.
+				logp("Client supports packed phase1.\n");
+				cconf->phase1_binary=1;
+			}
+			else if(!strncmp(buf,
+				"compressors=", strlen("compressors=")))
+			{
+				// Client can compress and decompress file
+				// data with these.
+				int alg=0;
+				const char *list=buf+strlen("compressors=");
+				cconf->compressors=0;
+				for(alg=0; alg<ZC_ALGS; alg++)
+					if(zcodec_in_list(list, alg))
+						cconf->compressors|=1<<alg;
+				logp("Client compressors: %s\n", list);
+			}
+			else if(!strncmp(buf,
+				"frame_size=", strlen("frame_size=")))
+			{
+				// Client wants bigger frames. Use the smaller
+				// of what the two of us allow. Both sides
+				// switch straight after this reply.
+				char msg[64]="";
+				unsigned long fsize=0;
+				fsize=strtoul(buf+strlen("frame_size="),
+					NULL, 10);
+				if(fsize>conf->max_frame_size)
+					fsize=conf->max_frame_size;
+				if(fsize<MIN_FRAME_SIZE)
+					fsize=ASYNC_BUF_LEN;
+				snprintf(msg, sizeof(msg),
+					"frame_size=%lu", fsize);
+				if(async_write_str(CMD_GEN, msg)
+				  || async_set_frame_size(fsize))
+				{
+					ret=-1;
+					break;
+				}
+				logp("Using network frame size of %lu bytes\n",
+					fsize);
+			}
+			else if(!strncmp(buf,
+				"channels=", strlen("channels=")))
+			{
+				// As for the frame size, use the smaller
+				// number, and switch straight after the reply.
+				int n=0;
+				char msg[64]="";
+				n=atoi(buf+strlen("channels="));
+				if(n>conf->network_channels)
+					n=conf->network_channels;
+				if(n<=1) n=0;
+				snprintf(msg, sizeof(msg), "channels=%d", n);
+				if(async_write_str(CMD_GEN, msg)
+				  || async_set_channels(n?n+1:0))
+				{
+					ret=-1;
+					break;
+				}
+				if(n) logp("Using %d network channels\n", n);
+			}
+			else if(!strncmp(buf,
+				"net_compression=", strlen("net_compression=")))
+			{
+				// Client wants the connection deflated. Switch
+				// straight after the reply, as for the frame
+				// size.
+				int level=0;
+				char msg[64]="";
+				level=atoi(buf+strlen("net_compression="));
+				if(level<0) level=0;
+				if(level>9) level=9;
+				snprintf(msg, sizeof(msg),
+					"net_compression=%d", level);
+				if(async_write_str(CMD_GEN, msg)
+				  || (level && async_set_compression(level)))
+				{
+					ret=-1;
+					break;
+				}
+				if(level)
+					logp("Using network compression level %d\n",
+						level);
+			}
 			else if(!strncmp(buf,
 				"orig_client=", strlen("orig_client="))
 			  && strlen(buf)>strlen("orig_client="))
@@ -1358,6 +1641,8 @@ static int extra_comms(char **client, const char *cversion, char **incexc, int *
 				}
 				sconf->send_client_counters=
 					cconf->send_client_counters;
+				sconf->can_queue=cconf->can_queue;
+				sconf->compressors=cconf->compressors;
 				for(r=0; r<sconf->rccount; r++)
 				{
 					if(sconf->rclients[r])
@@ -1438,7 +1723,56 @@ static int extra_comms(char **client, const char *cversion, char **incexc, int *
 	return ret;
 }
 
-static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, int forking)
+// Set when a pre-forked worker should not take on any more sessions.
+static int worker_retire=0;
+
+// Statistics that a pre-forked worker sends to the parent, which passes them
+// on to the status server children.
+struct workerstat
+{
+	int sessions;     // number of sessions served
+	int max_sessions; // recycle the worker after this many sessions
+	int handshakes;   // number of connections that got through SSL_accept
+	struct timeval accepted; // when the current connection was accepted
+	unsigned long last_ms;   // accept latency of the latest connection
+	unsigned long total_ms;  // sum of the accept latencies
+};
+
+static void worker_report(struct workerstat *ws, const char *state)
+{
+	long maxrss=0;
+	char buf[256]="";
+	struct rusage ru;
+
+	if(status_wfd<0) return;
+	if(!getrusage(RUSAGE_SELF, &ru)) maxrss=ru.ru_maxrss;
+
+	snprintf(buf, sizeof(buf), "%s%d\t%s\t%d\t%d\t%ld\t%lu\t%lu\n",
+		WORKER_STATUS_PREFIX, (int)getpid(), state,
+		ws->sessions, ws->max_sessions, maxrss, ws->last_ms,
+		ws->handshakes?ws->total_ms/ws->handshakes:0);
+	if(write(status_wfd, buf, strlen(buf))<0)
+	{
+		logp("error writing worker status down pipe to server: %s\n",
+			strerror(errno));
+		close_fd(&status_wfd);
+	}
+}
+
+// The accept latency is the time from accept() returning to the end of the
+// SSL handshake. This is the part that pre-forking is meant to make short.
+static void worker_session_started(struct workerstat *ws)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	ws->last_ms=(now.tv_sec-ws->accepted.tv_sec)*1000
+		+(now.tv_usec-ws->accepted.tv_usec)/1000;
+	ws->total_ms+=ws->last_ms;
+	ws->handshakes++;
+	worker_report(ws, "busy");
+}
+
+static int run_session(int *cfd, SSL_CTX *ctx, struct config *conf, struct workerstat *ws)
 {
 	int ret=0;
 	char cmd;
@@ -1453,7 +1787,7 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 	int srestore=0;
 	char *gotlock=NULL;
 	int timer_ret=0;
-	struct config conf;
+	int async_owns=0; // set once asyncio has taken over ssl and cfd
 	struct config cconf;
 
 	struct cntr p1cntr; // cntr for phase1 (scan)
@@ -1462,13 +1796,7 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 	reset_filecounter(&p1cntr, time(NULL));
 	reset_filecounter(&cntr, time(NULL));
 
-	if(forking) close_fd(rfd);
-
-	// Reload global config, in case things have changed. This means that
-	// the server does not need to be restarted for most config changes.
-	init_config(&conf);
 	init_config(&cconf);
-	if(load_config(configfile, &conf, 1)) return -1;
 
 	if(!(sbio=BIO_new_socket(*cfd, BIO_NOCLOSE))
 	  || !(ssl=SSL_new(ctx)))
@@ -1495,12 +1823,16 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 		goto finish;
 	}
 	ret=0;
-	if(async_init(*cfd, ssl, &conf, 0))
+	ssl_count_handshake(ssl);
+	ssl_log_ktls(ssl, conf);
+	if(ws) worker_session_started(ws);
+	async_owns=1;
+	if(async_init(*cfd, ssl, conf, 0))
 	{
 		ret=-1;
 		goto finish;
 	}
-	if(authorise_server(&conf, &client, &cversion, &cconf, &p1cntr)
+	if(authorise_server(conf, &client, &cversion, &cconf, &p1cntr)
 		|| !client || !*client)
 	{
 		// add an annoying delay in case they are tempted to
@@ -1514,7 +1846,7 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 	/* At this point, the client might want to get a new certificate
 	   signed. Clients on 1.3.2 or newer can do this. */
 	if((ca_ret=ca_server_maybe_sign_client_cert(client, cversion,
-		&conf, &p1cntr))<0)
+		conf, &p1cntr))<0)
 	{
 		// Error.
 		logp("Error signing client certificate request for %s\n",
@@ -1537,14 +1869,15 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 	if(ssl_check_cert(ssl, &cconf))
 	{
 		log_and_send("check cert failed on server");
-		return -1;
+		ret=-1;
+		goto finish;
 	}
 
 	/* Has to be before the chuser/chgrp stuff to allow clients to switch
 	   to different clients when both clients have different user/group
 	   settings. */
 	if(extra_comms(&client, cversion, &incexc, &srestore,
-		&conf, &cconf, &p1cntr))
+		conf, &cconf, &p1cntr))
 	{
 		log_and_send("running extra comms failed on server");
 		ret=-1;
@@ -1556,8 +1889,8 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 	// The main process could have already done this, so we don't want
 	// to try doing it again if cconf has the same values, because it
 	// will fail.
-	if(  (!conf.user  || (cconf.user && strcmp(conf.user, cconf.user)))
-	  || (!conf.group || (cconf.group && strcmp(conf.group, cconf.group))))
+	if(  (!conf->user  || (cconf.user && strcmp(conf->user, cconf.user)))
+	  || (!conf->group || (cconf.group && strcmp(conf->group, cconf.group))))
 	{
 		if(chuser_and_or_chgrp(cconf.user, cconf.group))
 		{
@@ -1565,6 +1898,9 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 			ret=-1;
 			goto finish;
 		}
+		// A worker cannot go back to the original user and group
+		// for the next session.
+		worker_retire=1;
 	}
 
 	set_non_blocking(*cfd);
@@ -1592,7 +1928,7 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 		// want to run.
 	}
 
-	if(!ret) ret=child(&conf, &cconf, client, cversion, incexc, srestore,
+	if(!ret) ret=child(conf, &cconf, client, cversion, incexc, srestore,
 		cmd, buf, &gotlock, &timer_ret, &p1cntr, &cntr);
 
 	if((!ret || cconf.server_script_post_run_on_fail)
@@ -1616,6 +1952,14 @@ static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, i
 	}
 
 finish:
+	if(!async_owns)
+	{
+		// The handshake did not get as far as asyncio, so clean up
+		// here. A pre-forked worker would otherwise leak these.
+		if(ssl) SSL_free(ssl);
+		else if(sbio) BIO_free(sbio);
+		close_fd(cfd);
+	}
 	*cfd=-1;
 	if(gotlock)
 	{
@@ -1628,11 +1972,28 @@ finish:
 	if(cversion) free(cversion);
 	if(buf) free(buf);
 	if(incexc) free(incexc);
-	free_config(&conf);
 	free_config(&cconf);
 	return ret;
 }
 
+static int run_child(int *rfd, int *cfd, SSL_CTX *ctx, const char *configfile, int forking)
+{
+	int ret=0;
+	struct config conf;
+
+	if(forking) close_fd(rfd);
+
+	// Reload global config, in case things have changed. This means that
+	// the server does not need to be restarted for most config changes.
+	init_config(&conf);
+	if(load_config(configfile, &conf, 1)) return -1;
+
+	ret=run_session(cfd, ctx, &conf, NULL);
+
+	free_config(&conf);
+	return ret;
+}
+
 static int run_status_server(int *rfd, int *cfd, const char *configfile)
 {
 	int ret=0;
@@ -1656,81 +2017,143 @@ static int run_status_server(int *rfd, int *cfd, const char *configfile)
 	return ret;
 }
 
-static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, const char *configfile, int is_status_server)
+// Wait for a connection on the listening socket, which all the workers share.
+// Returns 1 if the parent has closed its end of our pipe, which means that it
+// wants us to exit.
+static int worker_accept(int rfd, int *cfd)
 {
-	int cfd=-1;
-	socklen_t client_length=0;
-	struct sockaddr_in client_name;
+	int mfd=-1;
+	fd_set fsr;
+	struct timeval tval;
 
-	client_length=sizeof(client_name);
-	if((cfd=accept(rfd,
-		(struct sockaddr *) &client_name,
-		&client_length))==-1)
+	FD_ZERO(&fsr);
+
+	tval.tv_sec=1;
+	tval.tv_usec=0;
+
+	add_fd_to_sets(rfd, &fsr, NULL, NULL, &mfd);
+	if(status_rfd>=0) add_fd_to_sets(status_rfd, &fsr, NULL, NULL, &mfd);
+
+	if(select(mfd+1, &fsr, NULL, NULL, &tval)<0)
 	{
-		// Look out, accept will get interrupted by SIGCHLDs.
-		if(errno==EINTR) return 0;
-		logp("accept failed on %d: %s\n", rfd, strerror(errno));
+		if(errno==EAGAIN || errno==EINTR) return 0;
+		logp("select error in worker: %s\n", strerror(errno));
 		return -1;
 	}
-	reuseaddr(cfd);
-	check_for_exiting_children();
 
-	if(conf->forking)
+	if(status_rfd>=0 && FD_ISSET(status_rfd, &fsr))
 	{
-	  int p=0;
-	  int pipe_rfd[2];
-	  int pipe_wfd[2];
-	  pid_t childpid;
-	  int c_count=0;
-	  int sc_count=0;
-	  int total_max_children=conf->max_children+conf->max_status_children;
+		char buf[32];
+		if(read(status_rfd, buf, sizeof(buf))<=0) return 1;
+	}
 
-	  /* Need to count status children separately from normal children. */
-	  for(p=0; p<total_max_children; p++)
-	  {
-		if(chlds[p].pid>=0)
+	if(!FD_ISSET(rfd, &fsr)) return 0;
+
+	if((*cfd=accept(rfd, NULL, NULL))<0)
+	{
+		// The listening socket is non-blocking, because another
+		// worker may have got to the connection first.
+		if(errno==EAGAIN || errno==EWOULDBLOCK
+		  || errno==EINTR || errno==ECONNABORTED)
+			return 0;
+		logp("accept failed on %d: %s\n", rfd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int run_worker(int *rfd, SSL_CTX *ctx, const char *configfile)
+{
+	int r=0;
+	int ret=0;
+	int cfd=-1;
+	int directory_tree=0;
+	struct config conf;
+	struct workerstat ws;
+
+	// Status clients are dealt with by the parent.
+	close_fd(&sfd);
+
+	// Load the config once, rather than once per session.
+	init_config(&conf);
+	if(load_config(configfile, &conf, 1)) return -1;
+	// extra_comms() turns this off for old clients, so it needs to be put
+	// back after each session.
+	directory_tree=conf.directory_tree;
+
+	memset(&ws, 0, sizeof(ws));
+	ws.max_sessions=conf.prefork_max_sessions;
+	worker_report(&ws, "idle");
+
+	while(!worker_retire)
+	{
+		if(ws.max_sessions && ws.sessions>=ws.max_sessions)
 		{
-			if(chlds[p].status_server) sc_count++;
-			else c_count++;
+			logp("worker has served %d sessions - exiting\n",
+				ws.sessions);
+			break;
 		}
-	  }
+		if((r=worker_accept(*rfd, &cfd))<0)
+		{
+			ret=-1;
+			break;
+		}
+		if(r>0) break;
+		if(cfd<0) continue;
 
-	  if(!is_status_server && c_count>=conf->max_children)
-	  {
-		logp("Too many child processes. Closing new connection.\n");
-		close_fd(&cfd);
-		return 0;
-	  }
-	  if(is_status_server && sc_count>=conf->max_status_children)
-	  {
-		logp("Too many status child processes. Closing new connection.\n");
-		close_fd(&cfd);
-		return 0;
-	  }
+		gettimeofday(&ws.accepted, NULL);
+		reuseaddr(cfd);
+		set_blocking(cfd);
 
-	  // Find a spare slot in our pid list for the child.
-	  for(p=0; p<total_max_children; p++)
-	  {
-		if(chlds[p].pid<0) break;
-	  }
-	  if(p>=total_max_children)
-	  {
-		logp("Too many total child processes. Closing new connection.\n");
-		close_fd(&cfd);
-		return 0;
-	  }
-	  if(pipe(pipe_rfd)<0
-	    || pipe(pipe_wfd)<0)
-	  {
+		run_session(&cfd, ctx, &conf, &ws);
+
+		ws.sessions++;
+		conf.directory_tree=directory_tree;
+		// Stop writing to the log of the previous client.
+		set_logfp(NULL, &conf);
+		worker_report(&ws, "idle");
+	}
+
+	close_fd(rfd);
+	free_config(&conf);
+	logp("exit worker\n");
+	return ret;
+}
+
+// Fork a child into slot p of chlds. The child either deals with the
+// connection on cfd, or, if it is a pre-forked worker, accepts connections on
+// rfd for itself.
+static int fork_child(int p, int *rfd, int *cfd, SSL_CTX *ctx, struct config *conf, const char *configfile, int is_status_server, int is_worker)
+{
+	int q=0;
+	int pipe_rfd[2];
+	int pipe_wfd[2];
+	pid_t childpid;
+
+	if(pipe(pipe_rfd)<0)
+	{
 		logp("pipe failed: %s", strerror(errno));
-		close_fd(&cfd);
+		close_fd(cfd);
 		return -1;
-	  }
-	  /* fork off our new process to handle this request */
-	  switch((childpid=fork()))
-	  {
+	}
+	if(pipe(pipe_wfd)<0)
+	{
+		logp("pipe failed: %s", strerror(errno));
+		close(pipe_rfd[0]);
+		close(pipe_rfd[1]);
+		close_fd(cfd);
+		return -1;
+	}
+	/* fork off our new process to handle this request */
+	switch((childpid=fork()))
+	{
 		case -1:
 			logp("fork failed: %s\n", strerror(errno));
+			close(pipe_rfd[0]);
+			close(pipe_rfd[1]);
+			close(pipe_wfd[0]);
+			close(pipe_wfd[1]);
+			close_fd(cfd);
 			break;
 		case 0:
 		{
@@ -1744,6 +2167,15 @@ static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, c
 			sa.sa_handler=SIG_DFL;
 			sigaction(SIGCHLD, &sa, NULL);
 
+			// Do not hold on to the pipes of the other children.
+			// A worker would otherwise stop its siblings from
+			// seeing the parent close their pipes.
+			for(q=0; chlds[q].pid!=-2; q++)
+			{
+				close_fd(&(chlds[q].rfd));
+				close_fd(&(chlds[q].wfd));
+			}
+
 			close(pipe_rfd[0]); // close read end
 			close(pipe_wfd[1]); // close write end
 
@@ -1753,10 +2185,12 @@ static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, c
 			status_wfd=pipe_rfd[1];
 			status_rfd=pipe_wfd[0];
 
-			if(is_status_server)
-			  ret=run_status_server(&rfd, &cfd, configfile);
+			if(is_worker)
+			  ret=run_worker(rfd, ctx, configfile);
+			else if(is_status_server)
+			  ret=run_status_server(rfd, cfd, configfile);
 			else
-			  ret=run_child(&rfd, &cfd, ctx,
+			  ret=run_child(rfd, cfd, ctx,
 				configfile, conf->forking);
 			close_fd(&status_wfd);
 			close_fd(&status_rfd);
@@ -1768,7 +2202,9 @@ static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, c
 			close(pipe_wfd[0]); // close read end
 
 			// keep a note of the child pid.
-			if(is_status_server)
+			if(is_worker)
+				logp("forked worker pid %d\n", childpid);
+			else if(is_status_server)
 				logp("forked status server child pid %d\n", childpid);
 			else
 				logp("forked child pid %d\n", childpid);
@@ -1776,10 +2212,80 @@ static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, c
 			chlds[p].rfd=pipe_rfd[0];
 			chlds[p].wfd=pipe_wfd[1];
 			chlds[p].status_server=is_status_server;
+			chlds[p].worker=is_worker;
 			set_blocking(chlds[p].rfd);
-			close_fd(&cfd);
+			close_fd(cfd);
 			break;
+	}
+	return 0;
+}
+
+static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, const char *configfile, int is_status_server)
+{
+	int cfd=-1;
+	socklen_t client_length=0;
+	struct sockaddr_in client_name;
+
+	client_length=sizeof(client_name);
+	if((cfd=accept(rfd,
+		(struct sockaddr *) &client_name,
+		&client_length))==-1)
+	{
+		// Look out, accept will get interrupted by SIGCHLDs.
+		// The socket is non-blocking if workers have been
+		// pre-forked, and they may have taken the connection.
+		if(errno==EINTR || errno==EAGAIN || errno==EWOULDBLOCK)
+			return 0;
+		logp("accept failed on %d: %s\n", rfd, strerror(errno));
+		return -1;
+	}
+	reuseaddr(cfd);
+	check_for_exiting_children();
+
+	if(conf->forking)
+	{
+	  int p=0;
+	  int c_count=0;
+	  int sc_count=0;
+	  int total_max_children=conf->max_children+conf->max_status_children;
+
+	  /* Need to count status children separately from normal children. */
+	  for(p=0; p<total_max_children; p++)
+	  {
+		if(chlds[p].pid>=0)
+		{
+			if(chlds[p].status_server) sc_count++;
+			else c_count++;
+		}
+	  }
+
+	  if(!is_status_server && c_count>=conf->max_children)
+	  {
+		logp("Too many child processes. Closing new connection.\n");
+		close_fd(&cfd);
+		return 0;
+	  }
+	  if(is_status_server && sc_count>=conf->max_status_children)
+	  {
+		logp("Too many status child processes. Closing new connection.\n");
+		close_fd(&cfd);
+		return 0;
+	  }
+
+	  // Find a spare slot in our pid list for the child.
+	  for(p=0; p<total_max_children; p++)
+	  {
+		if(chlds[p].pid<0) break;
 	  }
+	  if(p>=total_max_children)
+	  {
+		logp("Too many total child processes. Closing new connection.\n");
+		close_fd(&cfd);
+		return 0;
+	  }
+	  if(fork_child(p, &rfd, &cfd, ctx, conf, configfile,
+		is_status_server, 0 /* not a worker */))
+		return -1;
 	}
 	else
 	{
@@ -1793,53 +2299,47 @@ static int process_incoming_client(int rfd, struct config *conf, SSL_CTX *ctx, c
 	return 0;
 }
 
-static int daemonise(void)
+// Keep prefork_children workers waiting for connections, without going over
+// max_children.
+static int fill_worker_pool(int *rfd, struct config *conf, SSL_CTX *ctx, const char *configfile)
 {
-	/* process ID */
-	pid_t pid;
-
-	/* session ID */
-	pid_t sid;
-
-	/* fork new child and end parent */
-	pid=fork();
-
-	/* did we fork? */
-	if(pid<0)
-	{
-		logp("error forking\n");
-		return -1;
-	}
-
-	/* parent? */
-	if(pid>0)
-		exit(EXIT_SUCCESS);
-
-	/* now we are in the child process */
+	int p=0;
+	int cfd=-1; // workers accept their own connections
+	int w_count=0;
+	int c_count=0;
+	int total_max_children=conf->max_children+conf->max_status_children;
 
-	/* create a session and set the process group ID */
-	sid=setsid();
-	if(sid<0)
+	// Workers that have been told to exit have had their wfd closed, and
+	// do not count towards the pool.
+	for(p=0; p<total_max_children; p++)
 	{
-		logp("error setting sid\n");
-		return -1;
+		if(chlds[p].pid<0 || chlds[p].status_server) continue;
+		c_count++;
+		if(chlds[p].worker && chlds[p].wfd>=0) w_count++;
 	}
 
-	/* leave and unblock current working dir */
-	if(chdir("/")<0)
+	for(; w_count<conf->prefork_children
+	  && c_count<conf->max_children; w_count++, c_count++)
 	{
-		logp("error changing working dir\n");
-		return -1;
+		for(p=0; p<total_max_children; p++)
+			if(chlds[p].pid<0) break;
+		if(p>=total_max_children) break;
+		if(fork_child(p, rfd, &cfd, ctx, conf, configfile,
+			0 /* not a status client */, 1 /* a worker */))
+				return -1;
 	}
-
-	/* close std* */
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
-
 	return 0;
 }
 
+// Tell the workers to exit once they have finished their current session.
+static void retire_workers(void)
+{
+	int q=0;
+	for(q=0; chlds && chlds[q].pid!=-2; q++)
+		if(chlds[q].pid>=0 && chlds[q].worker)
+			close_fd(&(chlds[q].wfd));
+}
+
 static int relock(const char *lockfile)
 {
 	int tries=5;
@@ -1857,6 +2357,10 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 	int ret=0;
 	SSL_CTX *ctx=NULL;
 	int found_normal_child=0;
+	time_t lastfill=0;
+	int total_max_children=conf->max_children+conf->max_status_children;
+	// Pre-forked workers accept connections on the main port themselves.
+	int prefork=conf->forking && conf->prefork_children;
 
 	if(!(ctx=ssl_initialise_ctx(conf)))
 	{
@@ -1869,6 +2373,18 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 		return 1;
 	}
 
+	if(ssl_session_cache_init(ctx, conf))
+	{
+		logp("error initialising ssl session cache\n");
+		return 1;
+	}
+
+	// Children inherit these, so that they all share the one limit
+	// and the one set of handshake counters.
+	if(ratelimit_shared_init(conf->ratelimit_total)
+	  || ssl_counters_init())
+		return 1;
+
 	if(!oldport
 	  || strcmp(oldport, conf->port))
 	{
@@ -1901,12 +2417,28 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 		tval.tv_sec=1;
 		tval.tv_usec=0;
 
-		add_fd_to_sets(*rfd, &fsr, NULL, &fse, &mfd);
+		if(!prefork) add_fd_to_sets(*rfd, &fsr, NULL, &fse, &mfd);
 		if(sfd>=0) add_fd_to_sets(sfd, &fsr, NULL, &fse, &mfd);
 
+		if(gentleshutdown)
+		{
+			retire_workers();
+		}
+		else if(prefork && lastfill!=time(NULL))
+		{
+			// At most once a second, so that workers that fail
+			// straight away do not cause a fork storm.
+			lastfill=time(NULL);
+			if(fill_worker_pool(rfd, conf, ctx, configfile))
+			{
+				ret=1;
+				break;
+			}
+		}
+
 		// Add read fds of normal children.
 		if(gentleshutdown) found_normal_child=0;
-		for(c=0; c<conf->max_children; c++)
+		for(c=0; c<total_max_children; c++)
 		{
 		  if(!chlds[c].status_server && chlds[c].rfd>=0)
 		  {
@@ -1971,7 +2503,7 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 			}
 		}
 
-		for(c=0; c<conf->max_children; c++)
+		for(c=0; c<total_max_children; c++)
 		{
 		  if(!chlds[c].status_server && chlds[c].rfd>=0)
 		  {
@@ -1995,6 +2527,12 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 					if(buf[l-1]=='\n')
 					{
 						buf[l]='\0';
+						chldstat_control_data(&chlds[c],
+							buf, conf);
+					}
+					else *buf='\0';
+					if(*buf)
+					{
 						chlds[c].data=strdup(buf);
 						//logp("got status: %s",
 						//	chlds[c].data);
@@ -2022,7 +2560,7 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 		mfd=-1;
 		FD_ZERO(&fsw);
 		FD_ZERO(&fse);
-		for(c=0; c<conf->max_children; c++)
+		for(c=0; c<total_max_children; c++)
 		  if(chlds[c].status_server && chlds[c].wfd>=0)
 			add_fd_to_sets(chlds[c].wfd, NULL, &fsw, &fse, &mfd);
 		if(mfd==-1)
@@ -2049,7 +2587,7 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 			}
 		}
 
-		for(c=0; c<conf->max_children; c++)
+		for(c=0; c<total_max_children; c++)
 		{
 		  if(chlds[c].status_server && chlds[c].wfd>=0)
 		  {
@@ -2064,7 +2602,7 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 				//printf("ready for write\n");
 				// Go through all the normal children and
 				// write their statuses to the status child.
-				for(d=0; d<conf->max_children; d++)
+				for(d=0; d<total_max_children; d++)
 				{
 				  if(!chlds[d].status_server && chlds[d].data)
 				  {
@@ -2072,12 +2610,19 @@ static int run_server(struct config *conf, const char *configfile, int *rfd, con
 					write(chlds[c].wfd, chlds[d].data,
 						strlen(chlds[d].data));
 				  }
+				  if(chlds[d].wdata)
+					write(chlds[c].wfd, chlds[d].wdata,
+						strlen(chlds[d].wdata));
 				}
 			}
 		  }
 		}
 	}
 
+	// Workers exit after their current session, and are replaced with
+	// ones that use the reloaded config.
+	retire_workers();
+
 	ssl_destroy_ctx(ctx);
 
 	return ret;
@@ -1,6 +1,12 @@
 #include "burp.h"
 #include "conf.h"
 #include "log.h"
+#include "ssl.h"
+
+#ifndef HAVE_WIN32
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
 
 static BIO *bio_err=0;
 static const char *pass=NULL;
@@ -110,6 +116,13 @@ SSL_CTX *ssl_initialise_ctx(struct config *conf)
 
 	if(ssl_load_keys_and_certs(ctx, conf)) return NULL;
 
+#ifdef SSL_OP_ENABLE_KTLS
+	// Hand the record layer to the kernel after the handshake, if the
+	// kernel and the negotiated cipher allow it. OpenSSL quietly keeps
+	// doing it in user space otherwise.
+	if(conf->ssl_ktls) SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
 	return ctx;
 }
 
@@ -118,6 +131,337 @@ void ssl_destroy_ctx(SSL_CTX *ctx)
 	SSL_CTX_free(ctx);
 }
 
+void ssl_log_ktls(SSL *ssl, struct config *conf)
+{
+	if(!conf->ssl_ktls) return;
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+	logp("kernel TLS: send %s, receive %s\n",
+		BIO_get_ktls_send(SSL_get_wbio(ssl))?"on":"off",
+		BIO_get_ktls_recv(SSL_get_rbio(ssl))?"on":"off");
+#endif
+}
+
+/* Handshake counters. The server sets these up in shared memory before
+   forking, so that all of its children add to the same ones. */
+static struct ssl_counters *counters=NULL;
+
+int ssl_counters_init(void)
+{
+#ifndef HAVE_WIN32
+	void *p;
+	if(counters) return 0;
+	if((p=mmap(NULL, sizeof(struct ssl_counters), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANON, -1, 0))==MAP_FAILED)
+	{
+		logp("could not mmap ssl counters: %s\n", strerror(errno));
+		return -1;
+	}
+	counters=(struct ssl_counters *)p;
+	memset(counters, 0, sizeof(struct ssl_counters));
+#endif
+	return 0;
+}
+
+void ssl_count_handshake(SSL *ssl)
+{
+	if(!counters) return;
+	if(SSL_session_reused(ssl))
+		__sync_fetch_and_add(&counters->resumed, 1);
+	else
+		__sync_fetch_and_add(&counters->full, 1);
+}
+
+int ssl_get_counters(struct ssl_counters *sc)
+{
+	if(!counters) return -1;
+	sc->full=counters->full;
+	sc->resumed=counters->resumed;
+	return 0;
+}
+
+/* The server session cache. Each session goes in its own file, named after
+   the session id, so that all the forked children and the server after a
+   restart can find them. */
+static char *cache_dir=NULL;
+static long cache_timeout=0;
+
+#ifndef HAVE_WIN32
+// Do not prune more often than this.
+#define PRUNE_INTERVAL	60
+
+static char *session_path(const unsigned char *id, unsigned int len)
+{
+	char *path=NULL;
+	unsigned int i=0;
+	size_t plen=strlen(cache_dir)+1+len*2+1;
+	if(!(path=(char *)malloc(plen)))
+	{
+		logp("out of memory\n");
+		return NULL;
+	}
+	snprintf(path, plen, "%s/", cache_dir);
+	for(i=0; i<len; i++)
+		snprintf(path+strlen(path), plen-strlen(path), "%02x", id[i]);
+	return path;
+}
+
+// Session files of clients that never come back would otherwise pile up.
+// A marker file records when this was last done, by any process.
+static void prune_cache(void)
+{
+	DIR *dirp=NULL;
+	char *marker=NULL;
+	struct dirent *dp=NULL;
+	struct stat statp;
+	time_t now=time(NULL);
+	size_t len=strlen(cache_dir)+strlen("/.pruned")+1;
+	int fd=-1;
+
+	if(!(marker=(char *)malloc(len))) return;
+	snprintf(marker, len, "%s/.pruned", cache_dir);
+	if(!lstat(marker, &statp) && now-statp.st_mtime<PRUNE_INTERVAL)
+	{
+		free(marker);
+		return;
+	}
+	if((fd=open(marker, O_WRONLY|O_CREAT|O_TRUNC, 0600))>=0) close(fd);
+	free(marker);
+
+	if(!(dirp=opendir(cache_dir))) return;
+	while((dp=readdir(dirp)))
+	{
+		char *path=NULL;
+		if(*(dp->d_name)=='.') continue;
+		len=strlen(cache_dir)+1+strlen(dp->d_name)+1;
+		if(!(path=(char *)malloc(len))) break;
+		snprintf(path, len, "%s/%s", cache_dir, dp->d_name);
+		if(!lstat(path, &statp) && S_ISREG(statp.st_mode)
+		  && now-statp.st_mtime>cache_timeout)
+			unlink(path);
+		free(path);
+	}
+	closedir(dirp);
+}
+
+static int cache_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	int fd=-1;
+	int len=0;
+	char *tmp=NULL;
+	char *path=NULL;
+	unsigned int idlen=0;
+	unsigned char *buf=NULL;
+	unsigned char *p=NULL;
+	const unsigned char *id=NULL;
+
+	id=SSL_SESSION_get_id(sess, &idlen);
+	if(!idlen || (len=i2d_SSL_SESSION(sess, NULL))<=0
+	  || !(path=session_path(id, idlen)))
+		return 0;
+	if(!(buf=(unsigned char *)malloc(len))
+	  || !(tmp=(char *)malloc(strlen(path)+32)))
+	{
+		logp("out of memory\n");
+		goto end;
+	}
+	p=buf;
+	i2d_SSL_SESSION(sess, &p);
+
+	// Write to a temporary file first, so that another child never
+	// reads half a session.
+	sprintf(tmp, "%s.%d", path, (int)getpid());
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600))<0)
+	{
+		logp("could not open %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	if(write(fd, buf, len)!=len)
+	{
+		logp("could not write %s: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto end;
+	}
+	close(fd);
+	if(rename(tmp, path))
+	{
+		logp("could not rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+	}
+	prune_cache();
+end:
+	if(buf) free(buf);
+	if(tmp) free(tmp);
+	free(path);
+	// We did not keep a reference to the session.
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *cache_get_cb(SSL *ssl, const unsigned char *id, int idlen, int *copy)
+#else
+static SSL_SESSION *cache_get_cb(SSL *ssl, unsigned char *id, int idlen, int *copy)
+#endif
+{
+	int fd=-1;
+	char *path=NULL;
+	ssize_t len=0;
+	unsigned char buf[8192];
+	const unsigned char *p=buf;
+	SSL_SESSION *sess=NULL;
+
+	*copy=0;
+	if(idlen<=0 || !(path=session_path(id, idlen))) return NULL;
+	if((fd=open(path, O_RDONLY))<0)
+	{
+		free(path);
+		return NULL;
+	}
+	len=read(fd, buf, sizeof(buf));
+	close(fd);
+	if(len>0 && len<(ssize_t)sizeof(buf))
+		sess=d2i_SSL_SESSION(NULL, &p, len);
+	if(sess && SSL_SESSION_get_time(sess)+SSL_SESSION_get_timeout(sess)
+		<time(NULL))
+	{
+		SSL_SESSION_free(sess);
+		sess=NULL;
+		unlink(path);
+	}
+	free(path);
+	return sess;
+}
+
+static void cache_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	char *path=NULL;
+	unsigned int idlen=0;
+	const unsigned char *id=NULL;
+	id=SSL_SESSION_get_id(sess, &idlen);
+	if(!idlen || !(path=session_path(id, idlen))) return;
+	unlink(path);
+	free(path);
+}
+#endif
+
+int ssl_session_cache_init(SSL_CTX *ctx, struct config *conf)
+{
+	static const unsigned char sid_ctx[]="burp";
+
+	// Resumed sessions skip the certificate exchange, so the server has
+	// to say which sessions belong to it.
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx)-1);
+	SSL_CTX_set_timeout(ctx, conf->ssl_session_timeout);
+
+	if(cache_dir)
+	{
+		free(cache_dir);
+		cache_dir=NULL;
+	}
+	// Without a cache directory, clients can still resume with session
+	// tickets. The ticket keys belong to the SSL_CTX, which the children
+	// inherit.
+	if(!conf->ssl_session_cache) return 0;
+#ifdef HAVE_WIN32
+	logp("ssl_session_cache is not supported on Windows\n");
+	return -1;
+#else
+	if(mkdir(conf->ssl_session_cache, 0700) && errno!=EEXIST)
+	{
+		logp("could not mkdir %s: %s\n",
+			conf->ssl_session_cache, strerror(errno));
+		return -1;
+	}
+	if(!(cache_dir=strdup(conf->ssl_session_cache)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	cache_timeout=conf->ssl_session_timeout;
+
+	// Keep the sessions in the files, rather than in tickets, so that
+	// they survive the server reloading and restarting.
+	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_session_cache_mode(ctx,
+		SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx, cache_new_cb);
+	SSL_CTX_sess_set_get_cb(ctx, cache_get_cb);
+	SSL_CTX_sess_set_remove_cb(ctx, cache_remove_cb);
+	return 0;
+#endif
+}
+
+/* The client keeps the session from its last connection in a file, and
+   offers it to the server the next time. */
+void ssl_load_client_session(SSL *ssl, struct config *conf)
+{
+	FILE *fp=NULL;
+	SSL_SESSION *sess=NULL;
+	if(!conf->ssl_session_cache
+	  || !(fp=fopen(conf->ssl_session_cache, "rb")))
+		return;
+	if((sess=PEM_read_SSL_SESSION(fp, NULL, NULL, NULL)))
+	{
+		SSL_set_session(ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+	fclose(fp);
+}
+
+void ssl_save_client_session(SSL *ssl, struct config *conf)
+{
+	int fd=-1;
+	FILE *fp=NULL;
+	char *tmp=NULL;
+	size_t len=0;
+	SSL_SESSION *sess=NULL;
+
+	if(!conf->ssl_session_cache) return;
+	if(SSL_session_reused(ssl)) logp("SSL session resumed\n");
+	// Save it even when it was resumed, because with TLS 1.3 the server
+	// sends a fresh ticket each time.
+	if(!(sess=SSL_get1_session(ssl))) return;
+	len=strlen(conf->ssl_session_cache)+32;
+	if(!(tmp=(char *)malloc(len)))
+	{
+		logp("out of memory\n");
+		goto end;
+	}
+	snprintf(tmp, len, "%s.%d", conf->ssl_session_cache, (int)getpid());
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600))<0
+	  || !(fp=fdopen(fd, "wb")))
+	{
+		logp("could not open %s: %s\n", tmp, strerror(errno));
+		if(fd>=0) close(fd);
+		goto end;
+	}
+	if(!PEM_write_SSL_SESSION(fp, sess))
+	{
+		logp("could not write SSL session to %s\n", tmp);
+		fclose(fp);
+		unlink(tmp);
+		goto end;
+	}
+	fclose(fp);
+#ifdef HAVE_WIN32
+	// Windows will not rename over an existing file.
+	unlink(conf->ssl_session_cache);
+#endif
+	if(rename(tmp, conf->ssl_session_cache))
+	{
+		logp("could not rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+	}
+end:
+	if(tmp) free(tmp);
+	SSL_SESSION_free(sess);
+}
+
+void ssl_forget_client_session(struct config *conf)
+{
+	if(conf->ssl_session_cache) unlink(conf->ssl_session_cache);
+}
+
 #ifndef HAVE_WIN32
 static void sanitise(char *buf)
 {
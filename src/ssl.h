@@ -7,5 +7,24 @@ extern int ssl_load_dh_params(SSL_CTX *ctx, struct config *conf);
 extern SSL_CTX *berr_exit(const char *fmt, ...);
 extern void ssl_load_globals(void);
 extern int ssl_check_cert(SSL *ssl, struct config *conf);
+// Says whether the connection went over to kernel TLS after the handshake.
+extern void ssl_log_ktls(SSL *ssl, struct config *conf);
+
+// Counts of SSL handshakes done by the server, shared by all its children.
+struct ssl_counters
+{
+	unsigned long full;
+	unsigned long resumed;
+};
+
+extern int ssl_counters_init(void);
+extern void ssl_count_handshake(SSL *ssl);
+extern int ssl_get_counters(struct ssl_counters *sc);
+
+// Lets clients that reconnect skip the full handshake.
+extern int ssl_session_cache_init(SSL_CTX *ctx, struct config *conf);
+extern void ssl_load_client_session(SSL *ssl, struct config *conf);
+extern void ssl_save_client_session(SSL *ssl, struct config *conf);
+extern void ssl_forget_client_session(struct config *conf);
 
 #endif
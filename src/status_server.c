@@ -8,6 +8,7 @@
 #include "sbuf.h"
 #include "current_backups_server.h"
 #include "status_server.h"
+#include "ssl.h"
 #include "list_client.h"
 #include "list_server.h"
 
@@ -30,6 +31,22 @@ struct cstat
 	time_t lockfile_mtime;
 };
 
+// The latest statistics line from each pre-forked worker, set from the
+// parent process.
+struct wstat
+{
+	int pid;
+	char *line;
+	time_t updated;
+};
+
+// The parent keeps passing on the lines of running workers, so a line that
+// has not been updated for this many seconds is from a worker that exited.
+#define WSTAT_STALE	10
+
+static struct wstat *wlist=NULL;
+static int wlen=0;
+
 int cstat_sort(const void *a, const void *b)
 {
 	struct cstat **x=(struct cstat **)a;
@@ -564,12 +581,97 @@ static int send_detail_to_client(int cfd, struct cstat **clist, int clen, const
 */
 
 
+static int wstat_update(const char *tok)
+{
+	int q=0;
+	int pid=0;
+	size_t len=0;
+	char *line=NULL;
+	time_t now=time(NULL);
+
+	pid=atoi(tok+strlen(WORKER_STATUS_PREFIX));
+	// Drop the leading tab, and add the newline back on the end.
+	len=strlen(tok)+1;
+	if(!(line=(char *)malloc(len)))
+	{
+		logp("out of memory\n");
+		return -1;
+	}
+	snprintf(line, len, "%s\n", tok+1);
+
+	for(q=0; q<wlen; q++) if(wlist[q].pid==pid) break;
+	if(q>=wlen)
+	{
+		// Reuse the entry of a worker that has gone away.
+		for(q=0; q<wlen; q++)
+			if(now-wlist[q].updated>WSTAT_STALE) break;
+	}
+	if(q>=wlen)
+	{
+		struct wstat *tmp=NULL;
+		if(!(tmp=(struct wstat *)
+			realloc(wlist, sizeof(struct wstat)*(wlen+1))))
+		{
+			logp("out of memory\n");
+			free(line);
+			return -1;
+		}
+		wlist=tmp;
+		wlist[wlen++].line=NULL;
+	}
+	if(wlist[q].line) free(wlist[q].line);
+	wlist[q].pid=pid;
+	wlist[q].line=line;
+	wlist[q].updated=now;
+	return 0;
+}
+
+static void wstat_free(void)
+{
+	int q=0;
+	for(q=0; q<wlen; q++)
+		if(wlist[q].line) free(wlist[q].line);
+	if(wlist) free(wlist);
+	wlist=NULL;
+	wlen=0;
+}
+
+static int send_workers_to_client(int cfd)
+{
+	int q=0;
+	time_t now=time(NULL);
+	for(q=0; q<wlen; q++)
+	{
+		if(!wlist[q].line || now-wlist[q].updated>WSTAT_STALE)
+			continue;
+		if(send_data_to_client(cfd,
+			wlist[q].line, strlen(wlist[q].line)))
+				return -1;
+	}
+	return 0;
+}
+
+static int send_handshakes_to_client(int cfd)
+{
+	char buf[128]="";
+	unsigned long total=0;
+	struct ssl_counters sc;
+	if(ssl_get_counters(&sc)) return 0;
+	total=sc.full+sc.resumed;
+	snprintf(buf, sizeof(buf), "handshakes\t%lu\t%lu\t%lu\n",
+		sc.full, sc.resumed, total?(sc.resumed*100)/total:0);
+	return send_data_to_client(cfd, buf, strlen(buf));
+}
+
 static int parse_parent_data_entry(char *tok, struct cstat **clist, int clen)
 {
 	int q=0;
 	char *tp=NULL;
 	//logp("status server got: %s", tok);
 
+	if(!strncmp(tok, WORKER_STATUS_PREFIX, strlen(WORKER_STATUS_PREFIX)))
+		return wstat_update(tok);
+
 	// Find the array entry for this client,
 	// and add the detail from the parent to it.
 	// The name of the client is at the start, and
@@ -845,6 +947,11 @@ static int parse_rbuf(const char *rbuf, int cfd, struct cstat **clist, int clen)
 	unsigned long bno=0;
 	struct cstat *cli=NULL;
 
+	// Statistics from the pre-forked workers.
+	if(!strcmp(rbuf, "w:")) return send_workers_to_client(cfd);
+	// How many SSL handshakes resumed an earlier session.
+	if(!strcmp(rbuf, "h:")) return send_handshakes_to_client(cfd);
+
 	cp=rbuf;
 	client=get_str(&cp, "c:", 0);
 	backup=get_str(&cp, "b:", 0);
@@ -1095,6 +1202,7 @@ int status_server(int *cfd, struct config *conf)
 		}
 	}
 
+	wstat_free();
 	close_fd(cfd);
 	return ret;
 }
@@ -1,6 +1,11 @@
 #ifndef STATUS_SERVER_H
 #define STATUS_SERVER_H
 
+// Prefix of the statistics lines that pre-forked workers send to the parent.
+// Client names cannot begin with a tab, so these cannot be confused with the
+// status lines of a client.
+#define WORKER_STATUS_PREFIX	"\tworker\t"
+
 extern int status_server(int *cfd, struct config *conf);
 
 #endif
@@ -0,0 +1,203 @@
+#include "burp.h"
+#include "prog.h"
+#include "workq.h"
+
+#if !defined(HAVE_WIN32) && defined(HAVE_PTHREAD)
+
+#include <pthread.h>
+
+struct workq
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nthreads;
+	int stopping;
+
+	// Items waiting for a thread. Threads take from the front.
+	struct workitem *queue;
+	struct workitem **qtail;
+
+	workq_run_t *run;
+	workq_done_t *done;
+	workq_free_t *free_item;
+	workq_tstart_t *tstart;
+	workq_tend_t *tend;
+};
+
+// Call with the lock held.
+static void unqueue(struct workq *q, struct workitem *wi)
+{
+	struct workitem **w=NULL;
+	for(w=&q->queue; *w; w=&((*w)->next))
+	{
+		if(*w!=wi) continue;
+		if(!(*w=wi->next)) q->qtail=w;
+		wi->next=NULL;
+		return;
+	}
+}
+
+static void *worker(void *arg)
+{
+	void *tdata=NULL;
+	struct workq *q=(struct workq *)arg;
+	if(q->tstart && !(tdata=q->tstart())) return NULL;
+	pthread_mutex_lock(&q->lock);
+	while(!q->stopping)
+	{
+		struct workitem *wi=NULL;
+		if(!q->queue)
+		{
+			pthread_cond_wait(&q->work_cond, &q->lock);
+			continue;
+		}
+		wi=q->queue;
+		unqueue(q, wi);
+		wi->state=WQ_RUNNING;
+		pthread_mutex_unlock(&q->lock);
+
+		q->run(wi, tdata);
+
+		pthread_mutex_lock(&q->lock);
+		wi->state=WQ_DONE;
+		if(wi->dropped) q->free_item(wi);
+		else if(q->done) q->done(wi);
+		pthread_cond_broadcast(&q->done_cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if(q->tend) q->tend(tdata);
+	return NULL;
+}
+
+struct workq *workq_new(int count, const char *what, workq_run_t *run, workq_done_t *done, workq_free_t *free_item, workq_tstart_t *tstart, workq_tend_t *tend)
+{
+	int t=0;
+	struct workq *q=NULL;
+	if(!(q=(struct workq *)calloc(1, sizeof(struct workq)))
+	  || !(q->threads=(pthread_t *)malloc(count*sizeof(pthread_t))))
+	{
+		logp("out of memory\n");
+		if(q) free(q);
+		return NULL;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->work_cond, NULL);
+	pthread_cond_init(&q->done_cond, NULL);
+	q->qtail=&q->queue;
+	q->run=run;
+	q->done=done;
+	q->free_item=free_item;
+	q->tstart=tstart;
+	q->tend=tend;
+	for(t=0; t<count; t++)
+	{
+		if(pthread_create(&(q->threads[t]), NULL, worker, q))
+		{
+			logp("could not start %s thread: %s\n",
+				what, strerror(errno));
+			break;
+		}
+		q->nthreads++;
+	}
+	if(!q->nthreads) workq_free(&q);
+	return q;
+}
+
+void workq_free(struct workq **q)
+{
+	int t=0;
+	if(!q || !*q) return;
+	pthread_mutex_lock(&(*q)->lock);
+	(*q)->stopping=1;
+	pthread_cond_broadcast(&(*q)->work_cond);
+	pthread_mutex_unlock(&(*q)->lock);
+	for(t=0; t<(*q)->nthreads; t++) pthread_join((*q)->threads[t], NULL);
+	while((*q)->queue) unqueue(*q, (*q)->queue);
+	pthread_mutex_destroy(&(*q)->lock);
+	pthread_cond_destroy(&(*q)->work_cond);
+	pthread_cond_destroy(&(*q)->done_cond);
+	free((*q)->threads);
+	free(*q);
+	*q=NULL;
+}
+
+void workq_lock(struct workq *q)
+{
+	pthread_mutex_lock(&q->lock);
+}
+
+void workq_unlock(struct workq *q)
+{
+	pthread_mutex_unlock(&q->lock);
+}
+
+void workq_add_locked(struct workq *q, struct workitem *wi)
+{
+	wi->state=WQ_QUEUED;
+	wi->dropped=0;
+	wi->next=NULL;
+	*(q->qtail)=wi;
+	q->qtail=&wi->next;
+	pthread_cond_signal(&q->work_cond);
+}
+
+void workq_push_locked(struct workq *q, struct workitem *wi)
+{
+	wi->state=WQ_QUEUED;
+	wi->dropped=0;
+	if(!(wi->next=q->queue)) q->qtail=&wi->next;
+	q->queue=wi;
+	pthread_cond_signal(&q->work_cond);
+}
+
+void workq_add(struct workq *q, struct workitem *wi)
+{
+	pthread_mutex_lock(&q->lock);
+	workq_add_locked(q, wi);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int workq_take_locked(struct workq *q, struct workitem *wi)
+{
+	while(wi->state==WQ_RUNNING)
+		pthread_cond_wait(&q->done_cond, &q->lock);
+	if(wi->state==WQ_DONE) return 1;
+	// Not started yet, so quicker for the caller to do it than to wait.
+	unqueue(q, wi);
+	wi->state=WQ_DONE;
+	return 0;
+}
+
+int workq_take(struct workq *q, struct workitem *wi)
+{
+	int ret=0;
+	pthread_mutex_lock(&q->lock);
+	ret=workq_take_locked(q, wi);
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+int workq_drop_locked(struct workq *q, struct workitem *wi)
+{
+	if(wi->state==WQ_RUNNING)
+	{
+		// The thread that is running it frees it.
+		wi->dropped=1;
+		return 0;
+	}
+	if(wi->state==WQ_QUEUED) unqueue(q, wi);
+	return 1;
+}
+
+void workq_drop(struct workq *q, struct workitem *wi)
+{
+	int mine=0;
+	pthread_mutex_lock(&q->lock);
+	mine=workq_drop_locked(q, wi);
+	pthread_mutex_unlock(&q->lock);
+	if(mine) q->free_item(wi);
+}
+
+#endif
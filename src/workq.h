@@ -0,0 +1,71 @@
+#ifndef _WORKQ_H
+#define _WORKQ_H
+
+/* A queue of work for a pool of threads, which the thread pools for reading
+   directories, opening files and deflating blocks are built on. The caller
+   hands items to the queue, and takes each one back when it needs the
+   result. An item that no thread has started on yet is taken back out of
+   the queue, so that the caller can do the work itself rather than wait.
+   Only available with pthreads, and not on Windows. */
+
+// States of an item given to the queue.
+#define WQ_QUEUED	0
+#define WQ_RUNNING	1
+#define WQ_DONE		2
+
+// Put one of these first in each item.
+struct workitem
+{
+	int state;
+	int dropped; // the caller has finished with it while it was running
+	struct workitem *next;
+};
+
+struct workq;
+
+// Does the work on an item, in a pool thread, without the lock. tdata is
+// what tstart gave the thread. No logging, because the log is not thread
+// safe.
+typedef void workq_run_t(struct workitem *wi, void *tdata);
+// Called with the lock held when a thread has finished with an item that
+// the caller still wants. May be NULL.
+typedef void workq_done_t(struct workitem *wi);
+// Frees an item.
+typedef void workq_free_t(struct workitem *wi);
+// Sets up what each thread keeps for itself between items, or returns NULL,
+// in which case the thread leaves the work to the others. May be NULL.
+typedef void *workq_tstart_t(void);
+typedef void workq_tend_t(void *tdata);
+
+// Starts count threads. what is for the log, if a thread cannot be started.
+// Returns NULL on error, or if not a single thread started.
+extern struct workq *workq_new(int count, const char *what, workq_run_t *run, workq_done_t *done, workq_free_t *free_item, workq_tstart_t *tstart, workq_tend_t *tend);
+// Stops the threads. Items still in the queue are left to whoever gave them,
+// to be freed.
+extern void workq_free(struct workq **q);
+
+extern void workq_lock(struct workq *q);
+extern void workq_unlock(struct workq *q);
+
+// Add an item at the back of the queue, or at the front, for the threads to
+// take next.
+extern void workq_add(struct workq *q, struct workitem *wi);
+// Call with the lock held.
+extern void workq_add_locked(struct workq *q, struct workitem *wi);
+extern void workq_push_locked(struct workq *q, struct workitem *wi);
+
+// Waits for a thread to finish with the item, if one has started on it.
+// Returns 1 if a thread did the work, or 0 if it was still queued, in which
+// case it is taken out of the queue for the caller to do. Either way, the
+// item is WQ_DONE afterwards. Call with the lock held.
+extern int workq_take_locked(struct workq *q, struct workitem *wi);
+extern int workq_take(struct workq *q, struct workitem *wi);
+
+// The caller has finished with the item. It is freed now, or by the thread
+// that is running it.
+extern void workq_drop(struct workq *q, struct workitem *wi);
+// Call with the lock held. Returns 1 if the caller must free the item, or 0
+// if the thread that is running it will.
+extern int workq_drop_locked(struct workq *q, struct workitem *wi);
+
+#endif
@@ -0,0 +1,729 @@
+#include "burp.h"
+#include "prog.h"
+#include "msg.h"
+#include "handy.h"
+#include "asyncio.h"
+#include "zcodec.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// The window that long distance matching uses. It is the most that zstd
+// will decompress without being told to allow more.
+#define ZSTD_LONG_WINDOW_LOG	27
+
+// Most that lz4 is given at once, so that what comes out fits in buf.
+#define LZ4_CHUNK	(64*1024)
+
+// How much of a zstd or lz4 file is read or written at once.
+#define ZFILE_BUF	(64*1024)
+
+static const char *names[ZC_ALGS]={ "gzip", "zstd", "lz4", "zstd-long" };
+static const char *suffixes[ZC_ALGS]={ ".gz", ".zst", ".lz4", ".zst" };
+
+static const unsigned char gzip_magic[2]={ 0x1f, 0x8b };
+static const unsigned char zstd_magic[4]={ 0x28, 0xb5, 0x2f, 0xfd };
+static const unsigned char lz4_magic[4]={ 0x04, 0x22, 0x4d, 0x18 };
+
+const char *zcodec_name(int alg)
+{
+	if(alg<0 || alg>=ZC_ALGS) return "unknown";
+	return names[alg];
+}
+
+int zcodec_from_name(const char *name)
+{
+	int alg=0;
+	for(alg=0; alg<ZC_ALGS; alg++)
+		if(!strcmp(name, names[alg])) return alg;
+	return -1;
+}
+
+int zcodec_supported(int alg)
+{
+	switch(alg)
+	{
+		case ZC_GZIP:
+			return 1;
+#ifdef HAVE_ZSTD
+		case ZC_ZSTD:
+		case ZC_ZSTD_LONG:
+			return 1;
+#endif
+#ifdef HAVE_LZ4
+		case ZC_LZ4:
+			return 1;
+#endif
+	}
+	return 0;
+}
+
+const char *zcodec_supported_list(void)
+{
+	int alg=0;
+	static char list[64]="";
+	if(*list) return list;
+	for(alg=0; alg<ZC_ALGS; alg++)
+	{
+		if(!zcodec_supported(alg)) continue;
+		if(*list) strcat(list, ",");
+		strcat(list, names[alg]);
+	}
+	return list;
+}
+
+int zcodec_in_list(const char *list, int alg)
+{
+	size_t len=0;
+	const char *cp=NULL;
+	if(alg<0 || alg>=ZC_ALGS) return 0;
+	len=strlen(names[alg]);
+	for(cp=list; cp; cp=strchr(cp, ','))
+	{
+		if(*cp==',') cp++;
+		if(!strncmp(cp, names[alg], len)
+		  && (cp[len]==',' || !cp[len]))
+			return 1;
+	}
+	return 0;
+}
+
+int zcodec_tag(int alg, int level)
+{
+	if(level<=0) return level;
+	return alg*ZC_STEP+level;
+}
+
+int zcodec_alg(int compression)
+{
+	if(compression<ZC_STEP) return ZC_GZIP;
+	return compression/ZC_STEP;
+}
+
+int zcodec_level(int compression)
+{
+	if(compression<0) return compression;
+	return compression%ZC_STEP;
+}
+
+const char *zcodec_suffix(int alg)
+{
+	if(alg<0 || alg>=ZC_ALGS) return "";
+	return suffixes[alg];
+}
+
+static int not_supported(int alg)
+{
+	logp("%s compression is not supported here\n", zcodec_name(alg));
+	return -1;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_error(size_t r)
+{
+	if(!ZSTD_isError(r)) return 0;
+	logp("zstd error: %s\n", ZSTD_getErrorName(r));
+	return -1;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int lz4_error(size_t r)
+{
+	if(!LZ4F_isError(r)) return 0;
+	logp("lz4 error: %s\n", LZ4F_getErrorName(r));
+	return -1;
+}
+#endif
+
+int zstrm_init_compress(struct zstrm *s, int compression)
+{
+	memset(s, 0, sizeof(struct zstrm));
+	s->compress=1;
+	s->alg=zcodec_alg(compression);
+	s->level=zcodec_level(compression);
+	if(s->level<=0 || s->level>ZC_MAX_LEVEL(s->alg))
+	{
+		logp("compression level %d out of range for %s\n",
+			s->level, zcodec_name(s->alg));
+		return -1;
+	}
+	switch(s->alg)
+	{
+		case ZC_GZIP:
+			if(deflateInit2(&s->z, s->level, Z_DEFLATED, (15+16),
+				8, Z_DEFAULT_STRATEGY)!=Z_OK)
+			{
+				logp("could not start deflate\n");
+				return -1;
+			}
+			s->zinit=1;
+			return 0;
+#ifdef HAVE_ZSTD
+		case ZC_ZSTD:
+		case ZC_ZSTD_LONG:
+		{
+			ZSTD_CCtx *cctx=NULL;
+			if(!(cctx=ZSTD_createCCtx()))
+			{
+				logp("out of memory in zstrm_init_compress\n");
+				return -1;
+			}
+			s->zstd=cctx;
+			if(zstd_error(ZSTD_CCtx_setParameter(cctx,
+				ZSTD_c_compressionLevel, s->level))
+			  || zstd_error(ZSTD_CCtx_setParameter(cctx,
+				ZSTD_c_checksumFlag, 1)))
+					return -1;
+			if(s->alg==ZC_ZSTD_LONG
+			  && (zstd_error(ZSTD_CCtx_setParameter(cctx,
+				ZSTD_c_enableLongDistanceMatching, 1))
+			  || zstd_error(ZSTD_CCtx_setParameter(cctx,
+				ZSTD_c_windowLog, ZSTD_LONG_WINDOW_LOG))))
+					return -1;
+			return 0;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case ZC_LZ4:
+		{
+			size_t r=0;
+			LZ4F_cctx *cctx=NULL;
+			LZ4F_preferences_t prefs;
+			memset(&prefs, 0, sizeof(prefs));
+			prefs.frameInfo.blockSizeID=LZ4F_max64KB;
+			prefs.frameInfo.contentChecksumFlag=
+				LZ4F_contentChecksumEnabled;
+			prefs.compressionLevel=s->level;
+			if(lz4_error(LZ4F_createCompressionContext(&cctx,
+				LZ4F_VERSION)))
+					return -1;
+			s->lz4=cctx;
+			s->bufsize=LZ4F_compressBound(LZ4_CHUNK, &prefs)
+				+LZ4F_HEADER_SIZE_MAX;
+			if(!(s->buf=(unsigned char *)malloc(s->bufsize)))
+			{
+				logp("out of memory in zstrm_init_compress\n");
+				return -1;
+			}
+			r=LZ4F_compressBegin(cctx, s->buf, s->bufsize, &prefs);
+			if(lz4_error(r)) return -1;
+			s->buflen=r;
+			return 0;
+		}
+#endif
+	}
+	return not_supported(s->alg);
+}
+
+int zstrm_init_decompress(struct zstrm *s)
+{
+	memset(s, 0, sizeof(struct zstrm));
+	s->alg=-1;
+	return 0;
+}
+
+// Copies out what lz4 has already compressed.
+static void drain_buf(struct zstrm *s)
+{
+	size_t n=s->buflen-s->bufpos;
+	if(n>s->avail_out) n=s->avail_out;
+	memcpy(s->next_out, s->buf+s->bufpos, n);
+	s->next_out+=n;
+	s->avail_out-=n;
+	s->bufpos+=n;
+}
+
+static int compress_run(struct zstrm *s, int finish)
+{
+	switch(s->alg)
+	{
+		case ZC_GZIP:
+		{
+			int zret=Z_OK;
+			s->z.next_in=(Bytef *)s->next_in;
+			s->z.avail_in=s->avail_in;
+			s->z.next_out=s->next_out;
+			s->z.avail_out=s->avail_out;
+			zret=deflate(&s->z, finish?Z_FINISH:Z_NO_FLUSH);
+			s->next_in=s->z.next_in;
+			s->avail_in=s->z.avail_in;
+			s->next_out=s->z.next_out;
+			s->avail_out=s->z.avail_out;
+			if(zret==Z_STREAM_ERROR)
+			{
+				logp("z_stream_error\n");
+				return ZS_ERROR;
+			}
+			if(zret==Z_STREAM_END) s->ended=1;
+			break;
+		}
+#ifdef HAVE_ZSTD
+		case ZC_ZSTD:
+		case ZC_ZSTD_LONG:
+		{
+			size_t r=0;
+			ZSTD_inBuffer in={ s->next_in, s->avail_in, 0 };
+			ZSTD_outBuffer out={ s->next_out, s->avail_out, 0 };
+			do
+			{
+				r=ZSTD_compressStream2((ZSTD_CCtx *)s->zstd,
+					&out, &in,
+					finish?ZSTD_e_end:ZSTD_e_continue);
+				if(zstd_error(r)) return ZS_ERROR;
+			} while(out.pos<out.size
+			  && (finish?r:in.pos<in.size));
+			s->next_in+=in.pos;
+			s->avail_in-=in.pos;
+			s->next_out+=out.pos;
+			s->avail_out-=out.pos;
+			if(finish && !r) s->ended=1;
+			break;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case ZC_LZ4:
+		{
+			size_t r=0;
+			size_t n=0;
+			LZ4F_cctx *cctx=(LZ4F_cctx *)s->lz4;
+			while(s->avail_out)
+			{
+				if(s->bufpos<s->buflen)
+				{
+					drain_buf(s);
+					continue;
+				}
+				s->bufpos=s->buflen=0;
+				if(s->avail_in)
+				{
+					n=s->avail_in>LZ4_CHUNK?
+						LZ4_CHUNK:s->avail_in;
+					r=LZ4F_compressUpdate(cctx, s->buf,
+						s->bufsize, s->next_in, n, NULL);
+					if(lz4_error(r)) return ZS_ERROR;
+					s->buflen=r;
+					s->next_in+=n;
+					s->avail_in-=n;
+				}
+				else if(finish && !s->ended)
+				{
+					r=LZ4F_compressEnd(cctx, s->buf,
+						s->bufsize, NULL);
+					if(lz4_error(r)) return ZS_ERROR;
+					s->buflen=r;
+					s->ended=1;
+				}
+				else break;
+			}
+			// Not the end until all of it has gone out.
+			if(s->ended && s->bufpos<s->buflen) return ZS_OK;
+			break;
+		}
+#endif
+		default:
+			return not_supported(s->alg);
+	}
+	return s->ended?ZS_END:ZS_OK;
+}
+
+static int start_decompress(struct zstrm *s)
+{
+	if(!memcmp(s->magic, gzip_magic, sizeof(gzip_magic)))
+		s->alg=ZC_GZIP;
+	else if(!memcmp(s->magic, zstd_magic, sizeof(zstd_magic)))
+		s->alg=ZC_ZSTD;
+	else if(!memcmp(s->magic, lz4_magic, sizeof(lz4_magic)))
+		s->alg=ZC_LZ4;
+	else
+	{
+		logp("compressed data of an unknown kind\n");
+		return -1;
+	}
+	switch(s->alg)
+	{
+		case ZC_GZIP:
+			if(inflateInit2(&s->z, (15+16))!=Z_OK)
+			{
+				logp("unable to init inflate\n");
+				return -1;
+			}
+			s->zinit=1;
+			return 0;
+#ifdef HAVE_ZSTD
+		case ZC_ZSTD:
+			if(!(s->zstd=ZSTD_createDCtx()))
+			{
+				logp("out of memory in start_decompress\n");
+				return -1;
+			}
+			return 0;
+#endif
+#ifdef HAVE_LZ4
+		case ZC_LZ4:
+		{
+			LZ4F_dctx *dctx=NULL;
+			if(lz4_error(LZ4F_createDecompressionContext(&dctx,
+				LZ4F_VERSION)))
+					return -1;
+			s->lz4=dctx;
+			return 0;
+		}
+#endif
+	}
+	return not_supported(s->alg);
+}
+
+// Decompresses from in, until all of in has been used, or the output is full,
+// or the stream has ended.
+static int decompress_some(struct zstrm *s, const unsigned char **in, size_t *inlen)
+{
+	switch(s->alg)
+	{
+		case ZC_GZIP:
+		{
+			int zret=Z_OK;
+			s->z.next_in=(Bytef *)*in;
+			s->z.avail_in=*inlen;
+			s->z.next_out=s->next_out;
+			s->z.avail_out=s->avail_out;
+			zret=inflate(&s->z, Z_NO_FLUSH);
+			*in=s->z.next_in;
+			*inlen=s->z.avail_in;
+			s->next_out=s->z.next_out;
+			s->avail_out=s->z.avail_out;
+			switch(zret)
+			{
+				case Z_NEED_DICT:
+				case Z_DATA_ERROR:
+				case Z_MEM_ERROR:
+				case Z_STREAM_ERROR:
+					logp("zstrm inflate error: %d\n", zret);
+					return -1;
+				case Z_STREAM_END:
+					s->ended=1;
+					break;
+			}
+			return 0;
+		}
+#ifdef HAVE_ZSTD
+		case ZC_ZSTD:
+		{
+			size_t r=1;
+			ZSTD_inBuffer zin={ *in, *inlen, 0 };
+			ZSTD_outBuffer zout={ s->next_out, s->avail_out, 0 };
+			while(r && zin.pos<zin.size && zout.pos<zout.size)
+			{
+				r=ZSTD_decompressStream((ZSTD_DCtx *)s->zstd,
+					&zout, &zin);
+				if(zstd_error(r)) return -1;
+			}
+			*in+=zin.pos;
+			*inlen-=zin.pos;
+			s->next_out+=zout.pos;
+			s->avail_out-=zout.pos;
+			if(!r) s->ended=1;
+			return 0;
+		}
+#endif
+#ifdef HAVE_LZ4
+		case ZC_LZ4:
+		{
+			size_t r=1;
+			while(r && *inlen && s->avail_out)
+			{
+				size_t srclen=*inlen;
+				size_t dstlen=s->avail_out;
+				r=LZ4F_decompress((LZ4F_dctx *)s->lz4,
+					s->next_out, &dstlen,
+					*in, &srclen, NULL);
+				if(lz4_error(r)) return -1;
+				*in+=srclen;
+				*inlen-=srclen;
+				s->next_out+=dstlen;
+				s->avail_out-=dstlen;
+				if(!srclen && !dstlen) break;
+			}
+			if(!r) s->ended=1;
+			return 0;
+		}
+#endif
+	}
+	return not_supported(s->alg);
+}
+
+static int decompress_run(struct zstrm *s)
+{
+	if(s->alg<0)
+	{
+		// Hold on to the first bytes until there are enough of them
+		// to tell which algorithm it is.
+		while(s->magiclen<sizeof(s->magic) && s->avail_in)
+		{
+			s->magic[s->magiclen++]=*(s->next_in++);
+			s->avail_in--;
+		}
+		if(s->magiclen<sizeof(s->magic)) return ZS_OK;
+		if(start_decompress(s)) return ZS_ERROR;
+	}
+	if(s->magiclen && !s->ended)
+	{
+		size_t len=s->magiclen;
+		const unsigned char *in=s->magic;
+		if(decompress_some(s, &in, &len)) return ZS_ERROR;
+		memmove(s->magic, in, len);
+		s->magiclen=len;
+		if(s->magiclen) return s->ended?ZS_END:ZS_OK;
+	}
+	if(!s->ended
+	  && decompress_some(s, &s->next_in, &s->avail_in))
+		return ZS_ERROR;
+	return s->ended?ZS_END:ZS_OK;
+}
+
+int zstrm_run(struct zstrm *s, int finish)
+{
+	if(s->compress) return compress_run(s, finish);
+	return decompress_run(s);
+}
+
+void zstrm_end(struct zstrm *s)
+{
+	if(s->zinit)
+	{
+		if(s->compress) deflateEnd(&s->z);
+		else inflateEnd(&s->z);
+		s->zinit=0;
+	}
+#ifdef HAVE_ZSTD
+	if(s->zstd)
+	{
+		if(s->compress) ZSTD_freeCCtx((ZSTD_CCtx *)s->zstd);
+		else ZSTD_freeDCtx((ZSTD_DCtx *)s->zstd);
+		s->zstd=NULL;
+	}
+#endif
+#ifdef HAVE_LZ4
+	if(s->lz4)
+	{
+		if(s->compress)
+			LZ4F_freeCompressionContext((LZ4F_cctx *)s->lz4);
+		else
+			LZ4F_freeDecompressionContext((LZ4F_dctx *)s->lz4);
+		s->lz4=NULL;
+	}
+#endif
+	if(s->buf) { free(s->buf); s->buf=NULL; }
+}
+
+struct zfile
+{
+	gzFile zp; // gzip, or not compressed at all
+	FILE *fp; // zstd or lz4, through s
+	struct zstrm s;
+	unsigned char *buf;
+	int writing;
+};
+
+static void zfile_free(struct zfile **zf)
+{
+	if(!zf || !*zf) return;
+	gzclose_fp(&(*zf)->zp);
+	close_fp(&(*zf)->fp);
+	zstrm_end(&(*zf)->s);
+	if((*zf)->buf) free((*zf)->buf);
+	free(*zf);
+	*zf=NULL;
+}
+
+static int zfile_open_read(struct zfile *zf, const char *path)
+{
+	size_t got=0;
+	unsigned char magic[4];
+
+	if(!(zf->fp=open_file(path, "rb"))) return -1;
+	got=fread(magic, 1, sizeof(magic), zf->fp);
+	if(got<sizeof(magic)
+	  || (memcmp(magic, zstd_magic, sizeof(zstd_magic))
+	    && memcmp(magic, lz4_magic, sizeof(lz4_magic))))
+	{
+		// gzread() reads what it does not recognise as it is.
+		close_fp(&zf->fp);
+		if(!(zf->zp=gzopen_file(path, "rb"))) return -1;
+		return 0;
+	}
+	if(!(zf->buf=(unsigned char *)malloc(ZFILE_BUF)))
+	{
+		logp("out of memory in zfile_open\n");
+		return -1;
+	}
+	memcpy(zf->buf, magic, sizeof(magic));
+	zstrm_init_decompress(&zf->s);
+	zf->s.next_in=zf->buf;
+	zf->s.avail_in=sizeof(magic);
+	return 0;
+}
+
+static int zfile_open_write(struct zfile *zf, const char *path, int compression)
+{
+	zf->writing=1;
+	if(zcodec_alg(compression)==ZC_GZIP)
+	{
+		char mode[16]="";
+		int level=zcodec_level(compression);
+		snprintf(mode, sizeof(mode), "wb%d", level>9?9:level);
+		if(!(zf->zp=gzopen_file(path, mode))) return -1;
+		return 0;
+	}
+	if(!(zf->buf=(unsigned char *)malloc(ZFILE_BUF)))
+	{
+		logp("out of memory in zfile_open\n");
+		return -1;
+	}
+	if(zstrm_init_compress(&zf->s, compression)
+	  || !(zf->fp=open_file(path, "wb")))
+		return -1;
+	return 0;
+}
+
+struct zfile *zfile_open(const char *path, const char *mode, int compression)
+{
+	struct zfile *zf=NULL;
+	if(!(zf=(struct zfile *)calloc(1, sizeof(struct zfile))))
+	{
+		logp("out of memory in zfile_open\n");
+		return NULL;
+	}
+	if(*mode=='w'?zfile_open_write(zf, path, compression)
+		:zfile_open_read(zf, path))
+	{
+		zfile_free(&zf);
+		return NULL;
+	}
+	return zf;
+}
+
+int zfile_read(struct zfile *zf, void *buf, size_t len)
+{
+	struct zstrm *s=&zf->s;
+	if(zf->zp) return gzread(zf->zp, buf, len);
+	s->next_out=(unsigned char *)buf;
+	s->avail_out=len;
+	while(s->avail_out && !s->ended)
+	{
+		if(!s->avail_in)
+		{
+			size_t got=fread(zf->buf, 1, ZFILE_BUF, zf->fp);
+			if(!got)
+			{
+				logp("%s in compressed file\n",
+					ferror(zf->fp)?"read error":
+					"unexpected end of data");
+				return -1;
+			}
+			s->next_in=zf->buf;
+			s->avail_in=got;
+		}
+		if(zstrm_run(s, 0)==ZS_ERROR) return -1;
+	}
+	return len-s->avail_out;
+}
+
+// Runs the compressor until it wants more input, or has finished.
+static int zfile_deflate(struct zfile *zf, int finish)
+{
+	int r=ZS_OK;
+	struct zstrm *s=&zf->s;
+	do
+	{
+		size_t have=0;
+		s->next_out=zf->buf;
+		s->avail_out=ZFILE_BUF;
+		if((r=zstrm_run(s, finish))==ZS_ERROR) return -1;
+		have=ZFILE_BUF-s->avail_out;
+		if(have && fwrite(zf->buf, 1, have, zf->fp)!=have)
+		{
+			logp("error writing compressed file: %s\n",
+				strerror(errno));
+			return -1;
+		}
+	} while(s->avail_in || !s->avail_out || (finish && r!=ZS_END));
+	return 0;
+}
+
+int zfile_write(struct zfile *zf, const void *buf, size_t len)
+{
+	if(zf->zp) return gzwrite(zf->zp, buf, len);
+	zf->s.next_in=(const unsigned char *)buf;
+	zf->s.avail_in=len;
+	if(zfile_deflate(zf, 0)) return -1;
+	return len;
+}
+
+int zfile_eof(struct zfile *zf)
+{
+	if(zf->zp) return gzeof(zf->zp);
+	return zf->s.ended;
+}
+
+int zfile_close(struct zfile **zf)
+{
+	int ret=0;
+	if(!zf || !*zf) return 0;
+	if((*zf)->zp)
+		ret=gzclose_fp(&(*zf)->zp);
+	else if((*zf)->fp)
+	{
+		if((*zf)->writing)
+		{
+			(*zf)->s.avail_in=0;
+			if(zfile_deflate(*zf, 1)) ret=-1;
+		}
+		if(close_fp(&(*zf)->fp)) ret=-1;
+	}
+	zfile_free(zf);
+	return ret;
+}
+
+int zcodec_inflate(FILE *source, FILE *dest)
+{
+	int r=ZS_OK;
+	struct zstrm s;
+	unsigned char in[ZCHUNK];
+	unsigned char out[ZCHUNK];
+
+	zstrm_init_decompress(&s);
+	while(r!=ZS_END)
+	{
+		if(!(s.avail_in=fread(in, 1, ZCHUNK, source)))
+		{
+			logp("%s while decompressing\n", ferror(source)?
+				"read error":"unexpected end of data");
+			r=ZS_ERROR;
+			break;
+		}
+		s.next_in=in;
+		do
+		{
+			size_t have=0;
+			s.next_out=out;
+			s.avail_out=ZCHUNK;
+			if((r=zstrm_run(&s, 0))==ZS_ERROR) break;
+			have=ZCHUNK-s.avail_out;
+			if(fwrite(out, 1, have, dest)!=have || ferror(dest))
+			{
+				logp("error writing decompressed data: %s\n",
+					strerror(errno));
+				r=ZS_ERROR;
+				break;
+			}
+		} while(!s.avail_out);
+		if(r==ZS_ERROR) break;
+	}
+	zstrm_end(&s);
+	return r==ZS_END?0:-1;
+}
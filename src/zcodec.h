@@ -0,0 +1,100 @@
+#ifndef _ZCODEC_H
+#define _ZCODEC_H
+
+#include <zlib.h>
+
+/* The compression of file data, which can be gzip, zstd or lz4. In the
+   manifest, the compression of a file is its level, plus the algorithm
+   times ZC_STEP, so that the gzip levels are what they always were. A
+   compressed data file is named with the suffix of its algorithm, and
+   each algorithm's stream starts with its own magic bytes, so the readers
+   here work out which one a file uses for themselves. Manifests, deltas
+   and logs stay gzip. */
+
+#define ZC_GZIP		0
+#define ZC_ZSTD		1
+#define ZC_LZ4		2
+#define ZC_ZSTD_LONG	3 // zstd with long distance matching
+#define ZC_ALGS		4
+
+#define ZC_STEP		100
+
+#define ZC_GZIP_MAX_LEVEL	9
+#define ZC_ZSTD_MAX_LEVEL	22 // ZSTD_maxCLevel()
+#define ZC_LZ4_MAX_LEVEL	12 // LZ4HC_CLEVEL_MAX
+
+#define ZC_MAX_LEVEL(alg) \
+	((alg)==ZC_LZ4?ZC_LZ4_MAX_LEVEL: \
+	 ((alg)==ZC_ZSTD || (alg)==ZC_ZSTD_LONG)?ZC_ZSTD_MAX_LEVEL: \
+	 ZC_GZIP_MAX_LEVEL)
+
+extern const char *zcodec_name(int alg);
+// Returns -1 if name is not an algorithm.
+extern int zcodec_from_name(const char *name);
+// Whether this build can read and write alg.
+extern int zcodec_supported(int alg);
+// The names of the algorithms that this build has, separated by commas.
+extern const char *zcodec_supported_list(void);
+// Whether alg is in a list from zcodec_supported_list().
+extern int zcodec_in_list(const char *list, int alg);
+extern int zcodec_tag(int alg, int level);
+extern int zcodec_alg(int compression);
+extern int zcodec_level(int compression);
+extern const char *zcodec_suffix(int alg);
+
+// Results of zstrm_run().
+#define ZS_OK		0
+#define ZS_END		1
+#define ZS_ERROR	-1
+
+/* A stream like a z_stream, whatever the algorithm. zstrm_run() goes on
+   until it has used all of the input or filled all of the output. A
+   decompressing stream finds the algorithm from the first bytes given to
+   it. */
+struct zstrm
+{
+	const unsigned char *next_in;
+	size_t avail_in;
+	unsigned char *next_out;
+	size_t avail_out;
+
+	int alg; // -1 until a decompressing stream has seen the magic
+	int compress;
+	int level;
+	int ended;
+	z_stream z;
+	int zinit;
+	void *zstd;
+	void *lz4;
+	// Compressed lz4 frames waiting to go out, and the magic bytes that
+	// a decompressing stream holds on to until it knows the algorithm.
+	unsigned char *buf;
+	size_t bufsize;
+	size_t bufpos;
+	size_t buflen;
+	unsigned char magic[4];
+	size_t magiclen;
+};
+
+// compression is from the manifest, and must not be 0.
+extern int zstrm_init_compress(struct zstrm *s, int compression);
+extern int zstrm_init_decompress(struct zstrm *s);
+// finish is for compressing - there is no more input after this.
+extern int zstrm_run(struct zstrm *s, int finish);
+extern void zstrm_end(struct zstrm *s);
+
+/* A compressed file. gzip files go through zlib's gzFile, as they always
+   have, and those that are not compressed at all are read as they are. */
+struct zfile;
+
+// mode is "rb", or "wb" with compression from the manifest.
+extern struct zfile *zfile_open(const char *path, const char *mode, int compression);
+extern int zfile_read(struct zfile *zf, void *buf, size_t len);
+extern int zfile_write(struct zfile *zf, const void *buf, size_t len);
+extern int zfile_eof(struct zfile *zf);
+extern int zfile_close(struct zfile **zf);
+
+// Writes the uncompressed contents of source to dest. Returns 0 on success.
+extern int zcodec_inflate(FILE *source, FILE *dest);
+
+#endif
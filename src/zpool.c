@@ -0,0 +1,188 @@
+#include "burp.h"
+#include "prog.h"
+#include "zpool.h"
+
+#if !defined(HAVE_WIN32) && defined(HAVE_PTHREAD)
+
+// A deflate stream, kept between blocks by each thread.
+struct zstate
+{
+	z_stream strm;
+	int level; // of strm, or -1 if it is not set up
+};
+
+// Blocks waiting for a thread, in the order that they were given.
+static struct workq *q=NULL;
+static int nthreads=0;
+
+// For blocks that the caller gets to before any thread does.
+static struct zstate caller_zs={{0}, -1};
+
+static void free_zblock(struct workitem *wi)
+{
+	struct zblock *zb=(struct zblock *)wi;
+	if(zb->in) free(zb->in);
+	if(zb->out) free(zb->out);
+	free(zb);
+}
+
+static int set_level(struct zstate *zs, int want)
+{
+	z_stream *strm=&zs->strm;
+	if(zs->level==want) return deflateReset(strm)==Z_OK?0:-1;
+	if(zs->level>=0) deflateEnd(strm);
+	zs->level=-1;
+	memset(strm, 0, sizeof(z_stream));
+	// Raw deflate, because the gzip header and trailer go around all of
+	// the blocks together.
+	if(deflateInit2(strm, want, Z_DEFLATED, -15, 8,
+		Z_DEFAULT_STRATEGY)!=Z_OK) return -1;
+	zs->level=want;
+	return 0;
+}
+
+static void *zstate_start(void)
+{
+	struct zstate *zs=NULL;
+	if(!(zs=(struct zstate *)calloc(1, sizeof(struct zstate)))) return NULL;
+	zs->level=-1;
+	return zs;
+}
+
+static void zstate_end(void *tdata)
+{
+	struct zstate *zs=(struct zstate *)tdata;
+	if(zs->level>=0) deflateEnd(&zs->strm);
+	free(zs);
+}
+
+// No logging in here, because it runs in the pool threads. The caller logs
+// if the block has an error.
+static void deflate_block(struct workitem *wi, void *tdata)
+{
+	int zret=0;
+	size_t alloc=0;
+	struct zblock *zb=(struct zblock *)wi;
+	struct zstate *zs=(struct zstate *)tdata;
+	z_stream *strm=&zs->strm;
+
+	zb->crc=crc32(crc32(0L, Z_NULL, 0), zb->in, zb->inlen);
+	if(set_level(zs, zb->level)
+	  || (zb->dictlen && deflateSetDictionary(strm,
+		zb->dict, zb->dictlen)!=Z_OK))
+	{
+		zb->error=1;
+		return;
+	}
+	strm->next_in=zb->in;
+	strm->avail_in=zb->inlen;
+	// The sync flush at the end of a block adds an empty stored block.
+	alloc=deflateBound(strm, zb->inlen)+16;
+	while(1)
+	{
+		unsigned char *tmp=NULL;
+		if(!(tmp=(unsigned char *)realloc(zb->out, alloc)))
+		{
+			zb->error=1;
+			return;
+		}
+		zb->out=tmp;
+		strm->next_out=zb->out+zb->outlen;
+		strm->avail_out=alloc-zb->outlen;
+		zret=deflate(strm, zb->last?Z_FINISH:Z_SYNC_FLUSH);
+		zb->outlen=alloc-strm->avail_out;
+		if(zret==Z_STREAM_ERROR)
+		{
+			zb->error=1;
+			return;
+		}
+		if(zb->last?zret==Z_STREAM_END:strm->avail_out>0) break;
+		alloc*=2;
+	}
+}
+
+int zpool_init(int count)
+{
+	if(count<=0) return 0;
+	if(!(q=workq_new(count, "compression", deflate_block, NULL,
+		free_zblock, zstate_start, zstate_end))) return -1;
+	nthreads=count;
+	return 0;
+}
+
+int zpool_threads(void)
+{
+	return nthreads;
+}
+
+void zpool_add(struct zblock *zb)
+{
+	workq_add(q, &zb->wi);
+}
+
+int zpool_take(struct zblock *zb)
+{
+	// Not started yet, so quicker to do it here than to wait.
+	if(!q || !workq_take(q, &zb->wi))
+		deflate_block(&zb->wi, &caller_zs);
+	if(zb->error)
+	{
+		logp("could not deflate block of %lu bytes\n",
+			(unsigned long)zb->inlen);
+		return -1;
+	}
+	return 0;
+}
+
+void zpool_drop(struct zblock *zb)
+{
+	if(!zb) return;
+	if(q) workq_drop(q, &zb->wi);
+	else free_zblock(&zb->wi);
+}
+
+void zpool_free(void)
+{
+	// Whoever gave blocks to the pool still has them, and drops them.
+	workq_free(&q);
+	nthreads=0;
+	if(caller_zs.level>=0) deflateEnd(&caller_zs.strm);
+	caller_zs.level=-1;
+}
+
+#else
+
+int zpool_init(int count)
+{
+	if(count>0)
+		logp("compression_threads is not supported here - compressing on one thread\n");
+	return 0;
+}
+
+int zpool_threads(void)
+{
+	return 0;
+}
+
+void zpool_add(struct zblock *zb)
+{
+}
+
+int zpool_take(struct zblock *zb)
+{
+	return -1;
+}
+
+void zpool_drop(struct zblock *zb)
+{
+	if(!zb) return;
+	if(zb->in) free(zb->in);
+	if(zb->out) free(zb->out);
+	free(zb);
+}
+
+void zpool_free(void)
+{
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _ZPOOL_H
+#define _ZPOOL_H
+
+#include "workq.h"
+
+/* Deflating big files on several threads at once. The file is cut into
+   blocks, and each block is deflated on its own, primed with the end of the
+   block before it, so that it compresses nearly as well as it would have as
+   part of one stream. Each block but the last ends on a byte boundary, so
+   that the blocks, put back in order behind a gzip header, make one gzip
+   stream that reads the same as if it had been deflated in one go. */
+
+// Most threads that compression_threads may ask for.
+#define MAX_COMPRESSION_THREADS	64
+
+// How much of the file goes in each block.
+#define ZPOOL_BLOCK		(128*1024)
+
+// How much of the block before is used to prime the next one.
+#define ZPOOL_DICT		(32*1024)
+
+// Files smaller than this are quicker to deflate in one go.
+#define ZPOOL_MIN_FILE		(4*ZPOOL_BLOCK)
+
+struct zblock
+{
+	struct workitem wi;
+
+	// Filled in by the caller.
+	unsigned char *in;
+	size_t inlen;
+	unsigned char dict[ZPOOL_DICT];
+	size_t dictlen;
+	int level;
+	int last; // finishes the stream
+
+	// Filled in by the pool.
+	unsigned char *out;
+	size_t outlen;
+	unsigned long crc; // crc32 of in
+	int error;
+
+	struct zblock *fnext; // in the order of the file
+};
+
+// Starts count threads. Returns 0 if the pool has started, or if count is 0,
+// so that there is no pool. Returns -1 on error.
+extern int zpool_init(int count);
+// How many threads there are, or 0 if there is no pool.
+extern int zpool_threads(void);
+// Hands a block over to the pool.
+extern void zpool_add(struct zblock *zb);
+// Waits for a block to be deflated. Returns 0 if it was, or -1 on error.
+extern int zpool_take(struct zblock *zb);
+// Frees a block, or leaves the thread that is deflating it to do so.
+extern void zpool_drop(struct zblock *zb);
+extern void zpool_free(void);
+
+#endif